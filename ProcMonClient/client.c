@@ -2,10 +2,16 @@
  * client.c — Консольный клиент для драйвера ProcMon.
  *
  * Multi-mode интерфейс:
- *   Режим 1: Мониторинг процессов (лог create/exit с MD5-хешами)
+ *   Режим 1: Мониторинг процессов (лог create/exit с хешами MD5 или SHA-256).
+ *            Кольца драйвера отображаются в процесс и читаются на месте;
+ *            если отображение недоступно — опрос через IOCTL.
+ *            Можно задать фильтр по имени образа (программа фильтра
+ *            из common/filter.c — в драйвере или у себя для отображения).
  *   Режим 2: Список установленных драйверов
  *   Режим 3: Загруженные драйверы (обновление по Enter)
  *   Режим 4: Активные устройства
+ *   Режим 5: Параметры буфера событий (размер колец, память, изменение на лету)
+ *   Режим 6: Статистика драйвера (события, потери, хеши, IOCTL — в секунду)
  *
  * Требует запуска от имени администратора.
  */
@@ -13,11 +19,25 @@
 #include <windows.h>
 #include <winioctl.h>
 #include <stdio.h>
+#include <malloc.h>
 
 #include "../common/shared.h"
+#include "../common/ring.h"
+#include "../common/filter.h"
 
-/* Размер буфера для приёма событий процессов (~64 события) */
-#define EVENT_BUFFER_SIZE  (sizeof(ULONG) + 64 * sizeof(PROCMON_EVENT))
+/*
+ * Размер буфера для приёма событий процессов (формат v2).
+ * Завершение занимает 32 байта, создание — ~100, так что 64 KB — это
+ * от ~650 до ~2000 событий за один вызов.
+ */
+#define EVENT_BUFFER_SIZE  (64 * 1024)
+
+/*
+ * Размер буфера для IOCTL_PROCMON_GET_EVENTS_DIRECT (1 MB).
+ * Драйвер пишет прямо в наши страницы, так что большой буфер не стоит
+ * ядру ни памяти, ни лишнего копирования.
+ */
+#define DIRECT_BUFFER_SIZE (1024 * 1024)
 
 /* Размер буфера для перечисления драйверов/устройств (256 KB) */
 #define ENUM_BUFFER_SIZE   (256 * 1024)
@@ -52,39 +72,41 @@ static void FormatTimestamp(LARGE_INTEGER timestamp, char *buffer, size_t buffer
 }
 
 /*
- * FormatHash — форматирует 16-байтовый MD5-хеш в hex-строку (32 символа).
+ * FormatHash — форматирует хеш длиной Length байт (16 — MD5, 32 — SHA-256)
+ * в hex-строку (Length * 2 символов).
  */
-static void FormatHash(const unsigned char hash[16], char *outStr, size_t outSize)
+static void FormatHash(const unsigned char *hash, size_t length, char *outStr, size_t outSize)
 {
     static const char hex[] = "0123456789abcdef";
-    int i;
+    size_t i;
 
-    if (outSize < 33) {
+    if (outSize < length * 2 + 1) {
         if (outSize > 0) outStr[0] = '\0';
         return;
     }
 
-    for (i = 0; i < 16; i++) {
+    for (i = 0; i < length; i++) {
         outStr[i * 2]     = hex[(hash[i] >> 4) & 0x0f];
         outStr[i * 2 + 1] = hex[hash[i] & 0x0f];
     }
-    outStr[32] = '\0';
+    outStr[length * 2] = '\0';
 }
 
 /*
  * OpenDevice — открыть устройство драйвера ProcMon.
+ * Flags — FILE_ATTRIBUTE_NORMAL или FILE_FLAG_OVERLAPPED (асинхронный хэндл).
  */
-static HANDLE OpenDevice(void)
+static HANDLE OpenDevice(DWORD flags)
 {
     HANDLE hDevice;
 
     hDevice = CreateFileW(
         L"\\\\.\\ProcMon",
-        GENERIC_READ,
+        GENERIC_READ | GENERIC_WRITE,   /* Запись нужна для изменения параметров колец */
         FILE_SHARE_READ | FILE_SHARE_WRITE,
         NULL,
         OPEN_EXISTING,
-        FILE_ATTRIBUTE_NORMAL,
+        flags,
         NULL
     );
 
@@ -99,77 +121,751 @@ static HANDLE OpenDevice(void)
 }
 
 /*
- * Режим 1: Мониторинг процессов (расширенный с MD5).
+ * PrintEvent — вывести одно событие процесса.
+ * Hash — PROCMON_EVENT_HASH_SIZE(Flags) байт или NULL; Name — имя без '\0' длиной NameLength или NULL.
+ * Запись о пропуске выводится отдельной строкой: ProcessId — число потерянных
+ * событий, ParentProcessId — номер кольца. Запись «хеш готов» — тоже:
+ * вместо PPID в ней номер события создания, к которому относится хеш.
  */
-static void ModeProcessMonitor(HANDLE hDevice)
+static void PrintEvent(const PROCMON_EVENT_HEADER *event, const BYTE *hash,
+                       const char *name, int nameLength)
+{
+    char timeStr[32];
+    char hashStr[PROCMON_HASH_MAX_SIZE * 2 + 1];
+
+    FormatTimestamp(event->Timestamp, timeStr, sizeof(timeStr));
+
+    if (event->Flags & PROCMON_EVENT_FLAG_GAP) {
+        printf("%-14s GAP      потеряно %lu событий (кольцо %lu)\n",
+               timeStr, event->ProcessId, event->ParentProcessId);
+        return;
+    }
+
+    if (hash != NULL) {
+        FormatHash(hash, PROCMON_EVENT_HASH_SIZE(event->Flags), hashStr, sizeof(hashStr));
+    } else {
+        _snprintf(hashStr, sizeof(hashStr),
+                  (event->Flags & PROCMON_EVENT_FLAG_HASH_PENDING) ? "(позже)" : "N/A");
+        hashStr[sizeof(hashStr) - 1] = '\0';
+    }
+
+    if (event->Flags & PROCMON_EVENT_FLAG_HASH_READY) {
+        printf("%-14s HASH     %8lu #%-7lu  %-34s %.*s\n",
+               timeStr, event->ProcessId, event->Sequence, hashStr,
+               (name != NULL) ? nameLength : 0, (name != NULL) ? name : "");
+        return;
+    }
+
+    if (name == NULL) {
+        if (event->Flags & PROCMON_EVENT_FLAG_NAME_LOST) {
+            name = "<lost>";
+            nameLength = 6;
+        } else if (event->Flags & PROCMON_EVENT_FLAG_CREATE) {
+            name = "<no name>";
+            nameLength = 9;
+        } else {
+            name = "<exiting>";
+            nameLength = 9;
+        }
+    }
+
+    printf("%-14s %-8s %8lu %8lu  %-34s %.*s\n",
+           timeStr,
+           (event->Flags & PROCMON_EVENT_FLAG_CREATE) ? "CREATE" : "EXIT",
+           event->ProcessId,
+           event->ParentProcessId,
+           hashStr,
+           nameLength, name);
+}
+
+/*
+ * Задержка доставки: от метки времени события (KeQuerySystemTimePrecise
+ * в драйвере) до момента, когда событие оказалось у клиента.
+ * Считается по событиям завершения и «хеш готов»: у создания в неё может
+ * входить ещё и хеширование файла, если драйвер хеширует синхронно.
+ */
+#define LATENCY_REPORT_MS  5000
+
+typedef struct _LATENCY_STATS {
+    ULONGLONG Sum;        /* Сумма задержек, 100 нс */
+    ULONGLONG Max;        /* Максимум, 100 нс */
+    ULONG     Count;      /* Событий в текущем интервале */
+    ULONGLONG NextReport; /* GetTickCount64 следующего отчёта */
+} LATENCY_STATS;
+
+/* LatencyAdd — учесть событие, полученное только что */
+static void LatencyAdd(LATENCY_STATS *stats, const PROCMON_EVENT_HEADER *event)
+{
+    FILETIME       now;
+    ULARGE_INTEGER nowValue;
+    ULONGLONG      latency;
+
+    if (event->Flags & (PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_GAP)) {
+        return;
+    }
+
+    GetSystemTimePreciseAsFileTime(&now);
+    nowValue.LowPart = now.dwLowDateTime;
+    nowValue.HighPart = now.dwHighDateTime;
+
+    latency = (nowValue.QuadPart > (ULONGLONG)event->Timestamp.QuadPart)
+              ? nowValue.QuadPart - (ULONGLONG)event->Timestamp.QuadPart : 0;
+
+    stats->Sum += latency;
+    stats->Count++;
+    if (latency > stats->Max) {
+        stats->Max = latency;
+    }
+}
+
+/* LatencyReport — раз в LATENCY_REPORT_MS вывести среднюю и максимальную задержку */
+static void LatencyReport(LATENCY_STATS *stats)
+{
+    ULONGLONG tick = GetTickCount64();
+
+    if (tick < stats->NextReport) {
+        return;
+    }
+
+    if (stats->Count != 0) {
+        printf("--- Задержка доставки: средняя %llu мкс, максимум %llu мкс (%lu событий) ---\n",
+               stats->Sum / stats->Count / 10, stats->Max / 10, stats->Count);
+    }
+
+    stats->Sum = 0;
+    stats->Max = 0;
+    stats->Count = 0;
+    stats->NextReport = tick + LATENCY_REPORT_MS;
+}
+
+/*
+ * MapRings — запросить отображение колец и настроить по описателю на кольцо.
+ * Возвращает массив описателей (освобождать _aligned_free) или NULL.
+ */
+static PPROCMON_RING_VIEW MapRings(HANDLE hDevice, const PROCMON_SHARED_HEADER **shared)
+{
+    PROCMON_MAP_RESPONSE map;
+    PPROCMON_RING_VIEW   views;
+    DWORD                bytesReturned;
+    ULONG                i;
+
+    if (!DeviceIoControl(hDevice, IOCTL_PROCMON_MAP_EVENTS, NULL, 0,
+                         &map, sizeof(map), &bytesReturned, NULL) ||
+        bytesReturned < sizeof(map)) {
+        return NULL;
+    }
+
+    *shared = (const PROCMON_SHARED_HEADER *)(ULONG_PTR)map.BaseAddress;
+    if (!RingCheckHeader(*shared, (SIZE_T)map.ViewSize)) {
+        printf("Неизвестная разметка колец, переход на IOCTL\n");
+        return NULL;
+    }
+
+    views = (PPROCMON_RING_VIEW)_aligned_malloc((*shared)->RingCount * sizeof(PROCMON_RING_VIEW),
+                                                 __alignof(PROCMON_RING_VIEW));
+    if (views == NULL) {
+        printf("Ошибка выделения памяти\n");
+        return NULL;
+    }
+
+    for (i = 0; i < (*shared)->RingCount; i++) {
+        RingViewInit(&views[i], (PVOID)*shared, i);
+    }
+
+    return views;
+}
+
+/*
+ * MonitorMapped — чтение событий прямо из колец драйвера.
+ *
+ * Драйвер отображает кольца в наш процесс только для чтения
+ * (IOCTL_PROCMON_MAP_EVENTS); события сливаются по времени тем же кодом,
+ * что и в драйвере (common/ring.c). Когда колец нечего читать — ждём
+ * именованное событие, которое драйвер взводит при новых данных.
+ *
+ * Если размер колец изменили (режим 5), старый набор помечается Retired:
+ * дочитываем его и запрашиваем отображение нового.
+ *
+ * Потери видны как записи GAP в потоке. Отбрасывающие политики считают
+ * заполненность по позиции IOCTL-читателя драйвера, а не по нашей, —
+ * при них ModeProcessMonitor этот режим не выбирает (OverwritePolicy).
+ *
+ * Драйвер в отображение не вмешивается, поэтому фильтр (если есть)
+ * исполняется здесь же, тем же кодом common/filter.c.
+ *
+ * Возвращает FALSE, если отображение недоступно (старый драйвер и т.п.).
+ */
+static BOOL MonitorMapped(HANDLE hDevice, const PROCMON_FILTER_PROGRAM *filter)
+{
+    const PROCMON_SHARED_HEADER *shared;
+    PPROCMON_RING_VIEW           views;
+    PROCMON_RECORD               record;
+    HANDLE                       hEvent;
+    LONG                         best;
+    LATENCY_STATS                latency = { 0 };
+    PROCMON_FILTER_STATE         filterState = { 0 };
+
+    views = MapRings(hDevice, &shared);
+    if (views == NULL) {
+        return FALSE;
+    }
+
+    /* Без события будем опрашивать кольца по таймеру */
+    hEvent = OpenEventW(SYNCHRONIZE, FALSE, PROCMON_NOTIFY_EVENT_USER_NAME);
+
+    while (1) {
+        while ((best = RingMergeSelect(views, shared->RingCount)) >= 0) {
+            if (RingViewTake(&views[best], &record)) {
+                if (filter == NULL || FilterRun(filter, &filterState, &record)) {
+                    PrintEvent(&record.Header,
+                               (record.Header.Flags & PROCMON_EVENT_FLAG_HASH_VALID)
+                                   ? record.FileHash : NULL,
+                               (record.Header.NameLength != 0) ? record.ImageName : NULL,
+                               record.Header.NameLength);
+                    LatencyAdd(&latency, &record.Header);
+                }
+                RingViewNext(&views[best], &record);
+            } else {
+                /* Перезаписано во время копирования — придёт записью GAP */
+                RingViewSkip(&views[best]);
+            }
+        }
+
+        LatencyReport(&latency);
+
+        if (best == RING_MERGE_EMPTY && shared->Retired) {
+            /* Старый набор дочитан — переходим на новый */
+            _aligned_free(views);
+            views = MapRings(hDevice, &shared);
+            if (views == NULL) {
+                printf("Не удалось отобразить новые кольца: %lu\n", GetLastError());
+                break;
+            }
+            printf("--- Кольца заменены: %lu x %lu событий ---\n",
+                   shared->RingCount, shared->SlotCount);
+            continue;
+        }
+
+        if (best == RING_MERGE_PENDING) {
+            /* Писатель дописывает событие — это доли микросекунды */
+            Sleep(0);
+        } else if (hEvent != NULL) {
+            WaitForSingleObject(hEvent, 1000);
+        } else {
+            Sleep(500);
+        }
+    }
+
+    if (hEvent != NULL) {
+        CloseHandle(hEvent);
+    }
+
+    return TRUE;
+}
+
+/*
+ * PrintResponse — вывести события ответа v2 и, если изменились, счётчики потерь
+ * вместе с отставанием этого хэндла от писателей.
+ * Имя и хеш берутся из области данных ответа по смещениям из заголовка.
+ */
+static void PrintResponse(const PROCMON_EVENT_RESPONSE_V2 *response, LATENCY_STATS *latency,
+                          ULONG64 *dropped, ULONG64 *overwritten)
+{
+    const BYTE *data = (const BYTE *)response + response->DataOffset;
+    ULONG       i;
+
+    for (i = 0; i < response->EventCount; i++) {
+        const PROCMON_EVENT_HEADER *event = &response->Events[i];
+
+        PrintEvent(event,
+                   (event->Flags & PROCMON_EVENT_FLAG_HASH_VALID)
+                       ? data + event->HashOffset : NULL,
+                   (event->NameOffset != PROCMON_NO_DATA)
+                       ? (const char *)(data + event->NameOffset) : NULL,
+                   event->NameLength);
+        LatencyAdd(latency, event);
+    }
+
+    LatencyReport(latency);
+
+    if (response->DroppedEvents != *dropped || response->OverwrittenEvents != *overwritten) {
+        *dropped = response->DroppedEvents;
+        *overwritten = response->OverwrittenEvents;
+        printf("--- Потери: отброшено %llu, перезаписано %llu, не прочитано %llu ---\n",
+               *dropped, *overwritten, response->PendingEvents);
+    }
+}
+
+/*
+ * Асинхронный читатель (IOCTL_PROCMON_WAIT_EVENTS через порт завершения).
+ *
+ * В драйвере всегда ждут несколько запросов: пока мы выводим одну пачку,
+ * поток доставки драйвера уже заполняет следующий буфер. Запросы
+ * IOCTL_PROCMON_WAIT_EVENTS заполняет и завершает только этот поток, по
+ * одному, а запросы отправляет один наш поток, так что завершения
+ * приходят в порт в порядке заполнения и порядок событий сохраняется.
+ * (Старые версии драйвера заполняли запрос прямо в DeviceIoControl,
+ * если события уже были, и две пачки могли прийти в обратном порядке.)
+ *
+ * Число запросов и размер буферов подстраиваются под поток событий:
+ *   - ответ занял больше 3/4 буфера — буфер удваивается;
+ *   - запрос вернулся, а других в драйвере не осталось — события могли
+ *     ждать буфера, запросов становится больше;
+ *   - OVERLAPPED_SHRINK_AFTER почти пустых ответов подряд — буфер
+ *     уменьшается вдвое, а запросов становится меньше.
+ */
+#define OVERLAPPED_MIN_REQUESTS  2
+#define OVERLAPPED_MAX_REQUESTS  8
+#define OVERLAPPED_MIN_BUFFER    EVENT_BUFFER_SIZE
+#define OVERLAPPED_MAX_BUFFER    (4 * DIRECT_BUFFER_SIZE)
+#define OVERLAPPED_SHRINK_AFTER  64
+
+typedef struct _EVENT_REQUEST {
+    OVERLAPPED Overlapped;   /* Должен быть первым: по нему находим запрос */
+    BYTE      *Buffer;       /* Выходной буфер (VirtualAlloc — выровнен на страницу) */
+    DWORD      Size;         /* Размер буфера */
+    BOOL       Busy;         /* Запрос сейчас в драйвере */
+} EVENT_REQUEST;
+
+/*
+ * IssueRequest — отправить запрос, при необходимости поменяв размер буфера.
+ * Завершение (и синхронное тоже) придёт через порт.
+ */
+static BOOL IssueRequest(HANDLE hDevice, EVENT_REQUEST *request, DWORD size)
+{
+    if (request->Buffer == NULL || request->Size != size) {
+        if (request->Buffer != NULL) {
+            VirtualFree(request->Buffer, 0, MEM_RELEASE);
+        }
+        request->Buffer = (BYTE *)VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE,
+                                               PAGE_READWRITE);
+        request->Size = (request->Buffer != NULL) ? size : 0;
+        if (request->Buffer == NULL) {
+            SetLastError(ERROR_NOT_ENOUGH_MEMORY);
+            return FALSE;
+        }
+    }
+
+    ZeroMemory(&request->Overlapped, sizeof(OVERLAPPED));
+
+    if (!DeviceIoControl(hDevice, IOCTL_PROCMON_WAIT_EVENTS, NULL, 0,
+                         request->Buffer, request->Size, NULL, &request->Overlapped) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        return FALSE;
+    }
+
+    request->Busy = TRUE;
+    return TRUE;
+}
+
+/*
+ * SetHandleFilter — поставить программу фильтра хэндлу (NULL — снять).
+ */
+static BOOL SetHandleFilter(HANDLE hDevice, const PROCMON_FILTER_PROGRAM *filter, DWORD filterSize)
 {
-    BYTE  buffer[EVENT_BUFFER_SIZE];
     DWORD bytesReturned;
-    BOOL  success;
-    PPROCMON_EVENT_RESPONSE response;
-    ULONG i;
-    char  timeStr[32];
-    char  hashStr[33];
 
-    printf("\nМониторинг процессов (Ctrl+C для остановки)...\n");
-    printf("%-14s %-8s %8s %8s  %-34s %s\n",
-           "Время", "Тип", "PID", "PPID", "MD5", "Имя процесса");
-    printf("------------------------------------------"
-           "------------------------------------------\n");
+    return DeviceIoControl(hDevice, IOCTL_PROCMON_SET_FILTER,
+                           (LPVOID)filter, (filter != NULL) ? filterSize : 0,
+                           NULL, 0, &bytesReturned, NULL);
+}
+
+/*
+ * MonitorOverlapped — чтение событий несколькими одновременными запросами.
+ * Хэндл свой, поэтому фильтр ставится и ему.
+ * Возвращает FALSE, если драйвер не поддерживает ожидание событий или
+ * фильтры, или не удалось подготовить хэндл и порт.
+ */
+static BOOL MonitorOverlapped(const PROCMON_FILTER_PROGRAM *filter, DWORD filterSize)
+{
+    HANDLE         hDevice;
+    HANDLE         hPort;
+    EVENT_REQUEST  requests[OVERLAPPED_MAX_REQUESTS];
+    EVENT_REQUEST *request;
+    OVERLAPPED    *overlapped;
+    DWORD          bytesReturned;
+    ULONG_PTR      key;
+    BOOL           success;
+    BOOL           received = FALSE;
+    BOOL           supported = TRUE;
+    ULONG          target = OVERLAPPED_MIN_REQUESTS;
+    ULONG          busy = 0;
+    ULONG          idle = 0;
+    DWORD          bufferSize = OVERLAPPED_MIN_BUFFER;
+    ULONG          i;
+    LATENCY_STATS  latency = { 0 };
+    ULONG64        dropped = 0;
+    ULONG64        overwritten = 0;
+
+    hDevice = OpenDevice(FILE_FLAG_OVERLAPPED);
+    if (hDevice == INVALID_HANDLE_VALUE) {
+        return FALSE;
+    }
+
+    /* Хэндл асинхронный, но SET_FILTER драйвер завершает сразу */
+    if (filter != NULL && !SetHandleFilter(hDevice, filter, filterSize)) {
+        CloseHandle(hDevice);
+        return FALSE;
+    }
+
+    hPort = CreateIoCompletionPort(hDevice, NULL, 0, 1);
+    if (hPort == NULL) {
+        CloseHandle(hDevice);
+        return FALSE;
+    }
+
+    ZeroMemory(requests, sizeof(requests));
+
+    for (i = 0; i < target; i++) {
+        if (!IssueRequest(hDevice, &requests[i], bufferSize)) {
+            printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
+            goto cleanup;
+        }
+        busy++;
+    }
+
+    while (1) {
+        /* Таймаут — только чтобы вовремя вывести статистику задержки */
+        success = GetQueuedCompletionStatus(hPort, &bytesReturned, &key, &overlapped,
+                                            LATENCY_REPORT_MS);
+        if (overlapped == NULL) {
+            if (GetLastError() != WAIT_TIMEOUT) {
+                printf("Ошибка GetQueuedCompletionStatus: %lu\n", GetLastError());
+                break;
+            }
+            LatencyReport(&latency);
+            continue;
+        }
+
+        request = CONTAINING_RECORD(overlapped, EVENT_REQUEST, Overlapped);
+        request->Busy = FALSE;
+        busy--;
+
+        if (!success) {
+            if (!received && GetLastError() == ERROR_INVALID_FUNCTION) {
+                /* Старый драйвер — пусть читает MonitorPolling */
+                supported = FALSE;
+            } else {
+                printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
+            }
+            break;
+        }
+
+        received = TRUE;
+        PrintResponse((const PROCMON_EVENT_RESPONSE_V2 *)request->Buffer, &latency,
+                      &dropped, &overwritten);
+
+        /* Подстройка под поток событий */
+        if (bytesReturned > request->Size - request->Size / 4) {
+            if (bufferSize < OVERLAPPED_MAX_BUFFER) {
+                bufferSize *= 2;
+            }
+            idle = 0;
+        } else if (bytesReturned < request->Size / 8) {
+            if (++idle >= OVERLAPPED_SHRINK_AFTER) {
+                if (bufferSize > OVERLAPPED_MIN_BUFFER) {
+                    bufferSize /= 2;
+                }
+                if (target > OVERLAPPED_MIN_REQUESTS) {
+                    target--;
+                }
+                idle = 0;
+            }
+        } else {
+            idle = 0;
+        }
+
+        if (busy == 0 && target < OVERLAPPED_MAX_REQUESTS) {
+            target++;
+        }
+
+        /* Возвращаем запросы в драйвер, пока их меньше target */
+        for (i = 0; i < OVERLAPPED_MAX_REQUESTS && busy < target; i++) {
+            if (requests[i].Busy) {
+                continue;
+            }
+            if (!IssueRequest(hDevice, &requests[i], bufferSize)) {
+                printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
+                goto cleanup;
+            }
+            busy++;
+        }
+    }
+
+cleanup:
+    /* Буферы освобождаем только после того, как драйвер вернул все запросы */
+    CancelIoEx(hDevice, NULL);
+    while (busy != 0) {
+        GetQueuedCompletionStatus(hPort, &bytesReturned, &key, &overlapped, INFINITE);
+        if (overlapped == NULL) {
+            break;
+        }
+        CONTAINING_RECORD(overlapped, EVENT_REQUEST, Overlapped)->Busy = FALSE;
+        busy--;
+    }
+
+    for (i = 0; i < OVERLAPPED_MAX_REQUESTS; i++) {
+        if (requests[i].Buffer != NULL) {
+            VirtualFree(requests[i].Buffer, 0, MEM_RELEASE);
+        }
+    }
+
+    CloseHandle(hPort);
+    CloseHandle(hDevice);
+
+    return supported;
+}
+
+/*
+ * MonitorPolling — опрос событий через IOCTL раз в 500 мс (драйвер без
+ * IOCTL_PROCMON_WAIT_EVENTS). Сначала IOCTL_PROCMON_GET_EVENTS_DIRECT
+ * с буфером в 1 MB от VirtualAlloc (страницы выровнены), если драйвер
+ * его не знает — IOCTL_PROCMON_GET_EVENTS_V2 с обычным буфером.
+ */
+static void MonitorPolling(HANDLE hDevice)
+{
+    BYTE *buffer;
+    DWORD bytesReturned;
+    BOOL  success;
+    ULONG64 dropped = 0;
+    ULONG64 overwritten = 0;
+    DWORD ioctlCode = IOCTL_PROCMON_GET_EVENTS_DIRECT;
+    DWORD bufferSize = DIRECT_BUFFER_SIZE;
+    LATENCY_STATS latency = { 0 };
+
+    buffer = (BYTE *)VirtualAlloc(NULL, DIRECT_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE,
+                                  PAGE_READWRITE);
+    if (buffer == NULL) {
+        printf("Ошибка выделения памяти\n");
+        return;
+    }
 
     while (1) {
         success = DeviceIoControl(
             hDevice,
-            IOCTL_PROCMON_GET_EVENTS,
+            ioctlCode,
             NULL, 0,
-            buffer, EVENT_BUFFER_SIZE,
+            buffer, bufferSize,
             &bytesReturned,
             NULL
         );
 
+        if (!success && ioctlCode == IOCTL_PROCMON_GET_EVENTS_DIRECT &&
+            GetLastError() == ERROR_INVALID_FUNCTION) {
+            /* Драйвер без direct I/O — буферизованный запрос поменьше */
+            ioctlCode = IOCTL_PROCMON_GET_EVENTS_V2;
+            bufferSize = EVENT_BUFFER_SIZE;
+            continue;
+        }
+
         if (!success) {
             printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
             break;
         }
 
-        response = (PPROCMON_EVENT_RESPONSE)buffer;
+        PrintResponse((const PROCMON_EVENT_RESPONSE_V2 *)buffer, &latency,
+                      &dropped, &overwritten);
 
-        for (i = 0; i < response->EventCount; i++) {
-            PPROCMON_EVENT event = &response->Events[i];
+        Sleep(500);
+    }
 
-            FormatTimestamp(event->Timestamp, timeStr, sizeof(timeStr));
+    VirtualFree(buffer, 0, MEM_RELEASE);
+}
 
-            if (event->HashValid) {
-                FormatHash(event->FileHash, hashStr, sizeof(hashStr));
-            } else {
-                _snprintf(hashStr, sizeof(hashStr), "N/A");
-                hashStr[sizeof(hashStr) - 1] = '\0';
-            }
+/*
+ * Режим 1: Мониторинг процессов (расширенный с MD5).
+ */
+/*
+ * BuildNameFilter — программа «создание процесса, имя кончается на Suffix».
+ * Имена в событиях — полные пути, поэтому достаточно написать "notepad.exe".
+ * Возвращает размер программы.
+ */
+static DWORD BuildNameFilter(const char *suffix, PPROCMON_FILTER_PROGRAM program)
+{
+    size_t length = strlen(suffix);
+
+    if (length > 255) {
+        length = 255;
+    }
+
+    ZeroMemory(program, PROCMON_FILTER_SIZE(4, length));
+    program->Version = PROCMON_FILTER_VERSION;
+    program->InsnCount = 4;
+    program->DataLength = (USHORT)length;
+
+    /* 0: создание? нет — к REJECT */
+    program->Insns[0].Opcode = PROCMON_FILTER_OP_CREATE;
+    program->Insns[0].JumpFalse = 2;
+    /* 1: имя кончается на suffix? да — ACCEPT, нет — REJECT */
+    program->Insns[1].Opcode = PROCMON_FILTER_OP_NAME_SUFFIX;
+    program->Insns[1].JumpFalse = 1;
+    program->Insns[1].Length = (UCHAR)length;
+    program->Insns[1].Value = 0;
+    program->Insns[2].Opcode = PROCMON_FILTER_OP_ACCEPT;
+    program->Insns[3].Opcode = PROCMON_FILTER_OP_REJECT;
+
+    memcpy(&program->Insns[4], suffix, length);
+
+    return (DWORD)PROCMON_FILTER_SIZE(4, length);
+}
+
+/*
+ * Действует ли политика перезаписи. Отбрасывающие политики нужны тем, кто
+ * не хочет терять непрочитанное, а освобождает место только IOCTL-чтение —
+ * отображение драйверу позицию не сообщает. Старый драйвер без
+ * IOCTL_PROCMON_GET_BUFFER_INFO умеет только перезапись.
+ */
+static BOOL OverwritePolicy(HANDLE hDevice)
+{
+    PROCMON_BUFFER_INFO info;
+    DWORD               bytesReturned;
+
+    if (!DeviceIoControl(hDevice, IOCTL_PROCMON_GET_BUFFER_INFO, NULL, 0,
+                         &info, sizeof(info), &bytesReturned, NULL)) {
+        return TRUE;
+    }
 
-            printf("%-14s %-8s %8lu %8lu  %-34s %s\n",
-                   timeStr,
-                   event->IsCreate ? "CREATE" : "EXIT",
-                   event->ProcessId,
-                   event->ParentProcessId,
-                   hashStr,
-                   event->ImageName);
+    return info.Config.OverflowPolicy == PROCMON_OVERFLOW_OVERWRITE;
+}
+
+static void ModeProcessMonitor(HANDLE hDevice)
+{
+    /* ULONG — для выравнивания полей программы */
+    ULONG                   filterBuffer[(PROCMON_FILTER_SIZE(4, 256) + 3) / 4];
+    PPROCMON_FILTER_PROGRAM filter = NULL;
+    DWORD                   filterSize = 0;
+    char                    suffix[260];
+    size_t                  length;
+
+    printf("Фильтр: окончание имени образа (Enter — все события): ");
+    if (fgets(suffix, sizeof(suffix), stdin) != NULL) {
+        length = strlen(suffix);
+        while (length > 0 && (suffix[length - 1] == '\n' || suffix[length - 1] == '\r')) {
+            suffix[--length] = '\0';
         }
+        if (length != 0) {
+            filter = (PPROCMON_FILTER_PROGRAM)filterBuffer;
+            filterSize = BuildNameFilter(suffix, filter);
+        }
+    }
 
-        Sleep(500);
+    printf("\nМониторинг процессов (Ctrl+C для остановки)...\n");
+    printf("%-14s %-8s %8s %8s  %-34s %s\n",
+           "Время", "Тип", "PID", "PPID", "Хеш", "Имя процесса");
+    printf("------------------------------------------"
+           "------------------------------------------\n");
+
+    if ((OverwritePolicy(hDevice) && MonitorMapped(hDevice, filter)) ||
+        MonitorOverlapped(filter, filterSize)) {
+        return;
+    }
+
+    if (filter != NULL && !SetHandleFilter(hDevice, filter, filterSize)) {
+        printf("Драйвер не поддерживает фильтры (%lu), показываются все события\n",
+               GetLastError());
     }
+
+    MonitorPolling(hDevice);
+}
+
+/*
+ * QueryEnumPage — одна страница перечисления (драйверы или устройства)
+ * в формате v2. Cursor 0 — новый обход в драйвере; дальше — NextCursor
+ * из прошлого ответа. В *bytesReturned — размер ответа.
+ */
+static BOOL QueryEnumPage(HANDLE hDevice, DWORD ioctlCode, ULONG64 cursor, BYTE *buffer,
+                          DWORD *bytesReturned)
+{
+    PROCMON_ENUM_REQUEST request;
+
+    ZeroMemory(&request, sizeof(request));
+    request.Cursor = cursor;
+    request.Format = PROCMON_ENUM_FORMAT_V2;
+
+    if (!DeviceIoControl(hDevice, ioctlCode,
+                         &request, sizeof(request),
+                         buffer, ENUM_BUFFER_SIZE,
+                         bytesReturned, NULL)) {
+        printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/*
+ * CopyStringRef — строка ответа v2 (общая часть + остаток) в out с '\0'.
+ */
+static void CopyStringRef(const BYTE *strings, const PROCMON_STRING_REF *ref,
+                          char *out, size_t outSize)
+{
+    size_t prefix = ref->PrefixLength;
+    size_t rest = ref->Length;
+
+    if (prefix > outSize - 1) {
+        prefix = outSize - 1;
+    }
+    if (rest > outSize - 1 - prefix) {
+        rest = outSize - 1 - prefix;
+    }
+
+    memcpy(out, strings + ref->PrefixOffset, prefix);
+    memcpy(out + prefix, strings + ref->Offset, rest);
+    out[prefix + rest] = '\0';
+}
+
+/*
+ * PrintCacheStats — состояние кэша драйвера, из которого отдано перечисление.
+ */
+static void PrintCacheStats(const PROCMON_CACHE_STATS *cache)
+{
+    printf("Кэш драйвера: попаданий %llu, промахов %llu, сверен %llu мс назад, "
+           "перечитано записей: %lu",
+           cache->Hits, cache->Misses, cache->AgeMs, cache->Reread);
+
+    /* Время хеширования есть только у перечислений с хешами файлов */
+    if (cache->HashMs != 0) {
+        printf(", хешировались %lu мс", cache->HashMs);
+    }
+
+    printf("\n");
+}
+
+/*
+ * PrintWireSize — сколько байт занял список в формате v2 и сколько
+ * занял бы в прежнем формате с записями фиксированного размера.
+ */
+static void PrintWireSize(ULONG64 received, ULONG64 fixed)
+{
+    printf("Передано: %llu байт (с записями фиксированного размера было бы %llu",
+           received, fixed);
+    if (received != 0) {
+        printf(", в %.1f раза больше", (double)fixed / (double)received);
+    }
+    printf(")\n");
 }
 
 /*
  * Режим 2: Все установленные драйверы.
+ * Список забирается страницами по ENUM_BUFFER_SIZE, пока NextCursor не 0.
  */
 static void ModeInstalledDrivers(HANDLE hDevice)
 {
     BYTE *buffer;
-    DWORD bytesReturned;
-    BOOL  success;
-    PDRIVER_INFO_RESPONSE response;
+    PDRIVER_INFO_RESPONSE_V2 response;
+    ULONG64 cursor = 0;
+    ULONG total = 0;
+    ULONG shown = 0;
     ULONG i;
     char  hashStr[33];
+    PROCMON_CACHE_STATS cache;
+    DWORD bytesReturned;
+    ULONG64 received = 0;
+    ULONG64 fixed = 0;
+    char  name[PROCMON_MAX_IMAGE_NAME];
+    char  path[PROCMON_MAX_DRIVER_PATH];
+
+    ZeroMemory(&cache, sizeof(cache));
 
     buffer = (BYTE *)malloc(ENUM_BUFFER_SIZE);
     if (buffer == NULL) {
@@ -179,113 +875,172 @@ static void ModeInstalledDrivers(HANDLE hDevice)
 
     printf("\nЗапрос установленных драйверов...\n\n");
 
-    success = DeviceIoControl(
-        hDevice,
-        IOCTL_PROCMON_GET_INSTALLED_DRIVERS,
-        NULL, 0,
-        buffer, ENUM_BUFFER_SIZE,
-        &bytesReturned,
-        NULL
-    );
-
-    if (!success) {
-        printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
-        free(buffer);
-        return;
-    }
-
-    response = (PDRIVER_INFO_RESPONSE)buffer;
-
     printf("%-24s %-50s %-8s %s\n",
            "Имя", "Путь", "Запуск", "MD5");
     printf("--------------------------------------------"
            "--------------------------------------------\n");
 
-    for (i = 0; i < response->ReturnedCount; i++) {
-        PDRIVER_INFO drv = &response->Drivers[i];
+    do {
+        if (!QueryEnumPage(hDevice, IOCTL_PROCMON_GET_INSTALLED_DRIVERS, cursor, buffer,
+                           &bytesReturned)) {
+            break;
+        }
+
+        response = (PDRIVER_INFO_RESPONSE_V2)buffer;
 
-        if (drv->HashValid) {
-            FormatHash(drv->FileHash, hashStr, sizeof(hashStr));
-        } else {
-            _snprintf(hashStr, sizeof(hashStr), "N/A");
-            hashStr[sizeof(hashStr) - 1] = '\0';
+        for (i = 0; i < response->ReturnedCount; i++) {
+            PDRIVER_RECORD_V2 drv = &response->Drivers[i];
+
+            CopyStringRef(buffer + response->StringsOffset, &drv->DriverName, name, sizeof(name));
+            CopyStringRef(buffer + response->StringsOffset, &drv->ImagePath, path, sizeof(path));
+
+            if (drv->HashValid) {
+                FormatHash(drv->FileHash, PROCMON_HASH_SIZE, hashStr, sizeof(hashStr));
+            } else {
+                _snprintf(hashStr, sizeof(hashStr), "N/A");
+                hashStr[sizeof(hashStr) - 1] = '\0';
+            }
+
+            printf("%-24.24s %-50.50s %-8lu %s\n",
+                   name,
+                   path,
+                   drv->StartType,
+                   hashStr);
         }
 
-        printf("%-24.24s %-50.50s %-8lu %s\n",
-               drv->DriverName,
-               drv->ImagePath,
-               drv->StartType,
-               hashStr);
-    }
+        total = response->TotalCount;
+        shown += response->ReturnedCount;
+        cursor = response->NextCursor;
+        cache = response->Cache;
+        received += bytesReturned;
+        fixed += FIELD_OFFSET(DRIVER_INFO_RESPONSE, Drivers) +
+                 (ULONG64)response->ReturnedCount * sizeof(DRIVER_INFO);
+    } while (cursor != 0);
 
-    printf("\nВсего: %lu драйверов (показано: %lu)\n",
-           response->TotalCount, response->ReturnedCount);
+    printf("\nВсего: %lu драйверов (показано: %lu)\n", total, shown);
+    PrintCacheStats(&cache);
+    PrintWireSize(received, fixed);
 
     free(buffer);
 }
 
 /*
- * Режим 3: Загруженные драйверы (с обновлением по Enter).
+ * PrintLoadedDriver — строка таблицы загруженных драйверов.
+ * Mark — '+' загружен, '-' выгружен, ' ' — строка полного списка.
+ */
+static void PrintLoadedDriver(char mark, const DRIVER_INFO *drv)
+{
+    char hashStr[33];
+
+    if (drv->HashValid) {
+        FormatHash(drv->FileHash, PROCMON_HASH_SIZE, hashStr, sizeof(hashStr));
+    } else {
+        _snprintf(hashStr, sizeof(hashStr), "N/A");
+        hashStr[sizeof(hashStr) - 1] = '\0';
+    }
+
+    printf("%c %-24.24s 0x%016llX   0x%08X %s\n",
+           mark,
+           drv->DriverName,
+           (unsigned long long)drv->BaseAddress,
+           drv->ImageSize,
+           hashStr);
+}
+
+/*
+ * QueryLoadedDelta — изменения с поколения generation.
+ * Если ответ не поместился, буфер увеличивается до RequiredLength и запрос
+ * повторяется (между попытками набор мог ещё вырасти).
+ */
+static PDRIVER_DELTA_RESPONSE QueryLoadedDelta(HANDLE hDevice, ULONG generation,
+                                               BYTE **buffer, DWORD *size)
+{
+    PROCMON_DELTA_REQUEST  request;
+    PDRIVER_DELTA_RESPONSE response;
+    DWORD                  bytesReturned;
+    BYTE                  *grown;
+
+    request.Generation = generation;
+    request.Reserved = 0;
+
+    for (;;) {
+        if (DeviceIoControl(hDevice, IOCTL_PROCMON_GET_LOADED_DRIVERS_DELTA,
+                            &request, sizeof(request),
+                            *buffer, *size, &bytesReturned, NULL)) {
+            return (PDRIVER_DELTA_RESPONSE)*buffer;
+        }
+
+        response = (PDRIVER_DELTA_RESPONSE)*buffer;
+
+        if (GetLastError() != ERROR_MORE_DATA ||
+            bytesReturned < FIELD_OFFSET(DRIVER_DELTA_RESPONSE, Changes) ||
+            response->RequiredLength <= *size) {
+            printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
+            return NULL;
+        }
+
+        grown = (BYTE *)realloc(*buffer, response->RequiredLength);
+        if (grown == NULL) {
+            printf("Ошибка выделения памяти\n");
+            return NULL;
+        }
+
+        *size = response->RequiredLength;
+        *buffer = grown;
+    }
+}
+
+/*
+ * Режим 3: Загруженные драйверы.
+ * Первый запрос (поколение 0) отдаёт весь список; обновление по Enter
+ * спрашивает только изменения с прошлого поколения, так что без
+ * загрузок и выгрузок драйвер ничего не перечитывает и не хеширует.
  */
 static void ModeLoadedDrivers(HANDLE hDevice)
 {
     BYTE *buffer;
-    DWORD bytesReturned;
-    BOOL  success;
-    PDRIVER_INFO_RESPONSE response;
+    DWORD size = ENUM_BUFFER_SIZE;
+    PDRIVER_DELTA_RESPONSE response;
+    ULONG generation = 0;
     ULONG i;
-    char  hashStr[33];
     int   ch;
 
-    buffer = (BYTE *)malloc(ENUM_BUFFER_SIZE);
+    buffer = (BYTE *)malloc(size);
     if (buffer == NULL) {
         printf("Ошибка выделения памяти\n");
         return;
     }
 
     while (1) {
-        printf("\nЗапрос загруженных драйверов...\n\n");
-
-        success = DeviceIoControl(
-            hDevice,
-            IOCTL_PROCMON_GET_LOADED_DRIVERS,
-            NULL, 0,
-            buffer, ENUM_BUFFER_SIZE,
-            &bytesReturned,
-            NULL
-        );
-
-        if (!success) {
-            printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
+        response = QueryLoadedDelta(hDevice, generation, &buffer, &size);
+        if (response == NULL) {
             break;
         }
 
-        response = (PDRIVER_INFO_RESPONSE)buffer;
-
-        printf("%-24s %-20s %-12s %s\n",
-               "Имя", "Базовый адрес", "Размер", "MD5");
-        printf("--------------------------------------------"
-               "--------------------------------------------\n");
-
-        for (i = 0; i < response->ReturnedCount; i++) {
-            PDRIVER_INFO drv = &response->Drivers[i];
+        if (response->Flags & PROCMON_DELTA_FLAG_FULL) {
+            printf("\nЗагруженные драйверы (поколение %lu):\n\n", response->Generation);
+            printf("  %-24s %-20s %-12s %s\n",
+                   "Имя", "Базовый адрес", "Размер", "MD5");
+            printf("--------------------------------------------"
+                   "--------------------------------------------\n");
+        } else if (response->ChangeCount == 0) {
+            printf("\nБез изменений (поколение %lu)\n", response->Generation);
+        } else {
+            printf("\nИзменения с поколения %lu по %lu:\n\n", generation, response->Generation);
+        }
 
-            if (drv->HashValid) {
-                FormatHash(drv->FileHash, hashStr, sizeof(hashStr));
-            } else {
-                _snprintf(hashStr, sizeof(hashStr), "N/A");
-                hashStr[sizeof(hashStr) - 1] = '\0';
-            }
+        for (i = 0; i < response->ChangeCount; i++) {
+            const DRIVER_CHANGE *change = &response->Changes[i];
 
-            printf("%-24.24s 0x%016llX   0x%08X %s\n",
-                   drv->DriverName,
-                   (unsigned long long)drv->BaseAddress,
-                   drv->ImageSize,
-                   hashStr);
+            PrintLoadedDriver((response->Flags & PROCMON_DELTA_FLAG_FULL)
+                                  ? ' '
+                                  : (change->Change == PROCMON_DRIVER_ADDED) ? '+' : '-',
+                              &change->Driver);
         }
 
-        printf("\nЗагружено: %lu драйверов (показано: %lu)\n",
-               response->TotalCount, response->ReturnedCount);
+        generation = response->Generation;
+
+        printf("\nЗагружено: %lu драйверов\n", response->TotalCount);
         printf("Нажмите Enter для обновления, Q для выхода.\n");
 
         ch = getchar();
@@ -303,10 +1058,18 @@ static void ModeLoadedDrivers(HANDLE hDevice)
 static void ModeDevices(HANDLE hDevice)
 {
     BYTE *buffer;
-    DWORD bytesReturned;
-    BOOL  success;
-    PDEVICE_INFO_RESPONSE response;
+    PDEVICE_INFO_RESPONSE_V2 response;
+    ULONG64 cursor = 0;
+    ULONG total = 0;
+    ULONG shown = 0;
     ULONG i;
+    PROCMON_CACHE_STATS cache;
+    DWORD bytesReturned;
+    ULONG64 received = 0;
+    ULONG64 fixed = 0;
+    DEVICE_INFO dev;
+
+    ZeroMemory(&cache, sizeof(cache));
 
     buffer = (BYTE *)malloc(ENUM_BUFFER_SIZE);
     if (buffer == NULL) {
@@ -316,42 +1079,226 @@ static void ModeDevices(HANDLE hDevice)
 
     printf("\nЗапрос активных устройств...\n\n");
 
-    success = DeviceIoControl(
-        hDevice,
-        IOCTL_PROCMON_GET_DEVICES,
-        NULL, 0,
-        buffer, ENUM_BUFFER_SIZE,
-        &bytesReturned,
-        NULL
-    );
+    printf("%-32s %-20s %-32s %s\n",
+           "Устройство", "Серийник", "Hardware ID", "Драйвер");
+    printf("--------------------------------------------"
+           "------------------------------------------------------\n");
+
+    do {
+        if (!QueryEnumPage(hDevice, IOCTL_PROCMON_GET_DEVICES, cursor, buffer,
+                           &bytesReturned)) {
+            break;
+        }
+
+        response = (PDEVICE_INFO_RESPONSE_V2)buffer;
+
+        for (i = 0; i < response->ReturnedCount; i++) {
+            const BYTE             *strings = buffer + response->StringsOffset;
+            const DEVICE_RECORD_V2 *rec = &response->Devices[i];
+
+            CopyStringRef(strings, &rec->DeviceName, dev.DeviceName, sizeof(dev.DeviceName));
+            CopyStringRef(strings, &rec->SerialNumber, dev.SerialNumber, sizeof(dev.SerialNumber));
+            CopyStringRef(strings, &rec->HardwareId, dev.HardwareId, sizeof(dev.HardwareId));
+            CopyStringRef(strings, &rec->Service, dev.Service, sizeof(dev.Service));
+
+            printf("%-32.32s %-20.20s %-32.32s %s\n",
+                   dev.DeviceName[0] ? dev.DeviceName : "-",
+                   dev.SerialNumber[0] ? dev.SerialNumber : "-",
+                   dev.HardwareId[0] ? dev.HardwareId : "-",
+                   dev.Service[0] ? dev.Service : "-");
+        }
+
+        total = response->TotalCount;
+        shown += response->ReturnedCount;
+        cursor = response->NextCursor;
+        cache = response->Cache;
+        received += bytesReturned;
+        fixed += FIELD_OFFSET(DEVICE_INFO_RESPONSE, Devices) +
+                 (ULONG64)response->ReturnedCount * sizeof(DEVICE_INFO);
+    } while (cursor != 0);
+
+    printf("\nВсего: %lu устройств (показано: %lu)\n", total, shown);
+    PrintCacheStats(&cache);
+    PrintWireSize(received, fixed);
+
+    free(buffer);
+}
+
+/*
+ * PrintBufferInfo — параметры колец и занимаемая память.
+ */
+static void PrintBufferInfo(const PROCMON_BUFFER_INFO *info)
+{
+    static const char *policies[] = { "перезапись", "отбрасывать новые", "приоритет завершений" };
+
+    printf("Колец (по процессорам): %lu, набор #%lu\n", info->RingCount, info->Generation);
+    printf("Событий в кольце:       %lu\n", info->Config.RingSize);
+    printf("Арена имён на кольцо:   %lu байт\n", info->Config.ArenaSize);
+    printf("Политика переполнения:  %s\n",
+           (info->Config.OverflowPolicy < ARRAYSIZE(policies))
+               ? policies[info->Config.OverflowPolicy] : "?");
+    printf("Память колец:           %llu KB\n", info->SectionBytes / 1024);
+    if (info->RetiredBytes != 0) {
+        printf("Старый набор (дочитывается): %llu KB\n", info->RetiredBytes / 1024);
+    }
+    printf("Служебные структуры:    %llu байт\n", info->NonPagedBytes);
+    printf("Открытых хэндлов:       %lu\n", info->ReaderCount);
+    printf("Всего:                  %llu KB\n", info->TotalBytes / 1024);
+}
+
+/*
+ * ReadNumber — прочитать число с консоли. Пустая строка — 0 («не менять»).
+ */
+static ULONG ReadNumber(const char *prompt)
+{
+    char input[32];
 
-    if (!success) {
+    printf("%s", prompt);
+    if (fgets(input, sizeof(input), stdin) == NULL) {
+        return 0;
+    }
+
+    return (ULONG)strtoul(input, NULL, 0);
+}
+
+/*
+ * Режим 5: Параметры буфера событий (размер колец, память, изменение на лету).
+ */
+static void ModeBufferConfig(HANDLE hDevice)
+{
+    PROCMON_BUFFER_INFO   info;
+    PROCMON_BUFFER_CONFIG config;
+    DWORD                 bytesReturned;
+
+    if (!DeviceIoControl(hDevice, IOCTL_PROCMON_GET_BUFFER_INFO, NULL, 0,
+                         &info, sizeof(info), &bytesReturned, NULL)) {
         printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
-        free(buffer);
         return;
     }
 
-    response = (PDEVICE_INFO_RESPONSE)buffer;
+    printf("\n");
+    PrintBufferInfo(&info);
 
-    printf("%-32s %-20s %-32s %s\n",
-           "Устройство", "Серийник", "Hardware ID", "Драйвер");
-    printf("--------------------------------------------"
-           "------------------------------------------------------\n");
+    printf("\nНовые параметры (Enter — оставить как есть):\n");
+    config.RingSize = ReadNumber("  Событий в кольце: ");
+    config.ArenaSize = ReadNumber("  Арена имён, байт: ");
+    config.OverflowPolicy = ReadNumber("  Политика (1 — перезапись, 2 — отбрасывать новые,\n"
+                                       "            3 — приоритет завершений): ");
 
-    for (i = 0; i < response->ReturnedCount; i++) {
-        PDEVICE_INFO dev = &response->Devices[i];
+    /* 0 — «не менять», поэтому политики в меню нумеруются с 1 */
+    if (config.OverflowPolicy == 0) {
+        config.OverflowPolicy = info.Config.OverflowPolicy;
+    } else {
+        config.OverflowPolicy--;
+    }
 
-        printf("%-32.32s %-20.20s %-32.32s %s\n",
-               dev->DeviceName[0] ? dev->DeviceName : "-",
-               dev->SerialNumber[0] ? dev->SerialNumber : "-",
-               dev->HardwareId[0] ? dev->HardwareId : "-",
-               dev->Service[0] ? dev->Service : "-");
+    if (config.RingSize == 0 && config.ArenaSize == 0 &&
+        config.OverflowPolicy == info.Config.OverflowPolicy) {
+        return;
     }
 
-    printf("\nВсего: %lu устройств (показано: %lu)\n",
-           response->TotalCount, response->ReturnedCount);
+    if (!DeviceIoControl(hDevice, IOCTL_PROCMON_SET_BUFFER_CONFIG, &config, sizeof(config),
+                         &info, sizeof(info), &bytesReturned, NULL)) {
+        printf("Ошибка изменения параметров: %lu\n", GetLastError());
+        return;
+    }
 
-    free(buffer);
+    printf("\nПараметры изменены:\n");
+    PrintBufferInfo(&info);
+}
+
+/* Имена IOCTL по индексу PROCMON_STATS_IOCTL_INDEX */
+static const char *g_IoctlNames[PROCMON_STATS_IOCTL_COUNT] = {
+    "GET_EVENTS", "GET_INSTALLED_DRIVERS", "GET_LOADED_DRIVERS", "GET_DEVICES",
+    "GET_EVENTS_V2", "MAP_EVENTS", "GET_BUFFER_INFO", "SET_BUFFER_CONFIG",
+    "GET_EVENTS_DIRECT", "WAIT_EVENTS", "SET_FILTER", "GET_LOADED_DRIVERS_DELTA",
+    "GET_STATS", NULL, NULL, NULL
+};
+
+/*
+ * Режим 6: Статистика драйвера. Раз в секунду запрашивает счётчики
+ * и печатает скорости — разности с прошлым ответом, делённые на время
+ * между ответами.
+ */
+static void ModeStats(HANDLE hDevice)
+{
+    PROCMON_STATS prev;
+    PROCMON_STATS cur;
+    DWORD         bytesReturned;
+    double        seconds;
+    ULONG64       calls;
+    ULONG         i;
+
+    if (!DeviceIoControl(hDevice, IOCTL_PROCMON_GET_STATS, NULL, 0,
+                         &prev, sizeof(prev), &bytesReturned, NULL)) {
+        printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
+        return;
+    }
+
+    printf("\nПроцессоров: %lu. Скорости — за последнюю секунду (Ctrl+C — выход).\n",
+           prev.CpuCount);
+
+    while (1) {
+        Sleep(1000);
+
+        if (!DeviceIoControl(hDevice, IOCTL_PROCMON_GET_STATS, NULL, 0,
+                             &cur, sizeof(cur), &bytesReturned, NULL)) {
+            printf("Ошибка DeviceIoControl: %lu\n", GetLastError());
+            break;
+        }
+
+        seconds = (double)(cur.Timestamp.QuadPart - prev.Timestamp.QuadPart) / 10000000.0;
+        if (seconds <= 0.0) {
+            seconds = 1.0;
+        }
+
+        printf("\nСобытия/с: создание %.1f, завершение %.1f, хеш готов %.1f, отброшено %.1f, "
+               "перезаписано %.1f\n",
+               (double)(cur.EventsCreate - prev.EventsCreate) / seconds,
+               (double)(cur.EventsExit - prev.EventsExit) / seconds,
+               (double)(cur.EventsHashReady - prev.EventsHashReady) / seconds,
+               (double)(cur.EventsDropped - prev.EventsDropped) / seconds,
+               (double)(cur.EventsOverwritten - prev.EventsOverwritten) / seconds);
+        printf("Заполнение колец (максимум): %llu\n", cur.RingHighWater);
+        printf("Хеши/с (%s%s): %.1f (ошибок %.1f), чтение %.2f MB/с\n",
+               ((cur.HashAlgorithm & PROCMON_HASH_ID_MASK) == PROCMON_HASH_SHA256)
+                   ? ((cur.HashImplementation == PROCMON_HASH_IMPL_SHA_NI) ? "SHA-256, SHA-NI" : "SHA-256")
+                   : "MD5",
+               (cur.HashAlgorithm & PROCMON_HASH_TREE) ? ", дерево" : "",
+               (double)(cur.HashSucceeded - prev.HashSucceeded) / seconds,
+               (double)(cur.HashFailed - prev.HashFailed) / seconds,
+               (double)(cur.HashBytes - prev.HashBytes) / seconds / (1024.0 * 1024.0));
+        if (cur.HashQueueThreads != 0) {
+            printf("Очередь хеширования: %lu файлов, потоков %lu, без хеша из-за полной "
+                   "очереди %.1f/с\n",
+                   cur.HashQueueDepth, cur.HashQueueThreads,
+                   (double)(cur.HashQueueFull - prev.HashQueueFull) / seconds);
+        } else {
+            printf("Хеширование синхронное\n");
+        }
+        if (cur.HashCacheCapacity != 0) {
+            printf("Кэш хешей: попаданий %.1f/с, промахов %.1f/с, занято %lu из %lu, "
+                   "вытеснено всего %llu\n",
+                   (double)(cur.HashCacheHits - prev.HashCacheHits) / seconds,
+                   (double)(cur.HashCacheMisses - prev.HashCacheMisses) / seconds,
+                   cur.HashCacheEntries, cur.HashCacheCapacity, cur.HashCacheEvictions);
+        }
+
+        for (i = 0; i < PROCMON_STATS_IOCTL_COUNT; i++) {
+            calls = cur.Ioctl[i].Calls - prev.Ioctl[i].Calls;
+            if (calls == 0) {
+                continue;
+            }
+
+            /* Время в 100 нс, среднее — в микросекундах */
+            printf("  %-26s %8.1f/с, в среднем %.1f мкс\n",
+                   (g_IoctlNames[i] != NULL) ? g_IoctlNames[i] : "?",
+                   (double)calls / seconds,
+                   (double)(cur.Ioctl[i].TotalTime - prev.Ioctl[i].TotalTime) / calls / 10.0);
+        }
+
+        prev = cur;
+    }
 }
 
 int main(void)
@@ -366,21 +1313,23 @@ int main(void)
     printf("  2. Все установленные драйверы\n");
     printf("  3. Загруженные драйверы (обновление по Enter)\n");
     printf("  4. Активные устройства\n");
-    printf("Режим [1-4]: ");
+    printf("  5. Параметры буфера событий\n");
+    printf("  6. Статистика драйвера\n");
+    printf("Режим [1-6]: ");
 
     if (fgets(input, sizeof(input), stdin) == NULL) {
         return 1;
     }
 
     mode = atoi(input);
-    if (mode < 1 || mode > 4) {
+    if (mode < 1 || mode > 6) {
         printf("Неверный режим: %d\n", mode);
         return 1;
     }
 
     printf("Подключение к драйверу...\n");
 
-    hDevice = OpenDevice();
+    hDevice = OpenDevice(FILE_ATTRIBUTE_NORMAL);
     if (hDevice == INVALID_HANDLE_VALUE) {
         return 1;
     }
@@ -400,6 +1349,12 @@ int main(void)
     case 4:
         ModeDevices(hDevice);
         break;
+    case 5:
+        ModeBufferConfig(hDevice);
+        break;
+    case 6:
+        ModeStats(hDevice);
+        break;
     }
 
     CloseHandle(hDevice);
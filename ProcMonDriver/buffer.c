@@ -1,88 +1,1182 @@
 /*
- * buffer.c — Реализация потокобезопасного кольцевого буфера.
+ * buffer.c — Реализация per-CPU lock-free кольцевых буферов.
  *
- * Буфер работает по принципу FIFO (очередь).
- * При переполнении новое событие перезаписывает самое старое (tail сдвигается).
- * Это гарантирует, что буфер никогда не вызовет проблем с памятью,
- * даже если клиент долго не читает события.
+ * Каждое кольцо работает по принципу FIFO (очередь).
+ * Поведение при переполнении задаёт PROCMON_BUFFER_CONFIG.OverflowPolicy:
+ *   OVERWRITE   — новое событие перезаписывает самое старое;
+ *   DROP_NEWEST — новое событие отбрасывается, непрочитанные сохраняются;
+ *   PRIORITY    — создания отбрасываются уже при заполнении на 7/8,
+ *                 завершения пишутся всегда (при полном кольце — с перезаписью).
+ * «Заполненность» — расстояние от Head до позиции самого продвинутого
+ * IOCTL-читателя (Control->ReadTail): медленный или заброшенный хэндл
+ * писателей не останавливает. Клиент отображения свою позицию драйверу не
+ * сообщает, поэтому, пока ни один хэндл не читает через IOCTL
+ * (EVENT_BUFFER.IoctlReaders), действует перезапись — иначе кольцо,
+ * заполнившись однажды, отбрасывало бы всё. Отброшенные считаются в Control->Dropped, и любой
+ * читатель получает на их месте запись о пропуске (PROCMON_EVENT_FLAG_GAP).
+ * Память буфера при этом не растёт, даже если клиент долго не читает события.
  *
- * IRQL: BufferPush может вызываться до DISPATCH_LEVEL (из callback ядра).
- *       BufferRead вызывается на PASSIVE_LEVEL (из IOCTL-обработчика).
- *       KSPIN_LOCK корректно работает в обоих случаях.
+ * Запись (BufferReserve / BufferCommit):
+ *   1. Вход в эпоху писателей (cache-aware rundown), выбор активного набора.
+ *   2. Выбирается кольцо текущего процессора.
+ *   3. Писатель атомарно получает номер события n = Head++
+ *      (при отбрасывающей политике — CAS, только если в кольце есть место).
+ *   4. Переводит ячейку n & MASK в состояние «пишется» (Commit = 2n+1).
+ *   5. Захватывает место в арене (ArenaHead += длина записи).
+ *   6. Вызывающий пишет поля заголовка, хеш и имя прямо в ячейку и арену.
+ *   7. BufferCommit публикует событие (Commit = 2n+2).
+ *   BufferPush — то же для готового события, с копированием.
+ *   Спинлока нет, IRQL не повышается, писатели на разных CPU не касаются
+ *   общих кэш-линий.
+ *
+ * Чтение (BufferRead):
+ *   k-way слияние: на каждом шаге из голов всех колец выбирается событие
+ *   с наименьшим (Timestamp, номер события). Чтение не удаляет событий:
+ *   у каждого хэндла свой BUFFER_READER с позициями по кольцам, а место
+ *   освобождают сами писатели, перезаписывая старое. Сам протокол чтения ячеек
+ *   (проверка Commit до и после копирования, проверка арены) — в
+ *   common/ring.c: им же пользуется клиент, читающий кольца из своего
+ *   отображения.
+ *
+ * Память:
+ *   Кольца лежат в секции, отображённой в системное пространство.
+ *   Страницы отображения закреплены MDL, поэтому писатели на DISPATCH_LEVEL
+ *   не вызывают page fault. Клиенты отображают ту же секцию только для чтения.
+ *   Размеры колец задаются PROCMON_BUFFER_CONFIG и могут меняться на лету:
+ *   тогда создаётся новая секция (набор колец), а старая дочитывается
+ *   читателями, которые в ней ещё стоят.
+ *
+ * IRQL: BufferReserve/BufferCommit/BufferPush — до DISPATCH_LEVEL (из callback ядра).
+ *       Остальные функции — PASSIVE_LEVEL (DriverEntry и IOCTL-обработчики).
  */
 
 #include "buffer.h"
+#include "stats.h"
+
+/*
+ * Отображение, которое нельзя снять или сделать записываемым из user mode.
+ * Определено в winnt.h, но не в заголовках WDK.
+ */
+#ifndef SEC_NO_CHANGE
+#define SEC_NO_CHANGE  0x00400000
+#endif
+
+/* Выравнивание частей секции — по кэш-линии */
+#define RING_ALIGN(x)  (((x) + SYSTEM_CACHE_ALIGNMENT_SIZE - 1) & ~((ULONG)SYSTEM_CACHE_ALIGNMENT_SIZE - 1))
+
+/*
+ * RoundUpPow2 — ближайшая степень двойки >= Value в пределах [Min, Max].
+ */
+static ULONG RoundUpPow2(_In_ ULONG Value, _In_ ULONG Min, _In_ ULONG Max)
+{
+    ULONG result = Min;
+
+    while (result < Value && result < Max) {
+        result <<= 1;
+    }
+
+    return result;
+}
+
+VOID BufferNormalizeConfig(
+    _Inout_ PPROCMON_BUFFER_CONFIG Config,
+    _In_opt_ const PROCMON_BUFFER_CONFIG *Current)
+{
+    if (Config->RingSize == 0) {
+        Config->RingSize = (Current != NULL) ? Current->RingSize : RING_BUFFER_SIZE;
+    }
+
+    if (Config->ArenaSize == 0) {
+        Config->ArenaSize = (Current != NULL) ? Current->ArenaSize : RING_ARENA_SIZE;
+    }
+
+    Config->RingSize = RoundUpPow2(Config->RingSize,
+                                   PROCMON_RING_SIZE_MIN, PROCMON_RING_SIZE_MAX);
+    Config->ArenaSize = RoundUpPow2(Config->ArenaSize,
+                                    PROCMON_ARENA_SIZE_MIN, PROCMON_ARENA_SIZE_MAX);
+
+    if (Config->OverflowPolicy != PROCMON_OVERFLOW_OVERWRITE &&
+        Config->OverflowPolicy != PROCMON_OVERFLOW_DROP_NEWEST &&
+        Config->OverflowPolicy != PROCMON_OVERFLOW_PRIORITY) {
+        DbgPrint("[ProcMon] Неизвестная политика переполнения %lu, используется перезапись\n",
+                 Config->OverflowPolicy);
+        Config->OverflowPolicy = PROCMON_OVERFLOW_OVERWRITE;
+    }
+}
+
+/*
+ * RingSetFree — освобождение набора колец.
+ * Писателей в наборе быть не должно. Клиентские отображения, которые
+ * ещё живы, держат секцию сами: память исчезнет, когда их процессы
+ * закроют отображения.
+ */
+static VOID RingSetFree(_In_ PRING_SET Set)
+{
+    if (Set->Rings != NULL) {
+        ExFreePoolWithTag(Set->Rings, RING_POOL_TAG);
+    }
+
+    if (Set->ViewMdl != NULL) {
+        MmUnlockPages(Set->ViewMdl);
+        IoFreeMdl(Set->ViewMdl);
+    }
+
+    if (Set->SystemView != NULL) {
+        MmUnmapViewInSystemSpace(Set->SystemView);
+    }
+
+    if (Set->SectionObject != NULL) {
+        ObDereferenceObject(Set->SectionObject);
+    }
+
+    if (Set->SectionHandle != NULL) {
+        ZwClose(Set->SectionHandle);
+    }
+
+    ExFreePoolWithTag(Set, RING_POOL_TAG);
+}
 
 /*
- * BufferInit — инициализация кольцевого буфера.
- * Обнуляет все поля и инициализирует спинлок.
+ * RingSetRetire — учесть отброшенные события набора, который сейчас будет
+ * освобождён (ReadLock захвачен). Перезаписанные считает каждый читатель сам.
  */
-VOID BufferInit(_Out_ PRING_BUFFER Buffer)
+static VOID RingSetRetire(_Inout_ PEVENT_BUFFER Buffer, _In_ PRING_SET Set)
 {
-    RtlZeroMemory(Buffer, sizeof(RING_BUFFER));
-    KeInitializeSpinLock(&Buffer->Lock);
+    ULONG i;
+
+    for (i = 0; i < Set->RingCount; i++) {
+        Buffer->FreedDropped += (ULONG64)Set->Rings[i].Control->Dropped;
+    }
 }
 
 /*
- * BufferPush — добавление события в буфер.
+ * RingSetCreate — создание секции с per-CPU кольцами.
+ * Количество колец = максимальному числу процессоров во всех группах,
+ * чтобы номер из KeGetCurrentProcessorNumberEx всегда был валидным индексом.
+ * Секция создаётся обнулённой: Commit = 0, ни одно событие не опубликовано.
  *
- * Копирует событие в текущую позицию Head.
- * Если буфер полон — перезаписывает самое старое событие (сдвигает Tail).
- * Head продвигается по кругу: (Head + 1) % RING_BUFFER_SIZE.
+ * Порядок:
+ *   1. ZwCreateSection (pagefile-backed) + ссылка на объект секции.
+ *   2. MmMapViewInSystemSpace + закрепление страниц MDL.
+ *   3. Заголовок разметки и описатели колец.
+ * При ошибке освобождается то, что успели создать.
  */
-VOID BufferPush(_Inout_ PRING_BUFFER Buffer, _In_ PPROCMON_EVENT Event)
+static NTSTATUS RingSetCreate(
+    _In_ const PROCMON_BUFFER_CONFIG *Config,
+    _In_ ULONG Generation,
+    _Out_ PRING_SET *Result)
 {
-    KIRQL OldIrql;
+    NTSTATUS               status;
+    PRING_SET              set;
+    OBJECT_ATTRIBUTES      objAttr;
+    LARGE_INTEGER          sectionSize;
+    PPROCMON_SHARED_HEADER header;
+    ULONG                  ringStride;
+    ULONG                  commitOffset;
+    ULONG                  slotsOffset;
+    ULONG                  arenaOffset;
+    ULONG                  firstRingOffset;
+    ULONG64                size;
+    ULONG                  i;
 
-    /* Захватываем спинлок. OldIrql сохраняет предыдущий IRQL для восстановления. */
-    KeAcquireSpinLock(&Buffer->Lock, &OldIrql);
+    *Result = NULL;
 
-    /* Копируем событие в текущую ячейку Head */
-    RtlCopyMemory(&Buffer->Entries[Buffer->Head], Event, sizeof(PROCMON_EVENT));
+    set = (PRING_SET)ExAllocatePoolWithTag(NonPagedPoolNx, sizeof(RING_SET), RING_POOL_TAG);
+    if (set == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
 
-    /* Продвигаем Head по кругу */
-    Buffer->Head = (Buffer->Head + 1) % RING_BUFFER_SIZE;
+    RtlZeroMemory(set, sizeof(RING_SET));
+    set->Generation = Generation;
 
-    if (Buffer->Count < RING_BUFFER_SIZE) {
-        /* Буфер ещё не заполнен — просто увеличиваем счётчик */
-        Buffer->Count++;
+    set->RingCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    if (set->RingCount == 0) {
+        set->RingCount = 1;
+    }
+
+    /* Разметка кольца: [Control][Commit][Slots][Arena + запас], каждая часть с кэш-линии */
+    commitOffset    = RING_ALIGN(sizeof(PROCMON_RING_CONTROL));
+    slotsOffset     = RING_ALIGN(commitOffset + Config->RingSize * sizeof(LONG64));
+    arenaOffset     = RING_ALIGN(slotsOffset + Config->RingSize * sizeof(PROCMON_EVENT_HEADER));
+    ringStride      = RING_ALIGN(arenaOffset + Config->ArenaSize + RING_ARENA_MAX_RECORD);
+    firstRingOffset = RING_ALIGN(sizeof(PROCMON_SHARED_HEADER));
+
+    size = firstRingOffset + (ULONG64)set->RingCount * ringStride;
+    if (size > PROCMON_BUFFER_BUDGET_MAX) {
+        DbgPrint("[ProcMon] Кольца %lu x %lu событий займут %I64u байт — больше предела\n",
+                 set->RingCount, Config->RingSize, size);
+        status = STATUS_INVALID_PARAMETER;
+        goto cleanup;
+    }
+
+    sectionSize.QuadPart = (LONGLONG)size;
+
+    InitializeObjectAttributes(&objAttr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = ZwCreateSection(&set->SectionHandle, SECTION_ALL_ACCESS, &objAttr,
+                             &sectionSize, PAGE_READWRITE, SEC_COMMIT, NULL);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("[ProcMon] ZwCreateSection для колец: 0x%08X\n", status);
+        set->SectionHandle = NULL;
+        goto cleanup;
+    }
+
+    status = ObReferenceObjectByHandle(set->SectionHandle, SECTION_MAP_READ | SECTION_MAP_WRITE,
+                                       NULL, KernelMode, &set->SectionObject, NULL);
+    if (!NT_SUCCESS(status)) {
+        set->SectionObject = NULL;
+        goto cleanup;
+    }
+
+    set->ViewSize = 0;
+    status = MmMapViewInSystemSpace(set->SectionObject, &set->SystemView, &set->ViewSize);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("[ProcMon] MmMapViewInSystemSpace для колец: 0x%08X\n", status);
+        set->SystemView = NULL;
+        goto cleanup;
+    }
+
+    /* Закрепляем страницы: писатели обращаются к кольцам на DISPATCH_LEVEL */
+    set->ViewMdl = IoAllocateMdl(set->SystemView, (ULONG)size, FALSE, FALSE, NULL);
+    if (set->ViewMdl == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto cleanup;
+    }
+
+    __try {
+        MmProbeAndLockPages(set->ViewMdl, KernelMode, IoWriteAccess);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        IoFreeMdl(set->ViewMdl);
+        set->ViewMdl = NULL;
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto cleanup;
+    }
+
+    header = (PPROCMON_SHARED_HEADER)set->SystemView;
+    header->Magic           = PROCMON_SHARED_MAGIC;
+    header->Version         = PROCMON_SHARED_VERSION;
+    header->RingCount       = set->RingCount;
+    header->SlotCount       = Config->RingSize;
+    header->ArenaSize       = Config->ArenaSize;
+    header->RingStride      = ringStride;
+    header->FirstRingOffset = firstRingOffset;
+    header->CommitOffset    = commitOffset;
+    header->SlotsOffset     = slotsOffset;
+    header->ArenaOffset     = arenaOffset;
+    header->Generation      = Generation;
+    set->Header = header;
+
+    set->Rings = (PPROCMON_RING_VIEW)ExAllocatePoolWithTag(
+        NonPagedPoolNx, set->RingCount * sizeof(PROCMON_RING_VIEW), RING_POOL_TAG);
+    if (set->Rings == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto cleanup;
+    }
+
+    for (i = 0; i < set->RingCount; i++) {
+        RingViewInit(&set->Rings[i], set->SystemView, i);
+    }
+
+    DbgPrint("[ProcMon] Кольцевые буферы #%lu: %lu x %lu событий, арена %lu (%I64u байт)\n",
+             Generation, set->RingCount, Config->RingSize, Config->ArenaSize, size);
+
+    *Result = set;
+    status = STATUS_SUCCESS;
+
+cleanup:
+    if (!NT_SUCCESS(status)) {
+        RingSetFree(set);
+    }
+
+    return status;
+}
+
+/*
+ * BufferInit — создание первого набора колец, эпох писателей
+ * и именованного события уведомления.
+ * Если параметры из реестра не проходят по памяти — берутся значения по умолчанию.
+ */
+NTSTATUS BufferInit(_Out_ PEVENT_BUFFER Buffer, _In_ const PROCMON_BUFFER_CONFIG *Config)
+{
+    NTSTATUS       status;
+    UNICODE_STRING eventName;
+    PRING_SET      set;
+
+    RtlZeroMemory(Buffer, sizeof(EVENT_BUFFER));
+    ExInitializeFastMutex(&Buffer->ReadLock);
+    InitializeListHead(&Buffer->Readers);
+    KeInitializeMutex(&Buffer->ConfigLock, 0);
+    KeInitializeEvent(&Buffer->ReaderEvent, SynchronizationEvent, FALSE);
+
+    Buffer->Config = *Config;
+
+    status = RingSetCreate(&Buffer->Config, Buffer->NextGeneration, &set);
+    if (status == STATUS_INVALID_PARAMETER) {
+        Buffer->Config.RingSize = RING_BUFFER_SIZE;
+        Buffer->Config.ArenaSize = RING_ARENA_SIZE;
+        status = RingSetCreate(&Buffer->Config, Buffer->NextGeneration, &set);
+    }
+    if (!NT_SUCCESS(status)) {
+        goto cleanup;
+    }
+
+    Buffer->Active = set;
+    Buffer->NextGeneration++;
+
+    Buffer->PushRundown[0] = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, RING_POOL_TAG);
+    Buffer->PushRundown[1] = ExAllocateCacheAwareRundownProtection(NonPagedPoolNx, RING_POOL_TAG);
+    if (Buffer->PushRundown[0] == NULL || Buffer->PushRundown[1] == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto cleanup;
+    }
+
+    /* Неактивная эпоха всегда «свёрнута»: BufferResize переинициализирует её перед переключением */
+    ExWaitForRundownProtectionReleaseCacheAware(Buffer->PushRundown[1]);
+    Buffer->PushEpoch = 0;
+
+    /* Synchronization event: взвод будит одного ожидающего клиента */
+    RtlInitUnicodeString(&eventName, PROCMON_NOTIFY_EVENT_KERNEL_NAME);
+    Buffer->NotifyEvent = IoCreateSynchronizationEvent(&eventName, &Buffer->NotifyHandle);
+    if (Buffer->NotifyEvent == NULL) {
+        /* Не критично: клиенты отображения будут опрашивать кольца по таймауту */
+        DbgPrint("[ProcMon] Не удалось создать событие уведомления\n");
+        Buffer->NotifyHandle = NULL;
     } else {
-        /* Буфер полон — самое старое событие перезаписано, сдвигаем Tail */
-        Buffer->Tail = (Buffer->Tail + 1) % RING_BUFFER_SIZE;
+        KeClearEvent(Buffer->NotifyEvent);
+    }
+
+    status = STATUS_SUCCESS;
+
+cleanup:
+    if (!NT_SUCCESS(status)) {
+        BufferFree(Buffer);
     }
 
-    KeReleaseSpinLock(&Buffer->Lock, OldIrql);
+    return status;
 }
 
 /*
- * BufferRead — извлечение событий из буфера.
+ * BufferFree — освобождение колец.
+ * Вызывается после снятия callback, когда писателей гарантированно нет,
+ * и после закрытия всех хэндлов (читателей тоже нет).
+ */
+VOID BufferFree(_Inout_ PEVENT_BUFFER Buffer)
+{
+    ULONG i;
+
+    if (Buffer->NotifyHandle != NULL) {
+        ZwClose(Buffer->NotifyHandle);
+        Buffer->NotifyHandle = NULL;
+        Buffer->NotifyEvent = NULL;
+    }
+
+    if (Buffer->Retired != NULL) {
+        RingSetFree(Buffer->Retired);
+        Buffer->Retired = NULL;
+    }
+
+    if (Buffer->Active != NULL) {
+        RingSetFree(Buffer->Active);
+        Buffer->Active = NULL;
+    }
+
+    for (i = 0; i < 2; i++) {
+        if (Buffer->PushRundown[i] != NULL) {
+            ExFreeCacheAwareRundownProtection(Buffer->PushRundown[i]);
+            Buffer->PushRundown[i] = NULL;
+        }
+    }
+}
+
+/*
+ * RingClaim — захватить номер события с учётом политики переполнения.
+ * Возвращает FALSE, если событие отброшено (оно уже учтено в Dropped).
+ */
+static BOOLEAN RingClaim(
+    _In_ PPROCMON_RING_VIEW Ring,
+    _In_ ULONG Policy,
+    _In_ USHORT Flags,
+    _Out_ LONG64 *Ticket)
+{
+    LONG64 head;
+    LONG64 limit = (LONG64)Ring->SlotMask + 1;
+
+    if (Policy == PROCMON_OVERFLOW_PRIORITY) {
+        if (!(Flags & (PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_HASH_READY))) {
+            /* Завершения не отбрасываются: при полном кольце — перезапись */
+            Policy = PROCMON_OVERFLOW_OVERWRITE;
+        } else {
+            /* Создания оставляют запас под завершения */
+            limit -= limit >> PROCMON_PRIORITY_RESERVE_SHIFT;
+        }
+    }
+
+    if (Policy == PROCMON_OVERFLOW_OVERWRITE) {
+        /* InterlockedIncrement64 возвращает новое значение */
+        *Ticket = InterlockedIncrement64(&Ring->Control->Head) - 1;
+        return TRUE;
+    }
+
+    for (;;) {
+        head = Ring->Control->Head;
+
+        if (head - Ring->Control->ReadTail >= limit) {
+            InterlockedIncrement64(&Ring->Control->Dropped);
+            return FALSE;
+        }
+
+        if (InterlockedCompareExchange64(&Ring->Control->Head, head + 1, head) == head) {
+            *Ticket = head;
+            return TRUE;
+        }
+    }
+}
+
+/*
+ * BufferReserve — захват ячейки и места в арене под событие.
+ *
+ * Если кольцо полно и политика — перезапись, ячейка самого старого события
+ * просто переиспользуется: его номер становится меньше Head - RingSize,
+ * и читатель его пропустит. Арена тоже перезаписывается по кругу.
+ * При отбрасывающей политике событие не пишется, растёт Control->Dropped.
  *
- * Копирует до MaxEvents событий из буфера в массив OutEvents.
- * Каждое прочитанное событие удаляется из буфера (Tail продвигается).
- * Возвращает количество фактически скопированных событий.
+ * Ожидание возможно только в одном случае: кольцо обернулось целиком,
+ * пока предыдущий писатель этой же ячейки ещё копировал своё событие.
+ * Тогда ждём его публикации, чтобы две записи не перемешались.
  */
-ULONG BufferRead(
-    _Inout_ PRING_BUFFER Buffer,
-    _Out_writes_(MaxEvents) PPROCMON_EVENT OutEvents,
-    _In_ ULONG MaxEvents)
+BOOLEAN BufferReserve(
+    _Inout_ PEVENT_BUFFER Buffer,
+    _In_ USHORT Flags,
+    _In_ USHORT NameLength,
+    _Out_ PBUFFER_RESERVATION Reservation)
+{
+    PRING_SET             set;
+    PPROCMON_RING_VIEW    ring;
+    LONG                  epoch;
+    ULONG                 ringIndex;
+    ULONG                 policy;
+    LONG64                ticket;
+    LONG64                writing;
+    LONG64                seq;
+    LONG64                fill;
+    ULONG                 index;
+    PPROCMON_EVENT_HEADER slot;
+    BOOLEAN               hashValid;
+    ULONG                 hashLength;
+    ULONG                 recordLen;
+    ULONG                 pos;
+    PUCHAR                dst;
+
+    /*
+     * Входим в текущую эпоху. Неудача значит, что BufferResize как раз
+     * сворачивает эту эпоху — она уже переключена, перечитываем.
+     */
+    for (;;) {
+        epoch = Buffer->PushEpoch & 1;
+        if (ExAcquireRundownProtectionCacheAware(Buffer->PushRundown[epoch])) {
+            break;
+        }
+        YieldProcessor();
+    }
+
+    set = Buffer->Active;
+
+    ringIndex = KeGetCurrentProcessorNumberEx(NULL);
+    if (ringIndex >= set->RingCount) {
+        ringIndex %= set->RingCount;
+    }
+    ring = &set->Rings[ringIndex];
+
+    /*
+     * Захватываем номер события (политику смотрим по флагам ещё не записанного события).
+     * Без IOCTL-читателей ReadTail стоит на месте — отбрасывать не по чему.
+     */
+    policy = Buffer->IoctlReaders != 0 ? Buffer->Config.OverflowPolicy
+                                       : PROCMON_OVERFLOW_OVERWRITE;
+    if (!RingClaim(ring, policy, Flags, &ticket)) {
+        ExReleaseRundownProtectionCacheAware(Buffer->PushRundown[epoch]);
+        StatsEventDropped();
+        return FALSE;
+    }
+
+    index = (ULONG)(ticket & ring->SlotMask);
+    writing = ticket * 2 + 1;
+
+    for (;;) {
+        seq = ring->Commit[index];
+
+        if (seq >= writing) {
+            /* Ячейку уже занял писатель следующего круга — наше событие и так перезаписано */
+            ExReleaseRundownProtectionCacheAware(Buffer->PushRundown[epoch]);
+            StatsEventOverwritten();
+            return FALSE;
+        }
+
+        if (seq & 1) {
+            /* Предыдущий писатель этой ячейки ещё копирует — ждём публикации */
+            YieldProcessor();
+            continue;
+        }
+
+        if (InterlockedCompareExchange64(&ring->Commit[index], writing, seq) == seq) {
+            break;
+        }
+    }
+
+    /*
+     * В ячейке остались поля прошлого круга. Служебные поля заполняем здесь,
+     * ProcessId/ParentProcessId/Timestamp — вызывающий, поэтому обнулять
+     * заголовок целиком не нужно.
+     */
+    slot = &ring->Slots[index];
+    slot->Flags = Flags & ~PROCMON_EVENT_FLAG_NAME_LOST;
+    slot->NameOffset = PROCMON_NO_DATA;
+    slot->HashOffset = PROCMON_NO_DATA;
+
+    /* Номер уникален между кольцами: номер в кольце * число колец + индекс кольца */
+    slot->Sequence = (ULONG)(ticket * set->RingCount + ringIndex);
+
+    if (NameLength >= PROCMON_MAX_IMAGE_NAME) {
+        NameLength = PROCMON_MAX_IMAGE_NAME - 1;
+    }
+    slot->NameLength = NameLength;
+
+    Reservation->Header = slot;
+    Reservation->Hash = NULL;
+    Reservation->Name = NULL;
+
+    /* Холодные данные — в арену: [хеш][имя], выровнено на 8 */
+    hashValid = (Flags & PROCMON_EVENT_FLAG_HASH_VALID) ? TRUE : FALSE;
+    hashLength = hashValid ? PROCMON_EVENT_HASH_SIZE(Flags) : 0;
+    recordLen = (hashLength + NameLength + 7) & ~7UL;
+    if (recordLen != 0) {
+        pos = (ULONG)InterlockedExchangeAdd(&ring->Control->ArenaHead, (LONG)recordLen);
+        dst = &ring->Arena[pos & (ring->ArenaSize - 1)];
+
+        if (hashValid) {
+            Reservation->Hash = dst;
+            slot->HashOffset = pos;
+            dst += hashLength;
+            pos += hashLength;
+        }
+
+        if (NameLength != 0) {
+            Reservation->Name = (PCHAR)dst;
+            slot->NameOffset = pos;
+        }
+    }
+
+    Reservation->Ring = ring;
+    Reservation->Index = index;
+    Reservation->Published = writing + 1;
+    Reservation->Epoch = epoch;
+
+    /*
+     * Заполнение — от позиции самого продвинутого IOCTL-читателя. Если оно
+     * больше кольца, ячейка прошлого круга ушла непрочитанной.
+     */
+    fill = ticket + 1 - ring->Control->ReadTail;
+    if (fill > (LONG64)ring->SlotMask + 1) {
+        fill = (LONG64)ring->SlotMask + 1;
+        StatsEventOverwritten();
+    }
+    StatsEventWritten(Flags, (ULONG64)fill);
+
+    return TRUE;
+}
+
+/*
+ * BufferCommit — публикация события, захваченного BufferReserve.
+ */
+VOID BufferCommit(_Inout_ PEVENT_BUFFER Buffer, _In_ PBUFFER_RESERVATION Reservation)
+{
+    PPROCMON_RING_VIEW ring = Reservation->Ring;
+
+    /* Interlocked-операция служит барьером: данные видны до флага */
+    InterlockedExchange64(&ring->Commit[Reservation->Index], Reservation->Published);
+
+    /*
+     * Будим клиента отображения. Событие уже взведено — повторный KeSetEvent
+     * ничего не даст, а его диспетчерская блокировка общая для всех CPU.
+     */
+    if (Buffer->MappedClients != 0 && Buffer->NotifyEvent != NULL &&
+        KeReadStateEvent(Buffer->NotifyEvent) == 0) {
+        KeSetEvent(Buffer->NotifyEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    /* И поток, который держит отложенные запросы событий */
+    if (Buffer->PendingReaders != 0 && KeReadStateEvent(&Buffer->ReaderEvent) == 0) {
+        KeSetEvent(&Buffer->ReaderEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+    ExReleaseRundownProtectionCacheAware(Buffer->PushRundown[Reservation->Epoch]);
+}
+
+/*
+ * BufferPush — добавление готового события копированием (Reserve + копия + Commit).
+ */
+VOID BufferPush(
+    _Inout_ PEVENT_BUFFER Buffer,
+    _In_ const PROCMON_EVENT_HEADER *Header,
+    _In_opt_ const UCHAR *Hash,
+    _In_reads_opt_(NameLength) const CHAR *Name,
+    _In_ USHORT NameLength)
+{
+    BUFFER_RESERVATION reservation;
+    USHORT             flags = Header->Flags;
+
+    if (Hash == NULL) {
+        flags &= ~PROCMON_EVENT_FLAG_HASH_VALID;
+    }
+
+    if (Name == NULL) {
+        NameLength = 0;
+    }
+
+    if (!BufferReserve(Buffer, flags, NameLength, &reservation)) {
+        return;
+    }
+
+    reservation.Header->ProcessId = Header->ProcessId;
+    reservation.Header->ParentProcessId = Header->ParentProcessId;
+    reservation.Header->Timestamp = Header->Timestamp;
+
+    if (reservation.Hash != NULL) {
+        RtlCopyMemory(reservation.Hash, Hash, PROCMON_EVENT_HASH_SIZE(flags));
+    }
+
+    if (reservation.Name != NULL) {
+        RtlCopyMemory(reservation.Name, Name, reservation.Header->NameLength);
+    }
+
+    BufferCommit(Buffer, &reservation);
+}
+
+/*
+ * ReaderPosition — поставить читателя на самые старые события набора Set
+ * (ReadLock захвачен).
+ */
+static VOID ReaderPosition(_Inout_ PBUFFER_READER Reader, _In_ PRING_SET Set)
 {
-    KIRQL OldIrql;
-    ULONG ReadCount = 0;
     ULONG i;
 
-    KeAcquireSpinLock(&Buffer->Lock, &OldIrql);
+    for (i = 0; i < Set->RingCount; i++) {
+        RingViewInit(&Reader->Views[i], Set->SystemView, i);
+    }
+
+    Reader->Generation = Set->Generation;
+}
+
+/*
+ * ReaderLeave — читатель уходит из набора Set (ReadLock захвачен).
+ * Всё, что он в нём не дочитал, считается для него перезаписанным.
+ */
+static VOID ReaderLeave(_Inout_ PBUFFER_READER Reader, _In_ PRING_SET Set)
+{
+    PPROCMON_RING_VIEW view;
+    ULONG              i;
+
+    for (i = 0; i < Set->RingCount; i++) {
+        view = &Reader->Views[i];
+        Reader->FreedOverwritten += view->LostTotal +
+                                    (ULONG64)(view->Control->Head - view->Tail);
+    }
+}
+
+/*
+ * RetiredRelease — отцепить старый набор, если в нём не осталось
+ * читателей (ReadLock захвачен). Возвращает набор, который вызывающий
+ * освободит после выхода из-под блокировки (ZwClose требует PASSIVE_LEVEL).
+ */
+static PRING_SET RetiredRelease(_Inout_ PEVENT_BUFFER Buffer)
+{
+    PRING_SET   set = Buffer->Retired;
+    PLIST_ENTRY entry;
+
+    if (set == NULL) {
+        return NULL;
+    }
+
+    for (entry = Buffer->Readers.Flink; entry != &Buffer->Readers; entry = entry->Flink) {
+        if (CONTAINING_RECORD(entry, BUFFER_READER, Link)->Generation == set->Generation) {
+            return NULL;
+        }
+    }
+
+    RingSetRetire(Buffer, set);
+    Buffer->Retired = NULL;
+
+    return set;
+}
+
+/*
+ * ReaderSelect — набор, в котором читатель сейчас читает, и кольцо
+ * с наименьшей головой в нём (ReadLock захвачен).
+ *
+ * Пока читатель стоит в старом наборе, он дочитывает его: писателей
+ * там нет, и всё в нём записано раньше, чем в активном. Дочитав, он
+ * переходит на активный; последний ушедший читатель отдаёт старый
+ * набор в *Drained.
+ */
+static PRING_SET ReaderSelect(
+    _Inout_ PEVENT_BUFFER Buffer,
+    _Inout_ PBUFFER_READER Reader,
+    _Out_ PLONG Best,
+    _Inout_ PRING_SET *Drained)
+{
+    PRING_SET set = Buffer->Active;
+
+    if (Reader->Generation != set->Generation) {
+        /* Набор не освобождается, пока в нём стоит хоть один читатель */
+        set = Buffer->Retired;
+
+        *Best = RingMergeSelect(Reader->Views, set->RingCount);
+        if (*Best >= 0) {
+            return set;
+        }
+
+        ReaderLeave(Reader, set);
+        set = Buffer->Active;
+        ReaderPosition(Reader, set);
+        *Drained = RetiredRelease(Buffer);
+    }
+
+    /* Отрицательный результат — пусто или голова какого-то кольца ещё не опубликована */
+    *Best = RingMergeSelect(Reader->Views, set->RingCount);
 
-    /* Читаем минимум из (запрошено, доступно) */
-    for (i = 0; i < MaxEvents && Buffer->Count > 0; i++) {
-        RtlCopyMemory(&OutEvents[i], &Buffer->Entries[Buffer->Tail], sizeof(PROCMON_EVENT));
+    return set;
+}
+
+NTSTATUS BufferReaderOpen(_Inout_ PEVENT_BUFFER Buffer, _Out_ PBUFFER_READER Reader)
+{
+    ULONG count;
 
-        /* Продвигаем Tail по кругу */
-        Buffer->Tail = (Buffer->Tail + 1) % RING_BUFFER_SIZE;
-        Buffer->Count--;
-        ReadCount++;
+    RtlZeroMemory(Reader, sizeof(BUFFER_READER));
+
+    /* Число колец одинаково у всех наборов, так что позиции выделяются один раз */
+    count = Buffer->Active->RingCount;
+
+    Reader->Views = (PPROCMON_RING_VIEW)ExAllocatePoolWithTag(
+        NonPagedPoolNx, (SIZE_T)count * sizeof(PROCMON_RING_VIEW), RING_POOL_TAG);
+    if (Reader->Views == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    KeReleaseSpinLock(&Buffer->Lock, OldIrql);
+    ExAcquireFastMutex(&Buffer->ReadLock);
+
+    ReaderPosition(Reader, Buffer->Active);
+    InsertTailList(&Buffer->Readers, &Reader->Link);
+    Buffer->ReaderCount++;
+
+    ExReleaseFastMutex(&Buffer->ReadLock);
+
+    return STATUS_SUCCESS;
+}
+
+VOID BufferReaderClose(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PBUFFER_READER Reader)
+{
+    PRING_SET drained;
+
+    if (Reader->Views == NULL) {
+        return;
+    }
+
+    ExAcquireFastMutex(&Buffer->ReadLock);
+
+    RemoveEntryList(&Reader->Link);
+    Buffer->ReaderCount--;
+    if (Reader->Reading) {
+        InterlockedDecrement(&Buffer->IoctlReaders);
+    }
+
+    /* Возможно, это был последний читатель старого набора */
+    drained = RetiredRelease(Buffer);
+
+    ExReleaseFastMutex(&Buffer->ReadLock);
+
+    if (drained != NULL) {
+        RingSetFree(drained);
+    }
+
+    ExFreePoolWithTag(Reader->Views, RING_POOL_TAG);
+    Reader->Views = NULL;
+}
+
+/*
+ * BufferRead — извлечение событий для одного читателя.
+ *
+ * Передаёт события в Sink в порядке (Timestamp, номер события в кольце,
+ * номер кольца). Принятое событие остаётся в кольце для других читателей —
+ * продвигается только позиция Reader. Если Sink отказался — Reader
+ * получит это событие при следующем чтении.
+ * Потери кольца приходят в Sink записью о пропуске перед его следующим событием.
+ * После чтения позиция публикуется в Control->ReadTail, если она дальше
+ * уже опубликованной, — по ней отбрасывающие политики считают
+ * заполненность колец.
+ *
+ * Если у какого-то кольца голова захвачена, но ещё не опубликована,
+ * слияние останавливается: это событие может оказаться раньше остальных.
+ * Писатель публикует его за время одного копирования, и следующий вызов
+ * продолжит с этого места.
+ *
+ * Возвращает количество принятых записей (вместе с записями о пропуске).
+ */
+ULONG BufferRead(
+    _Inout_ PEVENT_BUFFER Buffer,
+    _Inout_ PBUFFER_READER Reader,
+    _In_ PBUFFER_SINK Sink,
+    _Inout_ PVOID SinkContext)
+{
+    ULONG              ReadCount = 0;
+    LONG               best;
+    PRING_SET          set;
+    PPROCMON_RING_VIEW bestRing;
+    PRING_SET          drained = NULL;
+    PROCMON_RECORD     record;
+    ULONG              i;
+
+    ExAcquireFastMutex(&Buffer->ReadLock);
+
+    for (;;) {
+        set = ReaderSelect(Buffer, Reader, &best, &drained);
+        if (best < 0) {
+            break;
+        }
+
+        bestRing = &Reader->Views[best];
+
+        if (RingViewTake(bestRing, &record)) {
+            if (!Sink(SinkContext, &record)) {
+                /* Не поместилось — читатель получит запись при следующем чтении */
+                break;
+            }
+            RingViewNext(bestRing, &record);
+            ReadCount++;
+        } else {
+            /* Событие перезаписано во время копирования — сообщим о нём пропуском */
+            RingViewSkip(bestRing);
+        }
+    }
+
+    /*
+     * Освобождаем место для писателей с отбрасывающей политикой.
+     * ReadTail только растёт: место держит самый быстрый читатель,
+     * отставшие теряют события, а не тормозят остальных.
+     * Отбрасывающие политики включаются с первым таким чтением, когда
+     * ReadTail уже свежий (BufferReserve).
+     */
+    if (set == Buffer->Active) {
+        for (i = 0; i < set->RingCount; i++) {
+            if (Reader->Views[i].Tail > set->Rings[i].Control->ReadTail) {
+                InterlockedExchange64(&set->Rings[i].Control->ReadTail, Reader->Views[i].Tail);
+            }
+        }
+
+        if (!Reader->Reading) {
+            Reader->Reading = TRUE;
+            InterlockedIncrement(&Buffer->IoctlReaders);
+        }
+    }
+
+    ExReleaseFastMutex(&Buffer->ReadLock);
+
+    if (drained != NULL) {
+        RingSetFree(drained);
+    }
 
     return ReadCount;
 }
+
+BOOLEAN BufferHasData(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PBUFFER_READER Reader)
+{
+    PRING_SET drained = NULL;
+    LONG      best;
+
+    ExAcquireFastMutex(&Buffer->ReadLock);
+    ReaderSelect(Buffer, Reader, &best, &drained);
+    ExReleaseFastMutex(&Buffer->ReadLock);
+
+    if (drained != NULL) {
+        RingSetFree(drained);
+    }
+
+    return (best >= 0);
+}
+
+/*
+ * BufferResize — замена набора колец на лету.
+ *
+ *   1. Под ConfigLock (PASSIVE_LEVEL) создаётся новый набор.
+ *   2. Под ReadLock: Active = новый набор, эпоха писателей переключается,
+ *      и ждём выхода писателей старой эпохи (они могли видеть старый Active).
+ *      Писатели новой эпохи входят уже после смены Active и пишут в новый набор.
+ *   3. Старый набор помечается Retired (для клиентов отображения)
+ *      и дочитывается BufferRead каждым читателем, который в нём стоит.
+ *      Если в нём никто не стоит, он освобождается сразу.
+ *   Прошлый старый набор, если его так и не дочитали, отбрасывается:
+ *   его читатели переходят в начало только что заменённого набора.
+ */
+NTSTATUS BufferResize(_Inout_ PEVENT_BUFFER Buffer, _In_ const PROCMON_BUFFER_CONFIG *Config)
+{
+    NTSTATUS              status;
+    PROCMON_BUFFER_CONFIG config = *Config;
+    PRING_SET             newSet;
+    PRING_SET             oldSet;
+    PRING_SET             dropped;
+    PRING_SET             released;
+    PBUFFER_READER        reader;
+    PLIST_ENTRY           entry;
+    LONG                  epoch;
+
+    KeWaitForSingleObject(&Buffer->ConfigLock, Executive, KernelMode, FALSE, NULL);
+
+    BufferNormalizeConfig(&config, &Buffer->Config);
+
+    if (config.RingSize == Buffer->Config.RingSize &&
+        config.ArenaSize == Buffer->Config.ArenaSize) {
+        Buffer->Config.OverflowPolicy = config.OverflowPolicy;
+        status = STATUS_SUCCESS;
+        goto cleanup;
+    }
+
+    status = RingSetCreate(&config, Buffer->NextGeneration, &newSet);
+    if (!NT_SUCCESS(status)) {
+        goto cleanup;
+    }
+
+    Buffer->NextGeneration++;
+
+    ExAcquireFastMutex(&Buffer->ReadLock);
+
+    /* Прошлую замену так и не дочитали через IOCTL — остаток отбрасываем */
+    dropped = Buffer->Retired;
+    if (dropped != NULL) {
+        RingSetRetire(Buffer, dropped);
+    }
+
+    oldSet = Buffer->Active;
+
+    for (entry = Buffer->Readers.Flink; entry != &Buffer->Readers; entry = entry->Flink) {
+        reader = CONTAINING_RECORD(entry, BUFFER_READER, Link);
+        if (dropped != NULL && reader->Generation == dropped->Generation) {
+            ReaderLeave(reader, dropped);
+            ReaderPosition(reader, oldSet);
+        }
+    }
+
+    InterlockedExchangePointer((PVOID volatile *)&Buffer->Active, newSet);
+
+    epoch = Buffer->PushEpoch & 1;
+    ExReInitializeRundownProtectionCacheAware(Buffer->PushRundown[epoch ^ 1]);
+    InterlockedExchange(&Buffer->PushEpoch, epoch ^ 1);
+    ExWaitForRundownProtectionReleaseCacheAware(Buffer->PushRundown[epoch]);
+
+    /* В старый набор больше никто не пишет */
+    Buffer->Retired = oldSet;
+    Buffer->Config = config;
+    InterlockedExchange(&oldSet->Header->Retired, 1);
+
+    /* Нет ни одного хэндла — дочитывать старый набор некому */
+    released = RetiredRelease(Buffer);
+
+    ExReleaseFastMutex(&Buffer->ReadLock);
+
+    if (released != NULL) {
+        RingSetFree(released);
+    }
+
+    if (dropped != NULL) {
+        DbgPrint("[ProcMon] Старый набор колец #%lu освобождён недочитанным\n",
+                 dropped->Generation);
+        RingSetFree(dropped);
+    }
+
+    /* Будим клиентов отображения: им пора дочитать старый набор и перейти на новый */
+    if (Buffer->NotifyEvent != NULL) {
+        KeSetEvent(Buffer->NotifyEvent, IO_NO_INCREMENT, FALSE);
+    }
+
+cleanup:
+    KeReleaseMutex(&Buffer->ConfigLock, FALSE);
+
+    return status;
+}
+
+/*
+ * BufferQueryInfo — параметры и память колец.
+ * SectionBytes — закреплённые страницы секции; NonPagedBytes — описатели колец.
+ */
+VOID BufferQueryInfo(_Inout_ PEVENT_BUFFER Buffer, _Out_ PPROCMON_BUFFER_INFO Info)
+{
+    PRING_SET set;
+    ULONG64   descriptors;
+
+    RtlZeroMemory(Info, sizeof(PROCMON_BUFFER_INFO));
+
+    ExAcquireFastMutex(&Buffer->ReadLock);
+
+    set = Buffer->Active;
+    Info->Config = Buffer->Config;
+    Info->RingCount = set->RingCount;
+    Info->Generation = set->Generation;
+    Info->SectionBytes = set->ViewSize;
+    Info->ReaderCount = Buffer->ReaderCount;
+
+    descriptors = sizeof(RING_SET) + (ULONG64)set->RingCount * sizeof(PROCMON_RING_VIEW);
+
+    if (Buffer->Retired != NULL) {
+        Info->RetiredBytes = Buffer->Retired->ViewSize;
+        descriptors += sizeof(RING_SET) +
+                       (ULONG64)Buffer->Retired->RingCount * sizeof(PROCMON_RING_VIEW);
+    }
+
+    ExReleaseFastMutex(&Buffer->ReadLock);
+
+    Info->NonPagedBytes = descriptors;
+    Info->TotalBytes = Info->SectionBytes + Info->RetiredBytes + Info->NonPagedBytes;
+}
+
+/*
+ * BufferQueryLoss — потери и отставание одного читателя.
+ * Отставание считается по опубликованным Head и не больше ёмкости кольца:
+ * то, что старше, уже перезаписано. Пока читатель дочитывает старый набор,
+ * к отставанию прибавляется всё, что лежит в активном.
+ */
+VOID BufferQueryLoss(
+    _Inout_ PEVENT_BUFFER Buffer,
+    _In_ PBUFFER_READER Reader,
+    _Out_ PULONG64 Dropped,
+    _Out_ PULONG64 Overwritten,
+    _Out_ PULONG64 Pending)
+{
+    PRING_SET          set;
+    PPROCMON_RING_VIEW view;
+    ULONG64            unread;
+    ULONG64            capacity;
+    ULONG              pass;
+    ULONG              i;
+
+    ExAcquireFastMutex(&Buffer->ReadLock);
+
+    *Dropped = Buffer->FreedDropped;
+    *Overwritten = Reader->FreedOverwritten;
+    *Pending = 0;
+
+    for (pass = 0; pass < 2; pass++) {
+        set = (pass == 0) ? Buffer->Active : Buffer->Retired;
+        if (set == NULL) {
+            continue;
+        }
+
+        for (i = 0; i < set->RingCount; i++) {
+            *Dropped += (ULONG64)set->Rings[i].Control->Dropped;
+        }
+
+        for (i = 0; i < set->RingCount; i++) {
+            view = &set->Rings[i];
+            capacity = (ULONG64)view->SlotMask + 1;
+
+            if (set->Generation == Reader->Generation) {
+                *Overwritten += Reader->Views[i].LostTotal;
+                unread = (ULONG64)(view->Control->Head - Reader->Views[i].Tail);
+            } else if (set == Buffer->Active) {
+                /* Читатель ещё в старом наборе — весь активный впереди */
+                unread = (ULONG64)view->Control->Head;
+            } else {
+                continue;
+            }
+
+            *Pending += (unread < capacity) ? unread : capacity;
+        }
+    }
+
+    ExReleaseFastMutex(&Buffer->ReadLock);
+}
+
+/*
+ * UnmapLocked — снять отображение Mapping (ConfigLock захвачен).
+ * Из kernel mode SEC_NO_CHANGE не мешает снять отображение.
+ *
+ * Если хэндл закрывают из другого процесса (его дублировали), отображение
+ * остаётся у владельца до его завершения — секция при этом жива за счёт
+ * самого отображения.
+ */
+static VOID UnmapLocked(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PBUFFER_MAPPING Mapping)
+{
+    NTSTATUS status;
+
+    if (Mapping->View == NULL) {
+        return;
+    }
+
+    if (Mapping->Process == PsGetCurrentProcess()) {
+        status = ZwUnmapViewOfSection(ZwCurrentProcess(), Mapping->View);
+        if (!NT_SUCCESS(status)) {
+            DbgPrint("[ProcMon] ZwUnmapViewOfSection: 0x%08X\n", status);
+        }
+    }
+
+    ObDereferenceObject(Mapping->Process);
+    InterlockedDecrement(&Buffer->MappedClients);
+
+    RtlZeroMemory(Mapping, sizeof(BUFFER_MAPPING));
+}
+
+/*
+ * BufferMapView — отображение активного набора колец в текущий процесс.
+ *
+ * PAGE_READONLY + SEC_NO_CHANGE: клиент не может ни записать в кольца,
+ * ни поменять защиту страниц, ни снять отображение сам. Хэндл секции —
+ * kernel handle, поэтому отображение делается через ZwMapViewOfSection
+ * с ZwCurrentProcess() из контекста вызывающего потока.
+ *
+ * ConfigLock держит Active на месте и сериализует запросы на одном хэндле.
+ */
+NTSTATUS BufferMapView(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PBUFFER_MAPPING Mapping)
+{
+    NTSTATUS  status = STATUS_SUCCESS;
+    PRING_SET set;
+    PVOID     base = NULL;
+    SIZE_T    viewSize = 0;
+
+    KeWaitForSingleObject(&Buffer->ConfigLock, Executive, KernelMode, FALSE, NULL);
+
+    set = Buffer->Active;
+
+    if (Mapping->View != NULL) {
+        if (Mapping->Generation == set->Generation) {
+            goto cleanup;
+        }
+
+        /* Набор колец заменён — клиент дочитал старый и пришёл за новым */
+        UnmapLocked(Buffer, Mapping);
+    }
+
+    status = ZwMapViewOfSection(set->SectionHandle, ZwCurrentProcess(), &base,
+                                0, 0, NULL, &viewSize, ViewUnmap,
+                                SEC_NO_CHANGE, PAGE_READONLY);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("[ProcMon] ZwMapViewOfSection для клиента: 0x%08X\n", status);
+        goto cleanup;
+    }
+
+    Mapping->View = base;
+    Mapping->ViewSize = viewSize;
+    Mapping->Generation = set->Generation;
+    Mapping->Process = PsGetCurrentProcess();
+    ObReferenceObject(Mapping->Process);
+
+    InterlockedIncrement(&Buffer->MappedClients);
+
+cleanup:
+    KeReleaseMutex(&Buffer->ConfigLock, FALSE);
+
+    return status;
+}
+
+VOID BufferUnmapView(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PBUFFER_MAPPING Mapping)
+{
+    KeWaitForSingleObject(&Buffer->ConfigLock, Executive, KernelMode, FALSE, NULL);
+    UnmapLocked(Buffer, Mapping);
+    KeReleaseMutex(&Buffer->ConfigLock, FALSE);
+}
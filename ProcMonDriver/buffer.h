@@ -2,48 +2,315 @@
 #define PROCMON_BUFFER_H
 
 /*
- * buffer.h — Потокобезопасный кольцевой буфер для событий.
+ * buffer.h — Per-CPU lock-free кольцевые буферы для событий.
  * Используется для передачи данных из callback ядра (IRQL <= APC_LEVEL)
  * в IOCTL-обработчик (IRQL = PASSIVE_LEVEL).
- * Синхронизация через KSPIN_LOCK (безопасна на любом IRQL <= DISPATCH_LEVEL).
+ *
+ * На каждый логический процессор — своё кольцо, писатель
+ * работает только с кольцом своего CPU, поэтому кэш-линии не скачут между ядрами.
+ * Внутри кольца писатели не берут блокировок: номер ячейки захватывается
+ * атомарным инкрементом Head, публикация — флагом Commit ячейки
+ * (поток может быть вытеснен и продолжить на другом CPU, так что писателей
+ * у одного кольца всё равно может быть несколько).
+ *
+ * Горячие и холодные данные разделены: в ячейке лежит только 32-байтовый
+ * заголовок (PROCMON_EVENT_HEADER), а имя и хеш — запись переменной длины
+ * в арене кольца. События завершения в арене места не занимают.
+ *
+ * Память колец — секция (pagefile-backed), отображённая в системное
+ * пространство и закреплённая MDL: писатели работают с ней на любом
+ * IRQL <= DISPATCH_LEVEL. Ту же секцию клиент может отобразить к себе
+ * только для чтения (BufferMapView) и читать события на месте, без IOCTL.
+ * Разметка секции — PROCMON_SHARED_HEADER в shared.h.
+ *
+ * Читатель сливает кольца в один поток, упорядоченный по времени события.
+ * Чтение не разрушает данные: у каждого хэндла устройства свой читатель
+ * (BUFFER_READER) со своими позициями в кольцах и своими потерями, так что
+ * несколько клиентов видят каждый все события. Отставший читатель писателей
+ * не тормозит — до него просто доходят записи о пропуске.
+ * Читатели сериализуются между собой через FAST_MUTEX, который
+ * писатели никогда не трогают.
  */
 
 #include <ntddk.h>
 #include "../common/shared.h"
+#include "../common/ring.h"
 
-/* Размер кольцевого буфера (количество записей). Должен быть степенью двойки. */
+/*
+ * Параметры колец по умолчанию (если в реестре нет Parameters).
+ * Размеры — степени двойки; фактические берутся из PROCMON_BUFFER_CONFIG.
+ */
 #define RING_BUFFER_SIZE  512
 
 /*
- * Структура кольцевого буфера.
- * Head — индекс для записи (следующая свободная ячейка).
- * Tail — индекс для чтения (следующее непрочитанное событие).
- * Count — текущее количество непрочитанных событий.
+ * Размер арены имён одного кольца по умолчанию.
+ * Запись создания (хеш + типичный путь ~50 символов) занимает ~72 байта,
+ * завершения — 0, так что 16 KB хватает на полное кольцо смешанных событий.
+ */
+#define RING_ARENA_SIZE   (16 * 1024)
+
+/*
+ * Максимальный размер записи в арене (хеш + имя, выровнено на 8).
+ * Столько же байт запаса выделяется за концом арены, чтобы запись,
+ * начатая у конца, лежала непрерывно и не резалась на две части.
+ */
+#define RING_ARENA_MAX_RECORD  ((PROCMON_HASH_MAX_SIZE + PROCMON_MAX_IMAGE_NAME + 7) & ~7)
+
+/* Тег пула для памяти колец ('Ring') */
+#define RING_POOL_TAG     'gniR'
+
+/*
+ * Набор per-CPU колец одного размера — одна секция.
+ * Rings — описатели колец для писателей в NonPagedPoolNx, индекс = номер
+ * процессора (KeGetCurrentProcessorNumberEx). Позиции чтения в них не
+ * используются: они свои у каждого BUFFER_READER и у отображённых клиентов.
+ * RingCount одинаков у всех наборов (максимум процессоров в системе).
+ *
+ * Каждое кольцо в секции:
+ *   Control->Head      — номер следующего события (захватывается писателями атомарно);
+ *   Control->ArenaHead — позиция следующей записи в арене (по модулю 2^32);
+ *   Commit[i]          — флаг публикации ячейки i для события с номером n:
+ *                          2*n + 1 — событие n записывается,
+ *                          2*n + 2 — событие n опубликовано;
+ *   Slots[i]           — заголовок; NameOffset/HashOffset — позиции в арене.
  */
-typedef struct _RING_BUFFER {
-    PROCMON_EVENT  Entries[RING_BUFFER_SIZE];  /* Массив событий */
-    ULONG          Head;                       /* Индекс записи */
-    ULONG          Tail;                       /* Индекс чтения */
-    ULONG          Count;                      /* Количество непрочитанных */
-    KSPIN_LOCK     Lock;                       /* Спинлок для синхронизации */
-} RING_BUFFER, *PRING_BUFFER;
+typedef struct _RING_SET {
+    PPROCMON_RING_VIEW     Rings;          /* Описатели колец */
+    ULONG                  RingCount;      /* Количество колец (= максимум процессоров) */
+    ULONG                  Generation;     /* Номер набора */
+    PPROCMON_SHARED_HEADER Header;         /* Начало секции (= SystemView) */
 
-/* Инициализация буфера. Вызывается один раз при загрузке драйвера. */
-VOID BufferInit(_Out_ PRING_BUFFER Buffer);
+    HANDLE                 SectionHandle;  /* Секция с кольцами (kernel handle) */
+    PVOID                  SectionObject;  /* Объект секции (для отображения в систему) */
+    PVOID                  SystemView;     /* Отображение секции в системное пространство */
+    SIZE_T                 ViewSize;       /* Размер отображения */
+    PMDL                   ViewMdl;        /* MDL закреплённых страниц отображения */
+} RING_SET, *PRING_SET;
 
-/* Добавить событие в буфер. Вызывается из callback ядра. */
-VOID BufferPush(_Inout_ PRING_BUFFER Buffer, _In_ PPROCMON_EVENT Event);
+/*
+ * Буфер событий: активный набор колец плюс, после изменения размера,
+ * старый набор, который ещё дочитывают читатели. Старый набор освобождается,
+ * когда в нём не остаётся ни одного читателя (или при следующей замене).
+ *
+ * Замена набора на лету (BufferResize):
+ *   Писатель входит в BufferReserve через cache-aware rundown текущей эпохи
+ *   (PushRundown[PushEpoch]), выходит в BufferCommit и только внутри читает Active. Замена ставит
+ *   новый Active, переключает эпоху и ждёт выхода писателей старой эпохи —
+ *   после этого в старый набор никто не пишет, и его можно дочитать и
+ *   освободить. Писатели не берут блокировок: cache-aware rundown —
+ *   счётчик на каждый процессор.
+ */
+typedef struct _EVENT_BUFFER {
+    PRING_SET volatile   Active;           /* Набор, в который пишут */
+    PRING_SET            Retired;          /* Старый набор: писателей нет, дочитывается */
+    PROCMON_BUFFER_CONFIG Config;          /* Действующие параметры */
+    ULONG                NextGeneration;   /* Номер следующего набора */
+
+    PEX_RUNDOWN_REF_CACHE_AWARE PushRundown[2];  /* Писатели эпохи 0 и 1 */
+    volatile LONG        PushEpoch;        /* Текущая эпоха писателей */
+
+    FAST_MUTEX           ReadLock;         /* Сериализация читателей и смены Active/Retired */
+    LIST_ENTRY           Readers;          /* BUFFER_READER всех хэндлов (под ReadLock) */
+    ULONG                ReaderCount;
+    volatile LONG        IoctlReaders;     /* Читателей, которые читают через IOCTL: пока их нет,
+                                              ReadTail не движется, и политика — перезапись */
+    KMUTEX               ConfigLock;       /* Сериализация замены набора и отображений;
+                                              в отличие от FAST_MUTEX оставляет PASSIVE_LEVEL,
+                                              нужный Zw*Section */
+
+    PKEVENT              NotifyEvent;      /* Именованное событие «есть данные» */
+    HANDLE               NotifyHandle;     /* Хэндл события (держит его живым) */
+    volatile LONG        MappedClients;    /* Число клиентских отображений */
+
+    KEVENT               ReaderEvent;      /* «Есть данные» для потока отложенных запросов */
+    volatile LONG        PendingReaders;   /* Число отложенных запросов событий */
+
+    ULONG64              FreedDropped;     /* Отброшено в освобождённых наборах (под ReadLock) */
+} EVENT_BUFFER, *PEVENT_BUFFER;
 
 /*
- * Извлечь события из буфера.
- * MaxEvents — максимальное количество событий для извлечения.
- * OutEvents — массив для записи событий (выделен вызывающей стороной).
- * Возвращает количество фактически извлечённых событий.
+ * Читатель IOCTL — один на хэндл устройства.
+ * Views — позиции по кольцам набора Generation: это Active или Retired
+ * (пока старый набор не дочитан). Поля меняются только под ReadLock.
+ */
+typedef struct _BUFFER_READER {
+    LIST_ENTRY         Link;             /* В EVENT_BUFFER.Readers */
+    PPROCMON_RING_VIEW Views;            /* Позиции по кольцам (RingCount штук) или NULL */
+    ULONG              Generation;       /* Набор, в котором стоят Views */
+    ULONG64            FreedOverwritten; /* Потери в наборах, которые читатель уже покинул */
+    BOOLEAN            Reading;          /* Учтён в IoctlReaders (уже читал через BufferRead) */
+} BUFFER_READER, *PBUFFER_READER;
+
+/*
+ * Приёмник событий для BufferRead.
+ * Возвращает FALSE, если событие не помещается: оно остаётся в кольце,
+ * и чтение завершается.
+ */
+typedef BOOLEAN (*PBUFFER_SINK)(_Inout_ PVOID Context, _In_ const PROCMON_RECORD *Record);
+
+/*
+ * Привести параметры к допустимым: размеры — степени двойки в пределах
+ * PROCMON_*_MIN..MAX, неизвестная политика — PROCMON_OVERFLOW_OVERWRITE.
+ * Нулевые поля берутся из Current (или из значений по умолчанию, если Current == NULL).
+ */
+VOID BufferNormalizeConfig(
+    _Inout_ PPROCMON_BUFFER_CONFIG Config,
+    _In_opt_ const PROCMON_BUFFER_CONFIG *Current
+);
+
+/*
+ * Инициализация: создаёт секцию с кольцом на каждый возможный процессор
+ * и именованное событие уведомления. Config уже нормализован.
+ * Вызывается один раз при загрузке драйвера (PASSIVE_LEVEL).
+ */
+NTSTATUS BufferInit(_Out_ PEVENT_BUFFER Buffer, _In_ const PROCMON_BUFFER_CONFIG *Config);
+
+/* Освобождение колец. Вызывается при выгрузке, когда писателей уже нет. */
+VOID BufferFree(_Inout_ PEVENT_BUFFER Buffer);
+
+/*
+ * Изменить параметры на лету. Config нормализуется здесь.
+ * Если размеры не изменились — меняется только политика (сразу, без замены колец).
+ * Иначе создаётся новый набор колец, а старый дочитывается BufferRead.
+ * Если предыдущий старый набор ещё не дочитан, его остаток отбрасывается.
+ * IRQL: PASSIVE_LEVEL.
+ */
+NTSTATUS BufferResize(_Inout_ PEVENT_BUFFER Buffer, _In_ const PROCMON_BUFFER_CONFIG *Config);
+
+/* Параметры и занимаемая память. IRQL: PASSIVE_LEVEL. */
+VOID BufferQueryInfo(_Inout_ PEVENT_BUFFER Buffer, _Out_ PPROCMON_BUFFER_INFO Info);
+
+/*
+ * Захваченное под событие место в кольце (BufferReserve -> BufferCommit).
+ */
+typedef struct _BUFFER_RESERVATION {
+    PPROCMON_EVENT_HEADER Header;   /* Ячейка события в кольце */
+    PUCHAR                Hash;     /* Место под хеш в арене или NULL */
+    PCHAR                 Name;     /* Место под имя в арене (Header->NameLength байт) или NULL */
+
+    PPROCMON_RING_VIEW    Ring;     /* Служебные поля для BufferCommit */
+    ULONG                 Index;
+    LONG                  Epoch;
+    LONG64                Published;
+} BUFFER_RESERVATION, *PBUFFER_RESERVATION;
+
+/*
+ * Захватить ячейку кольца текущего CPU и место в арене под событие.
+ * Flags      — PROCMON_EVENT_FLAG_*; HASH_VALID резервирует место под хеш
+ *              (PROCMON_EVENT_HASH_SIZE(Flags) байт).
+ * NameLength — длина имени (обрезается до PROCMON_MAX_IMAGE_NAME - 1).
+ * Sequence, NameOffset, HashOffset, NameLength и Flags ячейки заполняются здесь
+ * (Sequence записи «хеш готов» вызывающий заменяет номером создания).
+ * Вызывающий заполняет ProcessId, ParentProcessId, Timestamp, пишет хеш
+ * и имя по указателям из Reservation (NameLength можно уменьшить)
+ * и обязательно вызывает BufferCommit: до него читатели ждут эту ячейку,
+ * поэтому между вызовами — только копирование, без ожиданий.
+ * Возвращает FALSE, если событие отброшено политикой переполнения или
+ * кольцо обернулось раньше, чем ячейку успели захватить (BufferCommit не нужен).
+ * IRQL <= DISPATCH_LEVEL.
+ */
+BOOLEAN BufferReserve(
+    _Inout_ PEVENT_BUFFER Buffer,
+    _In_ USHORT Flags,
+    _In_ USHORT NameLength,
+    _Out_ PBUFFER_RESERVATION Reservation
+);
+
+/* Опубликовать событие, захваченное BufferReserve. IRQL <= DISPATCH_LEVEL. */
+VOID BufferCommit(_Inout_ PEVENT_BUFFER Buffer, _In_ PBUFFER_RESERVATION Reservation);
+
+/*
+ * Добавить готовое событие в кольцо текущего CPU (копированием через
+ * BufferReserve/BufferCommit). IRQL <= DISPATCH_LEVEL.
+ * Header  — заголовок; Sequence, NameOffset, HashOffset, NameLength заполняются здесь.
+ * Hash    — хеш длиной PROCMON_EVENT_HASH_SIZE(Header->Flags) или NULL
+ *           (учитывается только при PROCMON_EVENT_FLAG_HASH_VALID).
+ * Name    — имя образа (ANSI, без '\0') длиной NameLength или NULL.
+ */
+VOID BufferPush(
+    _Inout_ PEVENT_BUFFER Buffer,
+    _In_ const PROCMON_EVENT_HEADER *Header,
+    _In_opt_ const UCHAR *Hash,
+    _In_reads_opt_(NameLength) const CHAR *Name,
+    _In_ USHORT NameLength
+);
+
+/*
+ * Зарегистрировать читателя (IRP_MJ_CREATE). Читатель начинает с самых
+ * старых событий, ещё лежащих в активном наборе.
+ * IRQL: PASSIVE_LEVEL.
+ */
+NTSTATUS BufferReaderOpen(_Inout_ PEVENT_BUFFER Buffer, _Out_ PBUFFER_READER Reader);
+
+/*
+ * Снять читателя (IRP_MJ_CLOSE). Безопасно для читателя, которого
+ * BufferReaderOpen не зарегистрировал (обнулённого).
+ * IRQL: PASSIVE_LEVEL.
+ */
+VOID BufferReaderClose(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PBUFFER_READER Reader);
+
+/*
+ * Извлечь события для Reader, слив кольца по (Timestamp, номер события).
+ * Каждое событие передаётся в Sink; извлечение идёт, пока Sink принимает события.
+ * Потери приходят в Sink записями с PROCMON_EVENT_FLAG_GAP.
+ * Позиции других читателей не меняются.
+ * Возвращает количество принятых записей.
+ * IRQL: PASSIVE_LEVEL.
  */
 ULONG BufferRead(
-    _Inout_ PRING_BUFFER Buffer,
-    _Out_writes_(MaxEvents) PPROCMON_EVENT OutEvents,
-    _In_ ULONG MaxEvents
+    _Inout_ PEVENT_BUFFER Buffer,
+    _Inout_ PBUFFER_READER Reader,
+    _In_ PBUFFER_SINK Sink,
+    _Inout_ PVOID SinkContext
 );
 
+/*
+ * Есть ли что прочитать BufferRead для Reader (событие или запись о пропуске).
+ * Голова, которая ещё не опубликована, данными не считается.
+ * IRQL: PASSIVE_LEVEL.
+ */
+BOOLEAN BufferHasData(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PBUFFER_READER Reader);
+
+/*
+ * Счётчики читателя:
+ * Dropped     — отброшено политикой переполнения с загрузки драйвера (общее);
+ * Overwritten — перезаписано до того, как Reader их прочитал;
+ * Pending     — отставание: событий в кольцах, ещё не прочитанных Reader.
+ * IRQL: PASSIVE_LEVEL.
+ */
+VOID BufferQueryLoss(
+    _Inout_ PEVENT_BUFFER Buffer,
+    _In_ PBUFFER_READER Reader,
+    _Out_ PULONG64 Dropped,
+    _Out_ PULONG64 Overwritten,
+    _Out_ PULONG64 Pending
+);
+
+/*
+ * Клиентское отображение колец (одно на хэндл устройства).
+ */
+typedef struct _BUFFER_MAPPING {
+    PVOID     View;        /* Адрес в процессе клиента или NULL */
+    SIZE_T    ViewSize;    /* Размер отображения */
+    PEPROCESS Process;     /* Процесс отображения (со ссылкой) */
+    ULONG     Generation;  /* Номер отображённого набора колец */
+} BUFFER_MAPPING, *PBUFFER_MAPPING;
+
+/*
+ * Отобразить активный набор колец в адресное пространство текущего процесса
+ * (только чтение). Если Mapping уже указывает на актуальный набор — ничего
+ * не делает; если на заменённый — снимает старое отображение и делает новое.
+ * Отображение нельзя ни снять, ни сделать записываемым из user mode —
+ * его снимает BufferUnmapView при закрытии хэндла.
+ * IRQL: PASSIVE_LEVEL, контекст вызывающего процесса.
+ */
+NTSTATUS BufferMapView(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PBUFFER_MAPPING Mapping);
+
+/*
+ * Снять отображение Mapping. Снимается, только если вызов идёт в контексте
+ * процесса отображения; ссылка на процесс освобождается в любом случае.
+ * IRQL: PASSIVE_LEVEL.
+ */
+VOID BufferUnmapView(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PBUFFER_MAPPING Mapping);
+
 #endif /* PROCMON_BUFFER_H */
@@ -25,19 +25,37 @@
  *   - Заполняем PID, PPID, имя образа из CreateInfo->ImageFileName.
  *
  * При завершении (CreateInfo == NULL):
- *   - Заполняем PID, ставим метку "<exiting>".
+ *   - Заполняем только PID. Имени нет: событие занимает лишь 32-байтовый
+ *     заголовок, клиент сам показывает "<exiting>".
  *   - PPID = 0 (недоступен при завершении).
+ *
+ * Событие пишется прямо в кольцо (BufferReserve/BufferCommit): имя
+ * конвертируется из Unicode сразу в арену, без промежуточной ANSI-строки
+ * из пула и без заголовка на стеке. Всё медленное (хеш файла) делается
+ * до резервирования — пока ячейка захвачена, читатели её ждут.
+ *
+ * Хеш обычно считается не здесь: файл уходит в очередь рабочих потоков
+ * (hash_queue.c), событие создания пишется с PROCMON_EVENT_FLAG_HASH_PENDING,
+ * а хеш приходит следом записью «хеш готов». Сами хешируем только в
+ * синхронном режиме: если очередь полна, создание пишется без хеша —
+ * задерживать запуск процесса под нагрузкой хуже, чем потерять хеш.
  */
 VOID ProcessNotifyCallback(
     _Inout_ PEPROCESS Process,
     _In_ HANDLE ProcessId,
     _Inout_opt_ PPS_CREATE_NOTIFY_INFO CreateInfo)
 {
-    PROCMON_EVENT     event;
-    PDEVICE_EXTENSION extension;
-    ANSI_STRING       ansiName;
-    NTSTATUS          status;
-    ULONG             copyLen;
+    PDEVICE_EXTENSION  extension;
+    BUFFER_RESERVATION reservation;
+    PHASH_WORK         hashWork = NULL;
+    ULONG              sequence;
+    LARGE_INTEGER      timestamp;
+    NTSTATUS           status;
+    UCHAR              fileHash[PROCMON_HASH_MAX_SIZE];
+    PCUNICODE_STRING   imageName = NULL;
+    const CHAR        *stubName = NULL;
+    ULONG              nameLength = 0;
+    USHORT             flags = 0;
 
     UNREFERENCED_PARAMETER(Process);
 
@@ -48,70 +66,115 @@ VOID ProcessNotifyCallback(
 
     extension = (PDEVICE_EXTENSION)g_DeviceObject->DeviceExtension;
 
-    /* Обнуляем структуру события */
-    RtlZeroMemory(&event, sizeof(PROCMON_EVENT));
-
-    /* PID всегда доступен */
-    event.ProcessId = (ULONG)(ULONG_PTR)ProcessId;
-
-    /* Метка времени */
-    KeQuerySystemTime(&event.Timestamp);
+    /*
+     * Метка времени. Точная версия (а не тиковая, ~15 мс), потому что по ней
+     * сливаются per-CPU кольца — события разных CPU должны различаться по времени.
+     */
+    KeQuerySystemTimePrecise(&timestamp);
 
     if (CreateInfo != NULL) {
         /* === Процесс создаётся === */
-        event.IsCreate = TRUE;
-        event.ParentProcessId = (ULONG)(ULONG_PTR)CreateInfo->ParentProcessId;
+        flags = PROCMON_EVENT_FLAG_CREATE;
 
         /*
          * CreateInfo->ImageFileName — PUNICODE_STRING.
          * Может быть NULL (например, для системных процессов).
-         * Конвертируем Unicode -> ANSI для простоты хранения.
+         * В кольце имя хранится в ANSI; здесь узнаём только его длину.
          */
         if (CreateInfo->ImageFileName != NULL) {
-            status = RtlUnicodeStringToAnsiString(&ansiName, CreateInfo->ImageFileName, TRUE);
-            if (NT_SUCCESS(status)) {
-                /* Копируем не больше, чем помещается в буфер */
-                copyLen = ansiName.Length;
-                if (copyLen >= PROCMON_MAX_IMAGE_NAME) {
-                    copyLen = PROCMON_MAX_IMAGE_NAME - 1;
-                }
-                RtlCopyMemory(event.ImageName, ansiName.Buffer, copyLen);
-                event.ImageName[copyLen] = '\0';
+            imageName = CreateInfo->ImageFileName;
 
-                /* Освобождаем ANSI-строку, выделенную RtlUnicodeStringToAnsiString */
-                RtlFreeAnsiString(&ansiName);
-            } else {
+            status = RtlUnicodeToMultiByteSize(&nameLength, imageName->Buffer, imageName->Length);
+            if (!NT_SUCCESS(status)) {
                 /* Если конвертация не удалась — ставим заглушку */
-                RtlCopyMemory(event.ImageName, "<unknown>", 10);
+                imageName = NULL;
+                stubName = "<unknown>";
             }
 
-            /* Вычисляем MD5-хеш исполняемого файла */
-            status = ComputeFileHash(CreateInfo->ImageFileName, event.FileHash);
-            if (NT_SUCCESS(status)) {
-                event.HashValid = TRUE;
+            /* Хеш исполняемого файла — в рабочем потоке, в синхронном режиме — здесь */
+            if (!HashQueueSynchronous(&extension->HashQueue)) {
+                hashWork = HashQueuePrepare(&extension->HashQueue, CreateInfo->ImageFileName);
+                if (hashWork != NULL) {
+                    flags |= PROCMON_EVENT_FLAG_HASH_PENDING;
+                }
             } else {
-                event.HashValid = FALSE;
+                status = ComputeFileHash(CreateInfo->ImageFileName, g_HashAlgorithm, fileHash);
+                if (NT_SUCCESS(status)) {
+                    flags |= PROCMON_EVENT_FLAG_HASH_VALID | g_HashAlgorithm->EventFlags;
+                }
             }
         } else {
-            RtlCopyMemory(event.ImageName, "<no name>", 10);
-            event.HashValid = FALSE;
+            stubName = "<no name>";
         }
 
-        DbgPrint("[ProcMon] CREATE: PID=%lu PPID=%lu Image=%s Hash=%s\n",
-                 event.ProcessId, event.ParentProcessId, event.ImageName,
-                 event.HashValid ? "OK" : "N/A");
+        if (stubName != NULL) {
+            nameLength = (ULONG)strlen(stubName);
+        }
+
+        if (imageName != NULL) {
+            DbgPrint("[ProcMon] CREATE: PID=%lu PPID=%lu Image=%wZ Hash=%s\n",
+                     (ULONG)(ULONG_PTR)ProcessId,
+                     (ULONG)(ULONG_PTR)CreateInfo->ParentProcessId, imageName,
+                     (flags & PROCMON_EVENT_FLAG_HASH_VALID) ? "OK" :
+                     (flags & PROCMON_EVENT_FLAG_HASH_PENDING) ? "pending" : "N/A");
+        } else {
+            DbgPrint("[ProcMon] CREATE: PID=%lu PPID=%lu Image=%s Hash=%s\n",
+                     (ULONG)(ULONG_PTR)ProcessId,
+                     (ULONG)(ULONG_PTR)CreateInfo->ParentProcessId, stubName,
+                     (flags & PROCMON_EVENT_FLAG_HASH_VALID) ? "OK" :
+                     (flags & PROCMON_EVENT_FLAG_HASH_PENDING) ? "pending" : "N/A");
+        }
 
     } else {
         /* === Процесс завершается === */
-        event.IsCreate = FALSE;
-        event.ParentProcessId = 0;
-        RtlCopyMemory(event.ImageName, "<exiting>", 10);
+        DbgPrint("[ProcMon] EXIT: PID=%lu\n", (ULONG)(ULONG_PTR)ProcessId);
+    }
+
+    if (nameLength >= PROCMON_MAX_IMAGE_NAME) {
+        nameLength = PROCMON_MAX_IMAGE_NAME - 1;
+    }
+
+    /* Захватываем ячейку в кольце текущего процессора */
+    if (!BufferReserve(&extension->EventBuffer, flags, (USHORT)nameLength, &reservation)) {
+        /* Создание потеряно — хеш к нему уже не нужен */
+        if (hashWork != NULL) {
+            HashQueueCancel(&extension->HashQueue, hashWork);
+        }
+        return;
+    }
+
+    reservation.Header->ProcessId = (ULONG)(ULONG_PTR)ProcessId;
+    reservation.Header->ParentProcessId =
+        (CreateInfo != NULL) ? (ULONG)(ULONG_PTR)CreateInfo->ParentProcessId : 0;
+    reservation.Header->Timestamp = timestamp;
+
+    if (reservation.Hash != NULL) {
+        RtlCopyMemory(reservation.Hash, fileHash, g_HashAlgorithm->DigestSize);
+    }
 
-        DbgPrint("[ProcMon] EXIT: PID=%lu\n", event.ProcessId);
+    if (reservation.Name != NULL) {
+        if (imageName != NULL) {
+            /* Длинное имя обрезается по размеру места в арене */
+            status = RtlUnicodeToMultiByteN(reservation.Name, nameLength, &nameLength,
+                                            imageName->Buffer, imageName->Length);
+            if (!NT_SUCCESS(status)) {
+                nameLength = 0;
+            }
+            reservation.Header->NameLength = (USHORT)nameLength;
+        } else {
+            RtlCopyMemory(reservation.Name, stubName, nameLength);
+        }
     }
 
-    /* Добавляем событие в кольцевой буфер */
-    BufferPush(&extension->RingBuffer, &event);
+    /* После публикации ячейку может перезаписать следующий круг — номер берём до */
+    sequence = reservation.Header->Sequence;
+
+    BufferCommit(&extension->EventBuffer, &reservation);
+
+    if (hashWork != NULL) {
+        HashQueueSubmit(&extension->HashQueue, hashWork, (ULONG)(ULONG_PTR)ProcessId,
+                        (ULONG)(ULONG_PTR)CreateInfo->ParentProcessId, sequence);
+    }
 }
 
 /*
@@ -15,13 +15,110 @@
 /* Глобальный указатель на устройство (нужен callback-у) */
 PDEVICE_OBJECT g_DeviceObject = NULL;
 
+/*
+ * ReadParameterDword — чтение REG_DWORD из ключа Parameters.
+ * Если значения нет или тип не тот — Value не меняется.
+ */
+static VOID ReadParameterDword(HANDLE KeyHandle, PCWSTR ValueName, PULONG Value)
+{
+    NTSTATUS                       status;
+    UNICODE_STRING                 valueName;
+    UCHAR                          buffer[sizeof(KEY_VALUE_PARTIAL_INFORMATION) + sizeof(ULONG)];
+    PKEY_VALUE_PARTIAL_INFORMATION info = (PKEY_VALUE_PARTIAL_INFORMATION)buffer;
+    ULONG                          resultLength;
+
+    RtlInitUnicodeString(&valueName, ValueName);
+
+    status = ZwQueryValueKey(KeyHandle, &valueName, KeyValuePartialInformation,
+                             info, sizeof(buffer), &resultLength);
+    if (NT_SUCCESS(status) && info->Type == REG_DWORD && info->DataLength == sizeof(ULONG)) {
+        *Value = *(PULONG)info->Data;
+    }
+}
+
+/*
+ * ReadParameters — параметры драйвера из <ключ службы>\Parameters.
+ *
+ * Значения (REG_DWORD, все необязательные):
+ *   RingSize        — событий в кольце одного процессора;
+ *   ArenaSize       — байт арены имён одного кольца;
+ *   OverflowPolicy  — PROCMON_OVERFLOW_*;
+ *   SynchronousHash — 1: хешировать образ в callback, до запуска процесса
+ *                     (по умолчанию 0 — хеш приходит следом, из рабочего потока);
+ *   HashAlgorithm   — алгоритм хеша образов, PROCMON_HASH_* (по умолчанию MD5);
+ *   TreeHash        — 1: хеш-дерево всего образа вместо первых 4 MB (по умолчанию 0);
+ *   EnumHashThreads — потоков, хеширующих файлы драйверов в перечислениях
+ *                     (по умолчанию 0 — по числу процессоров).
+ * Отсутствующие значения берутся по умолчанию, параметры колец нормализуются
+ * (степени двойки в допустимых пределах).
+ */
+static VOID ReadParameters(
+    _In_ PUNICODE_STRING RegistryPath,
+    _Out_ PPROCMON_BUFFER_CONFIG Config,
+    _Out_ PULONG SynchronousHash,
+    _Out_ PULONG HashAlgorithm,
+    _Out_ PULONG TreeHash,
+    _Out_ PULONG EnumHashThreads)
+{
+    NTSTATUS          status;
+    OBJECT_ATTRIBUTES objAttr;
+    UNICODE_STRING    paramsName;
+    HANDLE            serviceKey = NULL;
+    HANDLE            paramsKey = NULL;
+
+    RtlZeroMemory(Config, sizeof(PROCMON_BUFFER_CONFIG));
+    *SynchronousHash = 0;
+    *HashAlgorithm = PROCMON_HASH_MD5;
+    *TreeHash = 0;
+    *EnumHashThreads = 0;
+
+    InitializeObjectAttributes(&objAttr, RegistryPath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = ZwOpenKey(&serviceKey, KEY_READ, &objAttr);
+    if (!NT_SUCCESS(status)) {
+        goto cleanup;
+    }
+
+    RtlInitUnicodeString(&paramsName, L"Parameters");
+    InitializeObjectAttributes(&objAttr, &paramsName,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, serviceKey, NULL);
+
+    status = ZwOpenKey(&paramsKey, KEY_READ, &objAttr);
+    if (!NT_SUCCESS(status)) {
+        goto cleanup;
+    }
+
+    ReadParameterDword(paramsKey, L"RingSize", &Config->RingSize);
+    ReadParameterDword(paramsKey, L"ArenaSize", &Config->ArenaSize);
+    ReadParameterDword(paramsKey, L"OverflowPolicy", &Config->OverflowPolicy);
+    ReadParameterDword(paramsKey, L"SynchronousHash", SynchronousHash);
+    ReadParameterDword(paramsKey, L"HashAlgorithm", HashAlgorithm);
+    ReadParameterDword(paramsKey, L"TreeHash", TreeHash);
+    ReadParameterDword(paramsKey, L"EnumHashThreads", EnumHashThreads);
+
+cleanup:
+    if (paramsKey != NULL) {
+        ZwClose(paramsKey);
+    }
+    if (serviceKey != NULL) {
+        ZwClose(serviceKey);
+    }
+
+    BufferNormalizeConfig(Config, NULL);
+
+    DbgPrint("[ProcMon] Параметры колец: RingSize=%lu ArenaSize=%lu OverflowPolicy=%lu\n",
+             Config->RingSize, Config->ArenaSize, Config->OverflowPolicy);
+}
+
 /*
  * DriverEntry — точка входа драйвера.
  *
  * Аналог main() для user-mode программы, но вызывается ядром.
  * Параметры:
  *   DriverObject — объект драйвера, созданный ядром.
- *   RegistryPath — путь в реестре к параметрам драйвера.
+ *   RegistryPath — путь в реестре к параметрам драйвера (ключ службы;
+ *                  параметры колец читаются из его подключа Parameters).
  * Возвращает STATUS_SUCCESS при успехе, иначе код ошибки.
  */
 NTSTATUS DriverEntry(
@@ -34,8 +131,13 @@ NTSTATUS DriverEntry(
     UNICODE_STRING symlinkName;
     PDEVICE_EXTENSION extension;
     BOOLEAN        symlinkCreated = FALSE;
-
-    UNREFERENCED_PARAMETER(RegistryPath);
+    BOOLEAN        bufferCreated = FALSE;
+    BOOLEAN        cachesCreated = FALSE;
+    PROCMON_BUFFER_CONFIG bufferConfig;
+    ULONG          synchronousHash;
+    ULONG          hashAlgorithm;
+    ULONG          treeHash;
+    ULONG          enumHashThreads;
 
     DbgPrint("[ProcMon] DriverEntry: загрузка драйвера...\n");
 
@@ -65,7 +167,45 @@ NTSTATUS DriverEntry(
     /* Инициализируем расширение устройства */
     extension = (PDEVICE_EXTENSION)deviceObject->DeviceExtension;
     RtlZeroMemory(extension, sizeof(DEVICE_EXTENSION));
-    BufferInit(&extension->RingBuffer);
+
+    /* Счётчики нужны писателям колец, поэтому раньше колец */
+    StatsInit();
+    HashCacheInit();
+    TreeCacheInit();
+
+    /* Per-CPU кольца выделяются здесь, до регистрации callback */
+    ReadParameters(RegistryPath, &bufferConfig, &synchronousHash, &hashAlgorithm,
+                   &treeHash, &enumHashThreads);
+
+    /* Алгоритм и его реализация под процессор — до первого хеша */
+    HashSelectAlgorithm(hashAlgorithm, (BOOLEAN)(treeHash != 0));
+    HashBatchConfigure(enumHashThreads);
+
+    status = BufferInit(&extension->EventBuffer, &bufferConfig);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("[ProcMon] Ошибка BufferInit: 0x%08X\n", status);
+        goto cleanup;
+    }
+
+    bufferCreated = TRUE;
+
+    /* Поток доставки отложенных запросов событий (long-poll) */
+    status = PendingInit(&extension->PendingReads, &extension->EventBuffer,
+                         DeliverPendingEvents);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("[ProcMon] Ошибка PendingInit: 0x%08X\n", status);
+        goto cleanup;
+    }
+
+    /* Рабочие потоки хеширования пишут «хеш готов» в те же кольца */
+    HashQueueInit(&extension->HashQueue, &extension->EventBuffer,
+                  (synchronousHash != 0) ? TRUE : FALSE);
+
+    /* Таблица загруженных модулей и кэши перечислений строятся по первому запросу */
+    ModuleTableInit(&extension->LoadedModules);
+    InstalledCacheInit(&extension->InstalledDrivers);
+    DeviceCacheInit(&extension->DeviceTable, DriverObject);
+    cachesCreated = TRUE;
 
     /* Шаг 2: Создание символической ссылки для user-mode доступа */
     RtlInitUnicodeString(&symlinkName, SYMLINK_NAME);
@@ -82,6 +222,7 @@ NTSTATUS DriverEntry(
     /* Шаг 3: Регистрация dispatch-функций */
     DriverObject->MajorFunction[IRP_MJ_CREATE]         = DispatchCreateClose;
     DriverObject->MajorFunction[IRP_MJ_CLOSE]          = DispatchCreateClose;
+    DriverObject->MajorFunction[IRP_MJ_CLEANUP]        = DispatchCleanup;
     DriverObject->MajorFunction[IRP_MJ_DEVICE_CONTROL] = DispatchDeviceControl;
     DriverObject->DriverUnload                          = DriverUnload;
 
@@ -106,6 +247,24 @@ cleanup:
         IoDeleteSymbolicLink(&symlinkName);
     }
 
+    /* Очередь хеширования и кэши есть, только если дошли до их инициализации */
+    if (cachesCreated) {
+        HashQueueFree(&extension->HashQueue);
+        DeviceCacheFree(&extension->DeviceTable);
+        InstalledCacheFree(&extension->InstalledDrivers);
+        ModuleTableFree(&extension->LoadedModules);
+    }
+
+    if (bufferCreated) {
+        PendingFree(&extension->PendingReads);
+        BufferFree(&extension->EventBuffer);
+    }
+
+    HashBatchShutdown();
+    TreeCacheFree();
+    HashCacheFree();
+    StatsFree();
+
     if (deviceObject != NULL) {
         IoDeleteDevice(deviceObject);
         g_DeviceObject = NULL;
@@ -121,7 +280,8 @@ cleanup:
  * Очистка ресурсов строго в обратном порядке создания:
  * 1. Снять callback (чтобы новые события не писались в буфер)
  * 2. Удалить символическую ссылку
- * 3. Удалить устройство
+ * 3. Остановить поток доставки и освободить кольцевые буферы
+ * 4. Удалить устройство
  */
 VOID DriverUnload(_In_ PDRIVER_OBJECT DriverObject)
 {
@@ -145,7 +305,19 @@ VOID DriverUnload(_In_ PDRIVER_OBJECT DriverObject)
         IoDeleteSymbolicLink(&symlinkName);
         DbgPrint("[ProcMon] Символическая ссылка удалена\n");
 
-        /* Шаг 3: Удалить устройство */
+        /* Шаг 3: Остановить хеширование и доставку, освободить кольца (писателей больше нет) */
+        HashQueueFree(&extension->HashQueue);
+        DeviceCacheFree(&extension->DeviceTable);
+        InstalledCacheFree(&extension->InstalledDrivers);
+        ModuleTableFree(&extension->LoadedModules);
+        PendingFree(&extension->PendingReads);
+        BufferFree(&extension->EventBuffer);
+        HashBatchShutdown();
+        TreeCacheFree();
+        HashCacheFree();
+        StatsFree();
+
+        /* Шаг 4: Удалить устройство */
         IoDeleteDevice(DriverObject->DeviceObject);
         g_DeviceObject = NULL;
         DbgPrint("[ProcMon] Устройство удалено\n");
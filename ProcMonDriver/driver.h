@@ -8,10 +8,18 @@
 
 #include <ntddk.h>
 #include "../common/shared.h"
+#include "../common/filter.h"
 #include "buffer.h"
+#include "pending.h"
 #include "hash.h"
 #include "enum_drivers.h"
 #include "enum_devices.h"
+#include "snapshot.h"
+#include "enum_format.h"
+#include "stats.h"
+#include "hash_cache.h"
+#include "tree_cache.h"
+#include "hash_queue.h"
 
 /* Имя устройства в пространстве имён ядра */
 #define DEVICE_NAME     L"\\Device\\ProcMon"
@@ -28,15 +36,34 @@
  * Доступна через DeviceObject->DeviceExtension.
  */
 typedef struct _DEVICE_EXTENSION {
-    RING_BUFFER  RingBuffer;        /* Кольцевой буфер для событий */
+    EVENT_BUFFER EventBuffer;       /* Per-CPU кольцевые буферы для событий */
+    PENDING_QUEUE PendingReads;     /* Отложенные IOCTL_PROCMON_WAIT_EVENTS */
+    HASH_QUEUE   HashQueue;         /* Асинхронное хеширование образов новых процессов */
+    MODULE_TABLE LoadedModules;     /* Загруженные модули с поколениями (дельта-запросы) */
+    INSTALLED_CACHE InstalledDrivers; /* Кэш установленных драйверов (уведомления реестра) */
+    DEVICE_CACHE DeviceTable;       /* Кэш устройств (уведомления PnP) */
     BOOLEAN      CallbackRegistered; /* Флаг: callback зарегистрирован? */
 } DEVICE_EXTENSION, *PDEVICE_EXTENSION;
 
+/*
+ * HANDLE_CONTEXT — состояние одного открытого хэндла устройства.
+ * Создаётся на IRP_MJ_CREATE, хранится в FileObject->FsContext,
+ * освобождается на IRP_MJ_CLOSE.
+ */
+typedef struct _HANDLE_CONTEXT {
+    BUFFER_READER  Reader;     /* Позиция IOCTL-чтения событий этого хэндла */
+    BUFFER_MAPPING Mapping;    /* Отображение колец в процессе клиента */
+    ENUM_SNAPSHOT  Snapshot;   /* Снимок перечисления для постраничной выдачи */
+    FAST_MUTEX     FilterLock; /* Защищает Filter и FilterState */
+    PPROCMON_FILTER_PROGRAM Filter;  /* Проверенная программа фильтра (NULL — без фильтра) */
+    PROCMON_FILTER_STATE    FilterState; /* Счётчики RATE программы */
+} HANDLE_CONTEXT, *PHANDLE_CONTEXT;
+
 /*
  * Глобальный указатель на объект устройства.
  * Необходим, потому что PsSetCreateProcessNotifyRoutineEx не позволяет
  * передать контекст в callback — callback получает только фиксированные параметры.
- * Через g_DeviceObject мы получаем доступ к DeviceExtension и кольцевому буферу.
+ * Через g_DeviceObject мы получаем доступ к DeviceExtension и кольцевым буферам.
  */
 extern PDEVICE_OBJECT g_DeviceObject;
 
@@ -74,8 +101,15 @@ _Dispatch_type_(IRP_MJ_CREATE)
 _Dispatch_type_(IRP_MJ_CLOSE)
 DRIVER_DISPATCH DispatchCreateClose;
 
+/* Обработчик IRP_MJ_CLEANUP (последний хэндл закрыт): снимает отображение колец */
+_Dispatch_type_(IRP_MJ_CLEANUP)
+DRIVER_DISPATCH DispatchCleanup;
+
 /* Обработчик IRP_MJ_DEVICE_CONTROL (IOCTL-запросы от клиента) */
 _Dispatch_type_(IRP_MJ_DEVICE_CONTROL)
 DRIVER_DISPATCH DispatchDeviceControl;
 
+/* Заполнение отложенного IOCTL_PROCMON_WAIT_EVENTS (PPENDING_DELIVER) */
+BOOLEAN DeliverPendingEvents(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PIRP Irp);
+
 #endif /* PROCMON_DRIVER_H */
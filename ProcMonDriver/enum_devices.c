@@ -4,6 +4,10 @@
  * Обходит \Registry\Machine\System\CurrentControlSet\Enum
  * в три уровня: Bus \ DeviceId \ InstanceId.
  * Для каждого экземпляра читает FriendlyName, HardwareID, Service, etc.
+ *
+ * Запросы обслуживает кэш (DEVICE_CACHE): полный обход делается для
+ * первого заполнения и периодической сверки, а между ними таблицу
+ * обновляют уведомления PnP — перечитывается один ключ экземпляра.
  */
 
 #include "driver.h"
@@ -143,6 +147,82 @@ static void ExtractSerialFromInstanceId(const CHAR *instanceId, CHAR *serial, UL
     }
 }
 
+/*
+ * ReadDeviceInstance — прочитать открытый ключ экземпляра устройства.
+ * *IsDevice = FALSE, если у экземпляра нет Service (такие не выдаются).
+ * С Info == NULL только проверяет Service.
+ */
+static NTSTATUS ReadDeviceInstance(
+    _In_ HANDLE InstKey,
+    _In_ const CHAR *FullInstanceId,
+    _Out_opt_ PDEVICE_INFO dinfo,
+    _Out_ PBOOLEAN IsDevice)
+{
+    CHAR serviceName[PROCMON_MAX_IMAGE_NAME];
+    ULONG idLen;
+
+    *IsDevice = FALSE;
+
+    /* Фильтр: пропускаем устройства без Service */
+    serviceName[0] = '\0';
+    ReadDeviceRegistryString(InstKey, L"Service", serviceName, sizeof(serviceName));
+    if (serviceName[0] == '\0') {
+        return STATUS_SUCCESS;
+    }
+
+    *IsDevice = TRUE;
+
+    if (dinfo == NULL) {
+        return STATUS_SUCCESS;
+    }
+
+    RtlZeroMemory(dinfo, sizeof(DEVICE_INFO));
+
+    /* Service */
+    RtlCopyMemory(dinfo->Service, serviceName, strlen(serviceName) + 1);
+
+    /* DeviceName: FriendlyName, потом DeviceDesc */
+    if (!NT_SUCCESS(ReadDeviceRegistryString(InstKey, L"FriendlyName",
+                        dinfo->DeviceName, PROCMON_MAX_IMAGE_NAME)) ||
+        dinfo->DeviceName[0] == '\0') {
+        ReadDeviceRegistryString(InstKey, L"DeviceDesc",
+                                 dinfo->DeviceName, PROCMON_MAX_IMAGE_NAME);
+    }
+
+    /* HardwareID */
+    ReadDeviceRegistryString(InstKey, L"HardwareID",
+                             dinfo->HardwareId, PROCMON_MAX_HWID);
+
+    idLen = (ULONG)strlen(FullInstanceId);
+    if (idLen >= PROCMON_MAX_IMAGE_NAME)
+        idLen = PROCMON_MAX_IMAGE_NAME - 1;
+    RtlCopyMemory(dinfo->InstanceId, FullInstanceId, idLen);
+    dinfo->InstanceId[idLen] = '\0';
+
+    /* SerialNumber: извлекаем из Instance ID */
+    ExtractSerialFromInstanceId(dinfo->InstanceId, dinfo->SerialNumber, PROCMON_MAX_SERIAL);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * OpenEnumKey — ключ HKLM\System\CurrentControlSet\Enum (kernel handle).
+ */
+static NTSTATUS OpenEnumKey(_Out_ PHANDLE EnumKey)
+{
+    UNICODE_STRING    enumPath;
+    OBJECT_ATTRIBUTES enumAttr;
+
+    RtlInitUnicodeString(&enumPath,
+        L"\\Registry\\Machine\\System\\CurrentControlSet\\Enum");
+
+    InitializeObjectAttributes(&enumAttr, &enumPath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL, NULL);
+
+    return ZwOpenKey(EnumKey, KEY_READ, &enumAttr);
+}
+
 /*
  * EnumerateDevices — перечисление PnP-устройств из реестра.
  *
@@ -159,8 +239,6 @@ NTSTATUS EnumerateDevices(
 {
     NTSTATUS          status;
     HANDLE            enumKey = NULL;
-    UNICODE_STRING    enumPath;
-    OBJECT_ATTRIBUTES enumAttr;
     ULONG             busIndex;
     ULONG             total = 0, returned = 0;
     UCHAR            *keyBuf = NULL;
@@ -169,14 +247,7 @@ NTSTATUS EnumerateDevices(
     *TotalCount = 0;
     *ReturnedCount = 0;
 
-    RtlInitUnicodeString(&enumPath,
-        L"\\Registry\\Machine\\System\\CurrentControlSet\\Enum");
-
-    InitializeObjectAttributes(&enumAttr, &enumPath,
-                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
-                               NULL, NULL);
-
-    status = ZwOpenKey(&enumKey, KEY_READ, &enumAttr);
+    status = OpenEnumKey(&enumKey);
     if (!NT_SUCCESS(status)) {
         return status;
     }
@@ -292,7 +363,8 @@ NTSTATUS EnumerateDevices(
                 CHAR instIdAnsi[128];
                 ANSI_STRING instAnsi;
                 UNICODE_STRING instUniName;
-                CHAR serviceName[PROCMON_MAX_IMAGE_NAME];
+                CHAR fullInstanceId[PROCMON_MAX_IMAGE_NAME];
+                BOOLEAN isDevice;
 
                 UCHAR instBuf[512];
                 instInfo = (PKEY_BASIC_INFORMATION)instBuf;
@@ -326,54 +398,19 @@ NTSTATUS EnumerateDevices(
                 status = ZwOpenKey(&instKey, KEY_READ, &instAttr);
                 if (!NT_SUCCESS(status)) continue;
 
-                /* Фильтр: пропускаем устройства без Service */
-                serviceName[0] = '\0';
-                ReadDeviceRegistryString(instKey, L"Service",
-                                         serviceName, sizeof(serviceName));
-                if (serviceName[0] == '\0') {
-                    ZwClose(instKey);
-                    continue;
-                }
-
-                total++;
-
-                if (returned < MaxEntries) {
-                    PDEVICE_INFO dinfo = &OutputBuffer[returned];
-                    CHAR fullInstanceId[PROCMON_MAX_IMAGE_NAME];
-
-                    RtlZeroMemory(dinfo, sizeof(DEVICE_INFO));
+                /* InstanceId = Bus\DeviceId\InstanceId */
+                RtlStringCbPrintfA(fullInstanceId, sizeof(fullInstanceId),
+                                   "%s\\%s\\%s", busNameAnsi, devIdAnsi, instIdAnsi);
 
-                    /* Service */
-                    RtlCopyMemory(dinfo->Service, serviceName, strlen(serviceName) + 1);
+                status = ReadDeviceInstance(instKey, fullInstanceId,
+                                            (returned < MaxEntries) ? &OutputBuffer[returned] : NULL,
+                                            &isDevice);
+                if (NT_SUCCESS(status) && isDevice) {
+                    total++;
 
-                    /* DeviceName: FriendlyName, потом DeviceDesc */
-                    if (!NT_SUCCESS(ReadDeviceRegistryString(instKey, L"FriendlyName",
-                                        dinfo->DeviceName, PROCMON_MAX_IMAGE_NAME)) ||
-                        dinfo->DeviceName[0] == '\0') {
-                        ReadDeviceRegistryString(instKey, L"DeviceDesc",
-                                                 dinfo->DeviceName, PROCMON_MAX_IMAGE_NAME);
+                    if (returned < MaxEntries) {
+                        returned++;
                     }
-
-                    /* HardwareID */
-                    ReadDeviceRegistryString(instKey, L"HardwareID",
-                                             dinfo->HardwareId, PROCMON_MAX_HWID);
-
-                    /* InstanceId = Bus\DeviceId\InstanceId */
-                    RtlStringCbPrintfA(fullInstanceId, sizeof(fullInstanceId),
-                                       "%s\\%s\\%s", busNameAnsi, devIdAnsi, instIdAnsi);
-                    {
-                        ULONG idLen = (ULONG)strlen(fullInstanceId);
-                        if (idLen >= PROCMON_MAX_IMAGE_NAME)
-                            idLen = PROCMON_MAX_IMAGE_NAME - 1;
-                        RtlCopyMemory(dinfo->InstanceId, fullInstanceId, idLen);
-                        dinfo->InstanceId[idLen] = '\0';
-                    }
-
-                    /* SerialNumber: извлекаем из Instance ID */
-                    ExtractSerialFromInstanceId(fullInstanceId,
-                                                dinfo->SerialNumber, PROCMON_MAX_SERIAL);
-
-                    returned++;
                 }
 
                 ZwClose(instKey);
@@ -392,3 +429,435 @@ NTSTATUS EnumerateDevices(
     ZwClose(enumKey);
     return STATUS_SUCCESS;
 }
+
+/*
+ * === Кэш устройств ===
+ *
+ * Уведомления PnP приходят об интерфейсах устройств, а не о самих
+ * устройствах, и только для классов, на которые подписан кэш. Имя
+ * символической ссылки интерфейса содержит путь экземпляра:
+ * \??\USB#VID_046D&PID_C52B#5&2a8c1b4&0&2#{guid} -> USB\VID_046D&PID_C52B\5&2a8c1b4&0&2.
+ *
+ * Callback только ставит путь в очередь; ключ перечитывается при
+ * следующем запросе под Lock. Появление и исчезновение обрабатываются
+ * одинаково: ключ перечитывается, и запись добавляется, обновляется или
+ * удаляется по тем же правилам, что и в полном обходе. Поэтому после
+ * отключения устройство остаётся в таблице, пока в Enum есть его ключ
+ * с Service, — как и в обходе, который видит отключённые экземпляры.
+ *
+ * Устройства без интерфейсов подписанных классов попадают в таблицу
+ * при периодической сверке.
+ */
+
+/* Полная сверка с Enum не реже, чем раз в 5 минут (в единицах 100 нс) */
+#define DEVICE_CACHE_RECONCILE    (300LL * 10000000LL)
+
+/* Предел очереди уведомлений; переполнение — полный обход */
+#define DEVICE_CACHE_MAX_PENDING  256
+
+/* Запас таблицы на устройства, появившиеся после обхода */
+#define DEVICE_CACHE_SLACK        64
+
+/* Путь экземпляра из уведомления, ожидающий перечитывания */
+typedef struct _DEVICE_CHANGE_ITEM {
+    LIST_ENTRY Link;
+    USHORT     Length;    /* В байтах */
+    WCHAR      Path[1];   /* Bus\DeviceId\InstanceId относительно Enum */
+} DEVICE_CHANGE_ITEM, *PDEVICE_CHANGE_ITEM;
+
+/* Классы интерфейсов: USB-устройства, диски, тома, CD-ROM, HID, сеть, COM-порты */
+static const GUID g_DeviceCacheClasses[DEVICE_CACHE_CLASSES] = {
+    { 0xA5DCBF10, 0x6530, 0x11D2, { 0x90, 0x1F, 0x00, 0xC0, 0x4F, 0xB9, 0x51, 0xED } },
+    { 0x53F56307, 0xB6BF, 0x11D0, { 0x94, 0xF2, 0x00, 0xA0, 0xC9, 0x1E, 0xFB, 0x8B } },
+    { 0x53F5630D, 0xB6BF, 0x11D0, { 0x94, 0xF2, 0x00, 0xA0, 0xC9, 0x1E, 0xFB, 0x8B } },
+    { 0x53F56308, 0xB6BF, 0x11D0, { 0x94, 0xF2, 0x00, 0xA0, 0xC9, 0x1E, 0xFB, 0x8B } },
+    { 0x4D1E55B2, 0xF16F, 0x11CF, { 0x88, 0xCB, 0x00, 0x11, 0x11, 0x00, 0x00, 0x30 } },
+    { 0xCAC88484, 0x7515, 0x4C03, { 0x82, 0xE6, 0x71, 0xA8, 0x7A, 0xBA, 0xC3, 0x61 } },
+    { 0x86E0D1E0, 0x8089, 0x11D0, { 0x9C, 0xE4, 0x08, 0x00, 0x3E, 0x30, 0x1F, 0x73 } },
+};
+
+/*
+ * DeviceCacheNotify — интерфейс появился или исчез (PASSIVE, системный поток PnP).
+ * Ставит путь экземпляра в очередь, реестр здесь не читается.
+ */
+static NTSTATUS DeviceCacheNotify(_In_ PVOID NotificationStructure, _Inout_opt_ PVOID Context)
+{
+    PDEVICE_INTERFACE_CHANGE_NOTIFICATION notification =
+        (PDEVICE_INTERFACE_CHANGE_NOTIFICATION)NotificationStructure;
+    PDEVICE_CACHE       Cache = (PDEVICE_CACHE)Context;
+    PDEVICE_CHANGE_ITEM item;
+    PWCH                link = notification->SymbolicLinkName->Buffer;
+    ULONG               chars = notification->SymbolicLinkName->Length / sizeof(WCHAR);
+    ULONG               start = 0;
+    ULONG               end = 0;
+    ULONG               i;
+    KIRQL               oldIrql;
+
+    /* Префикс \??\ (или \\?\ у ссылок из user mode) */
+    if (chars > 4 && link[0] == L'\\' && (link[1] == L'?' || link[1] == L'\\') &&
+        link[2] == L'?' && link[3] == L'\\') {
+        start = 4;
+    }
+
+    /* Последний '#' отделяет GUID класса интерфейса */
+    for (i = start; i < chars; i++) {
+        if (link[i] == L'#') {
+            end = i;
+        }
+    }
+
+    if (end <= start) {
+        return STATUS_SUCCESS;
+    }
+
+    item = (PDEVICE_CHANGE_ITEM)ExAllocatePoolWithTag(
+        PagedPool, FIELD_OFFSET(DEVICE_CHANGE_ITEM, Path) + (end - start) * sizeof(WCHAR),
+        POOL_TAG);
+    if (item == NULL) {
+        InterlockedExchange(&Cache->Dirty, 1);
+        return STATUS_SUCCESS;
+    }
+
+    item->Length = (USHORT)((end - start) * sizeof(WCHAR));
+    for (i = start; i < end; i++) {
+        item->Path[i - start] = (link[i] == L'#') ? L'\\' : link[i];
+    }
+
+    KeAcquireSpinLock(&Cache->PendingLock, &oldIrql);
+    if (Cache->PendingCount < DEVICE_CACHE_MAX_PENDING) {
+        InsertTailList(&Cache->Pending, &item->Link);
+        Cache->PendingCount++;
+        item = NULL;
+    }
+    KeReleaseSpinLock(&Cache->PendingLock, oldIrql);
+
+    if (item != NULL) {
+        /* Очередь переполнена — дешевле один полный обход */
+        ExFreePoolWithTag(item, POOL_TAG);
+        InterlockedExchange(&Cache->Dirty, 1);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/* DeviceCacheTakePending — забрать всю очередь уведомлений в List */
+static VOID DeviceCacheTakePending(_Inout_ PDEVICE_CACHE Cache, _Out_ PLIST_ENTRY List)
+{
+    KIRQL oldIrql;
+
+    InitializeListHead(List);
+
+    KeAcquireSpinLock(&Cache->PendingLock, &oldIrql);
+    if (!IsListEmpty(&Cache->Pending)) {
+        /* Переносим цепочку целиком: голова List встаёт на место головы Pending */
+        List->Flink = Cache->Pending.Flink;
+        List->Blink = Cache->Pending.Blink;
+        List->Flink->Blink = List;
+        List->Blink->Flink = List;
+        InitializeListHead(&Cache->Pending);
+    }
+    Cache->PendingCount = 0;
+    KeReleaseSpinLock(&Cache->PendingLock, oldIrql);
+}
+
+/* DeviceCacheFreeList — освободить элементы очереди */
+static VOID DeviceCacheFreeList(_Inout_ PLIST_ENTRY List)
+{
+    PLIST_ENTRY entry;
+
+    while (!IsListEmpty(List)) {
+        entry = RemoveHeadList(List);
+        ExFreePoolWithTag(CONTAINING_RECORD(entry, DEVICE_CHANGE_ITEM, Link), POOL_TAG);
+    }
+}
+
+/*
+ * DeviceCacheApply — перечитать один экземпляр и поправить таблицу (Lock захвачен).
+ */
+static NTSTATUS DeviceCacheApply(
+    _Inout_ PDEVICE_CACHE Cache,
+    _In_ HANDLE EnumKey,
+    _In_ PDEVICE_CHANGE_ITEM Item)
+{
+    NTSTATUS          status;
+    HANDLE            instKey = NULL;
+    UNICODE_STRING    path;
+    OBJECT_ATTRIBUTES attr;
+    ANSI_STRING       ansiPath;
+    CHAR              instanceId[PROCMON_MAX_IMAGE_NAME];
+    DEVICE_INFO       info;
+    PDEVICE_INFO      grown;
+    BOOLEAN           isDevice = FALSE;
+    ULONG             copyLen;
+    ULONG             index;
+
+    path.Buffer = Item->Path;
+    path.Length = Item->Length;
+    path.MaximumLength = Item->Length;
+
+    status = RtlUnicodeStringToAnsiString(&ansiPath, &path, TRUE);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    copyLen = ansiPath.Length;
+    if (copyLen >= sizeof(instanceId))
+        copyLen = sizeof(instanceId) - 1;
+    RtlCopyMemory(instanceId, ansiPath.Buffer, copyLen);
+    instanceId[copyLen] = '\0';
+    RtlFreeAnsiString(&ansiPath);
+
+    InitializeObjectAttributes(&attr, &path, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               EnumKey, NULL);
+
+    status = ZwOpenKey(&instKey, KEY_READ, &attr);
+    if (NT_SUCCESS(status)) {
+        status = ReadDeviceInstance(instKey, instanceId, &info, &isDevice);
+        ZwClose(instKey);
+    } else if (status == STATUS_OBJECT_NAME_NOT_FOUND) {
+        /* Ключа больше нет — экземпляр удалён */
+        status = STATUS_SUCCESS;
+    }
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    for (index = 0; index < Cache->Count; index++) {
+        if (_stricmp(Cache->Devices[index].InstanceId, instanceId) == 0) {
+            break;
+        }
+    }
+
+    if (!isDevice) {
+        if (index < Cache->Count) {
+            RtlMoveMemory(&Cache->Devices[index], &Cache->Devices[index + 1],
+                          (SIZE_T)(Cache->Count - index - 1) * sizeof(DEVICE_INFO));
+            Cache->Count--;
+        }
+        return STATUS_SUCCESS;
+    }
+
+    if (index == Cache->Count) {
+        if (Cache->Count == Cache->Capacity) {
+            grown = (PDEVICE_INFO)ExAllocatePoolWithTag(
+                PagedPool, (SIZE_T)(Cache->Capacity + DEVICE_CACHE_SLACK) * sizeof(DEVICE_INFO),
+                POOL_TAG);
+            if (grown == NULL) {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+            if (Cache->Devices != NULL) {
+                RtlCopyMemory(grown, Cache->Devices, (SIZE_T)Cache->Count * sizeof(DEVICE_INFO));
+                ExFreePoolWithTag(Cache->Devices, POOL_TAG);
+            }
+            Cache->Devices = grown;
+            Cache->Capacity += DEVICE_CACHE_SLACK;
+        }
+        Cache->Count++;
+    }
+
+    Cache->Devices[index] = info;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * DeviceCacheApplyPending — применить накопленные уведомления (Lock захвачен).
+ * Ошибка (реестр недоступен, нет памяти) — взвести Dirty: сверит полный обход.
+ */
+static VOID DeviceCacheApplyPending(_Inout_ PDEVICE_CACHE Cache)
+{
+    NTSTATUS            status;
+    HANDLE              enumKey = NULL;
+    LIST_ENTRY          list;
+    PLIST_ENTRY         entry;
+    ULONG               applied = 0;
+
+    DeviceCacheTakePending(Cache, &list);
+
+    if (IsListEmpty(&list)) {
+        return;
+    }
+
+    status = OpenEnumKey(&enumKey);
+    if (!NT_SUCCESS(status)) {
+        InterlockedExchange(&Cache->Dirty, 1);
+        DeviceCacheFreeList(&list);
+        return;
+    }
+
+    for (entry = list.Flink; entry != &list; entry = entry->Flink) {
+        status = DeviceCacheApply(Cache, enumKey,
+                                  CONTAINING_RECORD(entry, DEVICE_CHANGE_ITEM, Link));
+        if (!NT_SUCCESS(status)) {
+            InterlockedExchange(&Cache->Dirty, 1);
+            break;
+        }
+        applied++;
+    }
+
+    ZwClose(enumKey);
+    DeviceCacheFreeList(&list);
+
+    Cache->Counters.Reread = applied;
+}
+
+/*
+ * DeviceCacheReconcile — заменить таблицу полным обходом Enum (Lock захвачен).
+ * Размер таблицы берётся с прошлого обхода, так что обычно обход один.
+ */
+static NTSTATUS DeviceCacheReconcile(_Inout_ PDEVICE_CACHE Cache)
+{
+    NTSTATUS     status;
+    LIST_ENTRY   list;
+    PDEVICE_INFO devices;
+    ULONG        capacity;
+    ULONG        total = 0;
+    ULONG        returned = 0;
+    ULONG        attempt;
+
+    /* Обход увидит всё, что пришло до него; пришедшее во время обхода останется в очереди */
+    DeviceCacheTakePending(Cache, &list);
+    DeviceCacheFreeList(&list);
+
+    capacity = Cache->Count + DEVICE_CACHE_SLACK;
+
+    for (attempt = 0; ; attempt++) {
+        devices = (PDEVICE_INFO)ExAllocatePoolWithTag(PagedPool,
+                                                      (SIZE_T)capacity * sizeof(DEVICE_INFO),
+                                                      POOL_TAG);
+        if (devices == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        status = EnumerateDevices(devices, capacity, &total, &returned);
+        if (!NT_SUCCESS(status)) {
+            ExFreePoolWithTag(devices, POOL_TAG);
+            return status;
+        }
+
+        /* Не поместилось — второй обход с точным размером */
+        if (total <= capacity || attempt != 0) {
+            break;
+        }
+
+        ExFreePoolWithTag(devices, POOL_TAG);
+        capacity = total + DEVICE_CACHE_SLACK;
+    }
+
+    if (Cache->Devices != NULL) {
+        ExFreePoolWithTag(Cache->Devices, POOL_TAG);
+    }
+
+    Cache->Devices = devices;
+    Cache->Count = returned;
+    Cache->Capacity = capacity;
+    Cache->Counters.Reread = total;
+    KeQuerySystemTime(&Cache->Counters.RefreshTime);
+
+    DbgPrint("[ProcMon] Кэш устройств: полный обход Enum, %lu устройств\n", returned);
+
+    return STATUS_SUCCESS;
+}
+
+VOID DeviceCacheInit(_Out_ PDEVICE_CACHE Cache, _In_ PDRIVER_OBJECT DriverObject)
+{
+    NTSTATUS status;
+    ULONG    i;
+
+    RtlZeroMemory(Cache, sizeof(DEVICE_CACHE));
+    KeInitializeMutex(&Cache->Lock, 0);
+    KeInitializeSpinLock(&Cache->PendingLock);
+    InitializeListHead(&Cache->Pending);
+
+    /* Таблица строится первым запросом */
+    Cache->Dirty = 1;
+
+    /* Существующие интерфейсы не нужны: их увидит первый обход */
+    for (i = 0; i < DEVICE_CACHE_CLASSES; i++) {
+        status = IoRegisterPlugPlayNotification(EventCategoryDeviceInterfaceChange, 0,
+                                                (PVOID)&g_DeviceCacheClasses[i], DriverObject,
+                                                DeviceCacheNotify, Cache,
+                                                &Cache->NotifyEntries[Cache->NotifyCount]);
+        if (NT_SUCCESS(status)) {
+            Cache->NotifyCount++;
+        } else {
+            DbgPrint("[ProcMon] IoRegisterPlugPlayNotification (класс %lu): 0x%08X\n", i, status);
+        }
+    }
+}
+
+VOID DeviceCacheFree(_Inout_ PDEVICE_CACHE Cache)
+{
+    LIST_ENTRY list;
+    ULONG      i;
+
+    /* Ex-вариант дожидается callback, который выполняется прямо сейчас */
+    for (i = 0; i < Cache->NotifyCount; i++) {
+        IoUnregisterPlugPlayNotificationEx(Cache->NotifyEntries[i]);
+    }
+    Cache->NotifyCount = 0;
+
+    DeviceCacheTakePending(Cache, &list);
+    DeviceCacheFreeList(&list);
+
+    if (Cache->Devices != NULL) {
+        ExFreePoolWithTag(Cache->Devices, POOL_TAG);
+        Cache->Devices = NULL;
+    }
+
+    Cache->Count = 0;
+    Cache->Capacity = 0;
+}
+
+NTSTATUS DeviceCacheRead(
+    _Inout_ PDEVICE_CACHE Cache,
+    _Out_writes_opt_(MaxEntries) PDEVICE_INFO OutputBuffer,
+    _In_ ULONG MaxEntries,
+    _Out_ PULONG TotalCount,
+    _Out_ PULONG ReturnedCount)
+{
+    NTSTATUS      status = STATUS_SUCCESS;
+    LARGE_INTEGER now;
+    ULONG         returned;
+
+    *TotalCount = 0;
+    *ReturnedCount = 0;
+
+    KeWaitForSingleObject(&Cache->Lock, Executive, KernelMode, FALSE, NULL);
+
+    KeQuerySystemTime(&now);
+
+    /*
+     * Полный обход: таблицы нет или очередь переполнялась; на проходе
+     * подсчёта ещё и по сроку сверки, и всегда, если уведомлений нет.
+     */
+    if (InterlockedExchange(&Cache->Dirty, 0) != 0 ||
+        (MaxEntries == 0 &&
+         (Cache->NotifyCount == 0 ||
+          now.QuadPart - Cache->Counters.RefreshTime.QuadPart >= DEVICE_CACHE_RECONCILE))) {
+        status = DeviceCacheReconcile(Cache);
+        if (!NT_SUCCESS(status)) {
+            InterlockedExchange(&Cache->Dirty, 1);
+            goto cleanup;
+        }
+        if (MaxEntries == 0) {
+            InterlockedIncrement64(&Cache->Counters.Misses);
+        }
+    } else {
+        DeviceCacheApplyPending(Cache);
+        if (MaxEntries == 0) {
+            InterlockedIncrement64(&Cache->Counters.Hits);
+        }
+    }
+
+    returned = (Cache->Count < MaxEntries) ? Cache->Count : MaxEntries;
+    if (returned != 0) {
+        RtlCopyMemory(OutputBuffer, Cache->Devices, (SIZE_T)returned * sizeof(DEVICE_INFO));
+    }
+
+    *TotalCount = Cache->Count;
+    *ReturnedCount = returned;
+
+cleanup:
+    KeReleaseMutex(&Cache->Lock, FALSE);
+    return status;
+}
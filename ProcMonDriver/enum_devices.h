@@ -7,11 +7,13 @@
 
 #include <ntddk.h>
 #include "../common/shared.h"
+#include "snapshot.h"
 
 /*
  * EnumerateDevices — перечислить PnP-устройства через реестр Enum.
  * Трёхуровневый обход: Bus\DeviceId\InstanceId.
  * Фильтрует по наличию Service (активные устройства).
+ * С MaxEntries == 0 только считает (OutputBuffer не трогается).
  */
 NTSTATUS EnumerateDevices(
     PDEVICE_INFO OutputBuffer,
@@ -20,4 +22,50 @@ NTSTATUS EnumerateDevices(
     PULONG ReturnedCount
 );
 
+/* Классы интерфейсов, на появление и исчезновение которых подписан кэш */
+#define DEVICE_CACHE_CLASSES  7
+
+/*
+ * Кэш устройств: таблица в памяти, которую обновляют уведомления PnP
+ * об интерфейсах устройств. Полный обход Enum — только первое заполнение
+ * и периодическая сверка (уведомления приходят не для всех устройств).
+ */
+typedef struct _DEVICE_CACHE {
+    KMUTEX        Lock;           /* PASSIVE: внутри обход и чтение реестра */
+    PDEVICE_INFO  Devices;        /* Записи в порядке обхода Enum (PagedPool) */
+    ULONG         Count;
+    ULONG         Capacity;
+    KSPIN_LOCK    PendingLock;    /* Защищает Pending и PendingCount */
+    LIST_ENTRY    Pending;        /* Экземпляры из уведомлений, ещё не перечитанные */
+    ULONG         PendingCount;
+    volatile LONG Dirty;          /* Нужен полный обход (нет таблицы или очередь переполнена) */
+    PVOID         NotifyEntries[DEVICE_CACHE_CLASSES];
+    ULONG         NotifyCount;    /* Зарегистрировано уведомлений */
+    ENUM_CACHE_COUNTERS Counters;
+} DEVICE_CACHE, *PDEVICE_CACHE;
+
+/*
+ * DeviceCacheInit — пустой кэш и подписка на уведомления PnP.
+ * Таблица строится первым запросом. IRQL: PASSIVE_LEVEL.
+ */
+VOID DeviceCacheInit(_Out_ PDEVICE_CACHE Cache, _In_ PDRIVER_OBJECT DriverObject);
+
+/* DeviceCacheFree — снять уведомления и освободить таблицу. IRQL: PASSIVE_LEVEL. */
+VOID DeviceCacheFree(_Inout_ PDEVICE_CACHE Cache);
+
+/*
+ * DeviceCacheRead — устройства из кэша, в той же форме, что EnumerateDevices.
+ * Перед копированием применяются накопленные уведомления; полный обход —
+ * если таблицы ещё нет или с прошлой сверки прошло DEVICE_CACHE_RECONCILE.
+ * Попадание или промах считается на проходе подсчёта (MaxEntries == 0).
+ * IRQL: PASSIVE_LEVEL.
+ */
+NTSTATUS DeviceCacheRead(
+    _Inout_ PDEVICE_CACHE Cache,
+    _Out_writes_opt_(MaxEntries) PDEVICE_INFO OutputBuffer,
+    _In_ ULONG MaxEntries,
+    _Out_ PULONG TotalCount,
+    _Out_ PULONG ReturnedCount
+);
+
 #endif /* PROCMON_ENUM_DEVICES_H */
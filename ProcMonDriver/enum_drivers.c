@@ -1,7 +1,8 @@
 /*
  * enum_drivers.c — Перечисление установленных и загруженных драйверов.
  *
- * Загруженные: ZwQuerySystemInformation(SystemModuleInformation)
+ * Загруженные: ZwQuerySystemInformation(SystemModuleInformation);
+ *   плюс таблица модулей с номерами поколений для запросов «что изменилось»
  * Установленные: перебор реестра \Registry\Machine\System\CurrentControlSet\Services
  */
 
@@ -174,21 +175,18 @@ static NTSTATUS ResolveDriverPath(const CHAR *kernelPath, PUNICODE_STRING result
 }
 
 /*
- * EnumerateLoadedDrivers — перечисление загруженных модулей ядра.
+ * QueryModules — список модулей ядра в PagedPool (освобождает вызывающий).
+ * В *QuerySize — размер, который назвало ядро: он меняется вместе
+ * с числом модулей.
  */
-NTSTATUS EnumerateLoadedDrivers(
-    PDRIVER_INFO OutputBuffer,
-    ULONG MaxEntries,
-    PULONG TotalCount,
-    PULONG ReturnedCount)
+static NTSTATUS QueryModules(_Out_ PRTL_PROCESS_MODULES *Modules, _Out_ PULONG QuerySize)
 {
-    NTSTATUS            status;
-    PRTL_PROCESS_MODULES modules = NULL;
-    ULONG               needed = 0;
-    ULONG               i, count, returned;
+    NTSTATUS             status;
+    PRTL_PROCESS_MODULES modules;
+    ULONG                needed = 0;
 
-    *TotalCount = 0;
-    *ReturnedCount = 0;
+    *Modules = NULL;
+    *QuerySize = 0;
 
     /* Узнаём необходимый размер буфера */
     status = ZwQuerySystemInformation(SystemModuleInformation, NULL, 0, &needed);
@@ -207,57 +205,520 @@ NTSTATUS EnumerateLoadedDrivers(
         return status;
     }
 
+    *Modules = modules;
+    *QuerySize = needed;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * FillModuleInfo — DRIVER_INFO загруженного модуля без хеша.
+ */
+static VOID FillModuleInfo(_In_ PRTL_PROCESS_MODULE_INFORMATION mod, _Out_ PDRIVER_INFO info)
+{
+    ULONG       nameLen;
+    const char *fileName;
+
+    RtlZeroMemory(info, sizeof(DRIVER_INFO));
+
+    /* Имя файла — последний компонент пути */
+    fileName = (const char *)&mod->FullPathName[mod->OffsetToFileName];
+    nameLen = (ULONG)strlen(fileName);
+    if (nameLen >= PROCMON_MAX_IMAGE_NAME)
+        nameLen = PROCMON_MAX_IMAGE_NAME - 1;
+    RtlCopyMemory(info->DriverName, fileName, nameLen);
+    info->DriverName[nameLen] = '\0';
+
+    /* Полный путь */
+    nameLen = (ULONG)strlen((const char *)mod->FullPathName);
+    if (nameLen >= PROCMON_MAX_DRIVER_PATH)
+        nameLen = PROCMON_MAX_DRIVER_PATH - 1;
+    RtlCopyMemory(info->ImagePath, mod->FullPathName, nameLen);
+    info->ImagePath[nameLen] = '\0';
+
+    info->BaseAddress = (ULONG_PTR)mod->ImageBase;
+    info->ImageSize = mod->ImageSize;
+    info->StartType = 0;
+}
+
+/*
+ * Файлы драйверов хешируются не по одному при обходе, а все вместе после
+ * него: обход собирает пути в HASH_LIST, HashListRun отдаёт их
+ * ComputeFileHashBatch, который ведёт несколько файлов разом в каналах
+ * многоканального MD5 (md5_mb.c). Записи DRIVER_INFO не должны
+ * перемещаться до HashListRun — хеш пишется прямо в их FileHash.
+ */
+typedef struct _HASH_LIST {
+    PHASH_BATCH_ITEM Items;
+    ULONG            Count;
+    ULONG            Capacity;
+} HASH_LIST, *PHASH_LIST;
+
+/*
+ * HashListAdd — поставить в очередь MD5 файла драйвера KernelPath для Info
+ * (HashValid остаётся FALSE, если файл не найден). Без памяти под список
+ * файл хешируется сразу.
+ */
+static VOID HashListAdd(_Inout_ PHASH_LIST List, _In_ const CHAR *KernelPath, _Inout_ PDRIVER_INFO Info)
+{
+    UNICODE_STRING   resolvedPath;
+    PHASH_BATCH_ITEM grown;
+    ULONG            capacity;
+
+    if (!NT_SUCCESS(ResolveDriverPath(KernelPath, &resolvedPath)) || resolvedPath.Buffer == NULL) {
+        return;
+    }
+
+    if (List->Count == List->Capacity) {
+        capacity = (List->Capacity != 0) ? List->Capacity * 2 : 64;
+        grown = (PHASH_BATCH_ITEM)ExAllocatePoolWithTag(PagedPool,
+                                                        (SIZE_T)capacity * sizeof(HASH_BATCH_ITEM),
+                                                        POOL_TAG);
+        if (grown == NULL) {
+            if (NT_SUCCESS(ComputeFileHash(&resolvedPath, &g_HashMd5, Info->FileHash))) {
+                Info->HashValid = TRUE;
+            }
+            ExFreePoolWithTag(resolvedPath.Buffer, POOL_TAG);
+            return;
+        }
+
+        if (List->Items != NULL) {
+            RtlCopyMemory(grown, List->Items, (SIZE_T)List->Count * sizeof(HASH_BATCH_ITEM));
+            ExFreePoolWithTag(List->Items, POOL_TAG);
+        }
+
+        List->Items = grown;
+        List->Capacity = capacity;
+    }
+
+    List->Items[List->Count].Path = resolvedPath;
+    List->Items[List->Count].Hash = Info->FileHash;
+    List->Items[List->Count].Context = Info;
+    List->Items[List->Count].Status = STATUS_PENDING;
+    List->Count++;
+}
+
+/* HashListFree — освободить пути и список (без хеширования) */
+static VOID HashListFree(_Inout_ PHASH_LIST List)
+{
+    ULONG i;
+
+    for (i = 0; i < List->Count; i++) {
+        ExFreePoolWithTag(List->Items[i].Path.Buffer, POOL_TAG);
+    }
+
+    if (List->Items != NULL) {
+        ExFreePoolWithTag(List->Items, POOL_TAG);
+    }
+
+    RtlZeroMemory(List, sizeof(HASH_LIST));
+}
+
+/*
+ * HashListRun — посчитать хеши собранных файлов и освободить список.
+ * Возвращает время хеширования в миллисекундах.
+ */
+static ULONG HashListRun(_Inout_ PHASH_LIST List)
+{
+    ULONG count = List->Count;
+    ULONG elapsed;
+    ULONG i;
+
+    if (count == 0) {
+        HashListFree(List);
+        return 0;
+    }
+
+    elapsed = ComputeFileHashBatch(List->Items, count);
+
+    for (i = 0; i < List->Count; i++) {
+        if (NT_SUCCESS(List->Items[i].Status)) {
+            ((PDRIVER_INFO)List->Items[i].Context)->HashValid = TRUE;
+        }
+    }
+
+    HashListFree(List);
+    return elapsed;
+}
+
+/*
+ * EnumerateLoadedDrivers — перечисление загруженных модулей ядра.
+ */
+NTSTATUS EnumerateLoadedDrivers(
+    PDRIVER_INFO OutputBuffer,
+    ULONG MaxEntries,
+    PULONG TotalCount,
+    PULONG ReturnedCount)
+{
+    NTSTATUS            status;
+    PRTL_PROCESS_MODULES modules = NULL;
+    ULONG               needed = 0;
+    ULONG               i, count, returned;
+    HASH_LIST           hashes;
+
+    *TotalCount = 0;
+    *ReturnedCount = 0;
+
+    status = QueryModules(&modules, &needed);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
     count = modules->NumberOfModules;
     *TotalCount = count;
     returned = 0;
+    RtlZeroMemory(&hashes, sizeof(hashes));
 
     for (i = 0; i < count && returned < MaxEntries; i++) {
         PRTL_PROCESS_MODULE_INFORMATION mod = &modules->Modules[i];
         PDRIVER_INFO info = &OutputBuffer[returned];
-        ULONG nameLen;
-        const char *fileName;
-
-        RtlZeroMemory(info, sizeof(DRIVER_INFO));
-
-        /* Имя файла — последний компонент пути */
-        fileName = (const char *)&mod->FullPathName[mod->OffsetToFileName];
-        nameLen = (ULONG)strlen(fileName);
-        if (nameLen >= PROCMON_MAX_IMAGE_NAME)
-            nameLen = PROCMON_MAX_IMAGE_NAME - 1;
-        RtlCopyMemory(info->DriverName, fileName, nameLen);
-        info->DriverName[nameLen] = '\0';
-
-        /* Полный путь */
-        nameLen = (ULONG)strlen((const char *)mod->FullPathName);
-        if (nameLen >= PROCMON_MAX_DRIVER_PATH)
-            nameLen = PROCMON_MAX_DRIVER_PATH - 1;
-        RtlCopyMemory(info->ImagePath, mod->FullPathName, nameLen);
-        info->ImagePath[nameLen] = '\0';
-
-        info->BaseAddress = (ULONG_PTR)mod->ImageBase;
-        info->ImageSize = mod->ImageSize;
-        info->StartType = 0;
-
-        /* Вычисляем MD5-хеш файла */
-        {
-            UNICODE_STRING resolvedPath;
-            status = ResolveDriverPath((const CHAR *)mod->FullPathName, &resolvedPath);
-            if (NT_SUCCESS(status) && resolvedPath.Buffer != NULL) {
-                if (NT_SUCCESS(ComputeFileHash(&resolvedPath, info->FileHash))) {
-                    info->HashValid = TRUE;
-                }
-                ExFreePoolWithTag(resolvedPath.Buffer, POOL_TAG);
-            }
-        }
+
+        FillModuleInfo(mod, info);
+        HashListAdd(&hashes, (const CHAR *)mod->FullPathName, info);
 
         returned++;
     }
 
+    HashListRun(&hashes);
+
     *ReturnedCount = returned;
     ExFreePoolWithTag(modules, POOL_TAG);
     return STATUS_SUCCESS;
 }
 
+/*
+ * === Таблица загруженных модулей с номерами поколений ===
+ *
+ * Запись живёт в таблице с поколения загрузки (AddedGeneration) до
+ * поколения выгрузки (RemovedGeneration), после чего ещё какое-то время
+ * хранится как «надгробие» — чтобы клиент, отставший на несколько
+ * поколений, узнал и о выгрузке. Изменения с поколения G — записи,
+ * добавленные или удалённые позже G.
+ *
+ * Без изменений опрос стоит одного ZwQuerySystemInformation без буфера:
+ * загрузку ловит ModuleLoadNotify, выгрузку — изменившийся размер списка.
+ * При изменении список перечитывается, а хешируются только новые модули.
+ */
+
+/* Надгробий больше этого — они сбрасываются, и отставшие клиенты получают полный список */
+#define MODULE_TOMBSTONES_MAX  64
+
+/*
+ * ModuleFind — живая запись того же модуля (адрес, размер и путь совпадают).
+ */
+static PMODULE_ENTRY ModuleFind(_In_ PMODULE_TABLE Table, _In_ const DRIVER_INFO *Info)
+{
+    PMODULE_ENTRY entry;
+    ULONG         i;
+
+    for (i = 0; i < Table->Count; i++) {
+        entry = &Table->Entries[i];
+        if (entry->RemovedGeneration == 0 &&
+            entry->Info.BaseAddress == Info->BaseAddress &&
+            entry->Info.ImageSize == Info->ImageSize &&
+            strcmp(entry->Info.ImagePath, Info->ImagePath) == 0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * ModuleTableCompact — выбросить надгробия, если их слишком много
+ * (Lock захвачен). Дельта от поколений до текущего становится недоступна.
+ */
+static VOID ModuleTableCompact(_Inout_ PMODULE_TABLE Table)
+{
+    ULONG i;
+    ULONG kept = 0;
+    ULONG tombstones = 0;
+
+    for (i = 0; i < Table->Count; i++) {
+        if (Table->Entries[i].RemovedGeneration != 0) {
+            tombstones++;
+        }
+    }
+
+    if (tombstones <= MODULE_TOMBSTONES_MAX) {
+        return;
+    }
+
+    for (i = 0; i < Table->Count; i++) {
+        if (Table->Entries[i].RemovedGeneration == 0) {
+            Table->Entries[kept++] = Table->Entries[i];
+        }
+    }
+
+    Table->Count = kept;
+    Table->OldestGeneration = Table->Generation;
+}
+
+/*
+ * ModuleTableRefresh — привести таблицу к текущему списку модулей
+ * (Lock захвачен). Поколение растёт, только если что-то изменилось.
+ */
+static NTSTATUS ModuleTableRefresh(_Inout_ PMODULE_TABLE Table)
+{
+    NTSTATUS             status;
+    PRTL_PROCESS_MODULES modules = NULL;
+    PMODULE_ENTRY        entries;
+    PMODULE_ENTRY        entry;
+    DRIVER_INFO          info;
+    ULONG                needed = 0;
+    ULONG                capacity;
+    ULONG                next;
+    ULONG                i;
+    BOOLEAN              changed = FALSE;
+    HASH_LIST            hashes;
+
+    /*
+     * Флаг сбрасывается до опроса: модуль, загруженный во время обхода,
+     * взведёт его снова, и следующий запрос перечитает список.
+     */
+    if (Table->Generation != 0 && Table->NotifyRegistered &&
+        InterlockedExchange(&Table->Dirty, 0) == 0) {
+        status = ZwQuerySystemInformation(SystemModuleInformation, NULL, 0, &needed);
+        if (status == STATUS_INFO_LENGTH_MISMATCH && needed == Table->QuerySize) {
+            return STATUS_SUCCESS;
+        }
+    }
+
+    status = QueryModules(&modules, &needed);
+    if (!NT_SUCCESS(status)) {
+        /* Список не прочитан — в следующий раз пробуем снова */
+        InterlockedExchange(&Table->Dirty, 1);
+        return status;
+    }
+
+    next = Table->Generation + 1;
+
+    /* Место под все записи сразу: живые + надгробия + новые */
+    capacity = Table->Count + modules->NumberOfModules;
+    if (capacity > Table->Capacity) {
+        entries = (PMODULE_ENTRY)ExAllocatePoolWithTag(PagedPool,
+                                                       (SIZE_T)capacity * sizeof(MODULE_ENTRY),
+                                                       POOL_TAG);
+        if (entries == NULL) {
+            ExFreePoolWithTag(modules, POOL_TAG);
+            InterlockedExchange(&Table->Dirty, 1);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        if (Table->Entries != NULL) {
+            RtlCopyMemory(entries, Table->Entries, (SIZE_T)Table->Count * sizeof(MODULE_ENTRY));
+            ExFreePoolWithTag(Table->Entries, POOL_TAG);
+        }
+
+        Table->Entries = entries;
+        Table->Capacity = capacity;
+    }
+
+    for (i = 0; i < Table->Count; i++) {
+        Table->Entries[i].Seen = FALSE;
+    }
+
+    RtlZeroMemory(&hashes, sizeof(hashes));
+
+    for (i = 0; i < modules->NumberOfModules; i++) {
+        FillModuleInfo(&modules->Modules[i], &info);
+
+        entry = ModuleFind(Table, &info);
+        if (entry != NULL) {
+            entry->Seen = TRUE;
+            continue;
+        }
+
+        entry = &Table->Entries[Table->Count++];
+        entry->Info = info;
+        entry->AddedGeneration = next;
+        entry->RemovedGeneration = 0;
+        entry->Seen = TRUE;
+        changed = TRUE;
+
+        /* Новый модуль — единственное место, где считается хеш */
+        HashListAdd(&hashes, (const CHAR *)modules->Modules[i].FullPathName, &entry->Info);
+    }
+
+    /* Записи на местах: места под все выделены выше, сжатие — только ниже */
+    HashListRun(&hashes);
+
+    for (i = 0; i < Table->Count; i++) {
+        entry = &Table->Entries[i];
+        if (entry->RemovedGeneration == 0 && !entry->Seen) {
+            entry->RemovedGeneration = next;
+            changed = TRUE;
+        }
+    }
+
+    Table->QuerySize = needed;
+    Table->LoadedCount = modules->NumberOfModules;
+    ExFreePoolWithTag(modules, POOL_TAG);
+
+    if (changed || Table->Generation == 0) {
+        Table->Generation = next;
+        if (Table->OldestGeneration == 0) {
+            Table->OldestGeneration = next;
+        }
+        ModuleTableCompact(Table);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ModuleChange — что запись означает для клиента, знающего поколение Since.
+ * Возвращает FALSE, если о записи сообщать не нужно.
+ */
+static BOOLEAN ModuleChange(
+    _In_ const MODULE_ENTRY *Entry,
+    _In_ ULONG Since,
+    _In_ BOOLEAN Full,
+    _Out_ PULONG Change)
+{
+    BOOLEAN added;
+    BOOLEAN removed;
+
+    if (Full) {
+        *Change = PROCMON_DRIVER_ADDED;
+        return (Entry->RemovedGeneration == 0);
+    }
+
+    added = (Entry->AddedGeneration > Since);
+    removed = (Entry->RemovedGeneration != 0 && Entry->RemovedGeneration > Since);
+
+    /* Появился и исчез после Since — клиент его не видел и не увидит */
+    if (added == removed) {
+        return FALSE;
+    }
+
+    *Change = added ? PROCMON_DRIVER_ADDED : PROCMON_DRIVER_REMOVED;
+    return TRUE;
+}
+
+/*
+ * ModuleLoadNotify — загрузка образа (PsSetLoadImageNotifyRoutine).
+ * Вызывается на каждую загрузку DLL во всей системе, поэтому для
+ * образов user mode — одна проверка и выход.
+ */
+static VOID ModuleLoadNotify(
+    _In_opt_ PUNICODE_STRING FullImageName,
+    _In_ HANDLE ProcessId,
+    _In_ PIMAGE_INFO ImageInfo)
+{
+    PDEVICE_EXTENSION extension;
+
+    UNREFERENCED_PARAMETER(FullImageName);
+    UNREFERENCED_PARAMETER(ProcessId);
+
+    if (!ImageInfo->SystemModeImage || g_DeviceObject == NULL) {
+        return;
+    }
+
+    extension = (PDEVICE_EXTENSION)g_DeviceObject->DeviceExtension;
+    InterlockedExchange(&extension->LoadedModules.Dirty, 1);
+}
+
+VOID ModuleTableInit(_Out_ PMODULE_TABLE Table)
+{
+    NTSTATUS status;
+
+    RtlZeroMemory(Table, sizeof(MODULE_TABLE));
+    KeInitializeMutex(&Table->Lock, 0);
+
+    /* Без уведомления таблица просто перечитывает список на каждый запрос */
+    status = PsSetLoadImageNotifyRoutine(ModuleLoadNotify);
+    if (NT_SUCCESS(status)) {
+        Table->NotifyRegistered = TRUE;
+    } else {
+        DbgPrint("[ProcMon] PsSetLoadImageNotifyRoutine: 0x%08X\n", status);
+    }
+}
+
+VOID ModuleTableFree(_Inout_ PMODULE_TABLE Table)
+{
+    if (Table->NotifyRegistered) {
+        PsRemoveLoadImageNotifyRoutine(ModuleLoadNotify);
+        Table->NotifyRegistered = FALSE;
+    }
+
+    if (Table->Entries != NULL) {
+        ExFreePoolWithTag(Table->Entries, POOL_TAG);
+        Table->Entries = NULL;
+    }
+
+    Table->Count = 0;
+    Table->Capacity = 0;
+}
+
+NTSTATUS ModuleTableQueryDelta(
+    _Inout_ PMODULE_TABLE Table,
+    _In_ ULONG Since,
+    _Out_writes_bytes_(OutputLength) PDRIVER_DELTA_RESPONSE Output,
+    _In_ ULONG OutputLength,
+    _Out_ PULONG BytesReturned)
+{
+    NTSTATUS status;
+    ULONG    change;
+    ULONG    count = 0;
+    ULONG    required;
+    ULONG    i;
+    BOOLEAN  full;
+
+    *BytesReturned = 0;
+
+    if (OutputLength < (ULONG)FIELD_OFFSET(DRIVER_DELTA_RESPONSE, Changes)) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    KeWaitForSingleObject(&Table->Lock, Executive, KernelMode, FALSE, NULL);
+
+    status = ModuleTableRefresh(Table);
+    if (!NT_SUCCESS(status)) {
+        goto cleanup;
+    }
+
+    /* Поколение неизвестно (0, чужое или надгробия уже сброшены) — весь список */
+    full = (Since == 0 || Since < Table->OldestGeneration || Since > Table->Generation);
+
+    for (i = 0; i < Table->Count; i++) {
+        if (ModuleChange(&Table->Entries[i], Since, full, &change)) {
+            count++;
+        }
+    }
+
+    RtlZeroMemory(Output, FIELD_OFFSET(DRIVER_DELTA_RESPONSE, Changes));
+    Output->Generation = Table->Generation;
+    Output->Flags = full ? PROCMON_DELTA_FLAG_FULL : 0;
+    Output->TotalCount = Table->LoadedCount;
+
+    required = FIELD_OFFSET(DRIVER_DELTA_RESPONSE, Changes) + count * sizeof(DRIVER_CHANGE);
+    Output->RequiredLength = required;
+
+    /* Не помещается — только заголовок: клиент увеличит буфер и повторит */
+    if (required > OutputLength) {
+        *BytesReturned = FIELD_OFFSET(DRIVER_DELTA_RESPONSE, Changes);
+        status = STATUS_BUFFER_OVERFLOW;
+        goto cleanup;
+    }
+
+    count = 0;
+    for (i = 0; i < Table->Count; i++) {
+        if (ModuleChange(&Table->Entries[i], Since, full, &change)) {
+            Output->Changes[count].Change = change;
+            Output->Changes[count].Reserved = 0;
+            Output->Changes[count].Driver = Table->Entries[i].Info;
+            count++;
+        }
+    }
+
+    Output->ChangeCount = count;
+    *BytesReturned = required;
+
+cleanup:
+    KeReleaseMutex(&Table->Lock, FALSE);
+    return status;
+}
+
 /*
  * ReadRegistryDword — чтение DWORD-значения из реестра.
  */
@@ -368,6 +829,150 @@ static NTSTATUS ReadRegistryString(HANDLE KeyHandle, PCWSTR ValueName,
     return status;
 }
 
+/*
+ * ReadServiceKey — прочитать подключ службы Name из ключа Services.
+ * *IsDriver = FALSE, если служба не драйвер (Type не 1 и не 2).
+ * С Info == NULL только проверяет тип (без хеша файла). Файл драйвера
+ * ставится в Hashes — хеш появится в Info после HashListRun.
+ */
+static NTSTATUS ReadServiceKey(
+    _In_ HANDLE ServicesKey,
+    _In_ PCUNICODE_STRING Name,
+    _Out_opt_ PDRIVER_INFO info,
+    _Inout_ PHASH_LIST Hashes,
+    _Out_ PBOOLEAN IsDriver)
+{
+    NTSTATUS          status;
+    HANDLE            subKey = NULL;
+    OBJECT_ATTRIBUTES subAttr;
+    ULONG             driverType = 0;
+    ANSI_STRING       ansiKeyName;
+
+    *IsDriver = FALSE;
+
+    InitializeObjectAttributes(&subAttr, (PUNICODE_STRING)Name,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               ServicesKey, NULL);
+
+    status = ZwOpenKey(&subKey, KEY_READ, &subAttr);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    /* Фильтруем: Type == 1 (KERNEL_DRIVER) или Type == 2 (FILE_SYSTEM_DRIVER) */
+    status = ReadRegistryDword(subKey, L"Type", &driverType);
+    if (!NT_SUCCESS(status) || (driverType != 1 && driverType != 2)) {
+        ZwClose(subKey);
+        return STATUS_SUCCESS;
+    }
+
+    *IsDriver = TRUE;
+
+    if (info == NULL) {
+        ZwClose(subKey);
+        return STATUS_SUCCESS;
+    }
+
+    RtlZeroMemory(info, sizeof(DRIVER_INFO));
+
+    /* Имя ключа -> DriverName */
+    status = RtlUnicodeStringToAnsiString(&ansiKeyName, Name, TRUE);
+    if (NT_SUCCESS(status)) {
+        ULONG copyLen = ansiKeyName.Length;
+        if (copyLen >= PROCMON_MAX_IMAGE_NAME)
+            copyLen = PROCMON_MAX_IMAGE_NAME - 1;
+        RtlCopyMemory(info->DriverName, ansiKeyName.Buffer, copyLen);
+        info->DriverName[copyLen] = '\0';
+        RtlFreeAnsiString(&ansiKeyName);
+    }
+
+    /* DisplayName (перезаписывает имя ключа, если есть и не MUI-ссылка) */
+    {
+        CHAR displayName[PROCMON_MAX_IMAGE_NAME];
+        displayName[0] = '\0';
+        if (NT_SUCCESS(ReadRegistryString(subKey, L"DisplayName",
+                                          displayName, sizeof(displayName)))) {
+            if (displayName[0] != '\0' && displayName[0] != '@') {
+                ULONG len = (ULONG)strlen(displayName);
+                if (len >= PROCMON_MAX_IMAGE_NAME)
+                    len = PROCMON_MAX_IMAGE_NAME - 1;
+                RtlCopyMemory(info->DriverName, displayName, len);
+                info->DriverName[len] = '\0';
+            }
+        }
+    }
+
+    /* ImagePath */
+    ReadRegistryString(subKey, L"ImagePath",
+                       info->ImagePath, PROCMON_MAX_DRIVER_PATH);
+
+    /* Start type */
+    ReadRegistryDword(subKey, L"Start", &info->StartType);
+
+    info->BaseAddress = 0;
+    info->ImageSize = 0;
+
+    ZwClose(subKey);
+
+    /* MD5-хеш файла драйвера — после обхода, пачкой */
+    if (info->ImagePath[0] != '\0') {
+        HashListAdd(Hashes, info->ImagePath, info);
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * OpenServicesKey — ключ HKLM\System\CurrentControlSet\Services (kernel handle).
+ */
+static NTSTATUS OpenServicesKey(_Out_ PHANDLE ServicesKey)
+{
+    UNICODE_STRING    servicesPath;
+    OBJECT_ATTRIBUTES objAttr;
+
+    RtlInitUnicodeString(&servicesPath,
+        L"\\Registry\\Machine\\System\\CurrentControlSet\\Services");
+
+    InitializeObjectAttributes(&objAttr, &servicesPath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL, NULL);
+
+    /* KEY_READ включает KEY_NOTIFY, нужный кэшу для ZwNotifyChangeKey */
+    return ZwOpenKey(ServicesKey, KEY_READ, &objAttr);
+}
+
+/*
+ * EnumerateServiceKey — очередной подключ Services (имя и LastWriteTime).
+ * Буфер *KeyInfo растёт, если имя не помещается.
+ * STATUS_NO_MORE_ENTRIES — подключи кончились.
+ */
+static NTSTATUS EnumerateServiceKey(
+    _In_ HANDLE ServicesKey,
+    _In_ ULONG Index,
+    _Inout_ PKEY_BASIC_INFORMATION *KeyInfo,
+    _Inout_ PULONG KeyInfoSize)
+{
+    NTSTATUS status;
+    ULONG    resultLength;
+
+    for (;;) {
+        status = ZwEnumerateKey(ServicesKey, Index, KeyBasicInformation,
+                                *KeyInfo, *KeyInfoSize, &resultLength);
+
+        if (status != STATUS_BUFFER_OVERFLOW && status != STATUS_BUFFER_TOO_SMALL) {
+            return status;
+        }
+
+        ExFreePoolWithTag(*KeyInfo, POOL_TAG);
+        *KeyInfoSize = resultLength + 64;
+        *KeyInfo = (PKEY_BASIC_INFORMATION)ExAllocatePoolWithTag(PagedPool, *KeyInfoSize,
+                                                                  POOL_TAG);
+        if (*KeyInfo == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+}
+
 /*
  * EnumerateInstalledDrivers — перечисление драйверов из реестра Services.
  */
@@ -379,159 +984,514 @@ NTSTATUS EnumerateInstalledDrivers(
 {
     NTSTATUS       status;
     HANDLE         servicesKey = NULL;
-    UNICODE_STRING servicesPath;
-    OBJECT_ATTRIBUTES objAttr;
     ULONG          index;
     ULONG          total = 0, returned = 0;
-    UCHAR         *keyInfoBuf = NULL;
-    ULONG          keyInfoBufSize = 512;
+    PKEY_BASIC_INFORMATION keyInfo;
+    ULONG          keyInfoSize = 512;
+    HASH_LIST      hashes;
 
     *TotalCount = 0;
     *ReturnedCount = 0;
 
-    RtlInitUnicodeString(&servicesPath,
-        L"\\Registry\\Machine\\System\\CurrentControlSet\\Services");
-
-    InitializeObjectAttributes(&objAttr, &servicesPath,
-                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
-                               NULL, NULL);
-
-    status = ZwOpenKey(&servicesKey, KEY_READ, &objAttr);
+    status = OpenServicesKey(&servicesKey);
     if (!NT_SUCCESS(status)) {
         return status;
     }
 
-    keyInfoBuf = (UCHAR *)ExAllocatePoolWithTag(PagedPool, keyInfoBufSize, POOL_TAG);
-    if (keyInfoBuf == NULL) {
+    keyInfo = (PKEY_BASIC_INFORMATION)ExAllocatePoolWithTag(PagedPool, keyInfoSize, POOL_TAG);
+    if (keyInfo == NULL) {
         ZwClose(servicesKey);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    RtlZeroMemory(&hashes, sizeof(hashes));
+
     for (index = 0; ; index++) {
-        PKEY_BASIC_INFORMATION keyInfo = (PKEY_BASIC_INFORMATION)keyInfoBuf;
-        ULONG resultLength;
-        HANDLE subKey = NULL;
         UNICODE_STRING subKeyName;
-        OBJECT_ATTRIBUTES subAttr;
-        ULONG driverType = 0;
+        BOOLEAN        isDriver;
 
-        status = ZwEnumerateKey(servicesKey, index, KeyBasicInformation,
-                                keyInfo, keyInfoBufSize, &resultLength);
+        status = EnumerateServiceKey(servicesKey, index, &keyInfo, &keyInfoSize);
 
         if (status == STATUS_NO_MORE_ENTRIES) {
             status = STATUS_SUCCESS;
             break;
         }
 
-        if (status == STATUS_BUFFER_OVERFLOW || status == STATUS_BUFFER_TOO_SMALL) {
-            ExFreePoolWithTag(keyInfoBuf, POOL_TAG);
-            keyInfoBufSize = resultLength + 64;
-            keyInfoBuf = (UCHAR *)ExAllocatePoolWithTag(PagedPool, keyInfoBufSize, POOL_TAG);
-            if (keyInfoBuf == NULL) {
-                ZwClose(servicesKey);
-                return STATUS_INSUFFICIENT_RESOURCES;
-            }
-            index--;
-            continue;
+        if (status == STATUS_INSUFFICIENT_RESOURCES) {
+            HashListFree(&hashes);
+            ZwClose(servicesKey);
+            return status;
         }
 
         if (!NT_SUCCESS(status)) {
             continue;
         }
 
-        /* Открываем подключ */
         subKeyName.Buffer = keyInfo->Name;
         subKeyName.Length = (USHORT)keyInfo->NameLength;
         subKeyName.MaximumLength = subKeyName.Length;
 
-        InitializeObjectAttributes(&subAttr, &subKeyName,
-                                   OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
-                                   servicesKey, NULL);
+        status = ReadServiceKey(servicesKey, &subKeyName,
+                                (returned < MaxEntries) ? &OutputBuffer[returned] : NULL,
+                                &hashes, &isDriver);
+        if (!NT_SUCCESS(status) || !isDriver) {
+            continue;
+        }
+
+        total++;
+
+        if (returned < MaxEntries) {
+            returned++;
+        }
+    }
+
+    HashListRun(&hashes);
+
+    *TotalCount = total;
+    *ReturnedCount = returned;
+
+    ExFreePoolWithTag(keyInfo, POOL_TAG);
+    ZwClose(servicesKey);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * === Кэш установленных драйверов ===
+ *
+ * Кэш хранит все подключи Services в порядке ZwEnumerateKey вместе с их
+ * LastWriteTime; для драйверов — готовый DRIVER_INFO с хешем.
+ * ZwNotifyChangeKey на всём дереве Services сигналит событие, по которому
+ * поток кэша взводит Dirty. Пока Dirty не взведён, запрос — копирование
+ * из памяти.
+ * После изменения подключи перебираются заново, но открываются и
+ * читаются только те, у которых сменился LastWriteTime (или которых
+ * раньше не было). Хеши файлов берутся заново у всех драйверов — через
+ * кэш хешей (hash_cache.h), который перечитывает только изменённые файлы.
+ *
+ * Уведомление ставится из системного потока (DriverEntry, поток кэша):
+ * ожидание, поставленное из потока клиента, отменилось бы при
+ * завершении этого потока. Рабочий элемент вместо своего потока не
+ * подходит: после последнего срабатывания он ещё выполнял бы код
+ * драйвера, когда выгрузка уже разрешена, и мог бы снова поставить
+ * ожидание на закрытый (и выданный заново) хэндл ключа. Поток же
+ * выгрузка дожидается, и ключ закрывается только после него.
+ */
+
+/* ZwNotifyChangeKey и ZwCreateEvent нет в ntddk.h */
+NTSYSAPI NTSTATUS NTAPI ZwNotifyChangeKey(
+    HANDLE KeyHandle,
+    HANDLE Event,
+    PIO_APC_ROUTINE ApcRoutine,
+    PVOID ApcContext,
+    PIO_STATUS_BLOCK IoStatusBlock,
+    ULONG CompletionFilter,
+    BOOLEAN WatchTree,
+    PVOID Buffer,
+    ULONG BufferSize,
+    BOOLEAN Asynchronous
+);
+
+NTSYSAPI NTSTATUS NTAPI ZwCreateEvent(
+    PHANDLE EventHandle,
+    ACCESS_MASK DesiredAccess,
+    POBJECT_ATTRIBUTES ObjectAttributes,
+    EVENT_TYPE EventType,
+    BOOLEAN InitialState
+);
+
+/*
+ * InstalledCacheArm — поставить ожидание изменений дерева Services.
+ * Срабатывание сигналит NotifyEvent.
+ */
+static NTSTATUS InstalledCacheArm(_Inout_ PINSTALLED_CACHE Cache)
+{
+    return ZwNotifyChangeKey(Cache->ServicesKey, Cache->NotifyEvent, NULL, NULL,
+                             &Cache->NotifyIosb,
+                             REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET,
+                             TRUE, NULL, 0, TRUE);
+}
+
+/*
+ * InstalledCacheThread — поток кэша: ждёт изменения дерева Services или
+ * выгрузки. Ожидание сразу ставится снова, до перечитывания: изменение,
+ * пришедшее во время обновления кэша, не потеряется.
+ */
+static VOID InstalledCacheThread(_In_ PVOID Context)
+{
+    PINSTALLED_CACHE Cache = (PINSTALLED_CACHE)Context;
+    PVOID            objects[2];
+    NTSTATUS         status;
+
+    objects[0] = &Cache->Stop;
+    objects[1] = Cache->NotifyObject;
+
+    for (;;) {
+        status = KeWaitForMultipleObjects(2, objects, WaitAny, Executive, KernelMode,
+                                          FALSE, NULL, NULL);
+        if (status != STATUS_WAIT_1) {
+            break;
+        }
+
+        status = InstalledCacheArm(Cache);
+        InterlockedExchange(&Cache->Dirty, 1);
 
-        status = ZwOpenKey(&subKey, KEY_READ, &subAttr);
         if (!NT_SUCCESS(status)) {
-            continue;
+            /* Дальше кэш сверяется с реестром на каждый запрос */
+            DbgPrint("[ProcMon] ZwNotifyChangeKey для Services: 0x%08X\n", status);
+            Cache->Armed = FALSE;
+            break;
         }
+    }
 
-        /* Фильтруем: Type == 1 (KERNEL_DRIVER) или Type == 2 (FILE_SYSTEM_DRIVER) */
-        status = ReadRegistryDword(subKey, L"Type", &driverType);
-        if (!NT_SUCCESS(status) || (driverType != 1 && driverType != 2)) {
-            ZwClose(subKey);
-            continue;
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+/* InstalledCacheFreeEntries — освободить записи массива Entries[0..Count) */
+static VOID InstalledCacheFreeEntries(_In_ PSERVICE_ENTRY Entries, _In_ ULONG Count)
+{
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        if (Entries[i].Name != NULL) {
+            ExFreePoolWithTag(Entries[i].Name, POOL_TAG);
+        }
+        if (Entries[i].Driver != NULL) {
+            ExFreePoolWithTag(Entries[i].Driver, POOL_TAG);
+        }
+    }
+}
+
+/*
+ * InstalledCacheFind — запись подключа Name среди старых записей.
+ * Подключи перебираются в одном и том же порядке, поэтому поиск
+ * начинается с *Hint (после прошлой найденной) и почти всегда
+ * заканчивается на первом сравнении.
+ */
+static PSERVICE_ENTRY InstalledCacheFind(
+    _In_ PSERVICE_ENTRY Entries,
+    _In_ ULONG Count,
+    _In_ PCUNICODE_STRING Name,
+    _Inout_ PULONG Hint)
+{
+    ULONG i;
+    ULONG index;
+
+    for (i = 0; i < Count; i++) {
+        index = (*Hint + i) % Count;
+
+        if (Entries[index].Name != NULL &&
+            Entries[index].NameLength == Name->Length &&
+            RtlEqualMemory(Entries[index].Name, Name->Buffer, Name->Length)) {
+            *Hint = index + 1;
+            return &Entries[index];
         }
+    }
 
-        total++;
+    return NULL;
+}
 
-        if (returned < MaxEntries) {
-            PDRIVER_INFO info = &OutputBuffer[returned];
-            ANSI_STRING  ansiKeyName;
-            UNICODE_STRING uniSubKeyName;
-
-            RtlZeroMemory(info, sizeof(DRIVER_INFO));
-
-            /* Имя ключа -> DriverName */
-            uniSubKeyName.Buffer = keyInfo->Name;
-            uniSubKeyName.Length = (USHORT)keyInfo->NameLength;
-            uniSubKeyName.MaximumLength = uniSubKeyName.Length;
-
-            status = RtlUnicodeStringToAnsiString(&ansiKeyName, &uniSubKeyName, TRUE);
-            if (NT_SUCCESS(status)) {
-                ULONG copyLen = ansiKeyName.Length;
-                if (copyLen >= PROCMON_MAX_IMAGE_NAME)
-                    copyLen = PROCMON_MAX_IMAGE_NAME - 1;
-                RtlCopyMemory(info->DriverName, ansiKeyName.Buffer, copyLen);
-                info->DriverName[copyLen] = '\0';
-                RtlFreeAnsiString(&ansiKeyName);
+/*
+ * InstalledCacheRefresh — сверить кэш с реестром (Lock захвачен).
+ * Записи без изменений переносятся в новый массив; хеши их файлов
+ * сверяются заново через кэш хешей.
+ */
+static NTSTATUS InstalledCacheRefresh(_Inout_ PINSTALLED_CACHE Cache)
+{
+    NTSTATUS               status;
+    PKEY_BASIC_INFORMATION keyInfo;
+    ULONG                  keyInfoSize = 512;
+    PSERVICE_ENTRY         entries = NULL;
+    PSERVICE_ENTRY         grown;
+    PSERVICE_ENTRY         old;
+    PSERVICE_ENTRY         entry;
+    ULONG                  capacity;
+    ULONG                  count = 0;
+    ULONG                  drivers = 0;
+    ULONG                  reread = 0;
+    ULONG                  hint = 0;
+    ULONG                  index;
+    UNICODE_STRING         name;
+    BOOLEAN                isDriver;
+    HASH_LIST              hashes;
+    ULONG                  hashMs;
+
+    RtlZeroMemory(&hashes, sizeof(hashes));
+
+    keyInfo = (PKEY_BASIC_INFORMATION)ExAllocatePoolWithTag(PagedPool, keyInfoSize, POOL_TAG);
+    if (keyInfo == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    capacity = Cache->Count + 16;
+
+    entries = (PSERVICE_ENTRY)ExAllocatePoolWithTag(PagedPool,
+                                                    (SIZE_T)capacity * sizeof(SERVICE_ENTRY),
+                                                    POOL_TAG);
+    if (entries == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto cleanup;
+    }
+
+    for (index = 0; ; index++) {
+        status = EnumerateServiceKey(Cache->ServicesKey, index, &keyInfo, &keyInfoSize);
+
+        if (status == STATUS_NO_MORE_ENTRIES) {
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        if (status == STATUS_INSUFFICIENT_RESOURCES) {
+            goto cleanup;
+        }
+
+        if (!NT_SUCCESS(status)) {
+            continue;
+        }
+
+        if (count == capacity) {
+            grown = (PSERVICE_ENTRY)ExAllocatePoolWithTag(PagedPool,
+                                                          (SIZE_T)capacity * 2 * sizeof(SERVICE_ENTRY),
+                                                          POOL_TAG);
+            if (grown == NULL) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                goto cleanup;
             }
+            RtlCopyMemory(grown, entries, (SIZE_T)count * sizeof(SERVICE_ENTRY));
+            ExFreePoolWithTag(entries, POOL_TAG);
+            entries = grown;
+            capacity *= 2;
+        }
 
-            /* DisplayName (перезаписывает имя ключа, если есть и не MUI-ссылка) */
-            {
-                CHAR displayName[PROCMON_MAX_IMAGE_NAME];
-                displayName[0] = '\0';
-                if (NT_SUCCESS(ReadRegistryString(subKey, L"DisplayName",
-                                                  displayName, sizeof(displayName)))) {
-                    if (displayName[0] != '\0' && displayName[0] != '@') {
-                        ULONG len = (ULONG)strlen(displayName);
-                        if (len >= PROCMON_MAX_IMAGE_NAME)
-                            len = PROCMON_MAX_IMAGE_NAME - 1;
-                        RtlCopyMemory(info->DriverName, displayName, len);
-                        info->DriverName[len] = '\0';
-                    }
-                }
+        name.Buffer = keyInfo->Name;
+        name.Length = (USHORT)keyInfo->NameLength;
+        name.MaximumLength = name.Length;
+
+        entry = &entries[count];
+        RtlZeroMemory(entry, sizeof(SERVICE_ENTRY));
+
+        old = InstalledCacheFind(Cache->Entries, Cache->Count, &name, &hint);
+        if (old != NULL && old->LastWriteTime.QuadPart == keyInfo->LastWriteTime.QuadPart) {
+            /*
+             * Подключ не менялся — забираем запись, но не хеш: LastWriteTime
+             * ключа не говорит о файле, его могли переписать на месте. Хеш
+             * берётся заново через кэш хешей, ключ которого — FileId, времена
+             * и размер файла, так что неизменный файл не перечитывается.
+             */
+            *entry = *old;
+            old->Name = NULL;
+            old->Driver = NULL;
+
+            if (entry->Driver != NULL && entry->Driver->ImagePath[0] != '\0') {
+                entry->Driver->HashValid = FALSE;
+                RtlZeroMemory(entry->Driver->FileHash, sizeof(entry->Driver->FileHash));
+                HashListAdd(&hashes, entry->Driver->ImagePath, entry->Driver);
+            }
+        } else {
+            entry->Name = (PWCHAR)ExAllocatePoolWithTag(PagedPool, name.Length + sizeof(WCHAR),
+                                                        POOL_TAG);
+            if (entry->Name == NULL) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                goto cleanup;
+            }
+            RtlCopyMemory(entry->Name, name.Buffer, name.Length);
+            entry->NameLength = name.Length;
+            entry->LastWriteTime = keyInfo->LastWriteTime;
+
+            entry->Driver = (PDRIVER_INFO)ExAllocatePoolWithTag(PagedPool, sizeof(DRIVER_INFO),
+                                                                POOL_TAG);
+            if (entry->Driver == NULL) {
+                ExFreePoolWithTag(entry->Name, POOL_TAG);
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                goto cleanup;
             }
 
-            /* ImagePath */
-            ReadRegistryString(subKey, L"ImagePath",
-                               info->ImagePath, PROCMON_MAX_DRIVER_PATH);
-
-            /* Start type */
-            ReadRegistryDword(subKey, L"Start", &info->StartType);
-
-            info->BaseAddress = 0;
-            info->ImageSize = 0;
-
-            /* Вычисляем MD5-хеш файла драйвера */
-            if (info->ImagePath[0] != '\0') {
-                UNICODE_STRING resolvedPath;
-                if (NT_SUCCESS(ResolveDriverPath(info->ImagePath, &resolvedPath)) &&
-                    resolvedPath.Buffer != NULL) {
-                    if (NT_SUCCESS(ComputeFileHash(&resolvedPath, info->FileHash))) {
-                        info->HashValid = TRUE;
-                    }
-                    ExFreePoolWithTag(resolvedPath.Buffer, POOL_TAG);
-                }
+            status = ReadServiceKey(Cache->ServicesKey, &name, entry->Driver, &hashes, &isDriver);
+            if (!NT_SUCCESS(status) || !isDriver) {
+                /* Не драйвер (или ключ уже удалён) — запоминаем только имя и время */
+                ExFreePoolWithTag(entry->Driver, POOL_TAG);
+                entry->Driver = NULL;
             }
 
-            returned++;
+            reread++;
         }
 
-        ZwClose(subKey);
+        if (entry->Driver != NULL) {
+            drivers++;
+        }
+
+        count++;
     }
 
-    *TotalCount = total;
+    /* Entries перевыделяется при росте, но DRIVER_INFO — отдельные блоки */
+    hashMs = HashListRun(&hashes);
+
+    /* Записи, которые не перенесены, — удалённые или изменённые подключи */
+    InstalledCacheFreeEntries(Cache->Entries, Cache->Count);
+    if (Cache->Entries != NULL) {
+        ExFreePoolWithTag(Cache->Entries, POOL_TAG);
+    }
+
+    Cache->Entries = entries;
+    Cache->Count = count;
+    Cache->DriverCount = drivers;
+    Cache->Counters.Reread = reread;
+    Cache->Counters.HashMs = hashMs;
+    KeQuerySystemTime(&Cache->Counters.RefreshTime);
+    entries = NULL;
+
+    DbgPrint("[ProcMon] Кэш драйверов: %lu подключей, перечитано %lu\n", count, reread);
+
+cleanup:
+    HashListFree(&hashes);
+
+    if (entries != NULL) {
+        InstalledCacheFreeEntries(entries, count);
+        ExFreePoolWithTag(entries, POOL_TAG);
+    }
+
+    if (keyInfo != NULL) {
+        ExFreePoolWithTag(keyInfo, POOL_TAG);
+    }
+
+    return status;
+}
+
+VOID InstalledCacheInit(_Out_ PINSTALLED_CACHE Cache)
+{
+    NTSTATUS          status;
+    OBJECT_ATTRIBUTES objAttr;
+
+    RtlZeroMemory(Cache, sizeof(INSTALLED_CACHE));
+    KeInitializeMutex(&Cache->Lock, 0);
+    KeInitializeEvent(&Cache->Stop, NotificationEvent, FALSE);
+
+    /* Кэш строится первым запросом */
+    Cache->Dirty = 1;
+
+    status = OpenServicesKey(&Cache->ServicesKey);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("[ProcMon] Ключ Services для кэша драйверов: 0x%08X\n", status);
+        Cache->ServicesKey = NULL;
+        return;
+    }
+
+    /* Без уведомления кэш сверяется с реестром на каждый запрос */
+    InitializeObjectAttributes(&objAttr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = ZwCreateEvent(&Cache->NotifyEvent, EVENT_ALL_ACCESS, &objAttr,
+                           SynchronizationEvent, FALSE);
+    if (!NT_SUCCESS(status)) {
+        Cache->NotifyEvent = NULL;
+        goto failed;
+    }
+
+    status = ObReferenceObjectByHandle(Cache->NotifyEvent, EVENT_ALL_ACCESS, *ExEventObjectType,
+                                       KernelMode, (PVOID *)&Cache->NotifyObject, NULL);
+    if (!NT_SUCCESS(status)) {
+        Cache->NotifyObject = NULL;
+        goto failed;
+    }
+
+    status = InstalledCacheArm(Cache);
+    if (!NT_SUCCESS(status)) {
+        goto failed;
+    }
+
+    status = PsCreateSystemThread(&Cache->Thread, SYNCHRONIZE, &objAttr, NULL, NULL,
+                                  InstalledCacheThread, Cache);
+    if (!NT_SUCCESS(status)) {
+        Cache->Thread = NULL;
+        goto failed;
+    }
+
+    Cache->Armed = TRUE;
+    return;
+
+failed:
+    /* Поставленное ожидание снимет закрытие ключа в InstalledCacheFree */
+    DbgPrint("[ProcMon] Уведомление об изменениях Services: 0x%08X\n", status);
+}
+
+VOID InstalledCacheFree(_Inout_ PINSTALLED_CACHE Cache)
+{
+    /* Сначала поток: пока он жив, он может снова поставить ожидание на ключ */
+    if (Cache->Thread != NULL) {
+        KeSetEvent(&Cache->Stop, IO_NO_INCREMENT, FALSE);
+        ZwWaitForSingleObject(Cache->Thread, FALSE, NULL);
+        ZwClose(Cache->Thread);
+        Cache->Thread = NULL;
+    }
+    Cache->Armed = FALSE;
+
+    /* Закрытие ключа снимает ожидание (STATUS_NOTIFY_CLEANUP) */
+    if (Cache->ServicesKey != NULL) {
+        ZwClose(Cache->ServicesKey);
+        Cache->ServicesKey = NULL;
+    }
+
+    if (Cache->NotifyObject != NULL) {
+        ObDereferenceObject(Cache->NotifyObject);
+        Cache->NotifyObject = NULL;
+    }
+
+    if (Cache->NotifyEvent != NULL) {
+        ZwClose(Cache->NotifyEvent);
+        Cache->NotifyEvent = NULL;
+    }
+
+    InstalledCacheFreeEntries(Cache->Entries, Cache->Count);
+    if (Cache->Entries != NULL) {
+        ExFreePoolWithTag(Cache->Entries, POOL_TAG);
+        Cache->Entries = NULL;
+    }
+
+    Cache->Count = 0;
+}
+
+NTSTATUS InstalledCacheRead(
+    _Inout_ PINSTALLED_CACHE Cache,
+    _Out_writes_opt_(MaxEntries) PDRIVER_INFO OutputBuffer,
+    _In_ ULONG MaxEntries,
+    _Out_ PULONG TotalCount,
+    _Out_ PULONG ReturnedCount)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG    returned = 0;
+    ULONG    i;
+
+    *TotalCount = 0;
+    *ReturnedCount = 0;
+
+    if (Cache->ServicesKey == NULL) {
+        return EnumerateInstalledDrivers(OutputBuffer, MaxEntries, TotalCount, ReturnedCount);
+    }
+
+    KeWaitForSingleObject(&Cache->Lock, Executive, KernelMode, FALSE, NULL);
+
+    /* Без уведомления сверяемся с реестром раз на запрос — на проходе подсчёта */
+    if (InterlockedExchange(&Cache->Dirty, 0) != 0 || (!Cache->Armed && MaxEntries == 0)) {
+        status = InstalledCacheRefresh(Cache);
+        if (!NT_SUCCESS(status)) {
+            InterlockedExchange(&Cache->Dirty, 1);
+            goto cleanup;
+        }
+        if (MaxEntries == 0) {
+            InterlockedIncrement64(&Cache->Counters.Misses);
+        }
+    } else if (MaxEntries == 0) {
+        InterlockedIncrement64(&Cache->Counters.Hits);
+    }
+
+    for (i = 0; i < Cache->Count && returned < MaxEntries; i++) {
+        if (Cache->Entries[i].Driver != NULL) {
+            OutputBuffer[returned++] = *Cache->Entries[i].Driver;
+        }
+    }
+
+    *TotalCount = Cache->DriverCount;
     *ReturnedCount = returned;
 
-    ExFreePoolWithTag(keyInfoBuf, POOL_TAG);
-    ZwClose(servicesKey);
-    return STATUS_SUCCESS;
+cleanup:
+    KeReleaseMutex(&Cache->Lock, FALSE);
+    return status;
 }
@@ -7,10 +7,12 @@
 
 #include <ntddk.h>
 #include "../common/shared.h"
+#include "snapshot.h"
 
 /*
  * EnumerateLoadedDrivers — перечислить загруженные драйверы ядра.
  * Использует ZwQuerySystemInformation(SystemModuleInformation).
+ * С MaxEntries == 0 только считает (OutputBuffer не трогается).
  */
 NTSTATUS EnumerateLoadedDrivers(
     PDRIVER_INFO OutputBuffer,
@@ -23,6 +25,7 @@ NTSTATUS EnumerateLoadedDrivers(
  * EnumerateInstalledDrivers — перечислить установленные драйверы из реестра.
  * Перебирает HKLM\System\CurrentControlSet\Services,
  * фильтрует по Type == 1 (SERVICE_KERNEL_DRIVER) или Type == 2 (SERVICE_FILE_SYSTEM_DRIVER).
+ * С MaxEntries == 0 только считает (OutputBuffer не трогается).
  */
 NTSTATUS EnumerateInstalledDrivers(
     PDRIVER_INFO OutputBuffer,
@@ -31,4 +34,110 @@ NTSTATUS EnumerateInstalledDrivers(
     PULONG ReturnedCount
 );
 
+/*
+ * Подключ Services в кэше установленных драйверов.
+ */
+typedef struct _SERVICE_ENTRY {
+    LARGE_INTEGER LastWriteTime;  /* Из KEY_BASIC_INFORMATION: сменилось — перечитать */
+    PWCHAR        Name;           /* Имя подключа (PagedPool) */
+    USHORT        NameLength;     /* В байтах */
+    PDRIVER_INFO  Driver;         /* Готовая запись с хешем, NULL — служба не драйвер */
+} SERVICE_ENTRY, *PSERVICE_ENTRY;
+
+/*
+ * Кэш установленных драйверов, сбрасываемый уведомлением реестра
+ * (ZwNotifyChangeKey на дереве Services).
+ */
+typedef struct _INSTALLED_CACHE {
+    KMUTEX          Lock;         /* PASSIVE: внутри обход реестра и хеширование */
+    HANDLE          ServicesKey;  /* Kernel handle ключа Services, NULL — кэша нет */
+    PSERVICE_ENTRY  Entries;      /* Все подключи в порядке ZwEnumerateKey */
+    ULONG           Count;
+    ULONG           DriverCount;  /* Записей с Driver != NULL */
+    volatile LONG   Dirty;        /* Реестр менялся после последней сверки */
+    BOOLEAN         Armed;        /* Ожидание изменений поставлено */
+    IO_STATUS_BLOCK NotifyIosb;
+    HANDLE          NotifyEvent;  /* Событие уведомления (kernel handle) */
+    PKEVENT         NotifyObject; /* Оно же — для ожидания в потоке */
+    HANDLE          Thread;       /* Поток, снова ставящий ожидание */
+    KEVENT          Stop;         /* Выгрузка: поток завершается */
+    ENUM_CACHE_COUNTERS Counters;
+} INSTALLED_CACHE, *PINSTALLED_CACHE;
+
+/*
+ * InstalledCacheInit — открыть Services и поставить ожидание изменений.
+ * Кэш строится первым запросом. Вызывается из системного потока
+ * (DriverEntry). IRQL: PASSIVE_LEVEL.
+ */
+VOID InstalledCacheInit(_Out_ PINSTALLED_CACHE Cache);
+
+/* InstalledCacheFree — снять ожидание и освободить записи. IRQL: PASSIVE_LEVEL. */
+VOID InstalledCacheFree(_Inout_ PINSTALLED_CACHE Cache);
+
+/*
+ * InstalledCacheRead — установленные драйверы из кэша, в той же форме,
+ * что EnumerateInstalledDrivers. Если реестр менялся, кэш сначала
+ * сверяется с ним. Попадание или промах считается на проходе подсчёта
+ * (MaxEntries == 0), с которого снимок начинает каждый запрос.
+ * IRQL: PASSIVE_LEVEL.
+ */
+NTSTATUS InstalledCacheRead(
+    _Inout_ PINSTALLED_CACHE Cache,
+    _Out_writes_opt_(MaxEntries) PDRIVER_INFO OutputBuffer,
+    _In_ ULONG MaxEntries,
+    _Out_ PULONG TotalCount,
+    _Out_ PULONG ReturnedCount
+);
+
+/*
+ * Запись таблицы загруженных модулей (см. ModuleTableQueryDelta).
+ */
+typedef struct _MODULE_ENTRY {
+    DRIVER_INFO Info;               /* С хешем, посчитанным при появлении модуля */
+    ULONG       AddedGeneration;    /* Поколение, в котором модуль появился */
+    ULONG       RemovedGeneration;  /* Поколение выгрузки, 0 — модуль загружен */
+    BOOLEAN     Seen;               /* Найден при текущем обходе */
+} MODULE_ENTRY, *PMODULE_ENTRY;
+
+/*
+ * Таблица загруженных модулей с номером поколения набора.
+ * Поколение растёт на каждое обнаруженное изменение (загрузку или выгрузку).
+ */
+typedef struct _MODULE_TABLE {
+    KMUTEX        Lock;             /* PASSIVE: внутри ZwQuerySystemInformation и хеширование */
+    PMODULE_ENTRY Entries;          /* Живые записи и надгробия (PagedPool) */
+    ULONG         Count;
+    ULONG         Capacity;
+    ULONG         LoadedCount;      /* Загружено модулей при последнем обходе */
+    ULONG         Generation;       /* Текущее поколение, 0 — таблица ещё не строилась */
+    ULONG         OldestGeneration; /* Дельта доступна только от этого поколения */
+    ULONG         QuerySize;        /* Размер списка модулей при последнем обходе */
+    volatile LONG Dirty;            /* С последнего обхода загрузился образ ядра */
+    BOOLEAN       NotifyRegistered; /* Уведомление о загрузке образов зарегистрировано */
+} MODULE_TABLE, *PMODULE_TABLE;
+
+/*
+ * ModuleTableInit — пустая таблица и уведомление о загрузке образов.
+ * Таблица строится при первом запросе. IRQL: PASSIVE_LEVEL.
+ */
+VOID ModuleTableInit(_Out_ PMODULE_TABLE Table);
+
+/* ModuleTableFree — снять уведомление и освободить записи. IRQL: PASSIVE_LEVEL. */
+VOID ModuleTableFree(_Inout_ PMODULE_TABLE Table);
+
+/*
+ * ModuleTableQueryDelta — изменения набора загруженных модулей
+ * после поколения Since (IOCTL_PROCMON_GET_LOADED_DRIVERS_DELTA).
+ * Если ответ не помещается в OutputLength, заполняется только заголовок
+ * с RequiredLength и возвращается STATUS_BUFFER_OVERFLOW.
+ * IRQL: PASSIVE_LEVEL.
+ */
+NTSTATUS ModuleTableQueryDelta(
+    _Inout_ PMODULE_TABLE Table,
+    _In_ ULONG Since,
+    _Out_writes_bytes_(OutputLength) PDRIVER_DELTA_RESPONSE Output,
+    _In_ ULONG OutputLength,
+    _Out_ PULONG BytesReturned
+);
+
 #endif /* PROCMON_ENUM_DRIVERS_H */
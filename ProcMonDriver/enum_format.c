@@ -0,0 +1,241 @@
+/*
+ * enum_format.c — Упаковка перечислений в формат v2 (таблица строк).
+ *
+ * Строка режется на общую часть и остаток по последнему разделителю
+ * поля (каталог пути, префикс Hardware ID), и каждый кусок ищется в
+ * таблице поиска по хешу FNV-1a. Найденный кусок не пишется второй раз.
+ * Когда таблица поиска заполнена на три четверти, новые куски пишутся
+ * без запоминания: ответ остаётся верным, только перестаёт сжиматься.
+ */
+
+#include "driver.h"
+#include "enum_format.h"
+
+/* Разделители, после которых начинается остаток строки */
+#define ENUM_SPLIT_PATH  "\\"
+#define ENUM_SPLIT_HWID  "\\&"
+
+/* Длина строки поля, не дальше MaxLength */
+static ULONG EnumFieldLength(_In_reads_(MaxLength) const CHAR *Field, _In_ ULONG MaxLength)
+{
+    ULONG length = 0;
+
+    while (length < MaxLength && Field[length] != '\0') {
+        length++;
+    }
+
+    return length;
+}
+
+/* EnumAddPiece — смещение куска в таблице строк (добавить, если его там нет) */
+static ULONG EnumAddPiece(_Inout_ PENUM_ENCODER Encoder, _In_reads_(Length) const CHAR *Data,
+                          _In_ ULONG Length)
+{
+    PENUM_STRING_SLOT slot;
+    ULONG             hash = 2166136261u;
+    ULONG             index;
+    ULONG             offset;
+    USHORT            tag;
+    ULONG             i;
+
+    if (Length == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < Length; i++) {
+        hash = (hash ^ (UCHAR)Data[i]) * 16777619u;
+    }
+
+    tag = (USHORT)(hash >> 16);
+    index = hash & (ENUM_STRING_SLOTS - 1);
+
+    for (;;) {
+        slot = &Encoder->Slots[index];
+
+        if (slot->Length == 0) {
+            break;
+        }
+
+        if (slot->Length == Length && slot->Tag == tag &&
+            RtlEqualMemory(Encoder->Strings + slot->Offset, Data, Length)) {
+            return slot->Offset;
+        }
+
+        index = (index + 1) & (ENUM_STRING_SLOTS - 1);
+    }
+
+    offset = Encoder->StringsLength;
+    RtlCopyMemory(Encoder->Strings + offset, Data, Length);
+    Encoder->StringsLength += Length;
+
+    if (Encoder->SlotsUsed < ENUM_STRING_SLOTS / 4 * 3) {
+        slot->Offset = offset;
+        slot->Length = (USHORT)Length;
+        slot->Tag = tag;
+        Encoder->SlotsUsed++;
+    }
+
+    return offset;
+}
+
+/*
+ * EnumAddString — поле в таблицу строк. Separators — после последнего
+ * из них начинается остаток (NULL — строка хранится одним куском).
+ */
+static VOID EnumAddString(
+    _Inout_ PENUM_ENCODER Encoder,
+    _In_reads_(MaxLength) const CHAR *Field,
+    _In_ ULONG MaxLength,
+    _In_opt_ const CHAR *Separators,
+    _Out_ PPROCMON_STRING_REF Ref)
+{
+    ULONG       length = EnumFieldLength(Field, MaxLength);
+    ULONG       split = 0;
+    ULONG       i;
+    const CHAR *sep;
+
+    if (Separators != NULL) {
+        for (i = 0; i < length; i++) {
+            for (sep = Separators; *sep != '\0'; sep++) {
+                if (Field[i] == *sep) {
+                    split = i + 1;
+                }
+            }
+        }
+    }
+
+    /* Разделитель в конце — остатка нет, храним целиком */
+    if (split == length) {
+        split = 0;
+    }
+
+    Ref->PrefixLength = (USHORT)split;
+    Ref->PrefixOffset = EnumAddPiece(Encoder, Field, split);
+    Ref->Length = (USHORT)(length - split);
+    Ref->Offset = EnumAddPiece(Encoder, Field + split, length - split);
+}
+
+NTSTATUS EnumEncoderInit(
+    _Out_ PENUM_ENCODER Encoder,
+    _In_ BOOLEAN Devices,
+    _Out_writes_bytes_(OutputLength) PVOID Output,
+    _In_ ULONG OutputLength)
+{
+    RtlZeroMemory(Encoder, sizeof(ENUM_ENCODER));
+
+    Encoder->Output = (PUCHAR)Output;
+    Encoder->OutputLength = OutputLength;
+    Encoder->Devices = Devices;
+
+    Encoder->Strings = (PUCHAR)ExAllocatePoolWithTag(PagedPool, OutputLength, POOL_TAG);
+    Encoder->Slots = (PENUM_STRING_SLOT)ExAllocatePoolWithTag(
+        PagedPool, ENUM_STRING_SLOTS * sizeof(ENUM_STRING_SLOT), POOL_TAG);
+
+    if (Encoder->Strings == NULL || Encoder->Slots == NULL) {
+        EnumEncoderFree(Encoder);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(Encoder->Slots, ENUM_STRING_SLOTS * sizeof(ENUM_STRING_SLOT));
+
+    return STATUS_SUCCESS;
+}
+
+ULONG EnumEncodeEntries(_Inout_ PVOID Context, _In_ const UCHAR *Entries, _In_ ULONG Count)
+{
+    PENUM_ENCODER      Encoder = (PENUM_ENCODER)Context;
+    const DRIVER_INFO *driver;
+    const DEVICE_INFO *device;
+    PDRIVER_RECORD_V2  driverRecord;
+    PDEVICE_RECORD_V2  deviceRecord;
+    ULONG              worst;
+    ULONG              i;
+
+    for (i = 0; i < Count; i++) {
+        /* Записи обоих видов по 64 байта, см. C_ASSERT в shared.h */
+        if (Encoder->Devices) {
+            device = (const DEVICE_INFO *)Entries + i;
+            worst = EnumFieldLength(device->DeviceName, PROCMON_MAX_IMAGE_NAME) +
+                    EnumFieldLength(device->InstanceId, PROCMON_MAX_IMAGE_NAME) +
+                    EnumFieldLength(device->HardwareId, PROCMON_MAX_HWID) +
+                    EnumFieldLength(device->SerialNumber, PROCMON_MAX_SERIAL) +
+                    EnumFieldLength(device->Service, PROCMON_MAX_IMAGE_NAME);
+        } else {
+            driver = (const DRIVER_INFO *)Entries + i;
+            worst = EnumFieldLength(driver->DriverName, PROCMON_MAX_IMAGE_NAME) +
+                    EnumFieldLength(driver->ImagePath, PROCMON_MAX_DRIVER_PATH);
+        }
+
+        if (ENUM_V2_HEADER_SIZE + (Encoder->RecordCount + 1) * sizeof(DRIVER_RECORD_V2) +
+            Encoder->StringsLength + worst > Encoder->OutputLength) {
+            break;
+        }
+
+        if (Encoder->Devices) {
+            deviceRecord = (PDEVICE_RECORD_V2)(Encoder->Output + ENUM_V2_HEADER_SIZE) +
+                           Encoder->RecordCount;
+            RtlZeroMemory(deviceRecord, sizeof(DEVICE_RECORD_V2));
+
+            EnumAddString(Encoder, device->DeviceName, PROCMON_MAX_IMAGE_NAME, NULL,
+                          &deviceRecord->DeviceName);
+            EnumAddString(Encoder, device->InstanceId, PROCMON_MAX_IMAGE_NAME, ENUM_SPLIT_PATH,
+                          &deviceRecord->InstanceId);
+            EnumAddString(Encoder, device->HardwareId, PROCMON_MAX_HWID, ENUM_SPLIT_HWID,
+                          &deviceRecord->HardwareId);
+            EnumAddString(Encoder, device->SerialNumber, PROCMON_MAX_SERIAL, NULL,
+                          &deviceRecord->SerialNumber);
+            EnumAddString(Encoder, device->Service, PROCMON_MAX_IMAGE_NAME, NULL,
+                          &deviceRecord->Service);
+        } else {
+            driverRecord = (PDRIVER_RECORD_V2)(Encoder->Output + ENUM_V2_HEADER_SIZE) +
+                           Encoder->RecordCount;
+            RtlZeroMemory(driverRecord, sizeof(DRIVER_RECORD_V2));
+
+            driverRecord->BaseAddress = driver->BaseAddress;
+            driverRecord->ImageSize = driver->ImageSize;
+            driverRecord->StartType = driver->StartType;
+            RtlCopyMemory(driverRecord->FileHash, driver->FileHash, PROCMON_HASH_SIZE);
+            driverRecord->HashValid = driver->HashValid;
+
+            EnumAddString(Encoder, driver->DriverName, PROCMON_MAX_IMAGE_NAME, NULL,
+                          &driverRecord->DriverName);
+            EnumAddString(Encoder, driver->ImagePath, PROCMON_MAX_DRIVER_PATH, ENUM_SPLIT_PATH,
+                          &driverRecord->ImagePath);
+        }
+
+        Encoder->RecordCount++;
+    }
+
+    return i;
+}
+
+ULONG EnumEncoderFinish(_Inout_ PENUM_ENCODER Encoder)
+{
+    PDRIVER_INFO_RESPONSE_V2 response = (PDRIVER_INFO_RESPONSE_V2)Encoder->Output;
+    ULONG                    stringsOffset;
+
+    stringsOffset = ENUM_V2_HEADER_SIZE + Encoder->RecordCount * sizeof(DRIVER_RECORD_V2);
+
+    RtlCopyMemory(Encoder->Output + stringsOffset, Encoder->Strings, Encoder->StringsLength);
+
+    response->Version = PROCMON_ENUM_FORMAT_V2;
+    response->ReturnedCount = Encoder->RecordCount;
+    response->Reserved = 0;
+    response->StringsOffset = stringsOffset;
+    response->StringsLength = Encoder->StringsLength;
+
+    return stringsOffset + Encoder->StringsLength;
+}
+
+VOID EnumEncoderFree(_Inout_ PENUM_ENCODER Encoder)
+{
+    if (Encoder->Strings != NULL) {
+        ExFreePoolWithTag(Encoder->Strings, POOL_TAG);
+        Encoder->Strings = NULL;
+    }
+
+    if (Encoder->Slots != NULL) {
+        ExFreePoolWithTag(Encoder->Slots, POOL_TAG);
+        Encoder->Slots = NULL;
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef PROCMON_ENUM_FORMAT_H
+#define PROCMON_ENUM_FORMAT_H
+
+/*
+ * enum_format.h — Упаковка перечислений в формат v2 (таблица строк).
+ *
+ * Записи снимка (DRIVER_INFO, DEVICE_INFO) превращаются в записи
+ * фиксированного размера со ссылками в общую таблицу строк ответа
+ * (формат описан у PROCMON_STRING_REF в shared.h). Повторяющиеся куски
+ * строк находятся по хеш-таблице и хранятся один раз.
+ */
+
+#include <ntddk.h>
+#include "../common/shared.h"
+
+/* Слотов в таблице поиска кусков (степень двойки) */
+#define ENUM_STRING_SLOTS  8192
+
+/* Слот таблицы поиска: кусок в таблице строк */
+typedef struct _ENUM_STRING_SLOT {
+    ULONG  Offset;
+    USHORT Length;   /* 0 — слот пуст */
+    USHORT Tag;      /* Старшие биты хеша: отсеивают несовпадения без сравнения */
+} ENUM_STRING_SLOT, *PENUM_STRING_SLOT;
+
+/*
+ * Состояние упаковки одной страницы. Таблица строк копится отдельно
+ * и ставится за записями в EnumEncoderFinish, когда число записей известно.
+ */
+typedef struct _ENUM_ENCODER {
+    PUCHAR            Output;         /* Ответ (DRIVER_INFO_RESPONSE_V2 / DEVICE_INFO_RESPONSE_V2) */
+    ULONG             OutputLength;
+    BOOLEAN           Devices;        /* Записи — устройства (иначе драйверы) */
+    ULONG             RecordCount;    /* Записей уже в ответе */
+    PUCHAR            Strings;        /* Таблица строк (PagedPool, OutputLength байт) */
+    ULONG             StringsLength;
+    PENUM_STRING_SLOT Slots;          /* ENUM_STRING_SLOTS слотов (PagedPool) */
+    ULONG             SlotsUsed;
+} ENUM_ENCODER, *PENUM_ENCODER;
+
+/* Заголовок ответа v2 до массива записей (одинаков у драйверов и устройств) */
+#define ENUM_V2_HEADER_SIZE  ((ULONG)FIELD_OFFSET(DRIVER_INFO_RESPONSE_V2, Drivers))
+
+/*
+ * EnumEncoderInit — подготовить упаковку в Output длиной OutputLength
+ * (не меньше ENUM_V2_HEADER_SIZE). IRQL: PASSIVE_LEVEL.
+ */
+NTSTATUS EnumEncoderInit(
+    _Out_ PENUM_ENCODER Encoder,
+    _In_ BOOLEAN Devices,
+    _Out_writes_bytes_(OutputLength) PVOID Output,
+    _In_ ULONG OutputLength
+);
+
+/*
+ * EnumEncodeEntries — PSNAPSHOT_ENCODE: добавить записи по порядку,
+ * пока помещаются. Запись берётся, только если поместится даже без
+ * совпадений строк, поэтому откатывать ничего не приходится.
+ */
+ULONG EnumEncodeEntries(_Inout_ PVOID Context, _In_ const UCHAR *Entries, _In_ ULONG Count);
+
+/*
+ * EnumEncoderFinish — поставить таблицу строк за записями и заполнить
+ * Version, ReturnedCount, StringsOffset, StringsLength. Возвращает размер ответа.
+ */
+ULONG EnumEncoderFinish(_Inout_ PENUM_ENCODER Encoder);
+
+/* EnumEncoderFree — освободить таблицу строк и слоты. */
+VOID EnumEncoderFree(_Inout_ PENUM_ENCODER Encoder);
+
+#endif /* PROCMON_ENUM_FORMAT_H */
@@ -1,17 +1,24 @@
 /*
- * hash.c — Самодостаточная реализация MD5 (RFC 1321) для kernel mode.
+ * hash.c — Самодостаточная реализация MD5 (RFC 1321) для kernel mode
+ * и хеширование файлов выбранным алгоритмом (MD5 или SHA-256, sha256.c).
  *
  * Не зависит от CRT, CNG или BCrypt.
  * Используется для вычисления контрольных сумм исполняемых файлов.
  */
 
 #include "hash.h"
+#include "stats.h"
+#include "hash_cache.h"
+#include "tree_cache.h"
 
 /* Максимальный размер файла для хеширования (4 MB) */
 #define HASH_MAX_FILE_SIZE  (4 * 1024 * 1024)
 
-/* Размер блока чтения */
-#define HASH_READ_BLOCK     4096
+/*
+ * Размер блока чтения, когда файл не удаётся отобразить: 4 MB — это
+ * 16 вызовов ZwReadFile вместо 1024 при блоке в 4 KB.
+ */
+#define HASH_READ_BLOCK     (256 * 1024)
 
 /* Pool tag */
 #define HASH_POOL_TAG       'hsaH'
@@ -46,15 +53,6 @@
     (a) += (b); \
 }
 
-/* Декодировать 4 байта (little-endian) в ULONG */
-static __inline ULONG Decode32(const UCHAR *input)
-{
-    return ((ULONG)input[0])
-         | ((ULONG)input[1] << 8)
-         | ((ULONG)input[2] << 16)
-         | ((ULONG)input[3] << 24);
-}
-
 /* Закодировать ULONG в 4 байта (little-endian) */
 static __inline void Encode32(UCHAR *output, ULONG input)
 {
@@ -72,11 +70,9 @@ static void Md5Transform(ULONG state[4], const UCHAR block[64])
 {
     ULONG a = state[0], b = state[1], c = state[2], d = state[3];
     ULONG x[16];
-    ULONG i;
 
-    for (i = 0; i < 16; i++) {
-        x[i] = Decode32(block + i * 4);
-    }
+    /* Слова MD5 — little-endian, как и x64 (другой драйвер не собирается): побайтовая сборка не нужна */
+    RtlCopyMemory(x, block, sizeof(x));
 
     /* Round 1 */
     FF(a, b, c, d, x[ 0],  7, 0xd76aa478);
@@ -238,65 +234,270 @@ VOID Md5Final(MD5_CTX *ctx, UCHAR digest[16])
     RtlZeroMemory(ctx, sizeof(MD5_CTX));
 }
 
+/* --- Описатели алгоритмов --- */
+
+static VOID HashMd5Init(PHASH_CONTEXT Context)
+{
+    Md5Init(&Context->Md5);
+}
+
+static VOID HashMd5Update(PHASH_CONTEXT Context, const UCHAR *Data, ULONG Length)
+{
+    Md5Update(&Context->Md5, Data, Length);
+}
+
+static VOID HashMd5Final(PHASH_CONTEXT Context, UCHAR *Digest)
+{
+    Md5Final(&Context->Md5, Digest);
+}
+
+static VOID HashSha256Init(PHASH_CONTEXT Context)
+{
+    Sha256Init(&Context->Sha256);
+}
+
+static VOID HashSha256Update(PHASH_CONTEXT Context, const UCHAR *Data, ULONG Length)
+{
+    Sha256Update(&Context->Sha256, Data, Length);
+}
+
+static VOID HashSha256Final(PHASH_CONTEXT Context, UCHAR *Digest)
+{
+    Sha256Final(&Context->Sha256, Digest);
+}
+
+const HASH_ALGORITHM g_HashMd5 = {
+    PROCMON_HASH_MD5, PROCMON_HASH_SIZE, 0,
+    HashMd5Init, HashMd5Update, HashMd5Final, 0
+};
+
+const HASH_ALGORITHM g_HashSha256 = {
+    PROCMON_HASH_SHA256, PROCMON_SHA256_SIZE, PROCMON_EVENT_FLAG_HASH_SHA256,
+    HashSha256Init, HashSha256Update, HashSha256Final, 0
+};
+
+/* Хеш-деревья тех же алгоритмов (Parameters\TreeHash) — только для образов */
+static const HASH_ALGORITHM g_HashMd5Tree = {
+    PROCMON_HASH_MD5 | PROCMON_HASH_TREE, PROCMON_HASH_SIZE, PROCMON_EVENT_FLAG_HASH_TREE,
+    HashMd5Init, HashMd5Update, HashMd5Final, PROCMON_HASH_TREE_CHUNK
+};
+
+static const HASH_ALGORITHM g_HashSha256Tree = {
+    PROCMON_HASH_SHA256 | PROCMON_HASH_TREE, PROCMON_SHA256_SIZE,
+    PROCMON_EVENT_FLAG_HASH_SHA256 | PROCMON_EVENT_FLAG_HASH_TREE,
+    HashSha256Init, HashSha256Update, HashSha256Final, PROCMON_HASH_TREE_CHUNK
+};
+
 /*
- * ComputeFileHash — вычисляет MD5-хеш файла.
- *
- * FilePath — NT-путь к файлу (UNICODE_STRING).
- * Hash — буфер для 16-байтового MD5-дайджеста.
- *
- * Читает файл блоками по 4KB, до 4MB максимум.
- * Вызывать только на PASSIVE_LEVEL.
+ * MmMapViewInSystemSpaceEx отображает секцию со смещения; её нет в старых
+ * сборках ядра, поэтому она ищется при загрузке (HashSelectAlgorithm).
+ * Без неё хеш-дерево читается ZwReadFile.
+ */
+typedef NTSTATUS (NTAPI *HASH_MAP_VIEW_EX)(PVOID Section, PVOID *MappedBase, PSIZE_T ViewSize,
+                                           PLARGE_INTEGER SectionOffset, ULONG_PTR Flags);
+
+static HASH_MAP_VIEW_EX g_HashMapViewEx;
+
+#ifndef MM_SYSTEM_VIEW_EXCEPTIONS_FOR_INPAGE_ERRORS
+#define MM_SYSTEM_VIEW_EXCEPTIONS_FOR_INPAGE_ERRORS  0x1
+#endif
+
+PCHASH_ALGORITHM g_HashAlgorithm = &g_HashMd5;
+
+/* Реализация выбранного алгоритма (PROCMON_HASH_IMPL_*) */
+static ULONG g_HashImplementation = PROCMON_HASH_IMPL_SCALAR;
+
+VOID HashSelectAlgorithm(_In_ ULONG AlgorithmId, _In_ BOOLEAN Tree)
+{
+    UNICODE_STRING routine;
+
+    RtlInitUnicodeString(&routine, L"MmMapViewInSystemSpaceEx");
+    g_HashMapViewEx = (HASH_MAP_VIEW_EX)MmGetSystemRoutineAddress(&routine);
+
+    /* Перечисления драйверов хешируют MD5 пачками при любом алгоритме образов */
+    DbgPrint("[ProcMon] Пакетный MD5: каналов %lu\n", Md5MbSelectImplementation());
+
+    if (AlgorithmId == PROCMON_HASH_SHA256) {
+        g_HashImplementation = Sha256SelectImplementation();
+        g_HashAlgorithm = Tree ? &g_HashSha256Tree : &g_HashSha256;
+        DbgPrint("[ProcMon] Хеш образов: SHA-256 (%s)%s\n",
+                 (g_HashImplementation == PROCMON_HASH_IMPL_SHA_NI) ? "SHA-NI" : "без SHA-NI",
+                 Tree ? ", дерево" : "");
+        return;
+    }
+
+    if (AlgorithmId != PROCMON_HASH_MD5) {
+        DbgPrint("[ProcMon] Неизвестный HashAlgorithm=%lu, хеш образов: MD5\n", AlgorithmId);
+    }
+
+    g_HashImplementation = PROCMON_HASH_IMPL_SCALAR;
+    g_HashAlgorithm = Tree ? &g_HashMd5Tree : &g_HashMd5;
+
+    if (Tree) {
+        DbgPrint("[ProcMon] Хеш образов: MD5, дерево\n");
+    }
+}
+
+VOID HashQuery(_Inout_ PPROCMON_STATS Stats)
+{
+    Stats->HashAlgorithm = g_HashAlgorithm->Id;
+    Stats->HashImplementation = g_HashImplementation;
+}
+
+/* Отображение файла в системное пространство */
+typedef struct _HASH_VIEW {
+    HANDLE Section;
+    PVOID  SectionObject;
+    PVOID  Base;
+} HASH_VIEW, *PHASH_VIEW;
+
+/*
+ * HashCreateSection — секция только для чтения над первыми Length байт
+ * файла и ссылка на её объект, без отображения. При ошибке View пуст.
  */
-NTSTATUS ComputeFileHash(PCUNICODE_STRING FilePath, UCHAR Hash[16])
+static NTSTATUS HashCreateSection(_In_ HANDLE FileHandle, _In_ ULONG Length, _Out_ PHASH_VIEW View)
 {
     NTSTATUS          status;
-    HANDLE            fileHandle = NULL;
     OBJECT_ATTRIBUTES objAttr;
-    IO_STATUS_BLOCK   ioStatus;
-    UCHAR            *readBuffer = NULL;
-    MD5_CTX           ctx;
-    ULONG             totalRead = 0;
-    LARGE_INTEGER     byteOffset;
+    LARGE_INTEGER     sectionSize;
 
-    if (FilePath == NULL || FilePath->Length == 0) {
-        return STATUS_INVALID_PARAMETER;
+    RtlZeroMemory(View, sizeof(HASH_VIEW));
+    sectionSize.QuadPart = Length;
+
+    InitializeObjectAttributes(&objAttr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = ZwCreateSection(&View->Section, SECTION_MAP_READ | SECTION_QUERY, &objAttr,
+                             &sectionSize, PAGE_READONLY, SEC_COMMIT, FileHandle);
+    if (!NT_SUCCESS(status)) {
+        View->Section = NULL;
+        return status;
     }
 
-    InitializeObjectAttributes(&objAttr, (PUNICODE_STRING)FilePath,
-                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
-                               NULL, NULL);
+    status = ObReferenceObjectByHandle(View->Section, SECTION_MAP_READ, NULL, KernelMode,
+                                       &View->SectionObject, NULL);
+    if (!NT_SUCCESS(status)) {
+        View->SectionObject = NULL;
+        ZwClose(View->Section);
+        View->Section = NULL;
+    }
 
-    status = ZwCreateFile(
-        &fileHandle,
-        FILE_READ_DATA | SYNCHRONIZE,
-        &objAttr,
-        &ioStatus,
-        NULL,
-        FILE_ATTRIBUTE_NORMAL,
-        FILE_SHARE_READ | FILE_SHARE_DELETE,
-        FILE_OPEN,
-        FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE,
-        NULL, 0);
+    return status;
+}
+
+/* HashUnmapView — снять отображение и закрыть секцию (части пустого View пропускаются) */
+static VOID HashUnmapView(_Inout_ PHASH_VIEW View)
+{
+    if (View->Base != NULL) {
+        MmUnmapViewInSystemSpace(View->Base);
+    }
+    if (View->SectionObject != NULL) {
+        ObDereferenceObject(View->SectionObject);
+    }
+    if (View->Section != NULL) {
+        ZwClose(View->Section);
+    }
+    RtlZeroMemory(View, sizeof(HASH_VIEW));
+}
+
+/*
+ * HashMapView — отобразить первые Length байт файла секцией в системное
+ * пространство (как кольца в buffer.c). При ошибке View пуст.
+ */
+static NTSTATUS HashMapView(_In_ HANDLE FileHandle, _In_ ULONG Length, _Out_ PHASH_VIEW View)
+{
+    NTSTATUS status;
+    SIZE_T   viewSize = 0;
 
+    status = HashCreateSection(FileHandle, Length, View);
     if (!NT_SUCCESS(status)) {
         return status;
     }
 
+    status = MmMapViewInSystemSpace(View->SectionObject, &View->Base, &viewSize);
+    if (!NT_SUCCESS(status)) {
+        View->Base = NULL;
+        HashUnmapView(View);
+    }
+
+    return status;
+}
+
+/*
+ * HashMapped — хеш первых Length байт файла прямо из отображения.
+ *
+ * Algorithm->Update читает страницы кэша файла на месте: вместо сотен
+ * ZwReadFile — страничные ошибки, которые диспетчер памяти обслуживает
+ * кластерами упреждающего чтения, и ни одного копирования.
+ *
+ * FALSE — файл отобразить не удалось (размер изменился, ФС не
+ * поддерживает секции и т.п.), вызывающий читает его ZwReadFile.
+ * TRUE — хеш посчитан или чтение страницы не удалось (*Status).
+ */
+static BOOLEAN HashMapped(
+    _In_ HANDLE FileHandle,
+    _In_ ULONG Length,
+    _In_ PCHASH_ALGORITHM Algorithm,
+    _Out_writes_(Algorithm->DigestSize) UCHAR *Hash,
+    _Out_ PNTSTATUS Status)
+{
+    HASH_VIEW    view;
+    HASH_CONTEXT ctx;
+
+    if (!NT_SUCCESS(HashMapView(FileHandle, Length, &view))) {
+        return FALSE;
+    }
+
+    /* Ошибка чтения страницы (сеть, съёмный диск) приходит исключением */
+    __try {
+        Algorithm->Init(&ctx);
+        Algorithm->Update(&ctx, (const UCHAR *)view.Base, Length);
+        Algorithm->Final(&ctx, Hash);
+        *Status = STATUS_SUCCESS;
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        *Status = GetExceptionCode();
+    }
+
+    HashUnmapView(&view);
+    return TRUE;
+}
+
+/*
+ * HashRead — хеш файла чтением блоками по HASH_READ_BLOCK (до
+ * HASH_MAX_FILE_SIZE), когда отобразить файл нельзя.
+ */
+static NTSTATUS HashRead(_In_ HANDLE FileHandle, _In_ PCHASH_ALGORITHM Algorithm,
+                         _Out_writes_(Algorithm->DigestSize) UCHAR *Hash,
+                         _Out_ PULONG BytesRead)
+{
+    NTSTATUS        status = STATUS_SUCCESS;
+    IO_STATUS_BLOCK ioStatus;
+    UCHAR          *readBuffer;
+    HASH_CONTEXT    ctx;
+    ULONG           totalRead = 0;
+    ULONG           chunk;
+    LARGE_INTEGER   byteOffset;
+
+    *BytesRead = 0;
+
     readBuffer = (UCHAR *)ExAllocatePoolWithTag(PagedPool, HASH_READ_BLOCK, HASH_POOL_TAG);
     if (readBuffer == NULL) {
-        ZwClose(fileHandle);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
-    Md5Init(&ctx);
+    Algorithm->Init(&ctx);
     byteOffset.QuadPart = 0;
 
     while (totalRead < HASH_MAX_FILE_SIZE) {
+        chunk = HASH_MAX_FILE_SIZE - totalRead;
+        if (chunk > HASH_READ_BLOCK) {
+            chunk = HASH_READ_BLOCK;
+        }
+
         status = ZwReadFile(
-            fileHandle, NULL, NULL, NULL,
+            FileHandle, NULL, NULL, NULL,
             &ioStatus,
             readBuffer,
-            HASH_READ_BLOCK,
+            chunk,
             &byteOffset,
             NULL);
 
@@ -309,17 +510,988 @@ NTSTATUS ComputeFileHash(PCUNICODE_STRING FilePath, UCHAR Hash[16])
             break;
         }
 
-        Md5Update(&ctx, readBuffer, (ULONG)ioStatus.Information);
+        Algorithm->Update(&ctx, readBuffer, (ULONG)ioStatus.Information);
         totalRead += (ULONG)ioStatus.Information;
         byteOffset.QuadPart += ioStatus.Information;
     }
 
     if (NT_SUCCESS(status)) {
-        Md5Final(&ctx, Hash);
+        Algorithm->Final(&ctx, Hash);
     }
 
+    *BytesRead = totalRead;
+
     ExFreePoolWithTag(readBuffer, HASH_POOL_TAG);
+    return status;
+}
+
+/*
+ * === Параллельный обход ===
+ *
+ * Вызывающий поток и до g_HashThreads - 1 потоков пула берут части
+ * работы по Slice элементов (InterlockedExchangeAdd по Next) и считают
+ * каждую Routine. Так хешируются файлы пакета (ComputeFileHashBatch) и
+ * куски хеш-дерева одного файла. Пока один поток ждёт чтения страницы,
+ * остальные хешируют: очередь диска не пустеет, и заняты все процессоры.
+ *
+ * Пул создаётся один раз в HashBatchConfigure, потоки ждут на семафоре.
+ * Обход в пуле один: если пул уже занят (дерево большого файла и сверка
+ * кэша перечислений одновременно), вызывающий считает свой обход сам,
+ * не дожидаясь чужого.
+ */
+
+typedef VOID HASH_SLICE_ROUTINE(_In_ PVOID Context, _In_ ULONG First, _In_ ULONG Count);
+
+typedef struct _HASH_PARALLEL {
+    HASH_SLICE_ROUTINE *Routine;
+    PVOID               Context;
+    ULONG               Count;
+    ULONG               Slice;
+    volatile LONG       Next;     /* Первый элемент, который ещё никто не взял */
+    volatile LONG       Helpers;  /* Разбуженных потоков пула, ещё не вышедших из обхода */
+    KEVENT              Done;     /* Helpers стал нулём */
+} HASH_PARALLEL, *PHASH_PARALLEL;
+
+typedef struct _HASH_POOL {
+    HANDLE                  Threads[HASH_BATCH_MAX_THREADS];
+    ULONG                   ThreadCount;
+    KSEMAPHORE              Wake;     /* По одному освобождению на поток, позванный к обходу */
+    PHASH_PARALLEL volatile Work;     /* Текущий обход, NULL — пул свободен */
+    volatile LONG           Stop;     /* Просьба потокам завершиться */
+} HASH_POOL;
+
+static HASH_POOL g_HashPool;
+
+/* Потоков на обход, считая вызывающий */
+static ULONG g_HashThreads = 1;
+
+/* HashParallelWork — брать части, пока они есть */
+static VOID HashParallelWork(_Inout_ PHASH_PARALLEL Work)
+{
+    ULONG first;
+    ULONG count;
+
+    for (;;) {
+        first = (ULONG)InterlockedExchangeAdd(&Work->Next, (LONG)Work->Slice);
+        if (first >= Work->Count) {
+            break;
+        }
+
+        count = Work->Count - first;
+        if (count > Work->Slice) {
+            count = Work->Slice;
+        }
+
+        Work->Routine(Work->Context, first, count);
+    }
+}
+
+static VOID HashPoolThread(_In_ PVOID Context)
+{
+    PHASH_PARALLEL work;
+
+    UNREFERENCED_PARAMETER(Context);
+
+    for (;;) {
+        KeWaitForSingleObject(&g_HashPool.Wake, Executive, KernelMode, FALSE, NULL);
+
+        if (g_HashPool.Stop) {
+            break;
+        }
+
+        /* Семафор освобождён под обход, который ждёт этот поток, — Work уже задан */
+        work = g_HashPool.Work;
+        HashParallelWork(work);
+
+        if (InterlockedDecrement(&work->Helpers) == 0) {
+            KeSetEvent(&work->Done, IO_NO_INCREMENT, FALSE);
+        }
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+VOID HashBatchConfigure(_In_ ULONG Threads)
+{
+    NTSTATUS          status;
+    OBJECT_ATTRIBUTES objAttr;
+    ULONG             i;
+
+    if (Threads == 0) {
+        Threads = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    }
+    if (Threads > HASH_BATCH_MAX_THREADS) {
+        Threads = HASH_BATCH_MAX_THREADS;
+    }
+
+    RtlZeroMemory(&g_HashPool, sizeof(HASH_POOL));
+    KeInitializeSemaphore(&g_HashPool.Wake, 0, MAXLONG);
+
+    InitializeObjectAttributes(&objAttr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    /* Вызывающий обход — тоже поток, пулу нужно на один меньше */
+    for (i = 1; i < Threads; i++) {
+        status = PsCreateSystemThread(&g_HashPool.Threads[g_HashPool.ThreadCount], SYNCHRONIZE,
+                                      &objAttr, NULL, NULL, HashPoolThread, NULL);
+        if (!NT_SUCCESS(status)) {
+            /* Без потока — просто меньше параллельности */
+            DbgPrint("[ProcMon] PsCreateSystemThread для хеширования: 0x%08X\n", status);
+            break;
+        }
+        g_HashPool.ThreadCount++;
+    }
+
+    g_HashThreads = g_HashPool.ThreadCount + 1;
+    DbgPrint("[ProcMon] Параллельное хеширование: потоков %lu\n", g_HashThreads);
+}
+
+VOID HashBatchShutdown(VOID)
+{
+    ULONG i;
+
+    if (g_HashPool.ThreadCount == 0) {
+        return;
+    }
+
+    InterlockedExchange(&g_HashPool.Stop, 1);
+    KeReleaseSemaphore(&g_HashPool.Wake, IO_NO_INCREMENT, (LONG)g_HashPool.ThreadCount, FALSE);
+
+    for (i = 0; i < g_HashPool.ThreadCount; i++) {
+        ZwWaitForSingleObject(g_HashPool.Threads[i], FALSE, NULL);
+        ZwClose(g_HashPool.Threads[i]);
+        g_HashPool.Threads[i] = NULL;
+    }
+
+    g_HashPool.ThreadCount = 0;
+    g_HashThreads = 1;
+}
+
+/*
+ * HashParallel — Routine над элементами [0, Count) частями по Slice.
+ * Возвращается, когда посчитаны все части.
+ */
+static VOID HashParallel(
+    _In_ HASH_SLICE_ROUTINE *Routine,
+    _In_ PVOID Context,
+    _In_ ULONG Count,
+    _In_ ULONG Slice)
+{
+    HASH_PARALLEL work;
+    ULONG         helpers;
+
+    work.Routine = Routine;
+    work.Context = Context;
+    work.Count = Count;
+    work.Slice = Slice;
+    work.Next = 0;
+    work.Helpers = 0;
+
+    /* Потоков не больше, чем частей; вызывающий — один из них */
+    helpers = (Count + Slice - 1) / Slice;
+    if (helpers > g_HashThreads) {
+        helpers = g_HashThreads;
+    }
+    helpers = (helpers > 1) ? helpers - 1 : 0;
+
+    if (helpers != 0 &&
+        InterlockedCompareExchangePointer((PVOID volatile *)&g_HashPool.Work, &work, NULL) == NULL) {
+        KeInitializeEvent(&work.Done, NotificationEvent, FALSE);
+        work.Helpers = (LONG)helpers;
+        KeReleaseSemaphore(&g_HashPool.Wake, IO_NO_INCREMENT, (LONG)helpers, FALSE);
+    } else {
+        helpers = 0;
+    }
+
+    HashParallelWork(&work);
+
+    /* work на стеке: вернуться можно, только когда из обхода вышли все позванные потоки */
+    if (helpers != 0) {
+        KeWaitForSingleObject(&work.Done, Executive, KernelMode, FALSE, NULL);
+        InterlockedExchangePointer((PVOID volatile *)&g_HashPool.Work, NULL);
+    }
+}
+
+/*
+ * === Хеш-дерево ===
+ *
+ * Без дерева хешируются первые HASH_MAX_FILE_SIZE байт, и всё, что
+ * дописано после них, на хеш не влияет. Дерево хеширует файл целиком:
+ * куски по ChunkSize байт хешируются независимо, а корень — хеш
+ * дайджестов кусков подряд. Как в RFC 6962, лист и корень различаются
+ * первым байтом: лист — H(0x00 || кусок), корень — H(0x01 || дайджесты),
+ * и дайджесты кусков нельзя выдать за кусок файла. Куски отображённого файла считают потоки
+ * HashParallel, у MD5 — ещё и по каналам Md5MbTransform (куски одного
+ * файла — такие же независимые потоки данных, как файлы пакета).
+ *
+ * Файл не отображается целиком: у него одна секция, а каждый кусок
+ * получает свой вид (MmMapViewInSystemSpaceEx со смещением куска) и
+ * отпускает его сразу после хеширования. Системного адресного
+ * пространства занято не больше куска на канал каждого потока, сколько
+ * бы ни весил файл.
+ *
+ * Корень кэшируется, как любой хеш: у алгоритма-дерева свой Id
+ * (PROCMON_HASH_TREE), так что с плоским хешем он не смешивается.
+ * Дайджесты кусков отображённого файла запоминает tree_cache.c: после
+ * дописывания в конец пересчитываются только новые куски.
+ */
+
+/* Больше этого файл деревом не хешируется (STATUS_FILE_TOO_LARGE) */
+#define HASH_TREE_MAX_FILE_SIZE  (1024 * 1024 * 1024)
+
+/* Кусков в части параллельного обхода: по одному на канал */
+#define HASH_TREE_SLICE          MD5_MB_MAX_LANES
+
+typedef struct _HASH_TREE {
+    PCHASH_ALGORITHM Algorithm;
+    PVOID            Section;     /* Объект секции файла; куски отображаются по одному */
+    ULONG            Length;
+    ULONG            ChunkCount;
+    ULONG            First;       /* Куски до First взяты из кэша кусков */
+    PUCHAR           Digests;     /* ChunkCount дайджестов по DigestSize байт */
+    volatile LONG    Status;      /* Первая ошибка чтения страницы */
+} HASH_TREE, *PHASH_TREE;
+
+/* Длина куска Index (последний может быть неполным) */
+static ULONG HashTreeChunkLength(_In_ PHASH_TREE Tree, _In_ ULONG Index)
+{
+    ULONG offset = Index * Tree->Algorithm->ChunkSize;
+
+    return (Tree->Length - offset < Tree->Algorithm->ChunkSize) ?
+           Tree->Length - offset : Tree->Algorithm->ChunkSize;
+}
+
+/* HashTreeInit — начать хеш листа или корня: первым идёт байт-префикс */
+static VOID HashTreeInit(_In_ PCHASH_ALGORITHM Algorithm, _Out_ PHASH_CONTEXT Context,
+                         _In_ UCHAR Prefix)
+{
+    Algorithm->Init(Context);
+    Algorithm->Update(Context, &Prefix, 1);
+}
+
+/*
+ * HashTreeMapChunk — отобразить кусок Index в свой вид. Ошибка чтения
+ * страницы вида приходит исключением, а не остановом системы.
+ */
+static NTSTATUS HashTreeMapChunk(_Inout_ PHASH_TREE Tree, _In_ ULONG Index, _Out_ const UCHAR **Base)
+{
+    NTSTATUS      status;
+    LARGE_INTEGER offset;
+    SIZE_T        viewSize = HashTreeChunkLength(Tree, Index);
+    PVOID         base = NULL;
+
+    offset.QuadPart = (LONGLONG)Index * Tree->Algorithm->ChunkSize;
+    status = g_HashMapViewEx(Tree->Section, &base, &viewSize, &offset,
+                             MM_SYSTEM_VIEW_EXCEPTIONS_FOR_INPAGE_ERRORS);
+    if (!NT_SUCCESS(status)) {
+        InterlockedCompareExchange(&Tree->Status, status, STATUS_SUCCESS);
+        base = NULL;
+    }
+
+    *Base = (const UCHAR *)base;
+    return status;
+}
+
+/* HashTreeChunk — кусок Index обычным Update */
+static VOID HashTreeChunk(_Inout_ PHASH_TREE Tree, _In_ ULONG Index)
+{
+    PCHASH_ALGORITHM algorithm = Tree->Algorithm;
+    HASH_CONTEXT     ctx;
+    const UCHAR     *base;
+
+    if (!NT_SUCCESS(HashTreeMapChunk(Tree, Index, &base))) {
+        return;
+    }
+
+    __try {
+        HashTreeInit(algorithm, &ctx, PROCMON_HASH_TREE_LEAF);
+        algorithm->Update(&ctx, base, HashTreeChunkLength(Tree, Index));
+        algorithm->Final(&ctx, Tree->Digests + (SIZE_T)Index * algorithm->DigestSize);
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        InterlockedCompareExchange(&Tree->Status, GetExceptionCode(), STATUS_SUCCESS);
+    }
+
+    MmUnmapViewInSystemSpace((PVOID)base);
+}
+
+/*
+ * HashTreeChunksMd5 — целые куски [First, First + Count) по каналам
+ * Md5MbTransform, по числу каналов за проход; у каждого куска прохода
+ * свой вид. Префикс листа сдвигает кусок на байт: первый блок (префикс
+ * и 63 байта куска) и последний байт считает Md5Update, а блоки между
+ * ними — каналы.
+ */
+static VOID HashTreeChunksMd5(_Inout_ PHASH_TREE Tree, _In_ ULONG First, _In_ ULONG Count)
+{
+    static const UCHAR leaf = PROCMON_HASH_TREE_LEAF;
+    const UCHAR *views[MD5_MB_MAX_LANES];
+    const UCHAR *data[MD5_MB_MAX_LANES];
+    MD5_MB_STATE state;
+    MD5_CTX      ctx;
+    NTSTATUS     status = STATUS_SUCCESS;
+    ULONG        chunkSize = Tree->Algorithm->ChunkSize;
+    ULONG        lanes = Md5MbLaneCount();
+    ULONG        mapped;
+    ULONG        done;
+    ULONG        n;
+    ULONG        i;
+
+    for (done = 0; done < Count; done += n) {
+        n = (Count - done < lanes) ? Count - done : lanes;
+
+        for (mapped = 0; mapped < n; mapped++) {
+            status = HashTreeMapChunk(Tree, First + done + mapped, &views[mapped]);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+        }
+
+        /* Первый блок; лишние каналы считают впустую по первому куску прохода */
+        if (NT_SUCCESS(status)) {
+            __try {
+                for (i = 0; i < MD5_MB_MAX_LANES; i++) {
+                    data[i] = views[(i < n) ? i : 0] + 63;
+                    Md5MbInitLane(&state, i);
+                    if (i < n) {
+                        Md5Init(&ctx);
+                        Md5Update(&ctx, &leaf, 1);
+                        Md5Update(&ctx, views[i], 63);
+                        state.State[0][i] = ctx.State[0];
+                        state.State[1][i] = ctx.State[1];
+                        state.State[2][i] = ctx.State[2];
+                        state.State[3][i] = ctx.State[3];
+                    }
+                }
+            } __except (EXCEPTION_EXECUTE_HANDLER) {
+                status = GetExceptionCode();
+            }
+        }
+
+        if (NT_SUCCESS(status)) {
+            status = Md5MbTransform(&state, data, chunkSize / 64 - 1);
+        }
+
+        /* Последний байт куска и дополнение */
+        if (NT_SUCCESS(status)) {
+            __try {
+                for (i = 0; i < n; i++) {
+                    ctx.State[0] = state.State[0][i];
+                    ctx.State[1] = state.State[1][i];
+                    ctx.State[2] = state.State[2][i];
+                    ctx.State[3] = state.State[3][i];
+                    ctx.Count = chunkSize;
+                    Md5Update(&ctx, views[i] + chunkSize - 1, 1);
+                    Md5Final(&ctx, Tree->Digests + (SIZE_T)(First + done + i) * PROCMON_HASH_SIZE);
+                }
+            } __except (EXCEPTION_EXECUTE_HANDLER) {
+                status = GetExceptionCode();
+            }
+        }
+
+        if (!NT_SUCCESS(status)) {
+            InterlockedCompareExchange(&Tree->Status, status, STATUS_SUCCESS);
+        }
+
+        for (i = 0; i < mapped; i++) {
+            MmUnmapViewInSystemSpace((PVOID)views[i]);
+        }
+
+        if (!NT_SUCCESS(status)) {
+            return;
+        }
+    }
+}
+
+/* HashTreeSlice — часть кусков для HashParallel (номера — от Tree->First) */
+static VOID HashTreeSlice(_In_ PVOID Context, _In_ ULONG First, _In_ ULONG Count)
+{
+    PHASH_TREE Tree = (PHASH_TREE)Context;
+    ULONG      i;
+
+    if (Tree->Status != STATUS_SUCCESS) {
+        return;
+    }
+
+    First += Tree->First;
+
+    /* Неполный последний кусок каналам не отдаётся */
+    if ((Tree->Algorithm->Id & PROCMON_HASH_ID_MASK) == PROCMON_HASH_MD5) {
+        if (First + Count == Tree->ChunkCount &&
+            HashTreeChunkLength(Tree, Tree->ChunkCount - 1) != Tree->Algorithm->ChunkSize) {
+            Count--;
+            HashTreeChunk(Tree, First + Count);
+        }
+        HashTreeChunksMd5(Tree, First, Count);
+        return;
+    }
+
+    for (i = 0; i < Count; i++) {
+        HashTreeChunk(Tree, First + i);
+    }
+}
+
+/*
+ * HashTreeMapped — дерево файла длиной Length из отображения, по виду на кусок.
+ * Возвращает FALSE, если отобразить файл не удалось (как HashMapped).
+ * *BytesRead — сколько байт хешировано (без кусков из кэша).
+ */
+static BOOLEAN HashTreeMapped(
+    _In_ HANDLE FileHandle,
+    _In_ ULONG Length,
+    _In_ PCHASH_ALGORITHM Algorithm,
+    _Out_writes_(Algorithm->DigestSize) UCHAR *Hash,
+    _Out_ PNTSTATUS Status,
+    _Out_ PULONG BytesRead)
+{
+    HASH_VIEW       view;
+    HASH_TREE       tree;
+    HASH_CONTEXT    ctx;
+    TREE_CACHE_FILE file;
+    BOOLEAN         cacheable = FALSE;
+
+    *BytesRead = 0;
+
+    if (g_HashMapViewEx == NULL || !NT_SUCCESS(HashCreateSection(FileHandle, Length, &view))) {
+        return FALSE;
+    }
+
+    tree.Algorithm = Algorithm;
+    tree.Section = view.SectionObject;
+    tree.Length = Length;
+    tree.ChunkCount = (Length + Algorithm->ChunkSize - 1) / Algorithm->ChunkSize;
+    tree.First = 0;
+    tree.Status = STATUS_SUCCESS;
+    tree.Digests = (PUCHAR)ExAllocatePoolWithTag(PagedPool,
+                                                 (SIZE_T)tree.ChunkCount * Algorithm->DigestSize,
+                                                 HASH_POOL_TAG);
+    if (tree.Digests == NULL) {
+        HashUnmapView(&view);
+        *Status = STATUS_INSUFFICIENT_RESOURCES;
+        return TRUE;
+    }
+
+    /* Файл в один кусок дешевле перечитать, чем сверять журнал */
+    if (tree.ChunkCount > 1) {
+        cacheable = TreeCacheLookup(FileHandle, Algorithm, Length, &file, tree.Digests,
+                                    &tree.First);
+    }
+
+    HashParallel(HashTreeSlice, &tree, tree.ChunkCount - tree.First, HASH_TREE_SLICE);
+
+    *Status = tree.Status;
+    if (NT_SUCCESS(*Status)) {
+        HashTreeInit(Algorithm, &ctx, PROCMON_HASH_TREE_NODE);
+        Algorithm->Update(&ctx, tree.Digests, tree.ChunkCount * Algorithm->DigestSize);
+        Algorithm->Final(&ctx, Hash);
+
+        *BytesRead = (tree.First == tree.ChunkCount) ? 0 :
+                     Length - tree.First * Algorithm->ChunkSize;
+        if (cacheable) {
+            TreeCacheInsert(&file, Algorithm, Length, tree.Digests);
+        }
+    }
+
+    ExFreePoolWithTag(tree.Digests, HASH_POOL_TAG);
+    HashUnmapView(&view);
+    return TRUE;
+}
+
+/*
+ * HashTreeRead — то же дерево чтением блоками по HASH_READ_BLOCK, когда
+ * отобразить файл нельзя: куски идут по порядку, и дайджест каждого сразу
+ * уходит в корень. Чтение может вернуть меньше блока (сетевые ФС, фильтры),
+ * поэтому прочитанное режется по границам кусков, а не по границам чтений.
+ */
+static NTSTATUS HashTreeRead(_In_ HANDLE FileHandle, _In_ PCHASH_ALGORITHM Algorithm,
+                             _Out_writes_(Algorithm->DigestSize) UCHAR *Hash,
+                             _Out_ PULONG BytesRead)
+{
+    NTSTATUS        status = STATUS_SUCCESS;
+    IO_STATUS_BLOCK ioStatus;
+    UCHAR          *readBuffer;
+    HASH_CONTEXT    root;
+    HASH_CONTEXT    chunk;
+    UCHAR           digest[PROCMON_HASH_MAX_SIZE];
+    const UCHAR    *data;
+    ULONG           length;
+    ULONG           part;
+    ULONG           totalRead = 0;
+    ULONG           inChunk = 0;
+    LARGE_INTEGER   byteOffset;
+
+    *BytesRead = 0;
+
+    readBuffer = (UCHAR *)ExAllocatePoolWithTag(PagedPool, HASH_READ_BLOCK, HASH_POOL_TAG);
+    if (readBuffer == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    HashTreeInit(Algorithm, &root, PROCMON_HASH_TREE_NODE);
+    byteOffset.QuadPart = 0;
+
+    for (;;) {
+        status = ZwReadFile(
+            FileHandle, NULL, NULL, NULL,
+            &ioStatus,
+            readBuffer,
+            HASH_READ_BLOCK,
+            &byteOffset,
+            NULL);
+
+        if (status == STATUS_END_OF_FILE || ioStatus.Information == 0) {
+            status = STATUS_SUCCESS;
+            break;
+        }
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        /*
+         * Файл ровно в HASH_TREE_MAX_FILE_SIZE законен: ошибка, только если
+         * за пределом нашлись данные (файл вырос после проверки размера, и
+         * хеш не был бы хешем всего файла).
+         */
+        if (ioStatus.Information > HASH_TREE_MAX_FILE_SIZE - totalRead) {
+            status = STATUS_FILE_TOO_LARGE;
+            break;
+        }
+
+        data = readBuffer;
+        length = (ULONG)ioStatus.Information;
+        totalRead += length;
+        byteOffset.QuadPart += length;
+
+        /* До конца куска, остаток — в следующий */
+        while (length != 0) {
+            if (inChunk == 0) {
+                HashTreeInit(Algorithm, &chunk, PROCMON_HASH_TREE_LEAF);
+            }
+
+            part = Algorithm->ChunkSize - inChunk;
+            if (part > length) {
+                part = length;
+            }
+
+            Algorithm->Update(&chunk, data, part);
+            inChunk += part;
+            data += part;
+            length -= part;
+
+            if (inChunk == Algorithm->ChunkSize) {
+                Algorithm->Final(&chunk, digest);
+                Algorithm->Update(&root, digest, Algorithm->DigestSize);
+                inChunk = 0;
+            }
+        }
+    }
+
+    if (NT_SUCCESS(status)) {
+        if (inChunk != 0) {
+            Algorithm->Final(&chunk, digest);
+            Algorithm->Update(&root, digest, Algorithm->DigestSize);
+        }
+        Algorithm->Final(&root, Hash);
+    }
+
+    *BytesRead = totalRead;
+
+    ExFreePoolWithTag(readBuffer, HASH_POOL_TAG);
+    return status;
+}
+
+/*
+ * HashTreeFile — хеш-дерево файла размером FileSize.
+ * Файл больше HASH_TREE_MAX_FILE_SIZE — ошибка, а не хеш его начала.
+ */
+static NTSTATUS HashTreeFile(
+    _In_ HANDLE FileHandle,
+    _In_ LONGLONG FileSize,
+    _In_ PCHASH_ALGORITHM Algorithm,
+    _Out_writes_(Algorithm->DigestSize) UCHAR *Hash,
+    _Out_ PULONG BytesRead)
+{
+    NTSTATUS status;
+
+    *BytesRead = 0;
+
+    if (FileSize > HASH_TREE_MAX_FILE_SIZE) {
+        return STATUS_FILE_TOO_LARGE;
+    }
+
+    if (FileSize != 0 &&
+        HashTreeMapped(FileHandle, (ULONG)FileSize, Algorithm, Hash, &status, BytesRead)) {
+        return status;
+    }
+
+    return HashTreeRead(FileHandle, Algorithm, Hash, BytesRead);
+}
+
+/*
+ * HashOpenFile — открыть файл для чтения данных (для хеширования).
+ */
+static NTSTATUS HashOpenFile(_In_ PCUNICODE_STRING FilePath, _Out_ PHANDLE FileHandle)
+{
+    OBJECT_ATTRIBUTES objAttr;
+    IO_STATUS_BLOCK   ioStatus;
+
+    *FileHandle = NULL;
+
+    if (FilePath == NULL || FilePath->Length == 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    InitializeObjectAttributes(&objAttr, (PUNICODE_STRING)FilePath,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE,
+                               NULL, NULL);
+
+    return ZwCreateFile(
+        FileHandle,
+        FILE_READ_DATA | FILE_READ_ATTRIBUTES | SYNCHRONIZE,
+        &objAttr,
+        &ioStatus,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ | FILE_SHARE_DELETE,
+        FILE_OPEN,
+        FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE,
+        NULL, 0);
+}
+
+/*
+ * HashFileSize — размер файла (0, если узнать не удалось).
+ * Размер нужен секции; ключ кэша (Key, если есть) его уже содержит.
+ */
+static LONGLONG HashFileSize(_In_ HANDLE FileHandle, _In_opt_ const HASH_CACHE_KEY *Key)
+{
+    NTSTATUS                  status;
+    IO_STATUS_BLOCK           ioStatus;
+    FILE_STANDARD_INFORMATION standardInfo;
+    LONGLONG                  fileSize;
+
+    if (Key != NULL) {
+        fileSize = Key->Size.QuadPart;
+    } else {
+        status = ZwQueryInformationFile(FileHandle, &ioStatus, &standardInfo,
+                                        sizeof(standardInfo), FileStandardInformation);
+        fileSize = NT_SUCCESS(status) ? standardInfo.EndOfFile.QuadPart : 0;
+    }
+
+    return fileSize;
+}
+
+/* Сколько байт файла размером FileSize хешировать без дерева */
+static ULONG HashPrefixLength(_In_ LONGLONG FileSize)
+{
+    return (FileSize < HASH_MAX_FILE_SIZE) ? (ULONG)FileSize : HASH_MAX_FILE_SIZE;
+}
+
+/*
+ * HashFile — вычисляет хеш файла.
+ *
+ * FilePath — NT-путь к файлу (UNICODE_STRING).
+ * Algorithm — алгоритм (g_HashMd5, g_HashSha256).
+ * Hash — буфер на PROCMON_HASH_MAX_SIZE байт, заполняются Algorithm->DigestSize.
+ * BytesRead — сколько байт прочитано (и при ошибке, для статистики).
+ *
+ * Сначала ищет хеш в кэше по идентичности открытого файла (hash_cache.c),
+ * при промахе хеширует первые 4MB файла из отображения (HashMapped),
+ * а если отобразить нельзя — чтением блоками (HashRead).
+ * Вызывать только на PASSIVE_LEVEL.
+ */
+static NTSTATUS HashFile(PCUNICODE_STRING FilePath, PCHASH_ALGORITHM Algorithm,
+                         UCHAR Hash[PROCMON_HASH_MAX_SIZE], PULONG BytesRead)
+{
+    NTSTATUS       status;
+    HANDLE         fileHandle = NULL;
+    HASH_CACHE_KEY key;
+    BOOLEAN        cacheable;
+    LONGLONG       fileSize;
+    ULONG          length;
+
+    status = HashOpenFile(FilePath, &fileHandle);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    /* Файл с тем же томом, FileId, временем и размером уже хешировали этим алгоритмом */
+    cacheable = HashCacheKey(fileHandle, Algorithm->Id, &key);
+    if (cacheable && HashCacheLookup(&key, Hash)) {
+        ZwClose(fileHandle);
+        return STATUS_SUCCESS;
+    }
+
+    fileSize = HashFileSize(fileHandle, cacheable ? &key : NULL);
+
+    if (Algorithm->ChunkSize != 0) {
+        status = HashTreeFile(fileHandle, fileSize, Algorithm, Hash, BytesRead);
+    } else {
+        length = HashPrefixLength(fileSize);
+
+        /* Пустой файл секцией не отобразить — его «чтение» и так одно */
+        if (length != 0 && HashMapped(fileHandle, length, Algorithm, Hash, &status)) {
+            *BytesRead = NT_SUCCESS(status) ? length : 0;
+        } else {
+            status = HashRead(fileHandle, Algorithm, Hash, BytesRead);
+        }
+    }
+
+    if (NT_SUCCESS(status) && cacheable) {
+        HashCacheInsert(&key, Hash);
+    }
+
     ZwClose(fileHandle);
 
     return status;
 }
+
+/*
+ * ComputeFileHash — HashFile с учётом в счётчиках драйвера
+ * (успехи, ошибки, прочитанные байты). Кэш хранит дайджесты любой
+ * длины в PROCMON_HASH_MAX_SIZE байтах, поэтому HashFile пишет в
+ * локальный буфер, а вызывающему копируется DigestSize байт.
+ */
+NTSTATUS ComputeFileHash(PCUNICODE_STRING FilePath, PCHASH_ALGORITHM Algorithm, UCHAR *Hash)
+{
+    NTSTATUS status;
+    ULONG    bytesRead = 0;
+    UCHAR    digest[PROCMON_HASH_MAX_SIZE];
+
+    RtlZeroMemory(digest, sizeof(digest));
+
+    status = HashFile(FilePath, Algorithm, digest, &bytesRead);
+    StatsHash(status, bytesRead);
+
+    if (NT_SUCCESS(status)) {
+        RtlCopyMemory(Hash, digest, Algorithm->DigestSize);
+    }
+
+    return status;
+}
+
+/*
+ * === Пакетный MD5 ===
+ *
+ * Каждый канал Md5MbTransform ведёт свой файл: открытый хендл и
+ * отображение, как у HashMapped. Шаг — столько целых блоков, сколько
+ * осталось у самого короткого из файлов в работе; файл, у которого
+ * остался неполный блок, дохешируется скалярно (Md5Update/Md5Final из
+ * состояния канала), и канал сразу занимает следующий файл. Файлы из
+ * кэша, пустые и не отображаемые в каналы не попадают — их считает
+ * ComputeFileHash.
+ */
+
+/* Канал свободен */
+#define HASH_LANE_IDLE  MAXULONG
+
+typedef struct _HASH_LANE {
+    ULONG          Item;        /* Индекс файла в Items, HASH_LANE_IDLE — свободен */
+    HANDLE         File;
+    HASH_VIEW      View;
+    const UCHAR   *Data;        /* Следующий блок в отображении */
+    ULONG          Length;      /* Хешируемых байт (не больше HASH_MAX_FILE_SIZE) */
+    ULONG          Remaining;   /* Байт до конца Length */
+    HASH_CACHE_KEY Key;
+    BOOLEAN        Cacheable;
+} HASH_LANE, *PHASH_LANE;
+
+/*
+ * HashLaneStart — занять канал файлом Item.
+ * FALSE — файл уже обработан (кэш, ошибка или ComputeFileHash), канал свободен.
+ */
+static BOOLEAN HashLaneStart(_Out_ PHASH_LANE Lane, _Inout_ PHASH_BATCH_ITEM Item, _In_ ULONG Index)
+{
+    NTSTATUS status;
+    UCHAR    digest[PROCMON_HASH_MAX_SIZE];
+
+    Lane->Item = HASH_LANE_IDLE;
+
+    status = HashOpenFile(&Item->Path, &Lane->File);
+    if (!NT_SUCCESS(status)) {
+        Item->Status = status;
+        StatsHash(status, 0);
+        return FALSE;
+    }
+
+    Lane->Cacheable = HashCacheKey(Lane->File, PROCMON_HASH_MD5, &Lane->Key);
+    if (Lane->Cacheable && HashCacheLookup(&Lane->Key, digest)) {
+        ZwClose(Lane->File);
+        RtlCopyMemory(Item->Hash, digest, PROCMON_HASH_SIZE);
+        Item->Status = STATUS_SUCCESS;
+        StatsHash(STATUS_SUCCESS, 0);
+        return FALSE;
+    }
+
+    Lane->Length = HashPrefixLength(HashFileSize(Lane->File, Lane->Cacheable ? &Lane->Key : NULL));
+
+    /* Пустой или не отображаемый файл — обычным путём (чтение ZwReadFile) */
+    if (Lane->Length == 0 || !NT_SUCCESS(HashMapView(Lane->File, Lane->Length, &Lane->View))) {
+        ZwClose(Lane->File);
+        Item->Status = ComputeFileHash(&Item->Path, &g_HashMd5, Item->Hash);
+        return FALSE;
+    }
+
+    Lane->Item = Index;
+    Lane->Data = (const UCHAR *)Lane->View.Base;
+    Lane->Remaining = Lane->Length;
+    return TRUE;
+}
+
+/* HashLaneRelease — закрыть файл канала и освободить канал */
+static VOID HashLaneRelease(_Inout_ PHASH_LANE Lane)
+{
+    HashUnmapView(&Lane->View);
+    ZwClose(Lane->File);
+    Lane->File = NULL;
+    Lane->Item = HASH_LANE_IDLE;
+}
+
+/*
+ * HashLaneFinish — дохешировать неполный блок (Remaining < 64) и записать
+ * результат файла. Состояние канала — MD5_CTX после Length - Remaining байт.
+ */
+static VOID HashLaneFinish(
+    _Inout_ PHASH_LANE Lane,
+    _In_ const MD5_MB_STATE *State,
+    _In_ ULONG LaneIndex,
+    _Inout_ PHASH_BATCH_ITEM Item)
+{
+    NTSTATUS status;
+    MD5_CTX  ctx;
+    UCHAR    digest[PROCMON_HASH_MAX_SIZE];
+
+    ctx.State[0] = State->State[0][LaneIndex];
+    ctx.State[1] = State->State[1][LaneIndex];
+    ctx.State[2] = State->State[2][LaneIndex];
+    ctx.State[3] = State->State[3][LaneIndex];
+    ctx.Count = Lane->Length - Lane->Remaining;
+
+    RtlZeroMemory(digest, sizeof(digest));
+
+    __try {
+        Md5Update(&ctx, Lane->Data, Lane->Remaining);
+        Md5Final(&ctx, digest);
+        status = STATUS_SUCCESS;
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+
+    if (NT_SUCCESS(status)) {
+        RtlCopyMemory(Item->Hash, digest, PROCMON_HASH_SIZE);
+        if (Lane->Cacheable) {
+            HashCacheInsert(&Lane->Key, digest);
+        }
+    }
+
+    Item->Status = status;
+    StatsHash(status, NT_SUCCESS(status) ? Lane->Length : 0);
+
+    HashLaneRelease(Lane);
+}
+
+/*
+ * HashBatchRun — файлы Items[0..Count) по каналам одного потока.
+ */
+static VOID HashBatchRun(_Inout_updates_(Count) PHASH_BATCH_ITEM Items, _In_ ULONG Count)
+{
+    HASH_LANE    lanes[MD5_MB_MAX_LANES];
+    const UCHAR *data[MD5_MB_MAX_LANES];
+    MD5_MB_STATE state;
+    NTSTATUS     status;
+    ULONG        laneCount = Md5MbLaneCount();
+    ULONG        next = 0;
+    ULONG        active = 0;
+    ULONG        blocks;
+    ULONG        first;
+    ULONG        i;
+
+    RtlZeroMemory(lanes, sizeof(lanes));
+    for (i = 0; i < MD5_MB_MAX_LANES; i++) {
+        lanes[i].Item = HASH_LANE_IDLE;
+    }
+
+    for (;;) {
+        /* Свободные каналы — следующим файлам */
+        for (i = 0; i < laneCount; i++) {
+            while (lanes[i].Item == HASH_LANE_IDLE && next < Count) {
+                if (HashLaneStart(&lanes[i], &Items[next], next)) {
+                    Md5MbInitLane(&state, i);
+                    active++;
+                }
+                next++;
+            }
+        }
+
+        if (active == 0) {
+            break;
+        }
+
+        /* Целые блоки, которые есть у всех файлов в работе */
+        blocks = MAXULONG;
+        first = HASH_LANE_IDLE;
+        for (i = 0; i < laneCount; i++) {
+            if (lanes[i].Item != HASH_LANE_IDLE) {
+                if (first == HASH_LANE_IDLE) {
+                    first = i;
+                }
+                if (lanes[i].Remaining / 64 < blocks) {
+                    blocks = lanes[i].Remaining / 64;
+                }
+            }
+        }
+
+        if (blocks != 0) {
+            /* Свободные каналы считают впустую по данным первого занятого */
+            for (i = 0; i < MD5_MB_MAX_LANES; i++) {
+                data[i] = (i < laneCount && lanes[i].Item != HASH_LANE_IDLE) ?
+                          lanes[i].Data : lanes[first].Data;
+            }
+
+            status = Md5MbTransform(&state, data, blocks);
+            if (!NT_SUCCESS(status)) {
+                /* Чей файл не прочитался — неизвестно: все файлы в работе заново по одному */
+                for (i = 0; i < laneCount; i++) {
+                    if (lanes[i].Item != HASH_LANE_IDLE) {
+                        PHASH_BATCH_ITEM item = &Items[lanes[i].Item];
+
+                        HashLaneRelease(&lanes[i]);
+                        item->Status = ComputeFileHash(&item->Path, &g_HashMd5, item->Hash);
+                    }
+                }
+                active = 0;
+                continue;
+            }
+
+            for (i = 0; i < laneCount; i++) {
+                if (lanes[i].Item != HASH_LANE_IDLE) {
+                    lanes[i].Data += (SIZE_T)blocks * 64;
+                    lanes[i].Remaining -= blocks * 64;
+                }
+            }
+        }
+
+        /* Файлы с неполным последним блоком — дохешировать и освободить канал */
+        for (i = 0; i < laneCount; i++) {
+            if (lanes[i].Item != HASH_LANE_IDLE && lanes[i].Remaining < 64) {
+                HashLaneFinish(&lanes[i], &state, i, &Items[lanes[i].Item]);
+                active--;
+            }
+        }
+    }
+}
+
+/* Файлов в части параллельного обхода: по два на канал, чтобы каналы не простаивали */
+#define HASH_BATCH_SLICE  (MD5_MB_MAX_LANES * 2)
+
+static VOID HashBatchSlice(_In_ PVOID Context, _In_ ULONG First, _In_ ULONG Count)
+{
+    HashBatchRun(&((PHASH_BATCH_ITEM)Context)[First], Count);
+}
+
+ULONG ComputeFileHashBatch(_Inout_updates_(Count) PHASH_BATCH_ITEM Items, _In_ ULONG Count)
+{
+    ULONG64 start = KeQueryInterruptTime();
+
+    HashParallel(HashBatchSlice, Items, Count, HASH_BATCH_SLICE);
+
+    return (ULONG)((KeQueryInterruptTime() - start) / 10000);
+}
@@ -2,11 +2,30 @@
 #define PROCMON_HASH_H
 
 /*
- * hash.h — MD5-хеширование для kernel mode.
- * Самодостаточная реализация RFC 1321 без внешних зависимостей.
+ * hash.h — Хеширование файлов для kernel mode.
+ * Самодостаточные реализации MD5 (RFC 1321, hash.c) и SHA-256
+ * (FIPS 180-4, sha256.c) без внешних зависимостей.
+ *
+ * Алгоритм образов процессов выбирается при загрузке драйвера
+ * (Parameters\HashAlgorithm) и дальше не меняется: g_HashAlgorithm
+ * указывает на его описатель. Перечисления драйверов хешируют MD5 —
+ * поля FileHash их записей 16-байтовые.
  */
 
 #include <ntddk.h>
+#include "../common/shared.h"
+
+/*
+ * HASH_TARGET — набор инструкций одной функции с интринсиками SHA или
+ * AVX2. MSVC генерирует их без флагов; GCC и Clang (тесты в tests/)
+ * — только внутри функций с этим атрибутом, так что остальной код,
+ * включая переносимые ветки и самопроверки, остаётся на базовом x64.
+ */
+#if defined(__GNUC__)
+#define HASH_TARGET(Features) __attribute__((target(Features)))
+#else
+#define HASH_TARGET(Features)
+#endif
 
 /* Контекст MD5-вычисления */
 typedef struct _MD5_CTX {
@@ -20,10 +39,133 @@ VOID Md5Update(MD5_CTX *ctx, const UCHAR *data, ULONG len);
 VOID Md5Final(MD5_CTX *ctx, UCHAR digest[16]);
 
 /*
- * ComputeFileHash — вычислить MD5 файла по пути.
- * Читает файл блоками по 4KB, ограничение 4MB.
+ * Многоканальный MD5 (md5_mb.c): до MD5_MB_MAX_LANES независимых потоков
+ * данных одним проходом раундов — 4 канала на SSE2, 8 на AVX2. State[слово][канал]
+ * после блоков совпадает с MD5_CTX.State того же потока.
+ */
+#define MD5_MB_MAX_LANES 8
+
+typedef struct _MD5_MB_STATE {
+    ULONG State[4][MD5_MB_MAX_LANES];
+} MD5_MB_STATE;
+
+VOID Md5MbInitLane(MD5_MB_STATE *State, ULONG Lane);
+
+/*
+ * Md5MbTransform — Blocks блоков по 64 байта с Data[канал] для каждого из
+ * Md5MbLaneCount() каналов. Data — MD5_MB_MAX_LANES указателей; у неиспользуемых
+ * каналов тоже должны быть читаемые Blocks * 64 байт. Исключение при чтении
+ * данных (отображение файла) возвращается кодом, состояние каналов тогда не определено.
+ */
+NTSTATUS Md5MbTransform(MD5_MB_STATE *State, const UCHAR * const *Data, ULONG Blocks);
+
+/* Каналов в работе: 4, 8 или 1 (векторные не прошли самопроверку) */
+ULONG Md5MbLaneCount(VOID);
+
+/*
+ * Выбрать ширину по процессору (AVX2 при включённом системой XSAVE, иначе SSE2)
+ * и сверить каналы с Md5Update; не сошлось — скалярный канал. Возвращает число каналов.
+ * Вызывается один раз из HashSelectAlgorithm.
+ */
+ULONG Md5MbSelectImplementation(VOID);
+
+/* Контекст SHA-256-вычисления */
+typedef struct _SHA256_CTX {
+    ULONG   State[8];    /* A..H */
+    ULONG64 Count;       /* Количество обработанных байт */
+    UCHAR   Buffer[64];  /* Буфер для неполного блока */
+} SHA256_CTX;
+
+VOID Sha256Init(SHA256_CTX *ctx);
+VOID Sha256Update(SHA256_CTX *ctx, const UCHAR *data, ULONG len);
+VOID Sha256Final(SHA256_CTX *ctx, UCHAR digest[32]);
+
+/*
+ * Выбрать реализацию блочной функции SHA-256 по процессору (SHA-NI или
+ * переносимая) и проверить её на известных ответах; реализация, не
+ * прошедшая проверку, не используется. Возвращает PROCMON_HASH_IMPL_*.
+ * Вызывается один раз из HashSelectAlgorithm.
+ */
+ULONG Sha256SelectImplementation(VOID);
+
+/* Контекст любого из алгоритмов */
+typedef union _HASH_CONTEXT {
+    MD5_CTX    Md5;
+    SHA256_CTX Sha256;
+} HASH_CONTEXT, *PHASH_CONTEXT;
+
+/* Описатель алгоритма хеширования */
+typedef struct _HASH_ALGORITHM {
+    ULONG  Id;            /* PROCMON_HASH_* */
+    ULONG  DigestSize;    /* Байт в дайджесте (не больше PROCMON_HASH_MAX_SIZE) */
+    USHORT EventFlags;    /* Флаг алгоритма у событий с хешем (0 — MD5) */
+    VOID (*Init)(PHASH_CONTEXT Context);
+    VOID (*Update)(PHASH_CONTEXT Context, const UCHAR *Data, ULONG Length);
+    VOID (*Final)(PHASH_CONTEXT Context, UCHAR *Digest);
+    ULONG  ChunkSize;     /* 0 — хеш первых 4MB; иначе хеш-дерево с кусками этого размера */
+} HASH_ALGORITHM, *PHASH_ALGORITHM;
+
+typedef const HASH_ALGORITHM *PCHASH_ALGORITHM;
+
+extern const HASH_ALGORITHM g_HashMd5;
+extern const HASH_ALGORITHM g_HashSha256;
+
+/* Алгоритм образов процессов (по умолчанию MD5) */
+extern PCHASH_ALGORITHM g_HashAlgorithm;
+
+/*
+ * Выбрать алгоритм образов по Parameters\HashAlgorithm (PROCMON_HASH_*) и
+ * Parameters\TreeHash (Tree — хеш-дерево всего файла вместо первых 4MB).
+ * Неизвестное значение — MD5. Вызывать в DriverEntry до регистрации callback.
+ */
+VOID HashSelectAlgorithm(_In_ ULONG AlgorithmId, _In_ BOOLEAN Tree);
+
+/* Заполнить поля HashAlgorithm/HashImplementation в PROCMON_STATS. */
+VOID HashQuery(_Inout_ PPROCMON_STATS Stats);
+
+/*
+ * ComputeFileHash — вычислить хеш файла по пути алгоритмом Algorithm.
+ * Hash — Algorithm->DigestSize байт.
+ * Хеширует первые 4MB из отображения файла (если отобразить нельзя —
+ * чтением блоками по 256KB), а алгоритм-дерево (ChunkSize) — весь файл
+ * до 1GB кусками параллельно; повторный запрос того же неизменённого
+ * файла тем же алгоритмом отвечается из кэша (hash_cache.h) без чтения.
  * Должен вызываться на PASSIVE_LEVEL.
  */
-NTSTATUS ComputeFileHash(PCUNICODE_STRING FilePath, UCHAR Hash[16]);
+NTSTATUS ComputeFileHash(PCUNICODE_STRING FilePath, PCHASH_ALGORITHM Algorithm, UCHAR *Hash);
+
+/* Файл пакетного хеширования */
+typedef struct _HASH_BATCH_ITEM {
+    UNICODE_STRING Path;      /* NT-путь к файлу */
+    PUCHAR         Hash;      /* Куда записать MD5 (PROCMON_HASH_SIZE байт) */
+    PVOID          Context;   /* Вызывающего, не используется */
+    NTSTATUS       Status;    /* Результат, как у ComputeFileHash */
+} HASH_BATCH_ITEM, *PHASH_BATCH_ITEM;
+
+/*
+ * ComputeFileHashBatch — MD5 нескольких файлов сразу (перечисления драйверов).
+ * Результат для каждого файла тот же, что у ComputeFileHash(&g_HashMd5), но
+ * отображённые файлы идут одновременно по каналам Md5MbTransform, и раунды
+ * MD5 считаются векторно для 4–8 файлов за проход. Большой список делится на
+ * части, которые разбирают системные потоки (HashBatchConfigure) вместе с
+ * вызывающим; результат каждого файла пишется в его элемент Items, так что
+ * порядок не меняется. Возвращает, через сколько миллисекунд всё посчитано.
+ * Должен вызываться на PASSIVE_LEVEL.
+ */
+ULONG ComputeFileHashBatch(_Inout_updates_(Count) PHASH_BATCH_ITEM Items, _In_ ULONG Count);
+
+/* Больше потоков пакетного хеширования не создаётся */
+#define HASH_BATCH_MAX_THREADS  32
+
+/*
+ * Число потоков пакетного хеширования и кусков хеш-дерева
+ * (Parameters\EnumHashThreads): 0 — по числу процессоров, 1 — только
+ * вызывающий поток. Создаёт пул из Threads - 1 системных потоков.
+ * Вызывать в DriverEntry.
+ */
+VOID HashBatchConfigure(_In_ ULONG Threads);
+
+/* Остановить пул. Вызывать при выгрузке, когда хеширований больше нет. */
+VOID HashBatchShutdown(VOID);
 
 #endif /* PROCMON_HASH_H */
@@ -0,0 +1,259 @@
+/*
+ * hash_cache.c — Кэш хешей файлов по идентичности файла.
+ *
+ * Бакет выбирается только по тому и FileId, поэтому устаревшая запись
+ * файла (до перезаписи) и новая лежат в одной цепочке; совпадение
+ * проверяется по полному ключу.
+ */
+
+#include "driver.h"
+#include "hash_cache.h"
+
+HASH_CACHE g_HashCache;
+
+/* Признак свободной записи в HASH_CACHE_ENTRY.Bucket */
+#define HASH_CACHE_FREE  HASH_CACHE_BUCKETS
+
+static ULONG HashCacheBucket(_In_ const HASH_CACHE_KEY *Key)
+{
+    const UCHAR *p = (const UCHAR *)Key;
+    ULONG        hash = 2166136261u;
+    ULONG        i;
+
+    /* FNV-1a по VolumeSerial и FileId */
+    for (i = 0; i < RTL_SIZEOF_THROUGH_FIELD(HASH_CACHE_KEY, FileId); i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+
+    return hash & (HASH_CACHE_BUCKETS - 1);
+}
+
+static PEX_PUSH_LOCK HashCacheStripe(_In_ ULONG Bucket)
+{
+    return &g_HashCache.Stripes[Bucket & (HASH_CACHE_STRIPES - 1)].Lock;
+}
+
+/* Найти запись в цепочке. Вызывается под полосой бакета. */
+static PHASH_CACHE_ENTRY HashCacheFind(_In_ ULONG Bucket, _In_ const HASH_CACHE_KEY *Key)
+{
+    PLIST_ENTRY       link;
+    PHASH_CACHE_ENTRY entry;
+
+    for (link = g_HashCache.Buckets[Bucket].Flink; link != &g_HashCache.Buckets[Bucket];
+         link = link->Flink) {
+        entry = CONTAINING_RECORD(link, HASH_CACHE_ENTRY, Link);
+        if (RtlEqualMemory(&entry->Key, Key, sizeof(HASH_CACHE_KEY))) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+VOID HashCacheInit(VOID)
+{
+    ULONG i;
+
+    RtlZeroMemory(&g_HashCache, sizeof(HASH_CACHE));
+    ExInitializeFastMutex(&g_HashCache.InsertLock);
+
+    for (i = 0; i < HASH_CACHE_STRIPES; i++) {
+        ExInitializePushLock(&g_HashCache.Stripes[i].Lock);
+    }
+
+    g_HashCache.Buckets = (PLIST_ENTRY)ExAllocatePoolWithTag(
+        PagedPool, HASH_CACHE_BUCKETS * sizeof(LIST_ENTRY), HASH_CACHE_POOL_TAG);
+    g_HashCache.Entries = (PHASH_CACHE_ENTRY)ExAllocatePoolWithTag(
+        PagedPool, HASH_CACHE_ENTRIES * sizeof(HASH_CACHE_ENTRY), HASH_CACHE_POOL_TAG);
+
+    if (g_HashCache.Buckets == NULL || g_HashCache.Entries == NULL) {
+        DbgPrint("[ProcMon] Нет памяти под кэш хешей, файлы хешируются без кэша\n");
+        HashCacheFree();
+        return;
+    }
+
+    for (i = 0; i < HASH_CACHE_BUCKETS; i++) {
+        InitializeListHead(&g_HashCache.Buckets[i]);
+    }
+
+    RtlZeroMemory(g_HashCache.Entries, HASH_CACHE_ENTRIES * sizeof(HASH_CACHE_ENTRY));
+    for (i = 0; i < HASH_CACHE_ENTRIES; i++) {
+        g_HashCache.Entries[i].Bucket = HASH_CACHE_FREE;
+    }
+}
+
+VOID HashCacheFree(VOID)
+{
+    if (g_HashCache.Entries != NULL) {
+        ExFreePoolWithTag(g_HashCache.Entries, HASH_CACHE_POOL_TAG);
+        g_HashCache.Entries = NULL;
+    }
+
+    if (g_HashCache.Buckets != NULL) {
+        ExFreePoolWithTag(g_HashCache.Buckets, HASH_CACHE_POOL_TAG);
+        g_HashCache.Buckets = NULL;
+    }
+
+    g_HashCache.Used = 0;
+}
+
+BOOLEAN HashCacheKey(_In_ HANDLE FileHandle, _In_ ULONG Algorithm, _Out_ PHASH_CACHE_KEY Key)
+{
+    NTSTATUS                      status;
+    IO_STATUS_BLOCK               ioStatus;
+    FILE_ID_INFORMATION           idInfo;
+    FILE_NETWORK_OPEN_INFORMATION openInfo;
+
+    RtlZeroMemory(Key, sizeof(HASH_CACHE_KEY));
+
+    if (g_HashCache.Entries == NULL) {
+        return FALSE;
+    }
+
+    status = ZwQueryInformationFile(FileHandle, &ioStatus, &idInfo, sizeof(idInfo),
+                                    FileIdInformation);
+    if (!NT_SUCCESS(status)) {
+        return FALSE;
+    }
+
+    status = ZwQueryInformationFile(FileHandle, &ioStatus, &openInfo, sizeof(openInfo),
+                                    FileNetworkOpenInformation);
+    if (!NT_SUCCESS(status)) {
+        return FALSE;
+    }
+
+    Key->VolumeSerial = idInfo.VolumeSerialNumber;
+    RtlCopyMemory(Key->FileId, &idInfo.FileId, sizeof(Key->FileId));
+    Key->LastWriteTime = openInfo.LastWriteTime;
+    Key->ChangeTime = openInfo.ChangeTime;
+    Key->Size = openInfo.EndOfFile;
+    Key->Algorithm = Algorithm;
+
+    return TRUE;
+}
+
+BOOLEAN HashCacheLookup(_In_ const HASH_CACHE_KEY *Key,
+                        _Out_writes_(PROCMON_HASH_MAX_SIZE) UCHAR *Hash)
+{
+    PHASH_CACHE_ENTRY entry;
+    PEX_PUSH_LOCK     stripe;
+    ULONG             bucket;
+
+    if (g_HashCache.Entries == NULL) {
+        return FALSE;
+    }
+
+    bucket = HashCacheBucket(Key);
+    stripe = HashCacheStripe(bucket);
+
+    KeEnterCriticalRegion();
+    ExAcquirePushLockShared(stripe);
+
+    entry = HashCacheFind(bucket, Key);
+    if (entry != NULL) {
+        RtlCopyMemory(Hash, entry->Hash, PROCMON_HASH_MAX_SIZE);
+
+        /* Бит пишем, только если он сброшен: не гоняем кэш-линию на каждом попадании */
+        if (entry->Referenced == 0) {
+            InterlockedExchange(&entry->Referenced, 1);
+        }
+    }
+
+    ExReleasePushLockShared(stripe);
+    KeLeaveCriticalRegion();
+
+    StatsHashCache(entry != NULL);
+
+    return (entry != NULL);
+}
+
+/*
+ * HashCacheVictim — свободная запись или запись, вытесненная по CLOCK.
+ * Вызывается под InsertLock. Записи с битом обращения получают второй
+ * шанс; за два оборота стрелки жертва найдётся всегда.
+ */
+static PHASH_CACHE_ENTRY HashCacheVictim(VOID)
+{
+    PHASH_CACHE_ENTRY entry;
+    PEX_PUSH_LOCK     stripe;
+
+    if (g_HashCache.Used < HASH_CACHE_ENTRIES) {
+        return &g_HashCache.Entries[g_HashCache.Used++];
+    }
+
+    for (;;) {
+        entry = &g_HashCache.Entries[g_HashCache.Hand];
+        g_HashCache.Hand = (g_HashCache.Hand + 1) % HASH_CACHE_ENTRIES;
+
+        if (entry->Bucket == HASH_CACHE_FREE) {
+            return entry;
+        }
+
+        if (entry->Referenced != 0) {
+            InterlockedExchange(&entry->Referenced, 0);
+            continue;
+        }
+
+        stripe = HashCacheStripe(entry->Bucket);
+        ExAcquirePushLockExclusive(stripe);
+        RemoveEntryList(&entry->Link);
+        entry->Bucket = HASH_CACHE_FREE;
+        ExReleasePushLockExclusive(stripe);
+
+        g_HashCache.Evictions++;
+        return entry;
+    }
+}
+
+VOID HashCacheInsert(_In_ const HASH_CACHE_KEY *Key,
+                     _In_reads_(PROCMON_HASH_MAX_SIZE) const UCHAR *Hash)
+{
+    PHASH_CACHE_ENTRY entry;
+    PEX_PUSH_LOCK     stripe;
+    ULONG             bucket;
+
+    if (g_HashCache.Entries == NULL) {
+        return;
+    }
+
+    bucket = HashCacheBucket(Key);
+    stripe = HashCacheStripe(bucket);
+
+    /* FAST_MUTEX поднимает до APC_LEVEL — push lock-и внутри можно брать без критической области */
+    ExAcquireFastMutex(&g_HashCache.InsertLock);
+
+    /* Тот же файл мог захешировать параллельный поток; вставки сериализованы, так что проверка окончательна */
+    ExAcquirePushLockShared(stripe);
+    entry = HashCacheFind(bucket, Key);
+    ExReleasePushLockShared(stripe);
+
+    if (entry == NULL) {
+        entry = HashCacheVictim();
+
+        RtlCopyMemory(&entry->Key, Key, sizeof(HASH_CACHE_KEY));
+        RtlCopyMemory(entry->Hash, Hash, PROCMON_HASH_MAX_SIZE);
+
+        /* Без бита обращения: файл, запущенный один раз, вытеснится первым */
+        entry->Referenced = 0;
+
+        ExAcquirePushLockExclusive(stripe);
+        entry->Bucket = bucket;
+        InsertHeadList(&g_HashCache.Buckets[bucket], &entry->Link);
+        ExReleasePushLockExclusive(stripe);
+    }
+
+    ExReleaseFastMutex(&g_HashCache.InsertLock);
+}
+
+VOID HashCacheQuery(_Inout_ PPROCMON_STATS Stats)
+{
+    if (g_HashCache.Entries == NULL) {
+        return;
+    }
+
+    ExAcquireFastMutex(&g_HashCache.InsertLock);
+    Stats->HashCacheEntries = g_HashCache.Used;
+    Stats->HashCacheCapacity = HASH_CACHE_ENTRIES;
+    Stats->HashCacheEvictions = g_HashCache.Evictions;
+    ExReleaseFastMutex(&g_HashCache.InsertLock);
+}
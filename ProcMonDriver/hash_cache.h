@@ -0,0 +1,104 @@
+#ifndef PROCMON_HASH_CACHE_H
+#define PROCMON_HASH_CACHE_H
+
+/*
+ * hash_cache.h — Кэш хешей файлов по идентичности файла.
+ *
+ * Одни и те же исполняемые файлы (cl.exe, conhost.exe, git.exe) запускаются
+ * тысячи раз, и каждый раз ComputeFileHash перечитывал бы до 4 MB. Кэш
+ * отвечает по ключу, который берётся у уже открытого файла без чтения
+ * данных: серийный номер тома и FileId (FileIdInformation) плюс время
+ * изменения и размер (FileNetworkOpenInformation). Файл переписали —
+ * сменились время или размер, старая запись просто перестаёт совпадать
+ * и со временем вытесняется. Алгоритм — тоже часть ключа: перечисления
+ * драйверов хешируют MD5, а образы процессов могут хешироваться SHA-256.
+ *
+ * Память ограничена: HASH_CACHE_ENTRIES записей выделяются одним массивом
+ * при загрузке. Вытеснение — CLOCK: попадание ставит записи бит обращения,
+ * стрелка при вставке сбрасывает биты и занимает первую запись без него.
+ *
+ * Поиск — под разделяемыми push lock-ами полос (бакет & маска полосы),
+ * так что параллельные поиски не мешают друг другу. Вставки и стрелка
+ * сериализованы одним FAST_MUTEX: вставке всё равно предшествует чтение
+ * файла, и они редки.
+ *
+ * Кэш один на драйвер (как g_Stats): через ComputeFileHash им пользуются
+ * и callback процессов, и перечисления драйверов.
+ *
+ * IRQL: всё — PASSIVE_LEVEL (ключ берётся запросами к файлу).
+ */
+
+#include <ntddk.h>
+#include "../common/shared.h"
+
+/* Записей в кэше (~110 байт каждая, всего ~450 KB PagedPool) */
+#define HASH_CACHE_ENTRIES   4096
+
+/* Бакетов (степень двойки) и полос блокировок */
+#define HASH_CACHE_BUCKETS   1024
+#define HASH_CACHE_STRIPES   16
+
+/* Тег пула кэша хешей ('HshC') */
+#define HASH_CACHE_POOL_TAG  'ChsH'
+
+/* Идентичность содержимого файла */
+typedef struct _HASH_CACHE_KEY {
+    ULONG64       VolumeSerial;   /* FILE_ID_INFORMATION.VolumeSerialNumber */
+    UCHAR         FileId[16];     /* FILE_ID_INFORMATION.FileId */
+    LARGE_INTEGER LastWriteTime;
+    LARGE_INTEGER ChangeTime;
+    LARGE_INTEGER Size;           /* EndOfFile */
+    ULONG         Algorithm;      /* PROCMON_HASH_* */
+    ULONG         Reserved;       /* Ключ сравнивается целиком — без мусора в выравнивании */
+} HASH_CACHE_KEY, *PHASH_CACHE_KEY;
+
+typedef struct _HASH_CACHE_ENTRY {
+    LIST_ENTRY     Link;          /* В цепочке бакета (под полосой бакета) */
+    HASH_CACHE_KEY Key;
+    UCHAR          Hash[PROCMON_HASH_MAX_SIZE];  /* Дайджест (у MD5 — первые 16 байт) */
+    ULONG          Bucket;        /* Бакет, HASH_CACHE_BUCKETS — запись свободна */
+    volatile LONG  Referenced;    /* Бит обращения CLOCK */
+} HASH_CACHE_ENTRY, *PHASH_CACHE_ENTRY;
+
+/* Полоса блокировок на отдельной кэш-линии */
+typedef struct DECLSPEC_CACHEALIGN _HASH_CACHE_STRIPE {
+    EX_PUSH_LOCK Lock;
+} HASH_CACHE_STRIPE, *PHASH_CACHE_STRIPE;
+
+typedef struct _HASH_CACHE {
+    PHASH_CACHE_ENTRY Entries;    /* HASH_CACHE_ENTRIES записей, NULL — кэша нет */
+    PLIST_ENTRY       Buckets;    /* HASH_CACHE_BUCKETS цепочек */
+    HASH_CACHE_STRIPE Stripes[HASH_CACHE_STRIPES];
+    FAST_MUTEX        InsertLock; /* Вставки, стрелка, Used, Evictions */
+    ULONG             Hand;       /* Стрелка CLOCK */
+    ULONG             Used;       /* Занятых записей */
+    ULONG64           Evictions;  /* Вытеснено записей */
+} HASH_CACHE, *PHASH_CACHE;
+
+extern HASH_CACHE g_HashCache;
+
+/* Выделить кэш (DriverEntry). Без памяти драйвер хеширует без кэша. */
+VOID HashCacheInit(VOID);
+
+/* Освободить кэш (выгрузка, хеширующих потоков больше нет). */
+VOID HashCacheFree(VOID);
+
+/*
+ * Ключ открытого файла для алгоритма Algorithm (PROCMON_HASH_*).
+ * FALSE — ФС не отдаёт FileId (FAT, некоторые сетевые), такой файл
+ * хешируется без кэша.
+ */
+BOOLEAN HashCacheKey(_In_ HANDLE FileHandle, _In_ ULONG Algorithm, _Out_ PHASH_CACHE_KEY Key);
+
+/* Найти хеш по ключу. Учитывается в счётчиках попаданий (g_Stats). */
+BOOLEAN HashCacheLookup(_In_ const HASH_CACHE_KEY *Key,
+                        _Out_writes_(PROCMON_HASH_MAX_SIZE) UCHAR *Hash);
+
+/* Запомнить хеш, вытеснив по CLOCK запись без обращений, если места нет. */
+VOID HashCacheInsert(_In_ const HASH_CACHE_KEY *Key,
+                     _In_reads_(PROCMON_HASH_MAX_SIZE) const UCHAR *Hash);
+
+/* Заполнить поля HashCacheEntries/Capacity/Evictions в PROCMON_STATS. */
+VOID HashCacheQuery(_Inout_ PPROCMON_STATS Stats);
+
+#endif /* PROCMON_HASH_CACHE_H */
@@ -0,0 +1,253 @@
+/*
+ * hash_queue.c — Очередь асинхронного хеширования и её рабочие потоки.
+ *
+ * Семафор Ready считает элементы Items: HashQueueSubmit добавляет элемент
+ * и освобождает семафор на единицу, поток забирает по элементу на каждое
+ * пробуждение. Остановка освобождает семафор на число потоков, и каждый
+ * поток, проснувшись с Stop, выходит, не дожидаясь конца очереди —
+ * callback к этому моменту снят, и хеши уже никто не ждёт.
+ *
+ * Depth ограничивает очередь вместе с файлами в работе: место занимается
+ * в HashQueuePrepare (до записи события создания) и освобождается, когда
+ * поток записал «хеш готов» или HashQueueCancel вернул место.
+ */
+
+#include "driver.h"
+#include "hash_queue.h"
+
+/*
+ * HashQueueEmit — записать событие «хеш готов».
+ * Имя — тот же путь образа, что у создания: по нему работают фильтры имён.
+ * Номер, выданный BufferReserve, заменяется номером создания: по нему
+ * клиент находит событие, к которому относится хеш.
+ */
+static VOID HashQueueEmit(
+    _In_ PHASH_QUEUE Queue,
+    _In_ PHASH_WORK Work,
+    _In_ NTSTATUS HashStatus,
+    _In_reads_(g_HashAlgorithm->DigestSize) const UCHAR *Hash)
+{
+    BUFFER_RESERVATION reservation;
+    LARGE_INTEGER      timestamp;
+    NTSTATUS           status;
+    ULONG              nameLength = 0;
+    USHORT             flags = PROCMON_EVENT_FLAG_HASH_READY;
+
+    KeQuerySystemTimePrecise(&timestamp);
+
+    if (NT_SUCCESS(HashStatus)) {
+        flags |= PROCMON_EVENT_FLAG_HASH_VALID | g_HashAlgorithm->EventFlags;
+    }
+
+    status = RtlUnicodeToMultiByteSize(&nameLength, Work->ImagePath.Buffer,
+                                       Work->ImagePath.Length);
+    if (!NT_SUCCESS(status)) {
+        nameLength = 0;
+    }
+
+    if (nameLength >= PROCMON_MAX_IMAGE_NAME) {
+        nameLength = PROCMON_MAX_IMAGE_NAME - 1;
+    }
+
+    if (!BufferReserve(Queue->Buffer, flags, (USHORT)nameLength, &reservation)) {
+        return;
+    }
+
+    reservation.Header->ProcessId = Work->ProcessId;
+    reservation.Header->ParentProcessId = Work->ParentProcessId;
+    reservation.Header->Sequence = Work->CreateSequence;
+    reservation.Header->Timestamp = timestamp;
+
+    if (reservation.Hash != NULL) {
+        RtlCopyMemory(reservation.Hash, Hash, g_HashAlgorithm->DigestSize);
+    }
+
+    if (reservation.Name != NULL) {
+        status = RtlUnicodeToMultiByteN(reservation.Name, nameLength, &nameLength,
+                                        Work->ImagePath.Buffer, Work->ImagePath.Length);
+        if (!NT_SUCCESS(status)) {
+            nameLength = 0;
+        }
+        reservation.Header->NameLength = (USHORT)nameLength;
+    }
+
+    BufferCommit(Queue->Buffer, &reservation);
+}
+
+/*
+ * HashQueueThread — рабочий поток: по файлу на пробуждение.
+ */
+static VOID HashQueueThread(_In_ PVOID Context)
+{
+    PHASH_QUEUE Queue = (PHASH_QUEUE)Context;
+    PLIST_ENTRY entry;
+    PHASH_WORK  work;
+    KIRQL       irql;
+    NTSTATUS    status;
+    UCHAR       hash[PROCMON_HASH_MAX_SIZE];
+
+    for (;;) {
+        KeWaitForSingleObject(&Queue->Ready, Executive, KernelMode, FALSE, NULL);
+
+        if (Queue->Stop) {
+            break;
+        }
+
+        KeAcquireSpinLock(&Queue->Lock, &irql);
+        entry = IsListEmpty(&Queue->Items) ? NULL : RemoveHeadList(&Queue->Items);
+        KeReleaseSpinLock(&Queue->Lock, irql);
+
+        if (entry == NULL) {
+            continue;
+        }
+
+        work = CONTAINING_RECORD(entry, HASH_WORK, Link);
+
+        status = ComputeFileHash(&work->ImagePath, g_HashAlgorithm, hash);
+        HashQueueEmit(Queue, work, status, hash);
+
+        ExFreePoolWithTag(work, POOL_TAG);
+        InterlockedDecrement(&Queue->Depth);
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+VOID HashQueueInit(
+    _Out_ PHASH_QUEUE Queue,
+    _In_ PEVENT_BUFFER Buffer,
+    _In_ BOOLEAN Synchronous)
+{
+    NTSTATUS          status;
+    OBJECT_ATTRIBUTES objAttr;
+    ULONG             count;
+    ULONG             i;
+
+    RtlZeroMemory(Queue, sizeof(HASH_QUEUE));
+    InitializeListHead(&Queue->Items);
+    KeInitializeSpinLock(&Queue->Lock);
+    KeInitializeSemaphore(&Queue->Ready, 0, MAXLONG);
+    Queue->Buffer = Buffer;
+
+    if (Synchronous) {
+        DbgPrint("[ProcMon] Хеширование синхронное (SynchronousHash)\n");
+        return;
+    }
+
+    /* Хеширование упирается в чтение файлов, больше пары-тройки потоков не нужно */
+    count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    if (count > HASH_QUEUE_MAX_THREADS) {
+        count = HASH_QUEUE_MAX_THREADS;
+    }
+
+    InitializeObjectAttributes(&objAttr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    for (i = 0; i < count; i++) {
+        status = PsCreateSystemThread(&Queue->Threads[Queue->ThreadCount], SYNCHRONIZE,
+                                      &objAttr, NULL, NULL, HashQueueThread, Queue);
+        if (!NT_SUCCESS(status)) {
+            DbgPrint("[ProcMon] PsCreateSystemThread для хеширования: 0x%08X\n", status);
+            break;
+        }
+        Queue->ThreadCount++;
+    }
+
+    DbgPrint("[ProcMon] Асинхронное хеширование: потоков %lu\n", Queue->ThreadCount);
+}
+
+VOID HashQueueFree(_Inout_ PHASH_QUEUE Queue)
+{
+    PLIST_ENTRY entry;
+    ULONG       i;
+
+    if (Queue->ThreadCount == 0) {
+        return;
+    }
+
+    InterlockedExchange(&Queue->Stop, 1);
+    KeReleaseSemaphore(&Queue->Ready, IO_NO_INCREMENT, (LONG)Queue->ThreadCount, FALSE);
+
+    for (i = 0; i < Queue->ThreadCount; i++) {
+        ZwWaitForSingleObject(Queue->Threads[i], FALSE, NULL);
+        ZwClose(Queue->Threads[i]);
+        Queue->Threads[i] = NULL;
+    }
+    Queue->ThreadCount = 0;
+
+    /* Потоков больше нет — спинлок не нужен */
+    while (!IsListEmpty(&Queue->Items)) {
+        entry = RemoveHeadList(&Queue->Items);
+        ExFreePoolWithTag(CONTAINING_RECORD(entry, HASH_WORK, Link), POOL_TAG);
+    }
+    Queue->Depth = 0;
+}
+
+BOOLEAN HashQueueSynchronous(_In_ PHASH_QUEUE Queue)
+{
+    return (Queue->ThreadCount == 0) ? TRUE : FALSE;
+}
+
+PHASH_WORK HashQueuePrepare(_Inout_ PHASH_QUEUE Queue, _In_ PCUNICODE_STRING ImagePath)
+{
+    PHASH_WORK work;
+
+    if (Queue->ThreadCount == 0 || Queue->Stop) {
+        return NULL;
+    }
+
+    if (InterlockedIncrement(&Queue->Depth) > HASH_QUEUE_DEPTH) {
+        InterlockedDecrement(&Queue->Depth);
+        InterlockedIncrement64(&Queue->Full);
+        return NULL;
+    }
+
+    work = (PHASH_WORK)ExAllocatePoolWithTag(PagedPool, sizeof(HASH_WORK) + ImagePath->Length,
+                                             POOL_TAG);
+    if (work == NULL) {
+        InterlockedDecrement(&Queue->Depth);
+        return NULL;
+    }
+
+    work->ProcessId = 0;
+    work->ParentProcessId = 0;
+    work->CreateSequence = 0;
+    work->ImagePath.Buffer = (PWCH)(work + 1);
+    work->ImagePath.Length = ImagePath->Length;
+    work->ImagePath.MaximumLength = ImagePath->Length;
+    RtlCopyMemory(work->ImagePath.Buffer, ImagePath->Buffer, ImagePath->Length);
+
+    return work;
+}
+
+VOID HashQueueSubmit(
+    _Inout_ PHASH_QUEUE Queue,
+    _In_ PHASH_WORK Work,
+    _In_ ULONG ProcessId,
+    _In_ ULONG ParentProcessId,
+    _In_ ULONG CreateSequence)
+{
+    KIRQL irql;
+
+    Work->ProcessId = ProcessId;
+    Work->ParentProcessId = ParentProcessId;
+    Work->CreateSequence = CreateSequence;
+
+    KeAcquireSpinLock(&Queue->Lock, &irql);
+    InsertTailList(&Queue->Items, &Work->Link);
+    KeReleaseSpinLock(&Queue->Lock, irql);
+
+    KeReleaseSemaphore(&Queue->Ready, IO_NO_INCREMENT, 1, FALSE);
+}
+
+VOID HashQueueCancel(_Inout_ PHASH_QUEUE Queue, _In_ PHASH_WORK Work)
+{
+    ExFreePoolWithTag(Work, POOL_TAG);
+    InterlockedDecrement(&Queue->Depth);
+}
+
+VOID HashQueueQuery(_In_ PHASH_QUEUE Queue, _Inout_ PPROCMON_STATS Stats)
+{
+    Stats->HashQueueDepth = (ULONG)Queue->Depth;
+    Stats->HashQueueThreads = Queue->ThreadCount;
+    Stats->HashQueueFull = (ULONG64)Queue->Full;
+}
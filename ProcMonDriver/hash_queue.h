@@ -0,0 +1,98 @@
+#ifndef PROCMON_HASH_QUEUE_H
+#define PROCMON_HASH_QUEUE_H
+
+/*
+ * hash_queue.h — Асинхронное хеширование образов новых процессов.
+ *
+ * ProcessNotifyCallback выполняется в потоке, создающем процесс, и всё
+ * время хеширования (до 4 MB ZwReadFile) процесс не стартует. Поэтому
+ * callback пишет событие создания сразу, без хеша (с флагом
+ * PROCMON_EVENT_FLAG_HASH_PENDING), и ставит файл в очередь. Рабочие
+ * потоки хешируют его и пишут в кольца запись «хеш готов»
+ * (PROCMON_EVENT_FLAG_HASH_READY) с теми же PID, PPID и Sequence, что у создания.
+ *
+ * Очередь ограничена: в ней и в работе не больше HASH_QUEUE_DEPTH файлов.
+ * Если места нет (или нет памяти), событие создания пишется без хеша:
+ * синхронное хеширование под нагрузкой задержало бы каждый новый процесс
+ * как раз тогда, когда их много. Такие отказы считает Full. Без рабочих
+ * потоков очередь работает как синхронный режим.
+ *
+ * Синхронный режим (Parameters\SynchronousHash = 1) — для развёртываний,
+ * которым хеш нужен до запуска процесса: потоки не создаются, и
+ * HashQueuePrepare всегда отказывает.
+ */
+
+#include <ntddk.h>
+#include "buffer.h"
+
+/* Предел рабочих потоков (фактически — не больше активных процессоров) */
+#define HASH_QUEUE_MAX_THREADS  4
+
+/* Файлов в очереди и в работе одновременно */
+#define HASH_QUEUE_DEPTH        256
+
+/* Файл в очереди; путь лежит сразу за структурой */
+typedef struct _HASH_WORK {
+    LIST_ENTRY     Link;
+    ULONG          ProcessId;
+    ULONG          ParentProcessId;
+    ULONG          CreateSequence;  /* Sequence события создания */
+    UNICODE_STRING ImagePath;
+} HASH_WORK, *PHASH_WORK;
+
+typedef struct _HASH_QUEUE {
+    LIST_ENTRY      Items;         /* HASH_WORK в порядке постановки */
+    KSPIN_LOCK      Lock;          /* Защищает Items */
+    KSEMAPHORE      Ready;         /* Счётчик элементов Items (и пробуждение на остановку) */
+    volatile LONG   Depth;         /* В очереди и в работе (ограничение HASH_QUEUE_DEPTH) */
+    volatile LONG   Stop;          /* Просьба потокам завершиться */
+    volatile LONG64 Full;          /* Созданий без хеша из-за полной очереди */
+    PEVENT_BUFFER   Buffer;        /* Куда писать «хеш готов» */
+    HANDLE          Threads[HASH_QUEUE_MAX_THREADS];
+    ULONG           ThreadCount;   /* 0 — синхронный режим */
+} HASH_QUEUE, *PHASH_QUEUE;
+
+/*
+ * Инициализировать очередь; без Synchronous — запустить рабочие потоки.
+ * Не запустившиеся потоки не ошибка: очередь работает с меньшим числом,
+ * а без потоков — как синхронный режим.
+ * IRQL: PASSIVE_LEVEL.
+ */
+VOID HashQueueInit(
+    _Out_ PHASH_QUEUE Queue,
+    _In_ PEVENT_BUFFER Buffer,
+    _In_ BOOLEAN Synchronous
+);
+
+/*
+ * Остановить потоки и освободить необработанные файлы. Вызывать после
+ * снятия callback: новых файлов быть не должно. Безопасно для обнулённой очереди.
+ * IRQL: PASSIVE_LEVEL.
+ */
+VOID HashQueueFree(_Inout_ PHASH_QUEUE Queue);
+
+/* Хешировать в callback: синхронный режим или не запустился ни один поток. */
+BOOLEAN HashQueueSynchronous(_In_ PHASH_QUEUE Queue);
+
+/*
+ * Занять место в очереди и скопировать путь. NULL — создание остаётся
+ * без хеша (очередь полна, нет памяти, драйвер выгружается).
+ */
+PHASH_WORK HashQueuePrepare(_Inout_ PHASH_QUEUE Queue, _In_ PCUNICODE_STRING ImagePath);
+
+/* Отдать файл рабочим потокам: событие создания уже записано. */
+VOID HashQueueSubmit(
+    _Inout_ PHASH_QUEUE Queue,
+    _In_ PHASH_WORK Work,
+    _In_ ULONG ProcessId,
+    _In_ ULONG ParentProcessId,
+    _In_ ULONG CreateSequence
+);
+
+/* Вернуть место: событие создания не записалось, хеш никому не нужен. */
+VOID HashQueueCancel(_Inout_ PHASH_QUEUE Queue, _In_ PHASH_WORK Work);
+
+/* Заполнить поля HashQueue* в PROCMON_STATS. */
+VOID HashQueueQuery(_In_ PHASH_QUEUE Queue, _Inout_ PPROCMON_STATS Stats);
+
+#endif /* PROCMON_HASH_QUEUE_H */
@@ -3,38 +3,553 @@
  *
  * DispatchCreateClose — обрабатывает открытие/закрытие хэндла устройства.
  *   Клиент вызывает CreateFile("\\.\ProcMon") → ядро отправляет IRP_MJ_CREATE.
- *   Клиент вызывает CloseHandle() → ядро отправляет IRP_MJ_CLOSE.
- *   Оба IRP завершаем со STATUS_SUCCESS (ничего делать не нужно).
+ *   Клиент вызывает CloseHandle() → ядро отправляет IRP_MJ_CLEANUP и IRP_MJ_CLOSE.
+ *   На CREATE создаётся контекст хэндла (HANDLE_CONTEXT), на CLOSE — освобождается.
+ *
+ * DispatchCleanup — снимает отображение колец, сделанное через этот хэндл,
+ *   и отменяет его отложенные запросы событий.
  *
  * DispatchDeviceControl — обрабатывает IOCTL-запросы.
  *   Клиент вызывает DeviceIoControl() → ядро отправляет IRP_MJ_DEVICE_CONTROL.
  *   Мы обрабатываем IOCTL_PROCMON_GET_EVENTS: читаем события из кольцевого буфера
  *   и копируем их в выходной буфер клиента.
+ *   Чтение не разрушает данные: у каждого хэндла своя позиция в кольцах
+ *   (BUFFER_READER), так что несколько клиентов получают каждый все события.
+ *   IOCTL_PROCMON_GET_EVENTS_V2 делает то же в компактном формате:
+ *   32-байтовые заголовки плюс область данных только с реальными именами и хешами.
+ *   IOCTL_PROCMON_GET_EVENTS_DIRECT — тот же ответ v2, но METHOD_OUT_DIRECT:
+ *   пишем прямо в закреплённые страницы клиента через MDL.
+ *   IOCTL_PROCMON_WAIT_EVENTS — то же, но без событий запрос откладывается
+ *   (pending.c) и завершается потоком доставки, когда события появятся.
+ *   IOCTL_PROCMON_MAP_EVENTS отображает сами кольца в процесс клиента,
+ *   после чего события читаются без IOCTL (см. common/ring.c).
+ *   IOCTL_PROCMON_GET_BUFFER_INFO / SET_BUFFER_CONFIG — параметры колец,
+ *   занимаемая память и изменение размера на лету.
+ *   Перечисления драйверов и устройств отдаются страницами из снимка
+ *   хэндла (snapshot.c) по курсору из PROCMON_ENUM_REQUEST.
+ *   IOCTL_PROCMON_GET_LOADED_DRIVERS_DELTA отдаёт только изменения набора
+ *   загруженных драйверов с известного клиенту поколения (enum_drivers.c).
+ *   IOCTL_PROCMON_SET_FILTER ставит хэндлу программу фильтра (common/filter.c):
+ *   все IOCTL-чтения событий через этот хэндл пропускают через неё записи
+ *   до копирования в ответ.
+ *   IOCTL_PROCMON_GET_STATS отдаёт счётчики драйвера (stats.c); время
+ *   обработки каждого IOCTL в них же учитывает обёртка DispatchDeviceControl.
  */
 
 #include "driver.h"
 #include "enum_drivers.h"
 #include "enum_devices.h"
+#include "stats.h"
 
 /*
  * DispatchCreateClose — обработчик открытия/закрытия устройства.
  *
- * Минимальная реализация: просто завершаем IRP успешно.
- * Без этого обработчика CreateFile в клиенте вернёт ошибку.
+ * На открытии создаёт контекст хэндла со своим читателем колец и сохраняет
+ * его в FileObject->FsContext, на закрытии освобождает. Отображение к этому
+ * моменту уже снято в DispatchCleanup.
  */
 NTSTATUS DispatchCreateClose(
     _In_ PDEVICE_OBJECT DeviceObject,
     _Inout_ PIRP Irp)
 {
-    UNREFERENCED_PARAMETER(DeviceObject);
+    PIO_STACK_LOCATION irpSp;
+    PHANDLE_CONTEXT    context;
+    PDEVICE_EXTENSION  extension;
+    NTSTATUS           status = STATUS_SUCCESS;
+
+    irpSp = IoGetCurrentIrpStackLocation(Irp);
+    extension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+    if (irpSp->MajorFunction == IRP_MJ_CREATE) {
+        context = (PHANDLE_CONTEXT)ExAllocatePoolWithTag(NonPagedPoolNx,
+                                                         sizeof(HANDLE_CONTEXT), POOL_TAG);
+        if (context == NULL) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        } else {
+            RtlZeroMemory(context, sizeof(HANDLE_CONTEXT));
+            SnapshotInit(&context->Snapshot);
+            ExInitializeFastMutex(&context->FilterLock);
+
+            status = BufferReaderOpen(&extension->EventBuffer, &context->Reader);
+            if (NT_SUCCESS(status)) {
+                irpSp->FileObject->FsContext = context;
+            } else {
+                ExFreePoolWithTag(context, POOL_TAG);
+            }
+        }
+    } else {
+        context = (PHANDLE_CONTEXT)irpSp->FileObject->FsContext;
+        if (context != NULL) {
+            irpSp->FileObject->FsContext = NULL;
+            BufferReaderClose(&extension->EventBuffer, &context->Reader);
+            SnapshotFree(&context->Snapshot);
+            if (context->Filter != NULL) {
+                ExFreePoolWithTag(context->Filter, POOL_TAG);
+            }
+            ExFreePoolWithTag(context, POOL_TAG);
+        }
+    }
 
     /* Устанавливаем статус завершения IRP */
-    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Status = status;
     Irp->IoStatus.Information = 0;
 
     /* Завершаем IRP — возвращаем результат вызывающей стороне */
     IoCompleteRequest(Irp, IO_NO_INCREMENT);
 
+    return status;
+}
+
+/*
+ * DispatchCleanup — закрыт последний хэндл файлового объекта.
+ *
+ * Приходит в контексте закрывающего процесса, поэтому здесь
+ * отображение колец ещё можно снять из его адресного пространства.
+ */
+NTSTATUS DispatchCleanup(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION irpSp;
+    PHANDLE_CONTEXT    context;
+    PDEVICE_EXTENSION  extension;
+
+    irpSp = IoGetCurrentIrpStackLocation(Irp);
+    context = (PHANDLE_CONTEXT)irpSp->FileObject->FsContext;
+    extension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+
+    if (context != NULL && context->Mapping.View != NULL) {
+        BufferUnmapView(&extension->EventBuffer, &context->Mapping);
+    }
+
+    PendingCancelFile(&extension->PendingReads, irpSp->FileObject);
+
+    Irp->IoStatus.Status = STATUS_SUCCESS;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * HandleFilterAccept — пропускает ли фильтр хэндла запись.
+ * Вызывается из приёмников под Handle->FilterLock (см. ReadFiltered).
+ */
+static BOOLEAN HandleFilterAccept(_In_ PHANDLE_CONTEXT Handle, _In_ const PROCMON_RECORD *Record)
+{
+    if (Handle->Filter == NULL) {
+        return TRUE;
+    }
+
+    return FilterRun(Handle->Filter, &Handle->FilterState, Record);
+}
+
+/*
+ * ReadFiltered — BufferRead читателем хэндла под замком его фильтра,
+ * чтобы SET_FILTER не заменил программу посреди чтения.
+ */
+static VOID ReadFiltered(
+    _Inout_ PEVENT_BUFFER Buffer,
+    _In_ PHANDLE_CONTEXT Handle,
+    _In_ PBUFFER_SINK Sink,
+    _Inout_ PVOID SinkContext)
+{
+    ExAcquireFastMutex(&Handle->FilterLock);
+    BufferRead(Buffer, &Handle->Reader, Sink, SinkContext);
+    ExReleaseFastMutex(&Handle->FilterLock);
+}
+
+/*
+ * Приёмник BufferRead для формата v1: массив PROCMON_EVENT фиксированного размера.
+ */
+typedef struct _EVENT_SINK_V1 {
+    PPROCMON_EVENT  Events;     /* Выходной массив */
+    ULONG           MaxEvents;  /* Ёмкость массива */
+    ULONG           Count;      /* Сколько уже записано */
+    PHANDLE_CONTEXT Handle;     /* Чей фильтр применять */
+} EVENT_SINK_V1, *PEVENT_SINK_V1;
+
+static BOOLEAN EventSinkV1(_Inout_ PVOID Context, _In_ const PROCMON_RECORD *Record)
+{
+    PEVENT_SINK_V1 sink = (PEVENT_SINK_V1)Context;
+    PPROCMON_EVENT event;
+    const CHAR    *name;
+    ULONG          nameLength;
+
+    /*
+     * В формате v1 пропуски не выразить — только счётчики в v2. Записи
+     * «хеш готов» v1-клиент принял бы за завершение: ему хеши приходят
+     * только в синхронном режиме (SynchronousHash).
+     */
+    if (Record->Header.Flags & (PROCMON_EVENT_FLAG_GAP | PROCMON_EVENT_FLAG_HASH_READY)) {
+        return TRUE;
+    }
+
+    if (sink->Count >= sink->MaxEvents) {
+        return FALSE;
+    }
+
+    /* Отвергнутое фильтром событие прочитано, но в ответ не попадает */
+    if (!HandleFilterAccept(sink->Handle, Record)) {
+        return TRUE;
+    }
+
+    event = &sink->Events[sink->Count];
+    RtlZeroMemory(event, sizeof(PROCMON_EVENT));
+
+    event->ProcessId = Record->Header.ProcessId;
+    event->ParentProcessId = Record->Header.ParentProcessId;
+    event->IsCreate = (Record->Header.Flags & PROCMON_EVENT_FLAG_CREATE) ? TRUE : FALSE;
+    event->Timestamp = Record->Header.Timestamp;
+
+    /* В v1 имя есть всегда: у событий без имени — прежние заглушки */
+    if (Record->Header.Flags & PROCMON_EVENT_FLAG_NAME_LOST) {
+        name = "<lost>";
+        nameLength = sizeof("<lost>") - 1;
+    } else if (!event->IsCreate) {
+        name = "<exiting>";
+        nameLength = sizeof("<exiting>") - 1;
+    } else {
+        name = Record->ImageName;
+        nameLength = Record->Header.NameLength;
+    }
+    RtlCopyMemory(event->ImageName, name, nameLength);
+    event->ImageName[nameLength] = '\0';
+
+    /* В v1 помещается только MD5, и клиент v1 принял бы корень дерева за MD5 файла */
+    if ((Record->Header.Flags & PROCMON_EVENT_FLAG_HASH_VALID) &&
+        !(Record->Header.Flags & (PROCMON_EVENT_FLAG_HASH_SHA256 | PROCMON_EVENT_FLAG_HASH_TREE))) {
+        RtlCopyMemory(event->FileHash, Record->FileHash, PROCMON_HASH_SIZE);
+        event->HashValid = TRUE;
+    }
+
+    sink->Count++;
+    return TRUE;
+}
+
+/*
+ * Приёмник BufferRead для формата v2.
+ * Заголовки растут от начала буфера вверх, данные (хеш + имя) — от конца вниз.
+ * Пока ответ собирается, NameOffset/HashOffset хранят смещения от начала буфера;
+ * в конце данные сдвигаются вплотную к заголовкам, а смещения пересчитываются.
+ */
+typedef struct _EVENT_SINK_V2 {
+    PUCHAR          Base;        /* Начало выходного буфера */
+    ULONG           HeaderEnd;   /* Конец массива заголовков */
+    ULONG           DataStart;   /* Начало области данных (растёт вниз) */
+    ULONG           Count;       /* Количество заголовков */
+    BOOLEAN         Full;        /* Запись не поместилась и осталась в кольце */
+    PHANDLE_CONTEXT Handle;      /* Чей фильтр применять */
+} EVENT_SINK_V2, *PEVENT_SINK_V2;
+
+static BOOLEAN EventSinkV2(_Inout_ PVOID Context, _In_ const PROCMON_RECORD *Record)
+{
+    PEVENT_SINK_V2        sink = (PEVENT_SINK_V2)Context;
+    PPROCMON_EVENT_HEADER header;
+    ULONG                 hashLength;
+    ULONG                 dataLength;
+
+    hashLength = (Record->Header.Flags & PROCMON_EVENT_FLAG_HASH_VALID)
+                 ? PROCMON_EVENT_HASH_SIZE(Record->Header.Flags) : 0;
+    dataLength = hashLength + Record->Header.NameLength;
+
+    if (sink->HeaderEnd + sizeof(PROCMON_EVENT_HEADER) + dataLength > sink->DataStart) {
+        sink->Full = TRUE;
+        return FALSE;
+    }
+
+    /*
+     * Фильтр — после проверки места: событие, которое не поместилось,
+     * останется в кольце, и счётчики RATE не должны учесть его дважды.
+     */
+    if (!HandleFilterAccept(sink->Handle, Record)) {
+        return TRUE;
+    }
+
+    header = (PPROCMON_EVENT_HEADER)(sink->Base + sink->HeaderEnd);
+    *header = Record->Header;
+    sink->HeaderEnd += sizeof(PROCMON_EVENT_HEADER);
+    sink->DataStart -= dataLength;
+
+    if (hashLength != 0) {
+        RtlCopyMemory(sink->Base + sink->DataStart, Record->FileHash, hashLength);
+        header->HashOffset = sink->DataStart;
+    }
+
+    if (Record->Header.NameLength != 0) {
+        RtlCopyMemory(sink->Base + sink->DataStart + hashLength,
+                      Record->ImageName, Record->Header.NameLength);
+        header->NameOffset = sink->DataStart + hashLength;
+    }
+
+    sink->Count++;
+    return TRUE;
+}
+
+/*
+ * FillEventsV2 — собрать PROCMON_EVENT_RESPONSE_V2 в Output.
+ * OutputLength должен вмещать хотя бы заголовок ответа.
+ * Handle — хэндл, чьим читателем и фильтром читать.
+ * Empty  — TRUE, если в ответ не попало ни одной записи (ни события, ни
+ *          пропуска), хотя место было: всё прочитанное отверг фильтр.
+ * Возвращает количество записанных байт.
+ */
+static ULONG FillEventsV2(
+    _Inout_ PEVENT_BUFFER Buffer,
+    _In_ PHANDLE_CONTEXT Handle,
+    _Out_writes_bytes_(OutputLength) PVOID Output,
+    _In_ ULONG OutputLength,
+    _Out_opt_ PBOOLEAN Empty)
+{
+    PPROCMON_EVENT_RESPONSE_V2 response = (PPROCMON_EVENT_RESPONSE_V2)Output;
+    EVENT_SINK_V2              sink;
+    ULONG                      dataLength;
+    ULONG                      i;
+
+    sink.Base = (PUCHAR)Output;
+    sink.HeaderEnd = FIELD_OFFSET(PROCMON_EVENT_RESPONSE_V2, Events);
+    sink.DataStart = OutputLength;
+    sink.Count = 0;
+    sink.Full = FALSE;
+    sink.Handle = Handle;
+
+    ReadFiltered(Buffer, Handle, EventSinkV2, &sink);
+
+    if (Empty != NULL) {
+        *Empty = (sink.Count == 0 && !sink.Full);
+    }
+
+    /* Сдвигаем данные вплотную к заголовкам и пересчитываем смещения */
+    dataLength = OutputLength - sink.DataStart;
+    RtlMoveMemory(sink.Base + sink.HeaderEnd, sink.Base + sink.DataStart, dataLength);
+
+    for (i = 0; i < sink.Count; i++) {
+        if (response->Events[i].NameOffset != PROCMON_NO_DATA) {
+            response->Events[i].NameOffset -= sink.DataStart;
+        }
+        if (response->Events[i].HashOffset != PROCMON_NO_DATA) {
+            response->Events[i].HashOffset -= sink.DataStart;
+        }
+    }
+
+    response->Version = PROCMON_EVENT_FORMAT_V3;
+    response->EventCount = sink.Count;
+    response->DataOffset = sink.HeaderEnd;
+    response->DataLength = dataLength;
+
+    BufferQueryLoss(Buffer, &Handle->Reader, &response->DroppedEvents,
+                    &response->OverwrittenEvents, &response->PendingEvents);
+
+    return sink.HeaderEnd + dataLength;
+}
+
+/*
+ * MapEventsOutput — выходной буфер METHOD_OUT_DIRECT-запроса событий.
+ *
+ * Выходной буфер клиента уже закреплён ядром, Irp->MdlAddress описывает
+ * его страницы. Отображаем их в системное пространство и собираем ответ
+ * на месте — промежуточного буфера и копирования при завершении IRP нет.
+ */
+static NTSTATUS MapEventsOutput(_In_ PIRP Irp, _In_ ULONG OutputLength, _Out_ PVOID *Output)
+{
+    *Output = NULL;
+
+    if (OutputLength < (ULONG)FIELD_OFFSET(PROCMON_EVENT_RESPONSE_V2, Events) ||
+        Irp->MdlAddress == NULL) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    /* В ответе есть 64-битные поля */
+    if (((ULONG_PTR)MmGetMdlVirtualAddress(Irp->MdlAddress) & 7) != 0) {
+        return STATUS_DATATYPE_MISALIGNMENT;
+    }
+
+    *Output = MmGetSystemAddressForMdlSafe(Irp->MdlAddress,
+                                           NormalPagePriority | MdlMappingNoExecute);
+    if (*Output == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * DeliverPendingEvents — заполнить отложенный IOCTL_PROCMON_WAIT_EVENTS,
+ * если читателю его хэндла есть что отдать.
+ * Буфер проверен ещё при постановке в очередь; здесь он только отображается.
+ * Если фильтр хэндла отверг всё прочитанное, позиция читателя уже
+ * сдвинута, а запрос остаётся в очереди: клиент с узким фильтром не
+ * просыпается на каждое чужое событие.
+ */
+BOOLEAN DeliverPendingEvents(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PIRP Irp)
+{
+    PIO_STACK_LOCATION irpSp = IoGetCurrentIrpStackLocation(Irp);
+    PHANDLE_CONTEXT    context = (PHANDLE_CONTEXT)irpSp->FileObject->FsContext;
+    ULONG              outputLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+    PVOID              output;
+    NTSTATUS           status;
+    ULONG              bytes = 0;
+    BOOLEAN            empty = FALSE;
+
+    if (!BufferHasData(Buffer, &context->Reader)) {
+        return FALSE;
+    }
+
+    status = MapEventsOutput(Irp, outputLength, &output);
+    if (NT_SUCCESS(status)) {
+        bytes = FillEventsV2(Buffer, context, output, outputLength, &empty);
+        if (empty) {
+            return FALSE;
+        }
+    }
+
+    Irp->IoStatus.Status = status;
+    Irp->IoStatus.Information = bytes;
+
+    return TRUE;
+}
+
+/* Ответы перечислений отличаются только типом записей */
+C_ASSERT(FIELD_OFFSET(DRIVER_INFO_RESPONSE, Drivers) == FIELD_OFFSET(DEVICE_INFO_RESPONSE, Devices));
+C_ASSERT(FIELD_OFFSET(DRIVER_INFO_RESPONSE_PAGED, Drivers) == FIELD_OFFSET(DEVICE_INFO_RESPONSE_PAGED, Devices));
+C_ASSERT(FIELD_OFFSET(DRIVER_INFO_RESPONSE_PAGED, Cache) == FIELD_OFFSET(DEVICE_INFO_RESPONSE_PAGED, Cache));
+C_ASSERT(FIELD_OFFSET(DRIVER_INFO_RESPONSE_V2, Drivers) == FIELD_OFFSET(DEVICE_INFO_RESPONSE_V2, Devices));
+C_ASSERT(FIELD_OFFSET(DRIVER_INFO_RESPONSE_V2, Cache) == FIELD_OFFSET(DEVICE_INFO_RESPONSE_V2, Cache));
+
+/* Перечисления с нетипизированным выходом для снимка (PSNAPSHOT_ENUMERATE) */
+static NTSTATUS SnapshotInstalledDrivers(PVOID Output, ULONG MaxEntries,
+                                         PULONG TotalCount, PULONG ReturnedCount)
+{
+    PDEVICE_EXTENSION extension = (PDEVICE_EXTENSION)g_DeviceObject->DeviceExtension;
+
+    return InstalledCacheRead(&extension->InstalledDrivers, (PDRIVER_INFO)Output,
+                              MaxEntries, TotalCount, ReturnedCount);
+}
+
+static NTSTATUS SnapshotLoadedDrivers(PVOID Output, ULONG MaxEntries,
+                                      PULONG TotalCount, PULONG ReturnedCount)
+{
+    return EnumerateLoadedDrivers((PDRIVER_INFO)Output, MaxEntries, TotalCount, ReturnedCount);
+}
+
+static NTSTATUS SnapshotDevices(PVOID Output, ULONG MaxEntries,
+                                PULONG TotalCount, PULONG ReturnedCount)
+{
+    PDEVICE_EXTENSION extension = (PDEVICE_EXTENSION)g_DeviceObject->DeviceExtension;
+
+    return DeviceCacheRead(&extension->DeviceTable, (PDEVICE_INFO)Output,
+                           MaxEntries, TotalCount, ReturnedCount);
+}
+
+/*
+ * ReadEnumPage — ответ IOCTL перечисления: страница снимка хэндла.
+ *
+ * Вход (необязательный) — PROCMON_ENUM_REQUEST, выход — DRIVER_INFO_RESPONSE
+ * или DEVICE_INFO_RESPONSE в прежней разметке, с Format ==
+ * PROCMON_ENUM_FORMAT_PAGED — они же с курсором (..._RESPONSE_PAGED), а с
+ * PROCMON_ENUM_FORMAT_V2 — варианты v2 с таблицей строк. Вход и выход делят
+ * SystemBuffer, поэтому курсор и формат читаются до записи ответа.
+ * Counters — кэш, из которого берёт записи Enumerate (NULL — перечисление без кэша);
+ * его счётчики попадают только в ответы PAGED и v2, разметка формата 0 их не вмещает.
+ */
+static NTSTATUS ReadEnumPage(
+    _Inout_ PIRP Irp,
+    _In_ PSNAPSHOT_ENUMERATE Enumerate,
+    _In_ ULONG EntrySize,
+    _In_opt_ const ENUM_CACHE_COUNTERS *Counters,
+    _Out_ PULONG BytesReturned)
+{
+    PIO_STACK_LOCATION    irpSp = IoGetCurrentIrpStackLocation(Irp);
+    PHANDLE_CONTEXT       context = (PHANDLE_CONTEXT)irpSp->FileObject->FsContext;
+    ULONG                 inputLength = irpSp->Parameters.DeviceIoControl.InputBufferLength;
+    ULONG                 outputLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
+    ULONG                 ioControlCode = irpSp->Parameters.DeviceIoControl.IoControlCode;
+    PPROCMON_ENUM_REQUEST request = (PPROCMON_ENUM_REQUEST)Irp->AssociatedIrp.SystemBuffer;
+    PDRIVER_INFO_RESPONSE response = (PDRIVER_INFO_RESPONSE)Irp->AssociatedIrp.SystemBuffer;
+    PDRIVER_INFO_RESPONSE_PAGED responsePaged = (PDRIVER_INFO_RESPONSE_PAGED)Irp->AssociatedIrp.SystemBuffer;
+    PDRIVER_INFO_RESPONSE_V2 responseV2 = (PDRIVER_INFO_RESPONSE_V2)Irp->AssociatedIrp.SystemBuffer;
+    ENUM_ENCODER          encoder;
+    SNAPSHOT_PAGE         page;
+    ULONG                 format = 0;
+    ULONG                 headerSize;
+    NTSTATUS              status;
+
+    *BytesReturned = 0;
+
+    if (context == NULL) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+
+    RtlZeroMemory(&page, sizeof(page));
+
+    /* Старые клиенты передают только курсор */
+    if (inputLength >= RTL_SIZEOF_THROUGH_FIELD(PROCMON_ENUM_REQUEST, Cursor)) {
+        page.Cursor = request->Cursor;
+    }
+    if (inputLength >= sizeof(PROCMON_ENUM_REQUEST)) {
+        format = request->Format;
+    }
+
+    if (format == PROCMON_ENUM_FORMAT_V2) {
+        if (outputLength < ENUM_V2_HEADER_SIZE) {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+
+        status = EnumEncoderInit(&encoder, (BOOLEAN)(ioControlCode == IOCTL_PROCMON_GET_DEVICES),
+                                 responseV2, outputLength);
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        page.Encode = EnumEncodeEntries;
+        page.EncodeContext = &encoder;
+
+        status = SnapshotReadPage(&context->Snapshot, ioControlCode, Enumerate, EntrySize, &page);
+        if (NT_SUCCESS(status)) {
+            *BytesReturned = EnumEncoderFinish(&encoder);
+            responseV2->TotalCount = page.TotalCount;
+            responseV2->NextCursor = page.NextCursor;
+            SnapshotCacheStats(Counters, &responseV2->Cache);
+        }
+
+        EnumEncoderFree(&encoder);
+        return status;
+    }
+
+    /* Записи фиксированного размера: прежний заголовок или заголовок с курсором */
+    if (format == 0) {
+        headerSize = (ULONG)FIELD_OFFSET(DRIVER_INFO_RESPONSE, Drivers);
+    } else if (format == PROCMON_ENUM_FORMAT_PAGED) {
+        headerSize = (ULONG)FIELD_OFFSET(DRIVER_INFO_RESPONSE_PAGED, Drivers);
+    } else {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (outputLength < headerSize) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    page.Output = (PUCHAR)Irp->AssociatedIrp.SystemBuffer + headerSize;
+    page.MaxEntries = (outputLength - headerSize) / EntrySize;
+
+    status = SnapshotReadPage(&context->Snapshot, ioControlCode, Enumerate, EntrySize, &page);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (format == PROCMON_ENUM_FORMAT_PAGED) {
+        responsePaged->Version = PROCMON_ENUM_FORMAT_PAGED;
+        responsePaged->TotalCount = page.TotalCount;
+        responsePaged->ReturnedCount = page.ReturnedCount;
+        responsePaged->Reserved = 0;
+        responsePaged->NextCursor = page.NextCursor;
+        SnapshotCacheStats(Counters, &responsePaged->Cache);
+    } else {
+        response->TotalCount = page.TotalCount;
+        response->ReturnedCount = page.ReturnedCount;
+    }
+    *BytesReturned = headerSize + page.ReturnedCount * EntrySize;
+
     return STATUS_SUCCESS;
 }
 
@@ -52,7 +567,7 @@ NTSTATUS DispatchCreateClose(
  * 4. Читаем события из кольцевого буфера.
  * 5. Устанавливаем Information = реальный размер возвращённых данных.
  */
-NTSTATUS DispatchDeviceControl(
+static NTSTATUS DeviceControl(
     _In_ PDEVICE_OBJECT DeviceObject,
     _Inout_ PIRP Irp)
 {
@@ -61,9 +576,10 @@ NTSTATUS DispatchDeviceControl(
     ULONG               outputLength;
     ULONG               ioctlCode;
     ULONG               maxEvents;
-    ULONG               readCount;
     PPROCMON_EVENT_RESPONSE response;
+    EVENT_SINK_V1       sinkV1;
     PDEVICE_EXTENSION   extension;
+    PHANDLE_CONTEXT     handle;
     ULONG               bytesReturned = 0;
 
     irpSp = IoGetCurrentIrpStackLocation(Irp);
@@ -71,6 +587,13 @@ NTSTATUS DispatchDeviceControl(
     outputLength = irpSp->Parameters.DeviceIoControl.OutputBufferLength;
 
     extension = (PDEVICE_EXTENSION)DeviceObject->DeviceExtension;
+    handle = (PHANDLE_CONTEXT)irpSp->FileObject->FsContext;
+
+    /* Контекст есть у каждого открытого хэндла: без него CREATE не проходит */
+    if (handle == NULL) {
+        status = STATUS_INVALID_DEVICE_REQUEST;
+        goto complete;
+    }
 
     switch (ioctlCode) {
     case IOCTL_PROCMON_GET_EVENTS:
@@ -112,81 +635,206 @@ NTSTATUS DispatchDeviceControl(
             break;
         }
 
-        /* Читаем события из кольцевого буфера */
-        readCount = BufferRead(&extension->RingBuffer, response->Events, maxEvents);
-        response->EventCount = readCount;
+        /* Читаем события из кольцевых буферов */
+        sinkV1.Events = response->Events;
+        sinkV1.MaxEvents = maxEvents;
+        sinkV1.Count = 0;
+        sinkV1.Handle = handle;
+        ReadFiltered(&extension->EventBuffer, sinkV1.Handle, EventSinkV1, &sinkV1);
+        response->EventCount = sinkV1.Count;
 
         /*
          * bytesReturned = размер заголовка + размер фактических данных.
          * Это значение ядро использует для копирования данных в user-space.
          */
         bytesReturned = FIELD_OFFSET(PROCMON_EVENT_RESPONSE, Events)
-                        + readCount * sizeof(PROCMON_EVENT);
+                        + sinkV1.Count * sizeof(PROCMON_EVENT);
 
         status = STATUS_SUCCESS;
         break;
 
-    case IOCTL_PROCMON_GET_INSTALLED_DRIVERS:
-    case IOCTL_PROCMON_GET_LOADED_DRIVERS:
-    {
-        PDRIVER_INFO_RESPONSE drvResponse;
-        ULONG drvMaxEntries;
-        ULONG drvTotal = 0, drvReturned = 0;
+    case IOCTL_PROCMON_GET_EVENTS_V2:
 
-        /* Минимальный буфер: TotalCount + ReturnedCount */
-        if (outputLength < (ULONG)FIELD_OFFSET(DRIVER_INFO_RESPONSE, Drivers)) {
+        /* Буфер должен вмещать хотя бы заголовок ответа (Version..OverwrittenEvents) */
+        if (outputLength < (ULONG)FIELD_OFFSET(PROCMON_EVENT_RESPONSE_V2, Events)) {
             status = STATUS_BUFFER_TOO_SMALL;
             break;
         }
 
-        drvResponse = (PDRIVER_INFO_RESPONSE)Irp->AssociatedIrp.SystemBuffer;
-        drvMaxEntries = (outputLength - (ULONG)FIELD_OFFSET(DRIVER_INFO_RESPONSE, Drivers))
-                        / sizeof(DRIVER_INFO);
+        bytesReturned = FillEventsV2(&extension->EventBuffer, handle,
+                                     Irp->AssociatedIrp.SystemBuffer, outputLength, NULL);
+        status = STATUS_SUCCESS;
+        break;
 
-        if (ioctlCode == IOCTL_PROCMON_GET_INSTALLED_DRIVERS) {
-            status = EnumerateInstalledDrivers(drvResponse->Drivers, drvMaxEntries,
-                                               &drvTotal, &drvReturned);
-        } else {
-            status = EnumerateLoadedDrivers(drvResponse->Drivers, drvMaxEntries,
-                                            &drvTotal, &drvReturned);
+    case IOCTL_PROCMON_GET_EVENTS_DIRECT:
+    case IOCTL_PROCMON_WAIT_EVENTS:
+    {
+        PVOID output;
+
+        status = MapEventsOutput(Irp, outputLength, &output);
+        if (!NT_SUCCESS(status)) {
+            break;
         }
 
-        if (NT_SUCCESS(status)) {
-            drvResponse->TotalCount = drvTotal;
-            drvResponse->ReturnedCount = drvReturned;
-            bytesReturned = FIELD_OFFSET(DRIVER_INFO_RESPONSE, Drivers)
-                            + drvReturned * sizeof(DRIVER_INFO);
+        /*
+         * Ожидающий запрос заполняет и завершает только поток доставки,
+         * даже если события уже есть: заполнив его здесь, мы завершили бы
+         * его одновременно с другим запросом хэндла из потока доставки,
+         * и пачки пришли бы в порт не в порядке событий.
+         */
+        if (ioctlCode == IOCTL_PROCMON_WAIT_EVENTS) {
+            return PendingEnqueue(&extension->PendingReads, Irp);
         }
+
+        bytesReturned = FillEventsV2(&extension->EventBuffer, handle, output, outputLength, NULL);
         break;
     }
 
-    case IOCTL_PROCMON_GET_DEVICES:
+    case IOCTL_PROCMON_MAP_EVENTS:
     {
-        PDEVICE_INFO_RESPONSE devResponse;
-        ULONG devMaxEntries;
-        ULONG devTotal = 0, devReturned = 0;
+        PHANDLE_CONTEXT       context = (PHANDLE_CONTEXT)irpSp->FileObject->FsContext;
+        PPROCMON_MAP_RESPONSE mapResponse;
 
-        if (outputLength < (ULONG)FIELD_OFFSET(DEVICE_INFO_RESPONSE, Devices)) {
+        if (outputLength < sizeof(PROCMON_MAP_RESPONSE)) {
             status = STATUS_BUFFER_TOO_SMALL;
             break;
         }
 
-        devResponse = (PDEVICE_INFO_RESPONSE)Irp->AssociatedIrp.SystemBuffer;
-        devMaxEntries = (outputLength - (ULONG)FIELD_OFFSET(DEVICE_INFO_RESPONSE, Devices))
-                        / sizeof(DEVICE_INFO);
-
-        status = EnumerateDevices(devResponse->Devices, devMaxEntries,
-                                  &devTotal, &devReturned);
+        /* Отображение в адресное пространство ядра не имеет смысла */
+        if (Irp->RequestorMode != UserMode || context == NULL) {
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+        }
 
+        /* Одно отображение на хэндл; после замены колец — отображение нового набора */
+        status = BufferMapView(&extension->EventBuffer, &context->Mapping);
         if (NT_SUCCESS(status)) {
-            devResponse->TotalCount = devTotal;
-            devResponse->ReturnedCount = devReturned;
-            bytesReturned = FIELD_OFFSET(DEVICE_INFO_RESPONSE, Devices)
-                            + devReturned * sizeof(DEVICE_INFO);
+            mapResponse = (PPROCMON_MAP_RESPONSE)Irp->AssociatedIrp.SystemBuffer;
+            mapResponse->BaseAddress = (ULONG64)(ULONG_PTR)context->Mapping.View;
+            mapResponse->ViewSize = context->Mapping.ViewSize;
+            bytesReturned = sizeof(PROCMON_MAP_RESPONSE);
         }
         break;
     }
 
+    case IOCTL_PROCMON_GET_BUFFER_INFO:
+
+        if (outputLength < sizeof(PROCMON_BUFFER_INFO)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        BufferQueryInfo(&extension->EventBuffer,
+                        (PPROCMON_BUFFER_INFO)Irp->AssociatedIrp.SystemBuffer);
+        bytesReturned = sizeof(PROCMON_BUFFER_INFO);
+        break;
+
+    case IOCTL_PROCMON_SET_BUFFER_CONFIG:
+    {
+        PROCMON_BUFFER_CONFIG config;
+
+        if (irpSp->Parameters.DeviceIoControl.InputBufferLength < sizeof(PROCMON_BUFFER_CONFIG)) {
+            status = STATUS_INVALID_PARAMETER;
+            break;
+        }
+
+        /* Вход и выход делят SystemBuffer — копируем вход до записи ответа */
+        config = *(PPROCMON_BUFFER_CONFIG)Irp->AssociatedIrp.SystemBuffer;
+
+        status = BufferResize(&extension->EventBuffer, &config);
+        if (NT_SUCCESS(status) && outputLength >= sizeof(PROCMON_BUFFER_INFO)) {
+            BufferQueryInfo(&extension->EventBuffer,
+                            (PPROCMON_BUFFER_INFO)Irp->AssociatedIrp.SystemBuffer);
+            bytesReturned = sizeof(PROCMON_BUFFER_INFO);
+        }
+        break;
+    }
+
+    case IOCTL_PROCMON_SET_FILTER:
+    {
+        PHANDLE_CONTEXT         context = (PHANDLE_CONTEXT)irpSp->FileObject->FsContext;
+        ULONG                   inputLength = irpSp->Parameters.DeviceIoControl.InputBufferLength;
+        PPROCMON_FILTER_PROGRAM program = NULL;
+        PPROCMON_FILTER_PROGRAM oldProgram;
+
+        if (context == NULL) {
+            status = STATUS_INVALID_DEVICE_REQUEST;
+            break;
+        }
+
+        /* Пустой вход — снять фильтр */
+        if (inputLength != 0) {
+            if (!FilterVerify((PPROCMON_FILTER_PROGRAM)Irp->AssociatedIrp.SystemBuffer,
+                              inputLength)) {
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            program = (PPROCMON_FILTER_PROGRAM)ExAllocatePoolWithTag(NonPagedPoolNx,
+                                                                     inputLength, POOL_TAG);
+            if (program == NULL) {
+                status = STATUS_INSUFFICIENT_RESOURCES;
+                break;
+            }
+            RtlCopyMemory(program, Irp->AssociatedIrp.SystemBuffer, inputLength);
+        }
+
+        ExAcquireFastMutex(&context->FilterLock);
+        oldProgram = context->Filter;
+        context->Filter = program;
+        RtlZeroMemory(&context->FilterState, sizeof(PROCMON_FILTER_STATE));
+        ExReleaseFastMutex(&context->FilterLock);
+
+        if (oldProgram != NULL) {
+            ExFreePoolWithTag(oldProgram, POOL_TAG);
+        }
+        break;
+    }
+
+    case IOCTL_PROCMON_GET_INSTALLED_DRIVERS:
+        status = ReadEnumPage(Irp, SnapshotInstalledDrivers, sizeof(DRIVER_INFO),
+                              &extension->InstalledDrivers.Counters, &bytesReturned);
+        break;
+
+    case IOCTL_PROCMON_GET_LOADED_DRIVERS:
+        status = ReadEnumPage(Irp, SnapshotLoadedDrivers, sizeof(DRIVER_INFO), NULL,
+                              &bytesReturned);
+        break;
+
+    case IOCTL_PROCMON_GET_LOADED_DRIVERS_DELTA:
+    {
+        ULONG since = 0;
+
+        /* Вход и выход делят SystemBuffer — поколение читаем до ответа */
+        if (irpSp->Parameters.DeviceIoControl.InputBufferLength >= sizeof(PROCMON_DELTA_REQUEST)) {
+            since = ((PPROCMON_DELTA_REQUEST)Irp->AssociatedIrp.SystemBuffer)->Generation;
+        }
+
+        status = ModuleTableQueryDelta(&extension->LoadedModules, since,
+                                       (PDRIVER_DELTA_RESPONSE)Irp->AssociatedIrp.SystemBuffer,
+                                       outputLength, &bytesReturned);
+        break;
+    }
+
+    case IOCTL_PROCMON_GET_STATS:
+
+        if (outputLength < sizeof(PROCMON_STATS)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        StatsQuery((PPROCMON_STATS)Irp->AssociatedIrp.SystemBuffer);
+        HashCacheQuery((PPROCMON_STATS)Irp->AssociatedIrp.SystemBuffer);
+        HashQueueQuery(&extension->HashQueue, (PPROCMON_STATS)Irp->AssociatedIrp.SystemBuffer);
+        HashQuery((PPROCMON_STATS)Irp->AssociatedIrp.SystemBuffer);
+        bytesReturned = sizeof(PROCMON_STATS);
+        break;
+
+    case IOCTL_PROCMON_GET_DEVICES:
+        status = ReadEnumPage(Irp, SnapshotDevices, sizeof(DEVICE_INFO),
+                              &extension->DeviceTable.Counters, &bytesReturned);
+        break;
+
     default:
         /* Неизвестный IOCTL-код */
         status = STATUS_INVALID_DEVICE_REQUEST;
@@ -194,6 +842,7 @@ NTSTATUS DispatchDeviceControl(
         break;
     }
 
+complete:
     /* Завершаем IRP */
     Irp->IoStatus.Status = status;
     Irp->IoStatus.Information = bytesReturned;
@@ -201,3 +850,26 @@ NTSTATUS DispatchDeviceControl(
 
     return status;
 }
+
+/*
+ * DispatchDeviceControl — DeviceControl с учётом числа вызовов и времени
+ * обработки по кодам IOCTL. После DeviceControl IRP уже завершён (или
+ * отложен), поэтому код запроса читается заранее.
+ */
+NTSTATUS DispatchDeviceControl(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _Inout_ PIRP Irp)
+{
+    NTSTATUS  status;
+    ULONG     ioctlCode;
+    ULONGLONG start;
+
+    ioctlCode = IoGetCurrentIrpStackLocation(Irp)->Parameters.DeviceIoControl.IoControlCode;
+    start = KeQueryInterruptTimePrecise(NULL);
+
+    status = DeviceControl(DeviceObject, Irp);
+
+    StatsIoctl(ioctlCode, KeQueryInterruptTimePrecise(NULL) - start);
+
+    return status;
+}
@@ -0,0 +1,391 @@
+/*
+ * md5_mb.c — Многоканальный MD5: несколько независимых потоков за раз.
+ *
+ * Каждый шаг MD5 зависит от предыдущего, и одиночный поток не занимает
+ * SIMD-блоки процессора. Зато шаги разных файлов независимы: канал
+ * вектора ведёт свой файл, и за один проход раундов продвигаются 4
+ * (SSE2) или 8 (AVX2) файлов. Раунды те же, что в Md5Transform (hash.c),
+ * только над векторами, поэтому состояние канала после блоков совпадает
+ * со скалярным, и хвост файла дохешируется обычными Md5Update/Md5Final.
+ *
+ * SSE2 есть на любом x64, и XMM-регистры kernel-mode код использует
+ * свободно. AVX2 работает с YMM, состояние которых ядро при переключении
+ * не сохраняет за драйвер: проход оборачивается в
+ * KeSaveExtendedProcessorState(XSTATE_MASK_AVX). Если сохранить не
+ * удалось, 8 каналов считаются двумя проходами SSE2.
+ *
+ * Если векторная реализация не сошлась со скалярной на самопроверке,
+ * остаётся один канал на обычном Md5Update: пачки идут по файлу за раз,
+ * но хеши верны.
+ */
+
+#include <intrin.h>
+#include "hash.h"
+
+/*
+ * 64 шага MD5 (как в Md5Transform). STEP(f, a, b, c, d, k, s, ac):
+ * a = b + ROTL(a + f(b, c, d) + x[k] + ac, s).
+ */
+#define MD5_MB_ROUNDS(STEP, F, G, H, I)            \
+    STEP(F, a, b, c, d,  0,  7, 0xd76aa478);       \
+    STEP(F, d, a, b, c,  1, 12, 0xe8c7b756);       \
+    STEP(F, c, d, a, b,  2, 17, 0x242070db);       \
+    STEP(F, b, c, d, a,  3, 22, 0xc1bdceee);       \
+    STEP(F, a, b, c, d,  4,  7, 0xf57c0faf);       \
+    STEP(F, d, a, b, c,  5, 12, 0x4787c62a);       \
+    STEP(F, c, d, a, b,  6, 17, 0xa8304613);       \
+    STEP(F, b, c, d, a,  7, 22, 0xfd469501);       \
+    STEP(F, a, b, c, d,  8,  7, 0x698098d8);       \
+    STEP(F, d, a, b, c,  9, 12, 0x8b44f7af);       \
+    STEP(F, c, d, a, b, 10, 17, 0xffff5bb1);       \
+    STEP(F, b, c, d, a, 11, 22, 0x895cd7be);       \
+    STEP(F, a, b, c, d, 12,  7, 0x6b901122);       \
+    STEP(F, d, a, b, c, 13, 12, 0xfd987193);       \
+    STEP(F, c, d, a, b, 14, 17, 0xa679438e);       \
+    STEP(F, b, c, d, a, 15, 22, 0x49b40821);       \
+    STEP(G, a, b, c, d,  1,  5, 0xf61e2562);       \
+    STEP(G, d, a, b, c,  6,  9, 0xc040b340);       \
+    STEP(G, c, d, a, b, 11, 14, 0x265e5a51);       \
+    STEP(G, b, c, d, a,  0, 20, 0xe9b6c7aa);       \
+    STEP(G, a, b, c, d,  5,  5, 0xd62f105d);       \
+    STEP(G, d, a, b, c, 10,  9, 0x02441453);       \
+    STEP(G, c, d, a, b, 15, 14, 0xd8a1e681);       \
+    STEP(G, b, c, d, a,  4, 20, 0xe7d3fbc8);       \
+    STEP(G, a, b, c, d,  9,  5, 0x21e1cde6);       \
+    STEP(G, d, a, b, c, 14,  9, 0xc33707d6);       \
+    STEP(G, c, d, a, b,  3, 14, 0xf4d50d87);       \
+    STEP(G, b, c, d, a,  8, 20, 0x455a14ed);       \
+    STEP(G, a, b, c, d, 13,  5, 0xa9e3e905);       \
+    STEP(G, d, a, b, c,  2,  9, 0xfcefa3f8);       \
+    STEP(G, c, d, a, b,  7, 14, 0x676f02d9);       \
+    STEP(G, b, c, d, a, 12, 20, 0x8d2a4c8a);       \
+    STEP(H, a, b, c, d,  5,  4, 0xfffa3942);       \
+    STEP(H, d, a, b, c,  8, 11, 0x8771f681);       \
+    STEP(H, c, d, a, b, 11, 16, 0x6d9d6122);       \
+    STEP(H, b, c, d, a, 14, 23, 0xfde5380c);       \
+    STEP(H, a, b, c, d,  1,  4, 0xa4beea44);       \
+    STEP(H, d, a, b, c,  4, 11, 0x4bdecfa9);       \
+    STEP(H, c, d, a, b,  7, 16, 0xf6bb4b60);       \
+    STEP(H, b, c, d, a, 10, 23, 0xbebfbc70);       \
+    STEP(H, a, b, c, d, 13,  4, 0x289b7ec6);       \
+    STEP(H, d, a, b, c,  0, 11, 0xeaa127fa);       \
+    STEP(H, c, d, a, b,  3, 16, 0xd4ef3085);       \
+    STEP(H, b, c, d, a,  6, 23, 0x04881d05);       \
+    STEP(H, a, b, c, d,  9,  4, 0xd9d4d039);       \
+    STEP(H, d, a, b, c, 12, 11, 0xe6db99e5);       \
+    STEP(H, c, d, a, b, 15, 16, 0x1fa27cf8);       \
+    STEP(H, b, c, d, a,  2, 23, 0xc4ac5665);       \
+    STEP(I, a, b, c, d,  0,  6, 0xf4292244);       \
+    STEP(I, d, a, b, c,  7, 10, 0x432aff97);       \
+    STEP(I, c, d, a, b, 14, 15, 0xab9423a7);       \
+    STEP(I, b, c, d, a,  5, 21, 0xfc93a039);       \
+    STEP(I, a, b, c, d, 12,  6, 0x655b59c3);       \
+    STEP(I, d, a, b, c,  3, 10, 0x8f0ccc92);       \
+    STEP(I, c, d, a, b, 10, 15, 0xffeff47d);       \
+    STEP(I, b, c, d, a,  1, 21, 0x85845dd1);       \
+    STEP(I, a, b, c, d,  8,  6, 0x6fa87e4f);       \
+    STEP(I, d, a, b, c, 15, 10, 0xfe2ce6e0);       \
+    STEP(I, c, d, a, b,  6, 15, 0xa3014314);       \
+    STEP(I, b, c, d, a, 13, 21, 0x4e0811a1);       \
+    STEP(I, a, b, c, d,  4,  6, 0xf7537e82);       \
+    STEP(I, d, a, b, c, 11, 10, 0xbd3af235);       \
+    STEP(I, c, d, a, b,  2, 15, 0x2ad7d2bb);       \
+    STEP(I, b, c, d, a,  9, 21, 0xeb86d391)
+
+/* --- SSE2: 4 канала --- */
+
+#define F128(x, y, z) _mm_xor_si128((z), _mm_and_si128((x), _mm_xor_si128((y), (z))))
+#define G128(x, y, z) _mm_xor_si128((y), _mm_and_si128((z), _mm_xor_si128((x), (y))))
+#define H128(x, y, z) _mm_xor_si128(_mm_xor_si128((x), (y)), (z))
+#define I128(x, y, z) _mm_xor_si128((y), _mm_or_si128((x), _mm_xor_si128((z), ones)))
+
+#define STEP128(f, a, b, c, d, k, s, ac) {                                            \
+    (a) = _mm_add_epi32((a), _mm_add_epi32(f((b), (c), (d)),                          \
+                        _mm_add_epi32(w[k], _mm_set1_epi32((int)(ac)))));             \
+    (a) = _mm_add_epi32(_mm_or_si128(_mm_slli_epi32((a), (s)),                        \
+                                     _mm_srli_epi32((a), 32 - (s))), (b));            \
+}
+
+/* Каналы First..First+3: Blocks блоков с Data[канал] */
+static VOID Md5MbTransformSse2(
+    _Inout_ MD5_MB_STATE *State,
+    _In_ const UCHAR * const *Data,
+    _In_ ULONG First,
+    _In_ ULONG Blocks)
+{
+    const __m128i ones = _mm_set1_epi32(-1);
+    __m128i a, b, c, d, aa, bb, cc, dd;
+    __m128i w[16];
+    __m128i r0, r1, r2, r3, t0, t1, t2, t3;
+    ULONG   offset;
+    ULONG   g;
+
+    a = _mm_loadu_si128((const __m128i *)&State->State[0][First]);
+    b = _mm_loadu_si128((const __m128i *)&State->State[1][First]);
+    c = _mm_loadu_si128((const __m128i *)&State->State[2][First]);
+    d = _mm_loadu_si128((const __m128i *)&State->State[3][First]);
+
+    for (offset = 0; Blocks != 0; Blocks--, offset += 64) {
+        /* Транспонирование 4x4: w[k] — слово k блока во всех каналах */
+        for (g = 0; g < 4; g++) {
+            r0 = _mm_loadu_si128((const __m128i *)(Data[First + 0] + offset + g * 16));
+            r1 = _mm_loadu_si128((const __m128i *)(Data[First + 1] + offset + g * 16));
+            r2 = _mm_loadu_si128((const __m128i *)(Data[First + 2] + offset + g * 16));
+            r3 = _mm_loadu_si128((const __m128i *)(Data[First + 3] + offset + g * 16));
+
+            t0 = _mm_unpacklo_epi32(r0, r1);
+            t1 = _mm_unpacklo_epi32(r2, r3);
+            t2 = _mm_unpackhi_epi32(r0, r1);
+            t3 = _mm_unpackhi_epi32(r2, r3);
+
+            w[g * 4 + 0] = _mm_unpacklo_epi64(t0, t1);
+            w[g * 4 + 1] = _mm_unpackhi_epi64(t0, t1);
+            w[g * 4 + 2] = _mm_unpacklo_epi64(t2, t3);
+            w[g * 4 + 3] = _mm_unpackhi_epi64(t2, t3);
+        }
+
+        aa = a; bb = b; cc = c; dd = d;
+
+        MD5_MB_ROUNDS(STEP128, F128, G128, H128, I128);
+
+        a = _mm_add_epi32(a, aa);
+        b = _mm_add_epi32(b, bb);
+        c = _mm_add_epi32(c, cc);
+        d = _mm_add_epi32(d, dd);
+    }
+
+    _mm_storeu_si128((__m128i *)&State->State[0][First], a);
+    _mm_storeu_si128((__m128i *)&State->State[1][First], b);
+    _mm_storeu_si128((__m128i *)&State->State[2][First], c);
+    _mm_storeu_si128((__m128i *)&State->State[3][First], d);
+}
+
+/* --- AVX2: 8 каналов --- */
+
+#define F256(x, y, z) _mm256_xor_si256((z), _mm256_and_si256((x), _mm256_xor_si256((y), (z))))
+#define G256(x, y, z) _mm256_xor_si256((y), _mm256_and_si256((z), _mm256_xor_si256((x), (y))))
+#define H256(x, y, z) _mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define I256(x, y, z) _mm256_xor_si256((y), _mm256_or_si256((x), _mm256_xor_si256((z), ones)))
+
+#define STEP256(f, a, b, c, d, k, s, ac) {                                            \
+    (a) = _mm256_add_epi32((a), _mm256_add_epi32(f((b), (c), (d)),                    \
+                           _mm256_add_epi32(w[k], _mm256_set1_epi32((int)(ac)))));    \
+    (a) = _mm256_add_epi32(_mm256_or_si256(_mm256_slli_epi32((a), (s)),               \
+                                           _mm256_srli_epi32((a), 32 - (s))), (b));   \
+}
+
+/* Все 8 каналов: Blocks блоков с Data[канал]. Только под сохранённым AVX-состоянием. */
+HASH_TARGET("avx2")
+static VOID Md5MbTransformAvx2(
+    _Inout_ MD5_MB_STATE *State,
+    _In_ const UCHAR * const *Data,
+    _In_ ULONG Blocks)
+{
+    const __m256i ones = _mm256_set1_epi32(-1);
+    __m256i a, b, c, d, aa, bb, cc, dd;
+    __m256i w[16];
+    __m256i r[8], t[8], u[8];
+    ULONG   offset;
+    ULONG   h;
+    ULONG   i;
+
+    a = _mm256_loadu_si256((const __m256i *)State->State[0]);
+    b = _mm256_loadu_si256((const __m256i *)State->State[1]);
+    c = _mm256_loadu_si256((const __m256i *)State->State[2]);
+    d = _mm256_loadu_si256((const __m256i *)State->State[3]);
+
+    for (offset = 0; Blocks != 0; Blocks--, offset += 64) {
+        /* Транспонирование 8x8 по половинам блока (слова 0-7 и 8-15) */
+        for (h = 0; h < 2; h++) {
+            for (i = 0; i < 8; i++) {
+                r[i] = _mm256_loadu_si256((const __m256i *)(Data[i] + offset + h * 32));
+            }
+
+            for (i = 0; i < 8; i += 2) {
+                t[i]     = _mm256_unpacklo_epi32(r[i], r[i + 1]);
+                t[i + 1] = _mm256_unpackhi_epi32(r[i], r[i + 1]);
+            }
+
+            /* u[0..3] — слова 0/4, 1/5, 2/6, 3/7 каналов 0-3; u[4..7] — то же для 4-7 */
+            for (i = 0; i < 2; i++) {
+                u[i * 4 + 0] = _mm256_unpacklo_epi64(t[i * 4 + 0], t[i * 4 + 2]);
+                u[i * 4 + 1] = _mm256_unpackhi_epi64(t[i * 4 + 0], t[i * 4 + 2]);
+                u[i * 4 + 2] = _mm256_unpacklo_epi64(t[i * 4 + 1], t[i * 4 + 3]);
+                u[i * 4 + 3] = _mm256_unpackhi_epi64(t[i * 4 + 1], t[i * 4 + 3]);
+            }
+
+            for (i = 0; i < 4; i++) {
+                w[h * 8 + i]     = _mm256_permute2x128_si256(u[i], u[i + 4], 0x20);
+                w[h * 8 + i + 4] = _mm256_permute2x128_si256(u[i], u[i + 4], 0x31);
+            }
+        }
+
+        aa = a; bb = b; cc = c; dd = d;
+
+        MD5_MB_ROUNDS(STEP256, F256, G256, H256, I256);
+
+        a = _mm256_add_epi32(a, aa);
+        b = _mm256_add_epi32(b, bb);
+        c = _mm256_add_epi32(c, cc);
+        d = _mm256_add_epi32(d, dd);
+    }
+
+    _mm256_storeu_si256((__m256i *)State->State[0], a);
+    _mm256_storeu_si256((__m256i *)State->State[1], b);
+    _mm256_storeu_si256((__m256i *)State->State[2], c);
+    _mm256_storeu_si256((__m256i *)State->State[3], d);
+}
+
+/* --- Скалярный канал --- */
+
+/* Канал 0 через Md5Update: целые блоки, буфер контекста не используется */
+static VOID Md5MbTransformScalar(
+    _Inout_ MD5_MB_STATE *State,
+    _In_ const UCHAR * const *Data,
+    _In_ ULONG Blocks)
+{
+    MD5_CTX ctx;
+    ULONG   i;
+
+    Md5Init(&ctx);
+    for (i = 0; i < 4; i++) {
+        ctx.State[i] = State->State[i][0];
+    }
+
+    Md5Update(&ctx, Data[0], Blocks * 64);
+
+    for (i = 0; i < 4; i++) {
+        State->State[i][0] = ctx.State[i];
+    }
+}
+
+/* --- Выбор и вызов --- */
+
+/* Каналов в работе: 4 (SSE2), 8 (AVX2) или 1 (скалярный запасной) */
+static ULONG g_Md5MbLanes = 4;
+
+VOID Md5MbInitLane(_Inout_ MD5_MB_STATE *State, _In_ ULONG Lane)
+{
+    State->State[0][Lane] = 0x67452301;
+    State->State[1][Lane] = 0xefcdab89;
+    State->State[2][Lane] = 0x98badcfe;
+    State->State[3][Lane] = 0x10325476;
+}
+
+ULONG Md5MbLaneCount(VOID)
+{
+    return g_Md5MbLanes;
+}
+
+NTSTATUS Md5MbTransform(
+    _Inout_ MD5_MB_STATE *State,
+    _In_reads_(MD5_MB_MAX_LANES) const UCHAR * const *Data,
+    _In_ ULONG Blocks)
+{
+    XSTATE_SAVE xstate;
+    NTSTATUS    status = STATUS_SUCCESS;
+    BOOLEAN     wide = FALSE;
+
+    if (g_Md5MbLanes == 8) {
+        wide = NT_SUCCESS(KeSaveExtendedProcessorState(XSTATE_MASK_AVX, &xstate));
+    }
+
+    /* Данные — отображения файлов: ошибка чтения страницы приходит исключением */
+    __try {
+        if (wide) {
+            Md5MbTransformAvx2(State, Data, Blocks);
+        } else if (g_Md5MbLanes == 1) {
+            Md5MbTransformScalar(State, Data, Blocks);
+        } else {
+            Md5MbTransformSse2(State, Data, 0, Blocks);
+            if (g_Md5MbLanes == 8) {
+                Md5MbTransformSse2(State, Data, 4, Blocks);
+            }
+        }
+    } __except (EXCEPTION_EXECUTE_HANDLER) {
+        status = GetExceptionCode();
+    }
+
+    if (wide) {
+        KeRestoreExtendedProcessorState(&xstate);
+    }
+
+    return status;
+}
+
+/* Сравнить каналы с Md5Update на двух блоках разных данных */
+static BOOLEAN Md5MbSelfTest(VOID)
+{
+    UCHAR        data[MD5_MB_MAX_LANES * 16 + 128];
+    const UCHAR *lanes[MD5_MB_MAX_LANES];
+    MD5_MB_STATE state;
+    MD5_CTX      ctx;
+    ULONG        i;
+
+    for (i = 0; i < sizeof(data); i++) {
+        data[i] = (UCHAR)(i * 131 + 7);
+    }
+
+    for (i = 0; i < MD5_MB_MAX_LANES; i++) {
+        lanes[i] = data + i * 16;
+    }
+
+    for (i = 0; i < MD5_MB_MAX_LANES; i++) {
+        Md5MbInitLane(&state, i);
+    }
+
+    if (!NT_SUCCESS(Md5MbTransform(&state, lanes, 2))) {
+        return FALSE;
+    }
+
+    for (i = 0; i < g_Md5MbLanes; i++) {
+        Md5Init(&ctx);
+        Md5Update(&ctx, lanes[i], 128);
+
+        if (ctx.State[0] != state.State[0][i] || ctx.State[1] != state.State[1][i] ||
+            ctx.State[2] != state.State[2][i] || ctx.State[3] != state.State[3][i]) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* AVX2 процессора, включённый системой (XSAVE для YMM) */
+static BOOLEAN Md5MbCpuHasAvx2(VOID)
+{
+    int regs[4];
+
+    if ((RtlGetEnabledExtendedFeatures(XSTATE_MASK_AVX) & XSTATE_MASK_AVX) == 0) {
+        return FALSE;
+    }
+
+    __cpuid(regs, 0);
+    if (regs[0] < 7) {
+        return FALSE;
+    }
+
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 5)) ? TRUE : FALSE;
+}
+
+ULONG Md5MbSelectImplementation(VOID)
+{
+    if (Md5MbCpuHasAvx2()) {
+        g_Md5MbLanes = 8;
+        if (Md5MbSelfTest()) {
+            return g_Md5MbLanes;
+        }
+        DbgPrint("[ProcMon] AVX2 MD5 не прошёл проверку, каналов 4 (SSE2)\n");
+    }
+
+    g_Md5MbLanes = 4;
+    if (Md5MbSelfTest()) {
+        return g_Md5MbLanes;
+    }
+
+    /* Не должно случаться: значит, сломана сама векторная реализация */
+    DbgPrint("[ProcMon] SSE2 MD5 не прошёл проверку, один скалярный канал\n");
+    g_Md5MbLanes = 1;
+    return g_Md5MbLanes;
+}
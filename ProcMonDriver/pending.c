@@ -0,0 +1,210 @@
+/*
+ * pending.c — Cancel-safe очередь отложенных запросов событий и поток доставки.
+ *
+ * Очередь построена на IO_CSQ: ядро само снимает IRP из очереди при отмене
+ * (CancelIo, завершение потока клиента), а мы при этом не рискуем завершить
+ * IRP дважды. Список защищён спинлоком, потому что отмена приходит на
+ * DISPATCH_LEVEL.
+ *
+ * Поток доставки спит на EVENT_BUFFER.ReaderEvent. Писатель взводит его
+ * только если в очереди кто-то есть (PendingReaders != 0), так что без
+ * отложенных запросов горячий путь BufferCommit не платит за KeSetEvent.
+ *
+ * Гонка «событие пришло между проверкой и постановкой в очередь» закрыта
+ * так: PendingEnqueue сначала увеличивает PendingReaders (в CsqInsertIrp),
+ * потом сам взводит ReaderEvent. Либо писатель увидит ненулевой счётчик,
+ * либо поток доставки при проверке увидит уже опубликованное событие.
+ * На время прохода поток сам держит PendingReaders ненулевым: запросы
+ * в этот момент вынуты из очереди, а событие, пришедшее посреди прохода,
+ * должно разбудить его ещё раз.
+ */
+
+#include "driver.h"
+#include "pending.h"
+
+static VOID CsqInsertIrp(_In_ PIO_CSQ Csq, _In_ PIRP Irp)
+{
+    PPENDING_QUEUE queue = CONTAINING_RECORD(Csq, PENDING_QUEUE, Csq);
+
+    InsertTailList(&queue->Irps, &Irp->Tail.Overlay.ListEntry);
+    InterlockedIncrement(&queue->Buffer->PendingReaders);
+}
+
+static VOID CsqRemoveIrp(_In_ PIO_CSQ Csq, _In_ PIRP Irp)
+{
+    PPENDING_QUEUE queue = CONTAINING_RECORD(Csq, PENDING_QUEUE, Csq);
+
+    RemoveEntryList(&Irp->Tail.Overlay.ListEntry);
+    InterlockedDecrement(&queue->Buffer->PendingReaders);
+}
+
+/*
+ * CsqPeekNextIrp — следующий IRP после Irp (или первый, если Irp == NULL).
+ * PeekContext — файловый объект: тогда только его запросы (PendingCancelFile).
+ */
+static PIRP CsqPeekNextIrp(_In_ PIO_CSQ Csq, _In_opt_ PIRP Irp, _In_opt_ PVOID PeekContext)
+{
+    PPENDING_QUEUE queue = CONTAINING_RECORD(Csq, PENDING_QUEUE, Csq);
+    PLIST_ENTRY    entry;
+    PIRP           next;
+
+    entry = (Irp != NULL) ? Irp->Tail.Overlay.ListEntry.Flink : queue->Irps.Flink;
+
+    for (; entry != &queue->Irps; entry = entry->Flink) {
+        next = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+
+        if (PeekContext == NULL ||
+            IoGetCurrentIrpStackLocation(next)->FileObject == (PFILE_OBJECT)PeekContext) {
+            return next;
+        }
+    }
+
+    return NULL;
+}
+
+_IRQL_raises_(DISPATCH_LEVEL)
+static VOID CsqAcquireLock(_In_ PIO_CSQ Csq, _Out_ PKIRQL Irql)
+{
+    PPENDING_QUEUE queue = CONTAINING_RECORD(Csq, PENDING_QUEUE, Csq);
+
+    KeAcquireSpinLock(&queue->Lock, Irql);
+}
+
+static VOID CsqReleaseLock(_In_ PIO_CSQ Csq, _In_ KIRQL Irql)
+{
+    PPENDING_QUEUE queue = CONTAINING_RECORD(Csq, PENDING_QUEUE, Csq);
+
+    KeReleaseSpinLock(&queue->Lock, Irql);
+}
+
+static VOID CsqCompleteCanceledIrp(_In_ PIO_CSQ Csq, _In_ PIRP Irp)
+{
+    UNREFERENCED_PARAMETER(Csq);
+
+    Irp->IoStatus.Status = STATUS_CANCELLED;
+    Irp->IoStatus.Information = 0;
+    IoCompleteRequest(Irp, IO_NO_INCREMENT);
+}
+
+/*
+ * PendingThread — поток доставки.
+ *
+ * На каждое пробуждение вынимает все отложенные запросы и обходит их
+ * по порядку: запрос, у читателя которого есть данные, заполняется и
+ * завершается, остальные возвращаются в очередь. У каждого хэндла своя
+ * позиция чтения, поэтому одно событие будит запросы всех хэндлов.
+ * Запрос, фильтр которого отверг всё прочитанное, тоже возвращается в
+ * очередь (Deliver вернул FALSE) — клиент узнаёт только о своих событиях.
+ *
+ * Приоритет — обычный для системного потока: поток просыпается, только
+ * пока в очереди есть запросы, и вперёд потоков пользователя при потоке
+ * событий не встаёт.
+ */
+static VOID PendingThread(_In_ PVOID Context)
+{
+    PPENDING_QUEUE queue = (PPENDING_QUEUE)Context;
+    LIST_ENTRY     waiting;
+    PLIST_ENTRY    entry;
+    PIRP           irp;
+
+    for (;;) {
+        KeWaitForSingleObject(&queue->Buffer->ReaderEvent, Executive, KernelMode, FALSE, NULL);
+
+        if (queue->Stop) {
+            break;
+        }
+
+        InterlockedIncrement(&queue->Buffer->PendingReaders);
+
+        /* Вынутый из очереди IRP отменить нельзя, пока он не вернётся обратно */
+        InitializeListHead(&waiting);
+        while ((irp = IoCsqRemoveNextIrp(&queue->Csq, NULL)) != NULL) {
+            InsertTailList(&waiting, &irp->Tail.Overlay.ListEntry);
+        }
+
+        while (!IsListEmpty(&waiting)) {
+            entry = RemoveHeadList(&waiting);
+            irp = CONTAINING_RECORD(entry, IRP, Tail.Overlay.ListEntry);
+
+            if (queue->Deliver(queue->Buffer, irp)) {
+                IoCompleteRequest(irp, IO_NO_INCREMENT);
+            } else {
+                /* Если IRP тем временем отменили, очередь сразу его завершит */
+                IoCsqInsertIrp(&queue->Csq, irp, NULL);
+            }
+        }
+
+        InterlockedDecrement(&queue->Buffer->PendingReaders);
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+}
+
+NTSTATUS PendingInit(
+    _Out_ PPENDING_QUEUE Queue,
+    _In_ PEVENT_BUFFER Buffer,
+    _In_ PPENDING_DELIVER Deliver)
+{
+    NTSTATUS          status;
+    OBJECT_ATTRIBUTES objAttr;
+
+    RtlZeroMemory(Queue, sizeof(PENDING_QUEUE));
+    InitializeListHead(&Queue->Irps);
+    KeInitializeSpinLock(&Queue->Lock);
+    Queue->Buffer = Buffer;
+    Queue->Deliver = Deliver;
+
+    status = IoCsqInitialize(&Queue->Csq, CsqInsertIrp, CsqRemoveIrp, CsqPeekNextIrp,
+                             CsqAcquireLock, CsqReleaseLock, CsqCompleteCanceledIrp);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    InitializeObjectAttributes(&objAttr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = PsCreateSystemThread(&Queue->ThreadHandle, SYNCHRONIZE, &objAttr,
+                                  NULL, NULL, PendingThread, Queue);
+    if (!NT_SUCCESS(status)) {
+        DbgPrint("[ProcMon] PsCreateSystemThread для доставки событий: 0x%08X\n", status);
+        Queue->ThreadHandle = NULL;
+    }
+
+    return status;
+}
+
+VOID PendingFree(_Inout_ PPENDING_QUEUE Queue)
+{
+    if (Queue->ThreadHandle == NULL) {
+        return;
+    }
+
+    InterlockedExchange(&Queue->Stop, 1);
+    KeSetEvent(&Queue->Buffer->ReaderEvent, IO_NO_INCREMENT, FALSE);
+
+    ZwWaitForSingleObject(Queue->ThreadHandle, FALSE, NULL);
+    ZwClose(Queue->ThreadHandle);
+    Queue->ThreadHandle = NULL;
+
+    /* Хэндлы к этому моменту закрыты, но на всякий случай ничего не оставляем */
+    PendingCancelFile(Queue, NULL);
+}
+
+NTSTATUS PendingEnqueue(_Inout_ PPENDING_QUEUE Queue, _Inout_ PIRP Irp)
+{
+    /* IoCsqInsertIrp сам помечает IRP pending (или завершает, если он уже отменён) */
+    IoCsqInsertIrp(&Queue->Csq, Irp, NULL);
+
+    /* Событие могло прийти до того, как мы попали в очередь, — пусть поток проверит */
+    KeSetEvent(&Queue->Buffer->ReaderEvent, IO_NO_INCREMENT, FALSE);
+
+    return STATUS_PENDING;
+}
+
+VOID PendingCancelFile(_Inout_ PPENDING_QUEUE Queue, _In_opt_ PFILE_OBJECT FileObject)
+{
+    PIRP irp;
+
+    while ((irp = IoCsqRemoveNextIrp(&Queue->Csq, FileObject)) != NULL) {
+        CsqCompleteCanceledIrp(&Queue->Csq, irp);
+    }
+}
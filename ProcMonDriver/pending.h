@@ -0,0 +1,67 @@
+#ifndef PROCMON_PENDING_H
+#define PROCMON_PENDING_H
+
+/*
+ * pending.h — Отложенные запросы событий (long-poll, IOCTL_PROCMON_WAIT_EVENTS).
+ *
+ * IRP не завершается в DeviceIoControl, а ставится в cancel-safe очередь
+ * (IO_CSQ). BufferCommit взводит EVENT_BUFFER.ReaderEvent, когда в
+ * очереди кто-то есть; системный поток доставки просыпается, заполняет
+ * запросы тех хэндлов, у читателя которых есть данные, и завершает их.
+ * Завершает их только он и по одному, поэтому пачки одного хэндла
+ * приходят клиенту в порядке событий.
+ * Клиент не опрашивает драйвер по таймеру: без событий он просто спит
+ * в DeviceIoControl.
+ */
+
+#include <ntddk.h>
+#include "buffer.h"
+
+/*
+ * Заполнить запрос событиями и выставить Irp->IoStatus.
+ * Вызывается потоком доставки (PASSIVE_LEVEL); IRP завершает очередь.
+ * FALSE — читателю хэндла пока нечего отдать (или фильтр хэндла отверг
+ * всё прочитанное): IRP не тронут и возвращается в очередь.
+ */
+typedef BOOLEAN (*PPENDING_DELIVER)(_Inout_ PEVENT_BUFFER Buffer, _Inout_ PIRP Irp);
+
+typedef struct _PENDING_QUEUE {
+    IO_CSQ           Csq;       /* Cancel-safe очередь поверх Irps */
+    LIST_ENTRY       Irps;      /* Отложенные IRP (Tail.Overlay.ListEntry) */
+    KSPIN_LOCK       Lock;      /* Защищает Irps */
+    PEVENT_BUFFER    Buffer;    /* Откуда берутся события */
+    PPENDING_DELIVER Deliver;   /* Заполнение запроса */
+    HANDLE           ThreadHandle; /* Поток доставки (kernel handle) */
+    volatile LONG    Stop;      /* Просьба потоку завершиться */
+} PENDING_QUEUE, *PPENDING_QUEUE;
+
+/*
+ * Инициализировать очередь и запустить поток доставки.
+ * IRQL: PASSIVE_LEVEL.
+ */
+NTSTATUS PendingInit(
+    _Out_ PPENDING_QUEUE Queue,
+    _In_ PEVENT_BUFFER Buffer,
+    _In_ PPENDING_DELIVER Deliver
+);
+
+/*
+ * Остановить поток доставки и отменить оставшиеся запросы.
+ * Безопасно для очереди, которую PendingInit не успел запустить (обнулённой).
+ * IRQL: PASSIVE_LEVEL.
+ */
+VOID PendingFree(_Inout_ PPENDING_QUEUE Queue);
+
+/*
+ * Поставить запрос в очередь (IRP помечается pending).
+ * Вызывающий возвращает из dispatch-функции STATUS_PENDING и больше IRP не трогает.
+ */
+NTSTATUS PendingEnqueue(_Inout_ PPENDING_QUEUE Queue, _Inout_ PIRP Irp);
+
+/*
+ * Отменить все запросы файлового объекта (IRP_MJ_CLEANUP: хэндл закрывается);
+ * FileObject == NULL — все запросы.
+ */
+VOID PendingCancelFile(_Inout_ PPENDING_QUEUE Queue, _In_opt_ PFILE_OBJECT FileObject);
+
+#endif /* PROCMON_PENDING_H */
@@ -0,0 +1,328 @@
+/*
+ * sha256.c — Самодостаточная реализация SHA-256 (FIPS 180-4) для kernel mode.
+ *
+ * Блочная функция выбирается при загрузке по процессору:
+ *   - SHA-NI (sha256rnds2/sha256msg1/sha256msg2) — на процессорах с
+ *     расширением SHA (CPUID.7.0:EBX[29]) и SSE4.1; в несколько раз
+ *     быстрее переносимой;
+ *   - переносимая — на остальных.
+ *
+ * Расширение SHA работает только с регистрами XMM. Драйвер собирается
+ * лишь под x64, а там ядро сохраняет XMM-состояние само и kernel-mode
+ * код может пользоваться SSE без KeSaveExtendedProcessorState (им
+ * пользуется и компилятор в memcpy). Сохранение расширенного состояния
+ * нужно для YMM/ZMM (AVX), которых этот файл не трогает.
+ *
+ * Многоканальная AVX2-версия не нужна: она ускоряет только несколько
+ * независимых потоков сразу, а ComputeFileHash хеширует один файл.
+ */
+
+#include <intrin.h>
+#include "hash.h"
+
+/* Блочная функция: обработать Blocks подряд идущих 64-байтовых блоков */
+typedef VOID (*SHA256_TRANSFORM)(ULONG State[8], const UCHAR *Data, ULONG Blocks);
+
+static const ULONG SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* --- Переносимая версия --- */
+
+#define ROTR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x, y, z)  (((x) & (y)) ^ ((~(x)) & (z)))
+#define MAJ(x, y, z) (((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define BSIG0(x)     (ROTR((x), 2) ^ ROTR((x), 13) ^ ROTR((x), 22))
+#define BSIG1(x)     (ROTR((x), 6) ^ ROTR((x), 11) ^ ROTR((x), 25))
+#define SSIG0(x)     (ROTR((x), 7) ^ ROTR((x), 18) ^ ((x) >> 3))
+#define SSIG1(x)     (ROTR((x), 17) ^ ROTR((x), 19) ^ ((x) >> 10))
+
+/* Декодировать 4 байта (big-endian) в ULONG */
+static __inline ULONG Load32(const UCHAR *input)
+{
+    return ((ULONG)input[0] << 24)
+         | ((ULONG)input[1] << 16)
+         | ((ULONG)input[2] << 8)
+         | ((ULONG)input[3]);
+}
+
+/* Закодировать ULONG в 4 байта (big-endian) */
+static __inline VOID Store32(UCHAR *output, ULONG input)
+{
+    output[0] = (UCHAR)(input >> 24);
+    output[1] = (UCHAR)(input >> 16);
+    output[2] = (UCHAR)(input >> 8);
+    output[3] = (UCHAR)input;
+}
+
+static VOID Sha256TransformScalar(ULONG State[8], const UCHAR *Data, ULONG Blocks)
+{
+    ULONG w[64];
+    ULONG a, b, c, d, e, f, g, h, t1, t2;
+    ULONG i;
+
+    for (; Blocks != 0; Blocks--, Data += 64) {
+        for (i = 0; i < 16; i++) {
+            w[i] = Load32(Data + i * 4);
+        }
+        for (; i < 64; i++) {
+            w[i] = SSIG1(w[i - 2]) + w[i - 7] + SSIG0(w[i - 15]) + w[i - 16];
+        }
+
+        a = State[0]; b = State[1]; c = State[2]; d = State[3];
+        e = State[4]; f = State[5]; g = State[6]; h = State[7];
+
+        for (i = 0; i < 64; i++) {
+            t1 = h + BSIG1(e) + CH(e, f, g) + SHA256_K[i] + w[i];
+            t2 = BSIG0(a) + MAJ(a, b, c);
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+
+        State[0] += a; State[1] += b; State[2] += c; State[3] += d;
+        State[4] += e; State[5] += f; State[6] += g; State[7] += h;
+    }
+
+    /* Очистка локальных данных */
+    RtlZeroMemory(w, sizeof(w));
+}
+
+/* --- Версия на расширении SHA --- */
+
+/* Четыре раунда: слово расписания Msg плюс константы K[Round..Round+3] */
+#define SHA_NI_ROUNDS(Msg, Round) {                                                   \
+    msg = _mm_add_epi32((Msg), _mm_loadu_si128((const __m128i *)&SHA256_K[Round]));   \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                              \
+    msg = _mm_shuffle_epi32(msg, 0x0E);                                               \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);                              \
+}
+
+/* Досчитать следующие четыре слова расписания Next по Cur и Prev */
+#define SHA_NI_SCHEDULE(Next, Cur, Prev) {                                            \
+    (Next) = _mm_add_epi32((Next), _mm_alignr_epi8((Cur), (Prev), 4));                \
+    (Next) = _mm_sha256msg2_epu32((Next), (Cur));                                     \
+}
+
+HASH_TARGET("sha,ssse3,sse4.1")
+static VOID Sha256TransformShaNi(ULONG State[8], const UCHAR *Data, ULONG Blocks)
+{
+    const __m128i swap = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+    __m128i state0, state1, abefSave, cdghSave;
+    __m128i msg, m0, m1, m2, m3, tmp;
+
+    /* Состояние ABCD/EFGH переставляется в порядок ABEF/CDGH инструкций */
+    tmp = _mm_loadu_si128((const __m128i *)&State[0]);
+    state1 = _mm_loadu_si128((const __m128i *)&State[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xB1);
+    state1 = _mm_shuffle_epi32(state1, 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    for (; Blocks != 0; Blocks--, Data += 64) {
+        abefSave = state0;
+        cdghSave = state1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(Data + 0)), swap);
+        SHA_NI_ROUNDS(m0, 0);
+
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(Data + 16)), swap);
+        SHA_NI_ROUNDS(m1, 4);
+        m0 = _mm_sha256msg1_epu32(m0, m1);
+
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(Data + 32)), swap);
+        SHA_NI_ROUNDS(m2, 8);
+        m1 = _mm_sha256msg1_epu32(m1, m2);
+
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(Data + 48)), swap);
+        SHA_NI_ROUNDS(m3, 12);
+        SHA_NI_SCHEDULE(m0, m3, m2);
+        m2 = _mm_sha256msg1_epu32(m2, m3);
+
+        SHA_NI_ROUNDS(m0, 16); SHA_NI_SCHEDULE(m1, m0, m3); m3 = _mm_sha256msg1_epu32(m3, m0);
+        SHA_NI_ROUNDS(m1, 20); SHA_NI_SCHEDULE(m2, m1, m0); m0 = _mm_sha256msg1_epu32(m0, m1);
+        SHA_NI_ROUNDS(m2, 24); SHA_NI_SCHEDULE(m3, m2, m1); m1 = _mm_sha256msg1_epu32(m1, m2);
+        SHA_NI_ROUNDS(m3, 28); SHA_NI_SCHEDULE(m0, m3, m2); m2 = _mm_sha256msg1_epu32(m2, m3);
+        SHA_NI_ROUNDS(m0, 32); SHA_NI_SCHEDULE(m1, m0, m3); m3 = _mm_sha256msg1_epu32(m3, m0);
+        SHA_NI_ROUNDS(m1, 36); SHA_NI_SCHEDULE(m2, m1, m0); m0 = _mm_sha256msg1_epu32(m0, m1);
+        SHA_NI_ROUNDS(m2, 40); SHA_NI_SCHEDULE(m3, m2, m1); m1 = _mm_sha256msg1_epu32(m1, m2);
+        SHA_NI_ROUNDS(m3, 44); SHA_NI_SCHEDULE(m0, m3, m2); m2 = _mm_sha256msg1_epu32(m2, m3);
+        SHA_NI_ROUNDS(m0, 48); SHA_NI_SCHEDULE(m1, m0, m3); m3 = _mm_sha256msg1_epu32(m3, m0);
+        SHA_NI_ROUNDS(m1, 52); SHA_NI_SCHEDULE(m2, m1, m0);
+        SHA_NI_ROUNDS(m2, 56); SHA_NI_SCHEDULE(m3, m2, m1);
+        SHA_NI_ROUNDS(m3, 60);
+
+        state0 = _mm_add_epi32(state0, abefSave);
+        state1 = _mm_add_epi32(state1, cdghSave);
+    }
+
+    /* Обратно в ABCD/EFGH */
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+    state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+    _mm_storeu_si128((__m128i *)&State[0], state0);
+    _mm_storeu_si128((__m128i *)&State[4], state1);
+}
+
+/* Выбранная блочная функция (до Sha256SelectImplementation — переносимая) */
+static SHA256_TRANSFORM g_Sha256Transform = Sha256TransformScalar;
+
+/* --- Init / Update / Final --- */
+
+VOID Sha256Init(SHA256_CTX *ctx)
+{
+    ctx->Count = 0;
+    ctx->State[0] = 0x6a09e667;
+    ctx->State[1] = 0xbb67ae85;
+    ctx->State[2] = 0x3c6ef372;
+    ctx->State[3] = 0xa54ff53a;
+    ctx->State[4] = 0x510e527f;
+    ctx->State[5] = 0x9b05688c;
+    ctx->State[6] = 0x1f83d9ab;
+    ctx->State[7] = 0x5be0cd19;
+    RtlZeroMemory(ctx->Buffer, 64);
+}
+
+VOID Sha256Update(SHA256_CTX *ctx, const UCHAR *data, ULONG len)
+{
+    ULONG index, partLen, blocks;
+
+    index = (ULONG)(ctx->Count & 0x3f);
+    ctx->Count += len;
+
+    if (index != 0) {
+        partLen = 64 - index;
+        if (len < partLen) {
+            RtlCopyMemory(&ctx->Buffer[index], data, len);
+            return;
+        }
+
+        /* Дозаполняем текущий блок и обрабатываем */
+        RtlCopyMemory(&ctx->Buffer[index], data, partLen);
+        g_Sha256Transform(ctx->State, ctx->Buffer, 1);
+        data += partLen;
+        len -= partLen;
+    }
+
+    /* Полные блоки — одним вызовом, без копирования */
+    blocks = len / 64;
+    if (blocks != 0) {
+        g_Sha256Transform(ctx->State, data, blocks);
+        data += blocks * 64;
+        len -= blocks * 64;
+    }
+
+    /* Буферизуем остаток */
+    if (len != 0) {
+        RtlCopyMemory(ctx->Buffer, data, len);
+    }
+}
+
+VOID Sha256Final(SHA256_CTX *ctx, UCHAR digest[32])
+{
+    ULONG64 bitCount = ctx->Count * 8;
+    ULONG   index = (ULONG)(ctx->Count & 0x3f);
+    ULONG   i;
+
+    /* Padding: 0x80, нули до 56 mod 64, длина в битах (big-endian) */
+    ctx->Buffer[index++] = 0x80;
+
+    if (index > 56) {
+        RtlZeroMemory(&ctx->Buffer[index], 64 - index);
+        g_Sha256Transform(ctx->State, ctx->Buffer, 1);
+        index = 0;
+    }
+
+    RtlZeroMemory(&ctx->Buffer[index], 56 - index);
+    Store32(&ctx->Buffer[56], (ULONG)(bitCount >> 32));
+    Store32(&ctx->Buffer[60], (ULONG)bitCount);
+    g_Sha256Transform(ctx->State, ctx->Buffer, 1);
+
+    for (i = 0; i < 8; i++) {
+        Store32(digest + i * 4, ctx->State[i]);
+    }
+
+    /* Очистка контекста */
+    RtlZeroMemory(ctx, sizeof(SHA256_CTX));
+}
+
+/* --- Выбор реализации --- */
+
+/* Известные ответы FIPS 180-4: один блок и два блока (padding в отдельном блоке) */
+static const CHAR SHA256_KAT_MSG1[] = "abc";
+static const UCHAR SHA256_KAT_DIGEST1[32] = {
+    0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+    0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+};
+
+static const CHAR SHA256_KAT_MSG2[] = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+static const UCHAR SHA256_KAT_DIGEST2[32] = {
+    0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+    0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1
+};
+
+/* Проверить выбранную блочную функцию на известных ответах */
+static BOOLEAN Sha256SelfTest(VOID)
+{
+    SHA256_CTX ctx;
+    UCHAR      digest[32];
+
+    Sha256Init(&ctx);
+    Sha256Update(&ctx, (const UCHAR *)SHA256_KAT_MSG1, sizeof(SHA256_KAT_MSG1) - 1);
+    Sha256Final(&ctx, digest);
+    if (!RtlEqualMemory(digest, SHA256_KAT_DIGEST1, sizeof(digest))) {
+        return FALSE;
+    }
+
+    Sha256Init(&ctx);
+    Sha256Update(&ctx, (const UCHAR *)SHA256_KAT_MSG2, sizeof(SHA256_KAT_MSG2) - 1);
+    Sha256Final(&ctx, digest);
+
+    return RtlEqualMemory(digest, SHA256_KAT_DIGEST2, sizeof(digest)) ? TRUE : FALSE;
+}
+
+/* Расширение SHA плюс SSSE3/SSE4.1, которыми переставляются слова */
+static BOOLEAN Sha256CpuHasShaNi(VOID)
+{
+    int regs[4];
+
+    __cpuid(regs, 0);
+    if (regs[0] < 7) {
+        return FALSE;
+    }
+
+    __cpuid(regs, 1);
+    if ((regs[2] & (1 << 9)) == 0 || (regs[2] & (1 << 19)) == 0) {
+        return FALSE;
+    }
+
+    __cpuidex(regs, 7, 0);
+    return (regs[1] & (1 << 29)) ? TRUE : FALSE;
+}
+
+ULONG Sha256SelectImplementation(VOID)
+{
+    if (Sha256CpuHasShaNi()) {
+        g_Sha256Transform = Sha256TransformShaNi;
+        if (Sha256SelfTest()) {
+            return PROCMON_HASH_IMPL_SHA_NI;
+        }
+        DbgPrint("[ProcMon] SHA-NI не прошёл проверку, SHA-256 считается без него\n");
+    }
+
+    g_Sha256Transform = Sha256TransformScalar;
+    if (!Sha256SelfTest()) {
+        /* Не должно случаться: значит, сломана сама реализация */
+        DbgPrint("[ProcMon] SHA-256 не прошёл проверку на известных ответах\n");
+    }
+
+    return PROCMON_HASH_IMPL_SCALAR;
+}
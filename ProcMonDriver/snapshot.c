@@ -0,0 +1,175 @@
+/*
+ * snapshot.c — Снимки перечислений для постраничной выдачи.
+ *
+ * Снимок строится в два прохода: сначала перечисление только считает
+ * записи (без хешей — это дёшево), потом заполняет массив с небольшим
+ * запасом. Если между проходами записей стало больше запаса (драйвер
+ * установили прямо сейчас), обход повторяется один раз.
+ */
+
+#include "driver.h"
+#include "snapshot.h"
+
+/* Запас на записи, появившиеся между подсчётом и обходом */
+#define SNAPSHOT_SLACK        16
+
+/* Предел записей в снимке — защита от неправдоподобного TotalCount */
+#define SNAPSHOT_MAX_ENTRIES  65536
+
+VOID SnapshotCacheStats(_In_opt_ const ENUM_CACHE_COUNTERS *Counters,
+                        _Out_ PPROCMON_CACHE_STATS Stats)
+{
+    LARGE_INTEGER now;
+
+    RtlZeroMemory(Stats, sizeof(PROCMON_CACHE_STATS));
+
+    if (Counters == NULL || Counters->RefreshTime.QuadPart == 0) {
+        return;
+    }
+
+    KeQuerySystemTime(&now);
+
+    Stats->Hits = (ULONG64)Counters->Hits;
+    Stats->Misses = (ULONG64)Counters->Misses;
+    Stats->AgeMs = (ULONG64)(now.QuadPart - Counters->RefreshTime.QuadPart) / 10000;
+    Stats->Reread = Counters->Reread;
+    Stats->HashMs = Counters->HashMs;
+}
+
+VOID SnapshotInit(_Out_ PENUM_SNAPSHOT Snapshot)
+{
+    RtlZeroMemory(Snapshot, sizeof(ENUM_SNAPSHOT));
+    KeInitializeMutex(&Snapshot->Lock, 0);
+}
+
+VOID SnapshotFree(_Inout_ PENUM_SNAPSHOT Snapshot)
+{
+    if (Snapshot->Entries != NULL) {
+        ExFreePoolWithTag(Snapshot->Entries, POOL_TAG);
+        Snapshot->Entries = NULL;
+    }
+    Snapshot->Count = 0;
+}
+
+/*
+ * SnapshotBuild — заменить снимок новым полным обходом.
+ * Вызывается под Snapshot->Lock.
+ */
+static NTSTATUS SnapshotBuild(
+    _Inout_ PENUM_SNAPSHOT Snapshot,
+    _In_ ULONG Kind,
+    _In_ PSNAPSHOT_ENUMERATE Enumerate,
+    _In_ ULONG EntrySize)
+{
+    NTSTATUS status;
+    PUCHAR   entries;
+    ULONG    capacity;
+    ULONG    total = 0;
+    ULONG    returned = 0;
+    ULONG    attempt;
+
+    SnapshotFree(Snapshot);
+
+    /* Новый номер делает недействительными курсоры прежнего снимка */
+    if (++Snapshot->Id == 0) {
+        Snapshot->Id = 1;
+    }
+
+    status = Enumerate(NULL, 0, &total, &returned);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    for (attempt = 0; ; attempt++) {
+        capacity = (total < SNAPSHOT_MAX_ENTRIES - SNAPSHOT_SLACK)
+                   ? total + SNAPSHOT_SLACK : SNAPSHOT_MAX_ENTRIES;
+
+        entries = (PUCHAR)ExAllocatePoolWithTag(PagedPool, (SIZE_T)capacity * EntrySize,
+                                                POOL_TAG);
+        if (entries == NULL) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        status = Enumerate(entries, capacity, &total, &returned);
+        if (!NT_SUCCESS(status)) {
+            ExFreePoolWithTag(entries, POOL_TAG);
+            return status;
+        }
+
+        /* Записей стало больше запаса — обходим ещё раз, но не бесконечно */
+        if (total <= capacity || capacity == SNAPSHOT_MAX_ENTRIES || attempt != 0) {
+            break;
+        }
+
+        ExFreePoolWithTag(entries, POOL_TAG);
+    }
+
+    Snapshot->Kind = Kind;
+    Snapshot->EntrySize = EntrySize;
+    Snapshot->Entries = entries;
+    Snapshot->Count = returned;
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS SnapshotReadPage(
+    _Inout_ PENUM_SNAPSHOT Snapshot,
+    _In_ ULONG Kind,
+    _In_ PSNAPSHOT_ENUMERATE Enumerate,
+    _In_ ULONG EntrySize,
+    _Inout_ PSNAPSHOT_PAGE Page)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG    index;
+    ULONG    count;
+
+    Page->TotalCount = 0;
+    Page->ReturnedCount = 0;
+    Page->NextCursor = 0;
+
+    KeWaitForSingleObject(&Snapshot->Lock, Executive, KernelMode, FALSE, NULL);
+
+    if (Page->Cursor == 0) {
+        status = SnapshotBuild(Snapshot, Kind, Enumerate, EntrySize);
+        if (!NT_SUCCESS(status)) {
+            goto cleanup;
+        }
+        index = 0;
+    } else {
+        index = (ULONG)Page->Cursor;
+
+        if ((ULONG)(Page->Cursor >> 32) != Snapshot->Id || Snapshot->Entries == NULL ||
+            Snapshot->Kind != Kind || index > Snapshot->Count) {
+            status = STATUS_INVALID_PARAMETER;
+            goto cleanup;
+        }
+    }
+
+    count = Snapshot->Count - index;
+
+    if (Page->Encode != NULL) {
+        count = Page->Encode(Page->EncodeContext,
+                             Snapshot->Entries + (SIZE_T)index * EntrySize, count);
+    } else {
+        if (count > Page->MaxEntries) {
+            count = Page->MaxEntries;
+        }
+
+        RtlCopyMemory(Page->Output, Snapshot->Entries + (SIZE_T)index * EntrySize,
+                      (SIZE_T)count * EntrySize);
+    }
+
+    Page->TotalCount = Snapshot->Count;
+    Page->ReturnedCount = count;
+
+    if (index + count < Snapshot->Count) {
+        Page->NextCursor = ((ULONG64)Snapshot->Id << 32) | (index + count);
+    } else {
+        /* Последняя страница отдана — снимок больше не нужен */
+        SnapshotFree(Snapshot);
+    }
+
+cleanup:
+    KeReleaseMutex(&Snapshot->Lock, FALSE);
+    return status;
+}
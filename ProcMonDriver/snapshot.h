@@ -0,0 +1,100 @@
+#ifndef PROCMON_SNAPSHOT_H
+#define PROCMON_SNAPSHOT_H
+
+/*
+ * snapshot.h — Снимки перечислений для постраничной выдачи.
+ *
+ * Перечисление драйверов и устройств дорогое (обход реестра, хеши файлов),
+ * а ответ может не поместиться в буфер клиента. Поэтому первый запрос
+ * (курсор 0) делает полный обход в снимок хэндла, а клиент забирает его
+ * страницами: каждый ответ несёт курсор следующей страницы. Последующие
+ * страницы — просто копирование из снимка.
+ *
+ * Курсор непрозрачен для клиента: старшие 32 бита — номер снимка в
+ * хэндле, младшие — индекс следующей записи. Новый снимок (курсор 0)
+ * делает курсоры старого недействительными.
+ */
+
+#include <ntddk.h>
+#include "../common/shared.h"
+
+/*
+ * Функция перечисления: заполняет не больше MaxEntries записей,
+ * в TotalCount — сколько найдено всего. С MaxEntries == 0 только считает
+ * (без хешей и без обращения к Output).
+ */
+typedef NTSTATUS (*PSNAPSHOT_ENUMERATE)(
+    _Out_writes_opt_(MaxEntries) PVOID Output,
+    _In_ ULONG MaxEntries,
+    _Out_ PULONG TotalCount,
+    _Out_ PULONG ReturnedCount
+);
+
+typedef struct _ENUM_SNAPSHOT {
+    KMUTEX  Lock;        /* Один запрос страницы за раз (PASSIVE: внутри обход реестра) */
+    ULONG   Kind;        /* IOCTL, которым снимок сделан */
+    ULONG   Id;          /* Номер снимка (старшая половина курсора) */
+    ULONG   Count;       /* Записей в снимке */
+    ULONG   EntrySize;   /* Размер записи */
+    PUCHAR  Entries;     /* Записи (PagedPool), NULL — снимка нет */
+} ENUM_SNAPSHOT, *PENUM_SNAPSHOT;
+
+/*
+ * Упаковщик страницы: берёт записи снимка по порядку, пока они помещаются
+ * в ответ, и возвращает, сколько взял (формат v2 с таблицей строк).
+ */
+typedef ULONG (*PSNAPSHOT_ENCODE)(
+    _Inout_ PVOID Context,
+    _In_ const UCHAR *Entries,
+    _In_ ULONG Count
+);
+
+/* Параметры и результат одной страницы */
+typedef struct _SNAPSHOT_PAGE {
+    ULONG64 Cursor;        /* Вход: курсор (0 — новый снимок) */
+    PVOID   Output;        /* Вход: куда копировать записи */
+    ULONG   MaxEntries;    /* Вход: сколько записей помещается в Output */
+    PSNAPSHOT_ENCODE Encode;  /* Вход: NULL — копировать записи в Output как есть */
+    PVOID   EncodeContext; /* Вход: контекст Encode (Output и MaxEntries тогда не нужны) */
+    ULONG   TotalCount;    /* Выход: записей в снимке */
+    ULONG   ReturnedCount; /* Выход: скопировано в Output */
+    ULONG64 NextCursor;    /* Выход: курсор следующей страницы, 0 — это последняя */
+} SNAPSHOT_PAGE, *PSNAPSHOT_PAGE;
+
+/*
+ * Счётчики кэша, из которого перечисление берёт записи
+ * (отдаются клиенту как PROCMON_CACHE_STATS).
+ */
+typedef struct _ENUM_CACHE_COUNTERS {
+    volatile LONG64 Hits;         /* Запросов, отданных из памяти */
+    volatile LONG64 Misses;       /* Запросов, перед которыми кэш сверялся с источником */
+    LARGE_INTEGER   RefreshTime;  /* Время последней сверки (системное) */
+    ULONG           Reread;       /* Записей, перечитанных при последней сверке */
+    ULONG           HashMs;       /* Сколько мс хешировались файлы при последней сверке */
+} ENUM_CACHE_COUNTERS, *PENUM_CACHE_COUNTERS;
+
+/* Заполнить PROCMON_CACHE_STATS по счётчикам кэша (NULL — кэша нет, нули). */
+VOID SnapshotCacheStats(_In_opt_ const ENUM_CACHE_COUNTERS *Counters,
+                        _Out_ PPROCMON_CACHE_STATS Stats);
+
+/* Инициализировать пустой снимок (IRP_MJ_CREATE). */
+VOID SnapshotInit(_Out_ PENUM_SNAPSHOT Snapshot);
+
+/* Освободить записи снимка (IRP_MJ_CLOSE). */
+VOID SnapshotFree(_Inout_ PENUM_SNAPSHOT Snapshot);
+
+/*
+ * Выдать страницу снимка. Курсор 0 — сделать новый снимок через Enumerate.
+ * Курсор чужого или уже заменённого снимка — STATUS_INVALID_PARAMETER
+ * (клиент начинает заново с 0). После последней страницы записи освобождаются.
+ * IRQL: PASSIVE_LEVEL.
+ */
+NTSTATUS SnapshotReadPage(
+    _Inout_ PENUM_SNAPSHOT Snapshot,
+    _In_ ULONG Kind,
+    _In_ PSNAPSHOT_ENUMERATE Enumerate,
+    _In_ ULONG EntrySize,
+    _Inout_ PSNAPSHOT_PAGE Page
+);
+
+#endif /* PROCMON_SNAPSHOT_H */
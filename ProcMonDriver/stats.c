@@ -0,0 +1,197 @@
+/*
+ * stats.c — Счётчики работы драйвера по процессорам.
+ *
+ * Запись: счётчик своего CPU (KeGetCurrentProcessorNumberEx), Interlocked
+ * без соперничества. Чтение (StatsQuery): сумма по всем CPU, для
+ * RingHighWater — максимум. Снимок не атомарен: пока складываются
+ * счётчики, соседние CPU продолжают считать.
+ */
+
+#include "driver.h"
+#include "stats.h"
+
+DRIVER_STATS g_Stats = { NULL, 0 };
+
+/* Счётчики текущего процессора, NULL — счётчиков нет */
+static PCPU_STATS StatsCurrentCpu(VOID)
+{
+    ULONG index;
+
+    if (g_Stats.Cpus == NULL) {
+        return NULL;
+    }
+
+    index = KeGetCurrentProcessorNumberEx(NULL);
+    if (index >= g_Stats.CpuCount) {
+        index %= g_Stats.CpuCount;
+    }
+
+    return &g_Stats.Cpus[index];
+}
+
+VOID StatsInit(VOID)
+{
+    ULONG count;
+
+    count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    if (count == 0) {
+        count = 1;
+    }
+
+    g_Stats.Cpus = (PCPU_STATS)ExAllocatePoolWithTag(NonPagedPoolNx,
+                                                     (SIZE_T)count * sizeof(CPU_STATS),
+                                                     STATS_POOL_TAG);
+    if (g_Stats.Cpus == NULL) {
+        DbgPrint("[ProcMon] Нет памяти под счётчики, статистика отключена\n");
+        return;
+    }
+
+    RtlZeroMemory(g_Stats.Cpus, (SIZE_T)count * sizeof(CPU_STATS));
+    g_Stats.CpuCount = count;
+}
+
+VOID StatsFree(VOID)
+{
+    if (g_Stats.Cpus != NULL) {
+        ExFreePoolWithTag(g_Stats.Cpus, STATS_POOL_TAG);
+        g_Stats.Cpus = NULL;
+    }
+    g_Stats.CpuCount = 0;
+}
+
+VOID StatsEventWritten(_In_ USHORT Flags, _In_ ULONG64 Fill)
+{
+    PCPU_STATS cpu = StatsCurrentCpu();
+
+    if (cpu == NULL) {
+        return;
+    }
+
+    if (Flags & PROCMON_EVENT_FLAG_CREATE) {
+        InterlockedIncrement64(&cpu->EventsCreate);
+    } else if (Flags & PROCMON_EVENT_FLAG_HASH_READY) {
+        InterlockedIncrement64(&cpu->EventsHashReady);
+    } else {
+        InterlockedIncrement64(&cpu->EventsExit);
+    }
+
+    /*
+     * Максимум без CAS-цикла: гонка с вытесненным писателем того же CPU
+     * может потерять одно обновление, что для отметки уровня неважно.
+     */
+    if ((LONG64)Fill > cpu->RingHighWater) {
+        cpu->RingHighWater = (LONG64)Fill;
+    }
+}
+
+VOID StatsEventDropped(VOID)
+{
+    PCPU_STATS cpu = StatsCurrentCpu();
+
+    if (cpu != NULL) {
+        InterlockedIncrement64(&cpu->EventsDropped);
+    }
+}
+
+VOID StatsEventOverwritten(VOID)
+{
+    PCPU_STATS cpu = StatsCurrentCpu();
+
+    if (cpu != NULL) {
+        InterlockedIncrement64(&cpu->EventsOverwritten);
+    }
+}
+
+VOID StatsHash(_In_ NTSTATUS Status, _In_ ULONG64 Bytes)
+{
+    PCPU_STATS cpu = StatsCurrentCpu();
+
+    if (cpu == NULL) {
+        return;
+    }
+
+    if (NT_SUCCESS(Status)) {
+        InterlockedIncrement64(&cpu->HashSucceeded);
+    } else {
+        InterlockedIncrement64(&cpu->HashFailed);
+    }
+
+    if (Bytes != 0) {
+        InterlockedAdd64(&cpu->HashBytes, (LONG64)Bytes);
+    }
+}
+
+VOID StatsHashCache(_In_ BOOLEAN Hit)
+{
+    PCPU_STATS cpu = StatsCurrentCpu();
+
+    if (cpu == NULL) {
+        return;
+    }
+
+    if (Hit) {
+        InterlockedIncrement64(&cpu->HashCacheHits);
+    } else {
+        InterlockedIncrement64(&cpu->HashCacheMisses);
+    }
+}
+
+VOID StatsIoctl(_In_ ULONG IoControlCode, _In_ ULONG64 Elapsed)
+{
+    PCPU_STATS cpu;
+    ULONG      index = PROCMON_STATS_IOCTL_INDEX(IoControlCode);
+
+    if (index >= PROCMON_STATS_IOCTL_COUNT) {
+        return;
+    }
+
+    cpu = StatsCurrentCpu();
+    if (cpu == NULL) {
+        return;
+    }
+
+    InterlockedIncrement64(&cpu->IoctlCalls[index]);
+    InterlockedAdd64(&cpu->IoctlTime[index], (LONG64)Elapsed);
+}
+
+VOID StatsQuery(_Out_ PPROCMON_STATS Stats)
+{
+    PCPU_STATS cpu;
+    ULONG      i;
+    ULONG      j;
+
+    RtlZeroMemory(Stats, sizeof(PROCMON_STATS));
+
+    Stats->Version = PROCMON_STATS_VERSION;
+    KeQuerySystemTime(&Stats->Timestamp);
+
+    if (g_Stats.Cpus == NULL) {
+        return;
+    }
+
+    Stats->CpuCount = g_Stats.CpuCount;
+
+    for (i = 0; i < g_Stats.CpuCount; i++) {
+        cpu = &g_Stats.Cpus[i];
+
+        Stats->EventsCreate += (ULONG64)cpu->EventsCreate;
+        Stats->EventsExit += (ULONG64)cpu->EventsExit;
+        Stats->EventsHashReady += (ULONG64)cpu->EventsHashReady;
+        Stats->EventsDropped += (ULONG64)cpu->EventsDropped;
+        Stats->EventsOverwritten += (ULONG64)cpu->EventsOverwritten;
+        Stats->HashSucceeded += (ULONG64)cpu->HashSucceeded;
+        Stats->HashFailed += (ULONG64)cpu->HashFailed;
+        Stats->HashBytes += (ULONG64)cpu->HashBytes;
+        Stats->HashCacheHits += (ULONG64)cpu->HashCacheHits;
+        Stats->HashCacheMisses += (ULONG64)cpu->HashCacheMisses;
+
+        if ((ULONG64)cpu->RingHighWater > Stats->RingHighWater) {
+            Stats->RingHighWater = (ULONG64)cpu->RingHighWater;
+        }
+
+        for (j = 0; j < PROCMON_STATS_IOCTL_COUNT; j++) {
+            Stats->Ioctl[j].Calls += (ULONG64)cpu->IoctlCalls[j];
+            Stats->Ioctl[j].TotalTime += (ULONG64)cpu->IoctlTime[j];
+        }
+    }
+}
@@ -0,0 +1,80 @@
+#ifndef PROCMON_STATS_H
+#define PROCMON_STATS_H
+
+/*
+ * stats.h — Счётчики работы драйвера (IOCTL_PROCMON_GET_STATS).
+ *
+ * Счётчики ведутся по процессорам: каждый CPU пишет только в свою
+ * структуру на отдельных кэш-линиях, поэтому горячий путь (BufferReserve
+ * из callback процессов) не гоняет общую кэш-линию между ядрами.
+ * Interlocked-операции остаются (поток может быть вытеснен посреди
+ * инкремента и продолжить на другом CPU), но без соперничества они
+ * стоят как обычная запись в свою линию. StatsQuery складывает счётчики
+ * всех процессоров при чтении.
+ *
+ * Состояние глобальное, как g_DeviceObject: кольца и хеширование не
+ * знают о DEVICE_EXTENSION. Если память под счётчики не выделилась,
+ * драйвер работает без них (все функции записи ничего не делают).
+ *
+ * IRQL: StatsInit/StatsFree/StatsQuery — PASSIVE_LEVEL,
+ *       функции записи — до DISPATCH_LEVEL.
+ */
+
+#include <ntddk.h>
+#include "../common/shared.h"
+
+/* Тег пула счётчиков ('Stat') */
+#define STATS_POOL_TAG  'tatS'
+
+/* Счётчики одного процессора (кратны кэш-линии, соседи не делят линий) */
+typedef struct DECLSPEC_CACHEALIGN _CPU_STATS {
+    volatile LONG64 EventsCreate;
+    volatile LONG64 EventsExit;
+    volatile LONG64 EventsHashReady;
+    volatile LONG64 EventsDropped;
+    volatile LONG64 EventsOverwritten;
+    volatile LONG64 RingHighWater;     /* Максимум заполнения колец, записанных с этого CPU */
+    volatile LONG64 HashSucceeded;
+    volatile LONG64 HashFailed;
+    volatile LONG64 HashBytes;
+    volatile LONG64 HashCacheHits;
+    volatile LONG64 HashCacheMisses;
+    volatile LONG64 IoctlCalls[PROCMON_STATS_IOCTL_COUNT];
+    volatile LONG64 IoctlTime[PROCMON_STATS_IOCTL_COUNT];
+} CPU_STATS, *PCPU_STATS;
+
+typedef struct _DRIVER_STATS {
+    PCPU_STATS Cpus;      /* Массив CpuCount структур (NonPagedPoolNx), NULL — счётчиков нет */
+    ULONG      CpuCount;  /* = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS) */
+} DRIVER_STATS, *PDRIVER_STATS;
+
+extern DRIVER_STATS g_Stats;
+
+/* Выделить счётчики (DriverEntry, до регистрации callback). */
+VOID StatsInit(VOID);
+
+/* Освободить счётчики (после снятия callback и BufferFree). */
+VOID StatsFree(VOID);
+
+/* Событие записано в кольцо; Fill — заполнение кольца после записи (ячеек). */
+VOID StatsEventWritten(_In_ USHORT Flags, _In_ ULONG64 Fill);
+
+/* Событие отброшено политикой переполнения. */
+VOID StatsEventDropped(VOID);
+
+/* Записано поверх непрочитанного события (или потеряно до записи). */
+VOID StatsEventOverwritten(VOID);
+
+/* Результат хеширования файла: Bytes — прочитано байт (и при ошибке). */
+VOID StatsHash(_In_ NTSTATUS Status, _In_ ULONG64 Bytes);
+
+/* Поиск в кэше хешей: Hit — хеш взят из кэша, иначе файл читается. */
+VOID StatsHashCache(_In_ BOOLEAN Hit);
+
+/* Вызов IOCTL: Elapsed — время обработки в 100 нс. Чужие коды не считаются. */
+VOID StatsIoctl(_In_ ULONG IoControlCode, _In_ ULONG64 Elapsed);
+
+/* Сложить счётчики всех процессоров. */
+VOID StatsQuery(_Out_ PPROCMON_STATS Stats);
+
+#endif /* PROCMON_STATS_H */
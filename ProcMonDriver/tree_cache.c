@@ -0,0 +1,434 @@
+/*
+ * tree_cache.c — Дайджесты кусков хеш-дерева по файлам.
+ *
+ * Записи — в списке LRU под одним FAST_MUTEX: файлов немного, а
+ * обращение бывает раз на хеширование большого файла. Журнал читается
+ * без блокировки, по копии записи; перед копированием дайджестов
+ * проверяется, что запись за это время не заменили.
+ */
+
+#include <ntifs.h>
+#include "driver.h"
+#include "tree_cache.h"
+
+/* Изменения файла, после которых целые куски прежней длины верны */
+#define TREE_CACHE_SAFE_REASONS  (USN_REASON_DATA_EXTEND | USN_REASON_CLOSE |           \
+                                  USN_REASON_BASIC_INFO_CHANGE | USN_REASON_EA_CHANGE |   \
+                                  USN_REASON_SECURITY_CHANGE | USN_REASON_OBJECT_ID_CHANGE | \
+                                  USN_REASON_HARD_LINK_CHANGE | USN_REASON_INDEXABLE_CHANGE | \
+                                  USN_REASON_RENAME_OLD_NAME | USN_REASON_RENAME_NEW_NAME)
+
+/* Буфер чтения журнала */
+#define TREE_CACHE_SCAN_BLOCK    (64 * 1024)
+
+/* Запись о файле; дайджесты лежат сразу за структурой */
+typedef struct _TREE_CACHE_ENTRY {
+    LIST_ENTRY      Link;        /* В Lru: в голове — последнее обращение */
+    TREE_CACHE_FILE File;
+    ULONG           Algorithm;   /* PROCMON_HASH_* | PROCMON_HASH_TREE */
+    ULONG           Length;      /* Длина файла при хешировании */
+    ULONG           ChunkCount;
+} TREE_CACHE_ENTRY, *PTREE_CACHE_ENTRY;
+
+typedef struct _TREE_CACHE {
+    LIST_ENTRY Lru;
+    ULONG      Count;
+    FAST_MUTEX Lock;
+    BOOLEAN    Ready;
+} TREE_CACHE;
+
+static TREE_CACHE g_TreeCache;
+
+static ULONG TreeCacheChunkCount(_In_ PCHASH_ALGORITHM Algorithm, _In_ ULONG Length)
+{
+    return (Length + Algorithm->ChunkSize - 1) / Algorithm->ChunkSize;
+}
+
+VOID TreeCacheInit(VOID)
+{
+    RtlZeroMemory(&g_TreeCache, sizeof(TREE_CACHE));
+    InitializeListHead(&g_TreeCache.Lru);
+    ExInitializeFastMutex(&g_TreeCache.Lock);
+    g_TreeCache.Ready = TRUE;
+}
+
+VOID TreeCacheFree(VOID)
+{
+    PLIST_ENTRY entry;
+
+    if (!g_TreeCache.Ready) {
+        return;
+    }
+
+    while (!IsListEmpty(&g_TreeCache.Lru)) {
+        entry = RemoveHeadList(&g_TreeCache.Lru);
+        ExFreePoolWithTag(CONTAINING_RECORD(entry, TREE_CACHE_ENTRY, Link), TREE_CACHE_POOL_TAG);
+    }
+
+    g_TreeCache.Count = 0;
+    g_TreeCache.Ready = FALSE;
+}
+
+/* Запись файла для алгоритма. Вызывается под Lock. */
+static PTREE_CACHE_ENTRY TreeCacheFind(_In_ const TREE_CACHE_FILE *File, _In_ ULONG Algorithm)
+{
+    PLIST_ENTRY       link;
+    PTREE_CACHE_ENTRY entry;
+
+    for (link = g_TreeCache.Lru.Flink; link != &g_TreeCache.Lru; link = link->Flink) {
+        entry = CONTAINING_RECORD(link, TREE_CACHE_ENTRY, Link);
+        if (entry->Algorithm == Algorithm &&
+            entry->File.VolumeSerial == File->VolumeSerial &&
+            RtlEqualMemory(entry->File.FileId, File->FileId, sizeof(File->FileId))) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * TreeCacheOpenVolume — открыть том, на котором открыт файл
+ * (\Device\HarddiskVolumeN): журнал читается запросами к тому.
+ */
+static NTSTATUS TreeCacheOpenVolume(_In_ HANDLE FileHandle, _Out_ PHANDLE Volume)
+{
+    NTSTATUS                 status;
+    PFILE_OBJECT             fileObject;
+    POBJECT_NAME_INFORMATION name = NULL;
+    ULONG                    nameLength = 0;
+    OBJECT_ATTRIBUTES        objAttr;
+    IO_STATUS_BLOCK          ioStatus;
+
+    *Volume = NULL;
+
+    status = ObReferenceObjectByHandle(FileHandle, 0, *IoFileObjectType, KernelMode,
+                                       (PVOID *)&fileObject, NULL);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = ObQueryNameString(fileObject->DeviceObject, NULL, 0, &nameLength);
+    if (status != STATUS_INFO_LENGTH_MISMATCH || nameLength == 0) {
+        status = NT_SUCCESS(status) ? STATUS_OBJECT_NAME_NOT_FOUND : status;
+        goto cleanup;
+    }
+
+    name = (POBJECT_NAME_INFORMATION)ExAllocatePoolWithTag(PagedPool, nameLength,
+                                                           TREE_CACHE_POOL_TAG);
+    if (name == NULL) {
+        status = STATUS_INSUFFICIENT_RESOURCES;
+        goto cleanup;
+    }
+
+    status = ObQueryNameString(fileObject->DeviceObject, name, nameLength, &nameLength);
+    if (!NT_SUCCESS(status)) {
+        goto cleanup;
+    }
+
+    InitializeObjectAttributes(&objAttr, &name->Name, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    status = ZwCreateFile(Volume, FILE_READ_DATA | SYNCHRONIZE, &objAttr, &ioStatus, NULL,
+                          FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                          FILE_OPEN, FILE_SYNCHRONOUS_IO_NONALERT, NULL, 0);
+    if (!NT_SUCCESS(status)) {
+        *Volume = NULL;
+    }
+
+cleanup:
+    if (name != NULL) {
+        ExFreePoolWithTag(name, TREE_CACHE_POOL_TAG);
+    }
+    ObDereferenceObject(fileObject);
+    return status;
+}
+
+/*
+ * TreeCacheRecord — номер, изменения и принадлежность файлу записи
+ * журнала. FALSE — версия записи незнакома.
+ */
+static BOOLEAN TreeCacheRecord(
+    _In_ const USN_RECORD_COMMON_HEADER *Header,
+    _In_ const TREE_CACHE_FILE *File,
+    _Out_ USN *Usn,
+    _Out_ PULONG Reason,
+    _Out_ PBOOLEAN Mine)
+{
+    static const UCHAR zero[8] = { 0 };
+    const USN_RECORD_V2 *v2;
+    const USN_RECORD_V3 *v3;
+
+    if (Header->MajorVersion == 2 && Header->RecordLength >= sizeof(USN_RECORD_V2)) {
+        /* 64-битный номер NTFS — младшие 8 байт FileId, старшие нулевые */
+        v2 = (const USN_RECORD_V2 *)Header;
+        *Usn = v2->Usn;
+        *Reason = v2->Reason;
+        *Mine = (RtlEqualMemory(&v2->FileReferenceNumber, File->FileId, 8) &&
+                 RtlEqualMemory(File->FileId + 8, zero, 8));
+        return TRUE;
+    }
+
+    if (Header->MajorVersion == 3 && Header->RecordLength >= sizeof(USN_RECORD_V3)) {
+        v3 = (const USN_RECORD_V3 *)Header;
+        *Usn = v3->Usn;
+        *Reason = v3->Reason;
+        *Mine = RtlEqualMemory(&v3->FileReferenceNumber, File->FileId, sizeof(File->FileId));
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/*
+ * TreeCacheIdentify — FileId файла, журнал тома и последняя запись
+ * файла в нём.
+ */
+static NTSTATUS TreeCacheIdentify(_In_ HANDLE FileHandle, _In_ HANDLE Volume,
+                                  _Out_ PTREE_CACHE_FILE File)
+{
+    NTSTATUS                  status;
+    IO_STATUS_BLOCK           ioStatus;
+    FILE_ID_INFORMATION       idInfo;
+    USN_JOURNAL_DATA_V0       journal;
+    READ_FILE_USN_DATA        readFile;
+    ULONG                     reason;
+    BOOLEAN                   mine;
+    /* Запись файла с именем до 255 символов */
+    ULONG64                   record[(sizeof(USN_RECORD_V3) + 512 + 7) / 8];
+
+    RtlZeroMemory(File, sizeof(TREE_CACHE_FILE));
+
+    status = ZwQueryInformationFile(FileHandle, &ioStatus, &idInfo, sizeof(idInfo),
+                                    FileIdInformation);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    File->VolumeSerial = idInfo.VolumeSerialNumber;
+    RtlCopyMemory(File->FileId, &idInfo.FileId, sizeof(File->FileId));
+
+    status = ZwFsControlFile(Volume, NULL, NULL, NULL, &ioStatus, FSCTL_QUERY_USN_JOURNAL,
+                             NULL, 0, &journal, sizeof(journal));
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    File->JournalId = journal.UsnJournalID;
+
+    readFile.MinMajorVersion = 2;
+    readFile.MaxMajorVersion = 3;
+
+    status = ZwFsControlFile(FileHandle, NULL, NULL, NULL, &ioStatus, FSCTL_READ_FILE_USN_DATA,
+                             &readFile, sizeof(readFile), record, sizeof(record));
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    if (ioStatus.Information < sizeof(USN_RECORD_COMMON_HEADER) ||
+        !TreeCacheRecord((const USN_RECORD_COMMON_HEADER *)record, File, &File->Usn,
+                         &reason, &mine)) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * TreeCacheUnchanged — по журналу с записи Since до текущей записи файла
+ * (File->Usn) у файла только дописывание и метаданные. Не дочитали до
+ * текущей записи (журнал обернулся, превышен TREE_CACHE_SCAN_LIMIT) — FALSE.
+ */
+static BOOLEAN TreeCacheUnchanged(_In_ HANDLE Volume, _In_ const TREE_CACHE_FILE *File,
+                                  _In_ USN Since)
+{
+    NTSTATUS                 status;
+    IO_STATUS_BLOCK          ioStatus;
+    READ_USN_JOURNAL_DATA_V1 read;
+    PUCHAR                   buffer;
+    const USN_RECORD_COMMON_HEADER *header;
+    ULONG                    returned;
+    ULONG                    offset;
+    ULONG                    scanned = 0;
+    ULONG                    reason;
+    ULONG                    reasons = 0;
+    USN                      usn;
+    BOOLEAN                  mine;
+    BOOLEAN                  result = FALSE;
+
+    buffer = (PUCHAR)ExAllocatePoolWithTag(PagedPool, TREE_CACHE_SCAN_BLOCK, TREE_CACHE_POOL_TAG);
+    if (buffer == NULL) {
+        return FALSE;
+    }
+
+    RtlZeroMemory(&read, sizeof(read));
+    read.StartUsn = Since;
+    read.ReasonMask = MAXULONG;
+    read.UsnJournalID = File->JournalId;
+    read.MinMajorVersion = 2;
+    read.MaxMajorVersion = 3;
+
+    while (scanned < TREE_CACHE_SCAN_LIMIT) {
+        /* Начало раньше FirstUsn (журнал обернулся) — STATUS_JOURNAL_ENTRY_DELETED */
+        status = ZwFsControlFile(Volume, NULL, NULL, NULL, &ioStatus, FSCTL_READ_USN_JOURNAL,
+                                 &read, sizeof(read), buffer, TREE_CACHE_SCAN_BLOCK);
+        returned = (ULONG)ioStatus.Information;
+        if (!NT_SUCCESS(status) || returned <= sizeof(USN)) {
+            break;
+        }
+
+        /* Буфер: номер для следующего чтения, затем записи */
+        for (offset = sizeof(USN); offset + sizeof(USN_RECORD_COMMON_HEADER) <= returned;
+             offset += header->RecordLength) {
+            header = (const USN_RECORD_COMMON_HEADER *)(buffer + offset);
+
+            if (header->RecordLength == 0 || header->RecordLength > returned - offset ||
+                !TreeCacheRecord(header, File, &usn, &reason, &mine)) {
+                goto done;
+            }
+
+            /* Запись Since — состояние, с которого хешировали: её изменения уже учтены */
+            if (mine && usn > Since) {
+                reasons |= reason;
+            }
+
+            if (usn >= File->Usn) {
+                result = ((reasons & ~TREE_CACHE_SAFE_REASONS) == 0);
+                goto done;
+            }
+        }
+
+        scanned += returned;
+        read.StartUsn = *(const USN *)buffer;
+    }
+
+done:
+    ExFreePoolWithTag(buffer, TREE_CACHE_POOL_TAG);
+    return result;
+}
+
+BOOLEAN TreeCacheLookup(
+    _In_ HANDLE FileHandle,
+    _In_ PCHASH_ALGORITHM Algorithm,
+    _In_ ULONG Length,
+    _Out_ PTREE_CACHE_FILE File,
+    _Out_writes_bytes_(((Length + Algorithm->ChunkSize - 1) / Algorithm->ChunkSize) *
+                       Algorithm->DigestSize) PUCHAR Digests,
+    _Out_ PULONG Reused)
+{
+    NTSTATUS          status;
+    HANDLE            volume;
+    PTREE_CACHE_ENTRY entry;
+    TREE_CACHE_FILE   cached;
+    ULONG             cachedLength = 0;
+    ULONG             keep;
+
+    *Reused = 0;
+    RtlZeroMemory(File, sizeof(TREE_CACHE_FILE));
+
+    if (!g_TreeCache.Ready) {
+        return FALSE;
+    }
+
+    status = TreeCacheOpenVolume(FileHandle, &volume);
+    if (!NT_SUCCESS(status)) {
+        return FALSE;
+    }
+
+    status = TreeCacheIdentify(FileHandle, volume, File);
+    if (!NT_SUCCESS(status)) {
+        ZwClose(volume);
+        return FALSE;
+    }
+
+    ExAcquireFastMutex(&g_TreeCache.Lock);
+    entry = TreeCacheFind(File, Algorithm->Id);
+    if (entry != NULL) {
+        cached = entry->File;
+        cachedLength = entry->Length;
+    }
+    ExReleaseFastMutex(&g_TreeCache.Lock);
+
+    /* Журнал пересоздан (мог пропустить изменения) или файл стал короче */
+    if (entry == NULL || cached.JournalId != File->JournalId || cached.Usn > File->Usn ||
+        cachedLength > Length) {
+        ZwClose(volume);
+        return TRUE;
+    }
+
+    if (cached.Usn != File->Usn && !TreeCacheUnchanged(volume, File, cached.Usn)) {
+        ZwClose(volume);
+        return TRUE;
+    }
+
+    ZwClose(volume);
+
+    /* Длина та же — верны все куски; дописали — все, кроме прежнего неполного */
+    keep = (cachedLength == Length) ? TreeCacheChunkCount(Algorithm, Length)
+                                    : cachedLength / Algorithm->ChunkSize;
+
+    ExAcquireFastMutex(&g_TreeCache.Lock);
+    entry = TreeCacheFind(File, Algorithm->Id);
+    if (entry != NULL && entry->File.Usn == cached.Usn && entry->File.JournalId == cached.JournalId &&
+        entry->Length == cachedLength) {
+        RtlCopyMemory(Digests, entry + 1, (SIZE_T)keep * Algorithm->DigestSize);
+        *Reused = keep;
+
+        RemoveEntryList(&entry->Link);
+        InsertHeadList(&g_TreeCache.Lru, &entry->Link);
+    }
+    ExReleaseFastMutex(&g_TreeCache.Lock);
+
+    return TRUE;
+}
+
+VOID TreeCacheInsert(
+    _In_ const TREE_CACHE_FILE *File,
+    _In_ PCHASH_ALGORITHM Algorithm,
+    _In_ ULONG Length,
+    _In_ const UCHAR *Digests)
+{
+    PTREE_CACHE_ENTRY entry;
+    PTREE_CACHE_ENTRY old;
+    PTREE_CACHE_ENTRY evicted = NULL;
+    ULONG             chunkCount = TreeCacheChunkCount(Algorithm, Length);
+    SIZE_T            digestsSize = (SIZE_T)chunkCount * Algorithm->DigestSize;
+
+    if (!g_TreeCache.Ready) {
+        return;
+    }
+
+    entry = (PTREE_CACHE_ENTRY)ExAllocatePoolWithTag(PagedPool,
+                                                     sizeof(TREE_CACHE_ENTRY) + digestsSize,
+                                                     TREE_CACHE_POOL_TAG);
+    if (entry == NULL) {
+        return;
+    }
+
+    entry->File = *File;
+    entry->Algorithm = Algorithm->Id;
+    entry->Length = Length;
+    entry->ChunkCount = chunkCount;
+    RtlCopyMemory(entry + 1, Digests, digestsSize);
+
+    ExAcquireFastMutex(&g_TreeCache.Lock);
+
+    old = TreeCacheFind(File, Algorithm->Id);
+    if (old != NULL) {
+        RemoveEntryList(&old->Link);
+        g_TreeCache.Count--;
+        evicted = old;
+    } else if (g_TreeCache.Count == TREE_CACHE_FILES) {
+        evicted = CONTAINING_RECORD(g_TreeCache.Lru.Blink, TREE_CACHE_ENTRY, Link);
+        RemoveEntryList(&evicted->Link);
+        g_TreeCache.Count--;
+    }
+
+    InsertHeadList(&g_TreeCache.Lru, &entry->Link);
+    g_TreeCache.Count++;
+
+    ExReleaseFastMutex(&g_TreeCache.Lock);
+
+    if (evicted != NULL) {
+        ExFreePoolWithTag(evicted, TREE_CACHE_POOL_TAG);
+    }
+}
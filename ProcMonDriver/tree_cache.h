@@ -0,0 +1,81 @@
+#ifndef PROCMON_TREE_CACHE_H
+#define PROCMON_TREE_CACHE_H
+
+/*
+ * tree_cache.h — Дайджесты кусков хеш-дерева по файлам.
+ *
+ * Кэш хешей (hash_cache.h) помнит только корень: стоит дописать в конец
+ * файла байт — сменятся размер и время, и дерево пересчитается целиком,
+ * до гигабайта. Здесь для последних TREE_CACHE_FILES файлов хранятся
+ * дайджесты всех кусков, и при следующем хешировании куски, которых
+ * изменения не касались, берутся готовыми.
+ *
+ * Что куски не менялись, говорит журнал изменений тома (USN). У файла
+ * запоминается номер его последней записи в журнале, а перед
+ * переиспользованием журнал читается от этого номера до текущего. Если
+ * у файла там только дописывание в конец и изменения метаданных, целые
+ * куски прежнего файла остаются верными, и пересчитываются только
+ * прежний неполный последний кусок и новые. Перезапись, усечение, смена
+ * журнала, обернувшийся или недоступный журнал (FAT, сеть) — дерево
+ * считается заново.
+ *
+ * Запись через отображение попадает в журнал, когда страницы
+ * сбрасываются на диск, — с той же задержкой меняется и время
+ * изменения, на котором стоит кэш корней, так что слабее его этот кэш
+ * проверку не делает.
+ *
+ * IRQL: всё — PASSIVE_LEVEL.
+ */
+
+#include <ntddk.h>
+#include "hash.h"
+
+/* Файлов с дайджестами кусков (до 32 KB на файл в 1 GB у SHA-256) */
+#define TREE_CACHE_FILES       32
+
+/* Больше этого журнала за одну проверку не читается — дешевле пересчитать */
+#define TREE_CACHE_SCAN_LIMIT  (4 * 1024 * 1024)
+
+/* Тег пула кэша дайджестов кусков ('TreC') */
+#define TREE_CACHE_POOL_TAG    'CerT'
+
+/* Файл и его место в журнале тома на момент хеширования */
+typedef struct _TREE_CACHE_FILE {
+    ULONG64  VolumeSerial;   /* FILE_ID_INFORMATION.VolumeSerialNumber */
+    UCHAR    FileId[16];     /* FILE_ID_INFORMATION.FileId */
+    ULONG64  JournalId;      /* USN_JOURNAL_DATA.UsnJournalID */
+    LONGLONG Usn;            /* Последняя запись файла в журнале */
+} TREE_CACHE_FILE, *PTREE_CACHE_FILE;
+
+/* Вызывается из DriverEntry. Без памяти кэш просто не работает. */
+VOID TreeCacheInit(VOID);
+
+/* Освободить все записи. Вызывается при выгрузке, когда хеширований нет. */
+VOID TreeCacheFree(VOID);
+
+/*
+ * Узнать файл и его место в журнале (File) и скопировать в Digests
+ * дайджесты начальных кусков, не менявшихся с прошлого хеширования
+ * (*Reused кусков). FALSE — у файла нет FileId или журнала, в кэш он
+ * не попадёт. File берётся до чтения данных: изменения во время
+ * хеширования увидит следующая проверка.
+ */
+BOOLEAN TreeCacheLookup(
+    _In_ HANDLE FileHandle,
+    _In_ PCHASH_ALGORITHM Algorithm,
+    _In_ ULONG Length,
+    _Out_ PTREE_CACHE_FILE File,
+    _Out_writes_bytes_(((Length + Algorithm->ChunkSize - 1) / Algorithm->ChunkSize) *
+                       Algorithm->DigestSize) PUCHAR Digests,
+    _Out_ PULONG Reused
+);
+
+/* Запомнить дайджесты всех кусков файла длиной Length, вытеснив самый старый файл. */
+VOID TreeCacheInsert(
+    _In_ const TREE_CACHE_FILE *File,
+    _In_ PCHASH_ALGORITHM Algorithm,
+    _In_ ULONG Length,
+    _In_ const UCHAR *Digests
+);
+
+#endif /* PROCMON_TREE_CACHE_H */
@@ -0,0 +1,184 @@
+/*
+ * filter.c — Проверка и исполнение программ фильтра событий.
+ *
+ * Исполнение — простой цикл по инструкциям без рекурсии и без
+ * выделения памяти: программа короткая (до PROCMON_FILTER_MAX_INSNS),
+ * переходы только вперёд. Время RATE берётся из Timestamp события,
+ * а не из часов системы, поэтому результат не зависит от того,
+ * когда событие читают.
+ */
+
+#include "filter.h"
+
+/* Окно RATE — одна секунда в единицах Timestamp (100 нс) */
+#define FILTER_RATE_WINDOW  10000000LL
+
+static BOOLEAN FilterIsTerminal(_In_ UCHAR Opcode)
+{
+    return (Opcode == PROCMON_FILTER_OP_ACCEPT || Opcode == PROCMON_FILTER_OP_REJECT);
+}
+
+BOOLEAN FilterVerify(_In_ const PROCMON_FILTER_PROGRAM *Program, _In_ SIZE_T Size)
+{
+    const PROCMON_FILTER_INSN *insn;
+    ULONG                      pc;
+    ULONG                      count;
+
+    if (Size < (SIZE_T)FIELD_OFFSET(PROCMON_FILTER_PROGRAM, Insns) ||
+        Program->Version != PROCMON_FILTER_VERSION) {
+        return FALSE;
+    }
+
+    count = Program->InsnCount;
+
+    if (count == 0 || count > PROCMON_FILTER_MAX_INSNS ||
+        Program->DataLength > PROCMON_FILTER_MAX_DATA ||
+        Size != PROCMON_FILTER_SIZE(count, Program->DataLength)) {
+        return FALSE;
+    }
+
+    for (pc = 0; pc < count; pc++) {
+        insn = &Program->Insns[pc];
+
+        if (insn->Opcode > PROCMON_FILTER_OP_RATE) {
+            return FALSE;
+        }
+
+        if (FilterIsTerminal(insn->Opcode)) {
+            continue;
+        }
+
+        /* Оба перехода должны попадать в программу */
+        if (pc + 1 + insn->JumpTrue >= count || pc + 1 + insn->JumpFalse >= count) {
+            return FALSE;
+        }
+
+        switch (insn->Opcode) {
+        case PROCMON_FILTER_OP_NAME_PREFIX:
+        case PROCMON_FILTER_OP_NAME_SUFFIX:
+        case PROCMON_FILTER_OP_HASH:
+            if (insn->Value > Program->DataLength ||
+                insn->Length > Program->DataLength - insn->Value) {
+                return FALSE;
+            }
+            if (insn->Opcode == PROCMON_FILTER_OP_HASH &&
+                insn->Length != PROCMON_HASH_SIZE && insn->Length != PROCMON_SHA256_SIZE) {
+                return FALSE;
+            }
+            break;
+
+        case PROCMON_FILTER_OP_RATE:
+            if (insn->Value == 0) {
+                return FALSE;
+            }
+            break;
+        }
+    }
+
+    /* Переходы только вперёд, значит, выполнение всегда дойдёт до последней */
+    return FilterIsTerminal(Program->Insns[count - 1].Opcode);
+}
+
+/* Сравнение ASCII без учёта регистра */
+static BOOLEAN FilterEqualNoCase(_In_reads_(Length) const CHAR *A,
+                                 _In_reads_(Length) const UCHAR *B,
+                                 _In_ ULONG Length)
+{
+    ULONG i;
+    UCHAR a;
+    UCHAR b;
+
+    for (i = 0; i < Length; i++) {
+        a = (UCHAR)A[i];
+        b = B[i];
+        if (a >= 'A' && a <= 'Z') {
+            a = (UCHAR)(a - 'A' + 'a');
+        }
+        if (b >= 'A' && b <= 'Z') {
+            b = (UCHAR)(b - 'A' + 'a');
+        }
+        if (a != b) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+BOOLEAN FilterRun(
+    _In_ const PROCMON_FILTER_PROGRAM *Program,
+    _Inout_ PPROCMON_FILTER_STATE State,
+    _In_ const PROCMON_RECORD *Record)
+{
+    const PROCMON_FILTER_INSN *insn;
+    const UCHAR               *data;
+    ULONG                      pc = 0;
+    ULONG                      nameLength = Record->Header.NameLength;
+    LONGLONG                   time = Record->Header.Timestamp.QuadPart;
+    BOOLEAN                    match;
+
+    if (Record->Header.Flags & PROCMON_EVENT_FLAG_GAP) {
+        return TRUE;
+    }
+
+    data = (const UCHAR *)&Program->Insns[Program->InsnCount];
+
+    for (;;) {
+        insn = &Program->Insns[pc];
+
+        switch (insn->Opcode) {
+        case PROCMON_FILTER_OP_ACCEPT:
+            return TRUE;
+
+        case PROCMON_FILTER_OP_REJECT:
+            return FALSE;
+
+        case PROCMON_FILTER_OP_PID:
+            match = (Record->Header.ProcessId == insn->Value);
+            break;
+
+        case PROCMON_FILTER_OP_PPID:
+            match = (Record->Header.ParentProcessId == insn->Value);
+            break;
+
+        case PROCMON_FILTER_OP_CREATE:
+            /* «Хеш готов» — продолжение создания, фильтр создания его не теряет */
+            match = (Record->Header.Flags &
+                     (PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_HASH_READY)) ? TRUE : FALSE;
+            break;
+
+        case PROCMON_FILTER_OP_NAME_PREFIX:
+            match = (insn->Length <= nameLength &&
+                     FilterEqualNoCase(Record->ImageName, data + insn->Value, insn->Length));
+            break;
+
+        case PROCMON_FILTER_OP_NAME_SUFFIX:
+            match = (insn->Length <= nameLength &&
+                     FilterEqualNoCase(Record->ImageName + nameLength - insn->Length,
+                                       data + insn->Value, insn->Length));
+            break;
+
+        case PROCMON_FILTER_OP_HASH:
+            /* Хеш другого алгоритма (другой длины) не совпадает ни с чем */
+            match = ((Record->Header.Flags & PROCMON_EVENT_FLAG_HASH_VALID) &&
+                     insn->Length == PROCMON_EVENT_HASH_SIZE(Record->Header.Flags) &&
+                     RtlEqualMemory(Record->FileHash, data + insn->Value, insn->Length));
+            break;
+
+        case PROCMON_FILTER_OP_RATE:
+        default:
+            /* Новая секунда (или время пошло назад — события другого CPU) */
+            if (time - State->RateWindow[pc] >= FILTER_RATE_WINDOW || time < State->RateWindow[pc]) {
+                State->RateWindow[pc] = time;
+                State->RateCount[pc] = 0;
+            }
+            match = (State->RateCount[pc] < insn->Value);
+            if (match) {
+                State->RateCount[pc]++;
+            }
+            break;
+        }
+
+        pc += 1 + (match ? insn->JumpTrue : insn->JumpFalse);
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef PROCMON_FILTER_H
+#define PROCMON_FILTER_H
+
+/*
+ * filter.h — Проверка и исполнение программ фильтра событий.
+ *
+ * Общий код драйвера и клиента: драйвер фильтрует IOCTL-чтения хэндла,
+ * клиент — события, прочитанные из отображённых колец. Формат программы
+ * описан у PROCMON_FILTER_PROGRAM в shared.h.
+ *
+ * Программа сначала проверяется FilterVerify; FilterRun исполняет
+ * только проверенную программу и сам границ больше не проверяет.
+ */
+
+#include "ring.h"
+
+/*
+ * Изменяемое состояние программы (счётчики RATE), своё у каждого
+ * владельца программы. Обнуляется при установке новой программы.
+ */
+typedef struct _PROCMON_FILTER_STATE {
+    LONGLONG RateWindow[PROCMON_FILTER_MAX_INSNS];  /* Начало текущей секунды */
+    ULONG    RateCount[PROCMON_FILTER_MAX_INSNS];   /* Событий в этой секунде */
+} PROCMON_FILTER_STATE, *PPROCMON_FILTER_STATE;
+
+/*
+ * Проверить программу размером Size байт: версия, размеры, коды
+ * инструкций, переходы (только вперёд и в пределах программы),
+ * данные в пределах области данных, последняя инструкция — конец.
+ */
+BOOLEAN FilterVerify(_In_ const PROCMON_FILTER_PROGRAM *Program, _In_ SIZE_T Size);
+
+/*
+ * Пропустить ли запись. Записи о пропуске (PROCMON_EVENT_FLAG_GAP)
+ * пропускаются всегда — о потерях должен узнать каждый читатель.
+ */
+BOOLEAN FilterRun(
+    _In_ const PROCMON_FILTER_PROGRAM *Program,
+    _Inout_ PPROCMON_FILTER_STATE State,
+    _In_ const PROCMON_RECORD *Record
+);
+
+#endif /* PROCMON_FILTER_H */
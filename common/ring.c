@@ -0,0 +1,269 @@
+/*
+ * ring.c — Чтение колец событий из общей памяти (драйвер и клиент).
+ *
+ * Событие с номером n лежит в ячейке n & SlotMask. Commit ячейки:
+ *   2*n + 1 — событие n записывается,
+ *   2*n + 2 — событие n опубликовано.
+ * Номер события монотонно растёт, поэтому по Commit читатель отличает
+ * «ещё не записано» от «уже перезаписано более новым».
+ *
+ * Копирование — в стиле seqlock: после копии заголовка Commit
+ * проверяется повторно; после копии имени и хеша проверяется, что
+ * арена не обернулась поверх записи. Писателей читатель не блокирует
+ * и в общую память ничего не пишет.
+ *
+ * Потери кольца складываются из двух счётчиков: Lost (читатель сам
+ * заметил, что события перезаписаны) и Control->Dropped - DroppedSeen
+ * (писатели отбросили события по политике переполнения). Пока сумма
+ * не нулевая, голова кольца — запись о пропуске.
+ */
+
+#include "ring.h"
+
+/* Состояние головы кольца для слияния */
+typedef enum _RING_PEEK {
+    RingPeekEmpty,      /* Непрочитанных событий нет */
+    RingPeekPending,    /* Номер захвачен, но событие ещё не опубликовано */
+    RingPeekReady       /* Голова опубликована и готова к чтению */
+} RING_PEEK;
+
+BOOLEAN RingCheckHeader(_In_ const PROCMON_SHARED_HEADER *Header, _In_ SIZE_T Size)
+{
+    ULONG64 ringEnd;
+
+    if (Size < sizeof(PROCMON_SHARED_HEADER) ||
+        Header->Magic != PROCMON_SHARED_MAGIC ||
+        Header->Version != PROCMON_SHARED_VERSION) {
+        return FALSE;
+    }
+
+    if (Header->RingCount == 0 ||
+        Header->SlotCount == 0 || (Header->SlotCount & (Header->SlotCount - 1)) != 0 ||
+        Header->ArenaSize == 0 || (Header->ArenaSize & (Header->ArenaSize - 1)) != 0) {
+        return FALSE;
+    }
+
+    /* Массивы кольца должны помещаться в RingStride */
+    if (Header->CommitOffset < sizeof(PROCMON_RING_CONTROL) ||
+        Header->SlotsOffset < Header->CommitOffset + (ULONG64)Header->SlotCount * sizeof(LONG64) ||
+        Header->ArenaOffset < Header->SlotsOffset +
+                              (ULONG64)Header->SlotCount * sizeof(PROCMON_EVENT_HEADER) ||
+        Header->RingStride < (ULONG64)Header->ArenaOffset + Header->ArenaSize) {
+        return FALSE;
+    }
+
+    ringEnd = Header->FirstRingOffset + (ULONG64)Header->RingCount * Header->RingStride;
+    return (Header->FirstRingOffset >= sizeof(PROCMON_SHARED_HEADER) && ringEnd <= Size);
+}
+
+VOID RingViewInit(
+    _Out_ PPROCMON_RING_VIEW View,
+    _In_ PVOID Base,
+    _In_ ULONG Index)
+{
+    const PROCMON_SHARED_HEADER *header = (const PROCMON_SHARED_HEADER *)Base;
+    PUCHAR ring;
+    LONG64 head;
+
+    ring = (PUCHAR)Base + header->FirstRingOffset + (SIZE_T)Index * header->RingStride;
+
+    View->Control   = (PPROCMON_RING_CONTROL)ring;
+    View->Commit    = (volatile LONG64 *)(ring + header->CommitOffset);
+    View->Slots     = (PPROCMON_EVENT_HEADER)(ring + header->SlotsOffset);
+    View->Arena     = ring + header->ArenaOffset;
+    View->SlotMask  = header->SlotCount - 1;
+    View->ArenaSize = header->ArenaSize;
+    View->Index     = Index;
+    View->Lost      = 0;
+    View->LostTotal = 0;
+    View->HeadTime  = 0;
+    View->LastTime  = 0;
+
+    View->DroppedSeen = View->Control->Dropped;
+    head = View->Control->Head;
+    View->Tail = (head > (LONG64)header->SlotCount) ? head - header->SlotCount : 0;
+}
+
+/* Несообщённые потери кольца */
+static ULONG64 RingPendingLoss(_In_ const PROCMON_RING_VIEW *View)
+{
+    return View->Lost + (ULONG64)(View->Control->Dropped - View->DroppedSeen);
+}
+
+/*
+ * RingPeek — найти голову кольца для слияния.
+ * Пропускает перезаписанные события (сдвигает Tail, считает в Lost)
+ * и выставляет HeadTime.
+ */
+static RING_PEEK RingPeek(_Inout_ PPROCMON_RING_VIEW View)
+{
+    LONG64 head;
+    LONG64 seq;
+    LONG64 slotCount = (LONG64)View->SlotMask + 1;
+
+    head = View->Control->Head;
+
+    /* Всё, что старше последних SlotCount событий, уже перезаписано */
+    if (head - View->Tail > slotCount) {
+        View->Lost += (ULONG64)(head - slotCount - View->Tail);
+        View->LostTotal += (ULONG64)(head - slotCount - View->Tail);
+        View->Tail = head - slotCount;
+    }
+
+    while (View->Tail < head) {
+        seq = View->Commit[View->Tail & View->SlotMask];
+
+        if (seq == View->Tail * 2 + 2) {
+            View->HeadTime = View->Slots[View->Tail & View->SlotMask].Timestamp.QuadPart;
+            return RingPeekReady;
+        }
+
+        if (seq < View->Tail * 2 + 2) {
+            return RingPeekPending;
+        }
+
+        /* Ячейку уже занял следующий круг — событие потеряно при переполнении */
+        View->Tail++;
+        View->Lost++;
+        View->LostTotal++;
+    }
+
+    /* Событий нет, но о потерях сообщить надо — временем последнего события */
+    if (RingPendingLoss(View) != 0) {
+        View->HeadTime = View->LastTime;
+        return RingPeekReady;
+    }
+
+    return RingPeekEmpty;
+}
+
+LONG RingMergeSelect(_Inout_updates_(Count) PPROCMON_RING_VIEW Views, _In_ ULONG Count)
+{
+    ULONG     i;
+    LONG      best = RING_MERGE_EMPTY;
+    LONGLONG  time;
+    LONGLONG  bestTime = 0;
+    RING_PEEK peek;
+
+    for (i = 0; i < Count; i++) {
+        peek = RingPeek(&Views[i]);
+
+        if (peek == RingPeekPending) {
+            /* Это событие может оказаться раньше остальных — ждём публикации */
+            return RING_MERGE_PENDING;
+        }
+
+        if (peek != RingPeekReady) {
+            continue;
+        }
+
+        time = Views[i].HeadTime;
+
+        if (best == RING_MERGE_EMPTY || time < bestTime ||
+            (time == bestTime && Views[i].Tail < Views[best].Tail)) {
+            best = (LONG)i;
+            bestTime = time;
+        }
+    }
+
+    return best;
+}
+
+BOOLEAN RingViewTake(_In_ const PROCMON_RING_VIEW *View, _Out_ PPROCMON_RECORD Record)
+{
+    ULONG  index;
+    LONG64 seq;
+    ULONG  recordPos;
+    ULONG  arenaMask = View->ArenaSize - 1;
+    ULONG64 loss;
+
+    loss = RingPendingLoss(View);
+    if (loss != 0) {
+        RtlZeroMemory(&Record->Header, sizeof(PROCMON_EVENT_HEADER));
+        Record->Header.Flags = PROCMON_EVENT_FLAG_GAP;
+        Record->Header.ProcessId = (loss > 0xFFFFFFFF) ? 0xFFFFFFFF : (ULONG)loss;
+        Record->Header.ParentProcessId = View->Index;
+        Record->Header.Timestamp.QuadPart = View->HeadTime;
+        Record->Header.NameOffset = PROCMON_NO_DATA;
+        Record->Header.HashOffset = PROCMON_NO_DATA;
+        Record->ImageName[0] = '\0';
+        return TRUE;
+    }
+
+    index = (ULONG)(View->Tail & View->SlotMask);
+    seq = View->Tail * 2 + 2;
+
+    Record->Header = View->Slots[index];
+
+    MemoryBarrier();
+    if (View->Commit[index] != seq) {
+        return FALSE;
+    }
+
+    /* Начало записи в арене — хеш, если он есть, иначе имя */
+    recordPos = (Record->Header.HashOffset != PROCMON_NO_DATA)
+                ? Record->Header.HashOffset : Record->Header.NameOffset;
+
+    if (Record->Header.NameLength >= PROCMON_MAX_IMAGE_NAME) {
+        Record->Header.NameLength = PROCMON_MAX_IMAGE_NAME - 1;
+    }
+
+    if (Record->Header.HashOffset != PROCMON_NO_DATA) {
+        RtlCopyMemory(Record->FileHash,
+                      &View->Arena[Record->Header.HashOffset & arenaMask],
+                      PROCMON_EVENT_HASH_SIZE(Record->Header.Flags));
+    }
+
+    if (Record->Header.NameOffset != PROCMON_NO_DATA) {
+        RtlCopyMemory(Record->ImageName,
+                      &View->Arena[Record->Header.NameOffset & arenaMask],
+                      Record->Header.NameLength);
+    } else {
+        Record->Header.NameLength = 0;
+    }
+
+    /*
+     * Запись цела, если с её начала в арену добавили не больше ArenaSize байт:
+     * иначе новые записи уже легли поверх неё (возможно, во время копирования).
+     */
+    MemoryBarrier();
+    if (recordPos != PROCMON_NO_DATA &&
+        (ULONG)((ULONG)View->Control->ArenaHead - recordPos) > View->ArenaSize) {
+        Record->Header.Flags &= ~PROCMON_EVENT_FLAG_HASH_VALID;
+        Record->Header.Flags |= PROCMON_EVENT_FLAG_NAME_LOST;
+        Record->Header.NameLength = 0;
+    }
+
+    Record->ImageName[Record->Header.NameLength] = '\0';
+    Record->Header.NameOffset = PROCMON_NO_DATA;
+    Record->Header.HashOffset = PROCMON_NO_DATA;
+
+    return TRUE;
+}
+
+VOID RingViewNext(_Inout_ PPROCMON_RING_VIEW View, _In_ const PROCMON_RECORD *Record)
+{
+    ULONG64 reported;
+
+    if (Record->Header.Flags & PROCMON_EVENT_FLAG_GAP) {
+        /* Сообщённое списываем сначала с Lost, остаток — с отброшенных писателями */
+        reported = Record->Header.ProcessId;
+        if (reported <= View->Lost) {
+            View->Lost -= reported;
+        } else {
+            View->DroppedSeen += (LONG64)(reported - View->Lost);
+            View->Lost = 0;
+        }
+        return;
+    }
+
+    View->LastTime = Record->Header.Timestamp.QuadPart;
+    View->Tail++;
+}
+
+VOID RingViewSkip(_Inout_ PPROCMON_RING_VIEW View)
+{
+    View->Tail++;
+    View->Lost++;
+    View->LostTotal++;
+}
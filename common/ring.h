@@ -0,0 +1,112 @@
+#ifndef PROCMON_RING_H
+#define PROCMON_RING_H
+
+/*
+ * ring.h — Чтение колец событий из общей памяти.
+ *
+ * Общий код драйвера и клиента: драйвер читает кольца через системное
+ * отображение (IOCTL-чтение), клиент — через своё отображение только
+ * для чтения (IOCTL_PROCMON_MAP_EVENTS). Разметка памяти описана
+ * у PROCMON_SHARED_HEADER в shared.h.
+ *
+ * Читатель не пишет в общую память: его позиция (Tail) хранится в
+ * PROCMON_RING_VIEW у каждого читателя своя.
+ *
+ * Потери (события, перезаписанные до чтения, и события, отброшенные
+ * политикой переполнения) читатель отдаёт в поток как записи о пропуске
+ * (PROCMON_EVENT_FLAG_GAP) перед следующим событием того же кольца.
+ *
+ * Цикл чтения:
+ *   while ((i = RingMergeSelect(views, n)) >= 0) {
+ *       if (RingViewTake(&views[i], &record)) {
+ *           ...обработать record...
+ *           RingViewNext(&views[i], &record);
+ *       } else {
+ *           RingViewSkip(&views[i]);
+ *       }
+ *   }
+ */
+
+#ifdef _KERNEL_MODE
+#include <ntddk.h>
+#else
+#include <windows.h>
+#endif
+
+#include "shared.h"
+
+/*
+ * Кольцо глазами одного читателя: указатели на массивы кольца
+ * внутри отображения и собственная позиция чтения.
+ */
+typedef struct DECLSPEC_CACHEALIGN _PROCMON_RING_VIEW {
+    PPROCMON_RING_CONTROL  Control;     /* Head / ArenaHead */
+    volatile LONG64       *Commit;      /* Флаги публикации ячеек */
+    PPROCMON_EVENT_HEADER  Slots;       /* Заголовки событий */
+    PUCHAR                 Arena;       /* Имена и хеши */
+    ULONG                  SlotMask;    /* SlotCount - 1 */
+    ULONG                  ArenaSize;   /* Размер арены (степень двойки) */
+    LONG64                 Tail;        /* Номер следующего непрочитанного события */
+    ULONG                  Index;       /* Номер кольца (для записей о пропуске) */
+    ULONG64                Lost;        /* Перезаписано до чтения, ещё не сообщено */
+    ULONG64                LostTotal;   /* Всего перезаписано до чтения */
+    LONG64                 DroppedSeen; /* Control->Dropped, уже сообщённый записью о пропуске */
+    LONGLONG               HeadTime;    /* Время головы (для слияния), выставляет RingMergeSelect */
+    LONGLONG               LastTime;    /* Время последнего прочитанного события */
+} PROCMON_RING_VIEW, *PPROCMON_RING_VIEW;
+
+/*
+ * Событие, извлечённое из кольца: заголовок плюс копии имени и хеша.
+ * В Header поля NameOffset/HashOffset не используются — данные лежат рядом.
+ */
+typedef struct _PROCMON_RECORD {
+    PROCMON_EVENT_HEADER Header;
+    UCHAR                FileHash[PROCMON_HASH_MAX_SIZE];  /* PROCMON_EVENT_HASH_SIZE(Header.Flags) байт */
+    CHAR                 ImageName[PROCMON_MAX_IMAGE_NAME];
+} PROCMON_RECORD, *PPROCMON_RECORD;
+
+/* Результат RingMergeSelect, когда выбрать событие нельзя */
+#define RING_MERGE_EMPTY    (-1)   /* Непрочитанных событий нет */
+#define RING_MERGE_PENDING  (-2)   /* Голова какого-то кольца ещё не опубликована */
+
+/*
+ * Проверить заголовок отображения. Size — размер отображения в байтах.
+ * Возвращает FALSE, если сигнатура, версия или размеры не сходятся.
+ */
+BOOLEAN RingCheckHeader(_In_ const PROCMON_SHARED_HEADER *Header, _In_ SIZE_T Size);
+
+/*
+ * Настроить View на кольцо Index отображения Base.
+ * Tail ставится на самое старое событие, ещё лежащее в кольце;
+ * потери до этого момента не сообщаются.
+ */
+VOID RingViewInit(
+    _Out_ PPROCMON_RING_VIEW View,
+    _In_ PVOID Base,
+    _In_ ULONG Index
+);
+
+/*
+ * Выбрать кольцо, чья голова идёт следующей в порядке (Timestamp, номер события).
+ * Перезаписанные события пропускаются (Tail сдвигается) и учитываются в Lost.
+ * Кольцо с несообщёнными потерями готово к чтению, даже если событий в нём нет.
+ * Возвращает индекс кольца, RING_MERGE_EMPTY или RING_MERGE_PENDING.
+ */
+LONG RingMergeSelect(_Inout_updates_(Count) PPROCMON_RING_VIEW Views, _In_ ULONG Count);
+
+/*
+ * Скопировать голову кольца в Record: запись о пропуске, если есть
+ * несообщённые потери, иначе событие.
+ * Возвращает FALSE, если ячейку перезаписали во время копирования
+ * (тогда вызывающий зовёт RingViewSkip).
+ * Позицию не двигает — это делает RingViewNext после приёма записи.
+ */
+BOOLEAN RingViewTake(_In_ const PROCMON_RING_VIEW *View, _Out_ PPROCMON_RECORD Record);
+
+/* Record (из RingViewTake) принят — перейти к следующей записи кольца. */
+VOID RingViewNext(_Inout_ PPROCMON_RING_VIEW View, _In_ const PROCMON_RECORD *Record);
+
+/* Голову перезаписали во время копирования — засчитать потерю и пропустить. */
+VOID RingViewSkip(_Inout_ PPROCMON_RING_VIEW View);
+
+#endif /* PROCMON_RING_H */
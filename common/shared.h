@@ -12,6 +12,31 @@
 /* Размер MD5-хеша в байтах */
 #define PROCMON_HASH_SIZE         16
 
+/* Размер SHA-256 и наибольший размер хеша события */
+#define PROCMON_SHA256_SIZE       32
+#define PROCMON_HASH_MAX_SIZE     32
+
+/* Алгоритмы хеширования образов (Parameters\HashAlgorithm) */
+#define PROCMON_HASH_MD5          0
+#define PROCMON_HASH_SHA256       1
+
+/*
+ * Флаг к PROCMON_HASH_* в PROCMON_STATS.HashAlgorithm: образы хешируются
+ * деревом (Parameters\TreeHash) — файл целиком кусками по
+ * PROCMON_HASH_TREE_CHUNK байт. Лист — хеш байта PROCMON_HASH_TREE_LEAF
+ * и куска, корень — хеш байта PROCMON_HASH_TREE_NODE и дайджестов кусков
+ * подряд (префиксы как в RFC 6962).
+ */
+#define PROCMON_HASH_TREE         0x100
+#define PROCMON_HASH_ID_MASK      0xFF
+#define PROCMON_HASH_TREE_CHUNK   (1024 * 1024)
+#define PROCMON_HASH_TREE_LEAF    0x00
+#define PROCMON_HASH_TREE_NODE    0x01
+
+/* Реализация SHA-256, выбранная по процессору (PROCMON_STATS.HashImplementation) */
+#define PROCMON_HASH_IMPL_SCALAR  0   /* Переносимая (и всегда — у MD5) */
+#define PROCMON_HASH_IMPL_SHA_NI  1   /* Инструкции расширения SHA */
+
 /* Максимальная длина пути к файлу драйвера */
 #define PROCMON_MAX_DRIVER_PATH   520
 
@@ -44,6 +69,91 @@
 #define IOCTL_PROCMON_GET_DEVICES \
     CTL_CODE(FILE_DEVICE_UNKNOWN, 0x803, METHOD_BUFFERED, FILE_READ_ACCESS)
 
+/*
+ * IOCTL для получения событий в компактном формате v2
+ * (PROCMON_EVENT_RESPONSE_V2: 32-байтовые заголовки + область строк).
+ */
+#define IOCTL_PROCMON_GET_EVENTS_V2 \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x804, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/*
+ * IOCTL для отображения колец событий в адресное пространство клиента
+ * (только чтение). Ответ — PROCMON_MAP_RESPONSE. Одно отображение на хэндл,
+ * снимается при закрытии хэндла.
+ */
+#define IOCTL_PROCMON_MAP_EVENTS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x805, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/* IOCTL для получения параметров колец и занимаемой памяти (PROCMON_BUFFER_INFO) */
+#define IOCTL_PROCMON_GET_BUFFER_INFO \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x806, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/*
+ * IOCTL для изменения параметров колец на лету.
+ * Вход — PROCMON_BUFFER_CONFIG (0 в поле — оставить как есть),
+ * выход — PROCMON_BUFFER_INFO с новыми параметрами.
+ * Непрочитанные события старых колец не теряются: их дочитывают
+ * до перехода к новым. Требует хэндл, открытый на запись.
+ */
+#define IOCTL_PROCMON_SET_BUFFER_CONFIG \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x807, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+
+/*
+ * IOCTL для получения событий в формате v2 напрямую в страницы клиента.
+ * METHOD_OUT_DIRECT: ядро не выделяет промежуточный буфер, а закрепляет
+ * выходной буфер клиента (MDL), и драйвер пишет ответ прямо в него —
+ * без второго копирования при завершении. Рассчитан на большие пачки
+ * (сотни KB и больше). Буфер должен быть выровнен на 8 байт.
+ */
+#define IOCTL_PROCMON_GET_EVENTS_DIRECT \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x808, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+
+/*
+ * IOCTL для ожидания событий (long-poll). Ответ тот же, что у
+ * IOCTL_PROCMON_GET_EVENTS_DIRECT, но если событий нет, запрос не
+ * возвращается пустым, а ждёт в драйвере первого события. Ожидание
+ * прерывается CancelIo/CancelIoEx или закрытием хэндла.
+ * Изредка ответ может прийти без событий — запрос надо просто повторить.
+ */
+#define IOCTL_PROCMON_WAIT_EVENTS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x809, METHOD_OUT_DIRECT, FILE_READ_ACCESS)
+
+/*
+ * IOCTL для установки фильтра событий хэндла (PROCMON_FILTER_PROGRAM).
+ * Программа проверяется драйвером и затем применяется ко всем чтениям
+ * событий через этот хэндл: отвергнутые события не копируются клиенту.
+ * Пустой вход снимает фильтр.
+ */
+#define IOCTL_PROCMON_SET_FILTER \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80A, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/*
+ * IOCTL для изменений набора загруженных драйверов.
+ * Вход (необязательный) — PROCMON_DELTA_REQUEST с поколением, которое клиент
+ * уже знает, выход — DRIVER_DELTA_RESPONSE: только загруженные и выгруженные
+ * с тех пор модули и новое поколение для следующего запроса. Если ничего
+ * не изменилось, ответ пустой и почти ничего не стоит драйверу.
+ * Если ответ не помещается, DeviceIoControl завершается с ERROR_MORE_DATA
+ * и возвращает только заголовок с RequiredLength.
+ */
+#define IOCTL_PROCMON_GET_LOADED_DRIVERS_DELTA \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80B, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/*
+ * IOCTL для счётчиков работы драйвера (PROCMON_STATS): события, потери,
+ * заполнение колец, хеширование, вызовы IOCTL. Счётчики растут с загрузки
+ * драйвера; скорости клиент считает по разности двух ответов.
+ */
+#define IOCTL_PROCMON_GET_STATS \
+    CTL_CODE(FILE_DEVICE_UNKNOWN, 0x80C, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+/*
+ * Именованное событие «в кольцах появились данные» (synchronization event).
+ * Драйвер взводит его после публикации события, если есть отображённые клиенты.
+ */
+#define PROCMON_NOTIFY_EVENT_KERNEL_NAME  L"\\BaseNamedObjects\\ProcMonEvents"
+#define PROCMON_NOTIFY_EVENT_USER_NAME    L"Global\\ProcMonEvents"
+
 /*
  * Структура одного события мониторинга процесса.
  * Заполняется в callback ядра, читается клиентом через IOCTL.
@@ -55,7 +165,8 @@ typedef struct _PROCMON_EVENT {
     LARGE_INTEGER Timestamp;                      /* Время события (системное) */
     CHAR      ImageName[PROCMON_MAX_IMAGE_NAME];  /* Имя исполняемого файла (ANSI) */
     UCHAR     FileHash[PROCMON_HASH_SIZE];        /* MD5 хеш исполняемого файла */
-    BOOLEAN   HashValid;                          /* TRUE если хеш вычислен */
+    BOOLEAN   HashValid;                          /* TRUE если хеш вычислен (только MD5:
+                                                     SHA-256 в этот формат не помещается) */
 } PROCMON_EVENT, *PPROCMON_EVENT;
 
 /*
@@ -67,6 +178,313 @@ typedef struct _PROCMON_EVENT_RESPONSE {
     PROCMON_EVENT Events[1];    /* Гибкий массив событий (C89-совместимый) */
 } PROCMON_EVENT_RESPONSE, *PPROCMON_EVENT_RESPONSE;
 
+/*
+ * Версия формата событий в PROCMON_EVENT_RESPONSE_V2.
+ * v3 отличается от v2 только длиной хеша: она задаётся флагом
+ * PROCMON_EVENT_FLAG_HASH_SHA256 (PROCMON_EVENT_HASH_SIZE), в v2 хеш
+ * всегда был 16-байтовым MD5.
+ */
+#define PROCMON_EVENT_FORMAT_V2       2
+#define PROCMON_EVENT_FORMAT_V3       3
+
+/* Флаги PROCMON_EVENT_HEADER.Flags */
+#define PROCMON_EVENT_FLAG_CREATE      0x0001  /* Создание процесса (иначе — завершение) */
+#define PROCMON_EVENT_FLAG_HASH_VALID  0x0002  /* HashOffset указывает на хеш */
+#define PROCMON_EVENT_FLAG_NAME_LOST   0x0004  /* Имя вытеснено из арены до чтения */
+
+/*
+ * Запись о пропуске: перед следующим событием кольца потеряны события
+ * (перезаписаны до чтения или отброшены политикой переполнения).
+ * В такой записи ProcessId — количество потерянных событий,
+ * ParentProcessId — номер кольца (процессора), Timestamp — время
+ * следующего события кольца. Имени и хеша нет.
+ */
+#define PROCMON_EVENT_FLAG_GAP         0x0008
+
+/*
+ * Хеш создания посчитан отдельно (асинхронное хеширование). Событие
+ * создания с PROCMON_EVENT_FLAG_HASH_PENDING пишется сразу, без хеша;
+ * когда рабочий поток дочитает файл, приходит запись «хеш готов»:
+ * ProcessId и ParentProcessId — те же, что у создания (по ним работают
+ * фильтры PID/PPID), Sequence — номер события создания, которое запись
+ * дополняет, Timestamp — время окончания хеширования, имя — то же, что у создания.
+ * Без PROCMON_EVENT_FLAG_HASH_VALID — файл захешировать не удалось.
+ */
+#define PROCMON_EVENT_FLAG_HASH_READY    0x0010
+#define PROCMON_EVENT_FLAG_HASH_PENDING  0x0020  /* У создания: хеш придёт записью HASH_READY */
+
+/*
+ * Хеш события — SHA-256 (PROCMON_SHA256_SIZE байт), без флага — MD5
+ * (PROCMON_HASH_SIZE). Алгоритм выбирается при загрузке драйвера
+ * (Parameters\HashAlgorithm), так что он одинаков у всех событий.
+ */
+#define PROCMON_EVENT_FLAG_HASH_SHA256   0x0040
+
+/*
+ * Хеш события — корень хеш-дерева всего файла (PROCMON_HASH_TREE), а не
+ * хеш его первых 4 MB. Длина — по-прежнему PROCMON_EVENT_HASH_SIZE.
+ */
+#define PROCMON_EVENT_FLAG_HASH_TREE     0x0080
+
+/* Длина хеша события с флагами Flags */
+#define PROCMON_EVENT_HASH_SIZE(Flags) \
+    (((Flags) & PROCMON_EVENT_FLAG_HASH_SHA256) ? PROCMON_SHA256_SIZE : PROCMON_HASH_SIZE)
+
+/* Смещение «нет данных» для NameOffset/HashOffset */
+#define PROCMON_NO_DATA               0xFFFFFFFF
+
+/*
+ * Компактный заголовок события (формат v2), ровно 32 байта — два на кэш-линию.
+ * Имя и хеш хранятся отдельно, в области данных ответа:
+ *   имя — NameLength байт ANSI без завершающего '\0' по смещению NameOffset,
+ *   хеш — PROCMON_EVENT_HASH_SIZE(Flags) байт по смещению HashOffset.
+ * Смещения отсчитываются от начала области данных (DataOffset ответа).
+ * У событий завершения имени нет (NameLength = 0).
+ */
+typedef struct _PROCMON_EVENT_HEADER {
+    ULONG         ProcessId;        /* PID процесса */
+    ULONG         ParentProcessId;  /* PID родителя (0 при завершении) */
+    LARGE_INTEGER Timestamp;        /* Время события (системное) */
+    ULONG         Sequence;         /* Номер события, уникальный в пределах загрузки драйвера;
+                                       у «хеш готов» — номер его создания */
+    USHORT        Flags;            /* PROCMON_EVENT_FLAG_* */
+    USHORT        NameLength;       /* Длина имени в байтах */
+    ULONG         NameOffset;       /* Смещение имени или PROCMON_NO_DATA */
+    ULONG         HashOffset;       /* Смещение хеша или PROCMON_NO_DATA */
+} PROCMON_EVENT_HEADER, *PPROCMON_EVENT_HEADER;
+
+C_ASSERT(sizeof(PROCMON_EVENT_HEADER) == 32);
+
+/*
+ * Ответ на IOCTL_PROCMON_GET_EVENTS_V2.
+ * За массивом заголовков по смещению DataOffset (от начала ответа)
+ * лежит область данных длиной DataLength с именами и хешами.
+ */
+typedef struct _PROCMON_EVENT_RESPONSE_V2 {
+    ULONG                Version;     /* PROCMON_EVENT_FORMAT_V3 */
+    ULONG                EventCount;  /* Количество заголовков (с записями о пропуске) */
+    ULONG                DataOffset;  /* Начало области данных */
+    ULONG                DataLength;  /* Размер области данных */
+    ULONG64              DroppedEvents;      /* Всего отброшено политикой переполнения */
+    ULONG64              OverwrittenEvents;  /* Перезаписано до чтения этим хэндлом */
+    ULONG64              PendingEvents;      /* Отставание: ещё не прочитано этим хэндлом */
+    PROCMON_EVENT_HEADER Events[1];   /* Гибкий массив заголовков */
+} PROCMON_EVENT_RESPONSE_V2, *PPROCMON_EVENT_RESPONSE_V2;
+
+/*
+ * Ответ на IOCTL_PROCMON_MAP_EVENTS.
+ * Адрес — в адресном пространстве вызывающего процесса.
+ */
+typedef struct _PROCMON_MAP_RESPONSE {
+    ULONG64 BaseAddress;   /* Начало отображения (PROCMON_SHARED_HEADER) */
+    ULONG64 ViewSize;      /* Размер отображения в байтах */
+} PROCMON_MAP_RESPONSE, *PPROCMON_MAP_RESPONSE;
+
+/* Политики переполнения кольца (PROCMON_BUFFER_CONFIG.OverflowPolicy) */
+#define PROCMON_OVERFLOW_OVERWRITE    0   /* Новое событие вытесняет самое старое */
+#define PROCMON_OVERFLOW_DROP_NEWEST  1   /* Полное кольцо не принимает новые события */
+#define PROCMON_OVERFLOW_PRIORITY     2   /* Создания отбрасываются раньше, завершения — никогда */
+
+/*
+ * Отбрасывающие политики считают место от позиции IOCTL-читателей: клиент
+ * отображения (IOCTL_PROCMON_MAP_EVENTS) свою позицию не сообщает, и пока
+ * через IOCTL никто не читает, кольца перезаписываются. Клиенту, которому
+ * нужны DROP_NEWEST/PRIORITY, следует читать через IOCTL.
+ */
+
+/*
+ * Доля кольца, которую политика PROCMON_OVERFLOW_PRIORITY держит под
+ * завершения: создания отбрасываются, когда свободно меньше RingSize / 8.
+ */
+#define PROCMON_PRIORITY_RESERVE_SHIFT  3
+
+/*
+ * Границы параметров колец. Значения из реестра и IOCTL округляются
+ * вверх до степени двойки и зажимаются в эти пределы.
+ * PROCMON_BUFFER_BUDGET_MAX — предел памяти всех колец вместе.
+ */
+#define PROCMON_RING_SIZE_MIN       64
+#define PROCMON_RING_SIZE_MAX       65536
+#define PROCMON_ARENA_SIZE_MIN      (4 * 1024)
+#define PROCMON_ARENA_SIZE_MAX      (4 * 1024 * 1024)
+#define PROCMON_BUFFER_BUDGET_MAX   (256ULL * 1024 * 1024)
+
+/*
+ * Параметры колец. Читаются при загрузке из
+ * HKLM\System\CurrentControlSet\Services\ProcMon\Parameters
+ * (REG_DWORD: RingSize, ArenaSize, OverflowPolicy), меняются IOCTL_PROCMON_SET_BUFFER_CONFIG.
+ */
+typedef struct _PROCMON_BUFFER_CONFIG {
+    ULONG RingSize;         /* Событий в одном кольце */
+    ULONG ArenaSize;        /* Байт арены имён одного кольца */
+    ULONG OverflowPolicy;   /* PROCMON_OVERFLOW_* */
+} PROCMON_BUFFER_CONFIG, *PPROCMON_BUFFER_CONFIG;
+
+/*
+ * Ответ на IOCTL_PROCMON_GET_BUFFER_INFO / IOCTL_PROCMON_SET_BUFFER_CONFIG.
+ */
+typedef struct _PROCMON_BUFFER_INFO {
+    PROCMON_BUFFER_CONFIG Config;        /* Действующие параметры */
+    ULONG   RingCount;                   /* Количество колец (по одному на процессор) */
+    ULONG   Generation;                  /* Номер набора колец, растёт при каждом изменении размера */
+    ULONG64 SectionBytes;                /* Память колец текущего набора (секция) */
+    ULONG64 RetiredBytes;                /* Память старого набора, который ещё дочитывается */
+    ULONG64 NonPagedBytes;               /* Служебные структуры в NonPagedPool */
+    ULONG64 TotalBytes;                  /* Всего */
+    ULONG   ReaderCount;                 /* Открытых хэндлов (у каждого своя позиция чтения) */
+    ULONG   Reserved;
+} PROCMON_BUFFER_INFO, *PPROCMON_BUFFER_INFO;
+
+/*
+ * Сигнатура и версия разметки общей памяти колец.
+ * Версия 2: хеш в арене — PROCMON_EVENT_HASH_SIZE(Flags) байт (до 32).
+ */
+#define PROCMON_SHARED_MAGIC    0x474E5250  /* 'PRNG' */
+#define PROCMON_SHARED_VERSION  2
+
+/*
+ * Заголовок общей памяти колец (начало отображения).
+ * Кольцо i начинается по смещению FirstRingOffset + i * RingStride и состоит из:
+ *   PROCMON_RING_CONTROL                       — счётчики писателей;
+ *   LONG64 Commit[SlotCount]       (CommitOffset) — флаги публикации ячеек;
+ *   PROCMON_EVENT_HEADER Slots[SlotCount] (SlotsOffset) — заголовки событий;
+ *   UCHAR Arena[ArenaSize + запас] (ArenaOffset)  — имена и хеши.
+ * Смещения массивов отсчитываются от начала кольца.
+ *
+ * Протокол чтения (см. common/ring.c): событие с номером n лежит в ячейке
+ * n & (SlotCount - 1) и опубликовано, когда Commit == 2*n + 2. В ячейке
+ * NameOffset/HashOffset — позиции в арене (по модулю 2^32); запись в арене
+ * цела, пока ArenaHead - позиция <= ArenaSize.
+ */
+typedef struct _PROCMON_SHARED_HEADER {
+    ULONG Magic;            /* PROCMON_SHARED_MAGIC */
+    ULONG Version;          /* PROCMON_SHARED_VERSION */
+    ULONG RingCount;        /* Количество колец (по одному на процессор) */
+    ULONG SlotCount;        /* Ячеек в кольце, степень двойки */
+    ULONG ArenaSize;        /* Размер арены кольца, степень двойки */
+    ULONG RingStride;       /* Расстояние между началами колец */
+    ULONG FirstRingOffset;  /* Смещение первого кольца от начала отображения */
+    ULONG CommitOffset;     /* Смещение Commit[] от начала кольца */
+    ULONG SlotsOffset;      /* Смещение Slots[] от начала кольца */
+    ULONG ArenaOffset;      /* Смещение Arena[] от начала кольца */
+    ULONG Generation;       /* Номер набора колец */
+    volatile LONG Retired;  /* 1 — набор заменён: писателей больше нет,
+                               дочитать и заново запросить отображение */
+    ULONG Reserved[4];
+} PROCMON_SHARED_HEADER, *PPROCMON_SHARED_HEADER;
+
+C_ASSERT(sizeof(PROCMON_SHARED_HEADER) == 64);
+
+/*
+ * Счётчики писателей кольца — отдельная кэш-линия в начале кольца.
+ */
+typedef struct _PROCMON_RING_CONTROL {
+    volatile LONG64 Head;        /* Номер следующего события */
+    volatile LONG   ArenaHead;   /* Позиция следующей записи в арене */
+    ULONG           Reserved0;
+    volatile LONG64 Dropped;     /* Событий, отброшенных политикой переполнения */
+    volatile LONG64 ReadTail;    /* Позиция самого продвинутого IOCTL-читателя: по ней
+                                    политики DROP_NEWEST/PRIORITY считают заполненность
+                                    (без IOCTL-читателей кольца перезаписываются) */
+    ULONG           Reserved[8];
+} PROCMON_RING_CONTROL, *PPROCMON_RING_CONTROL;
+
+C_ASSERT(sizeof(PROCMON_RING_CONTROL) == 64);
+
+/*
+ * Программа фильтра событий (IOCTL_PROCMON_SET_FILTER).
+ *
+ * Байткод в духе классического BPF: каждая инструкция проверяет одно
+ * условие и переходит вперёд на JumpTrue или JumpFalse инструкций
+ * (0 — на следующую). Переходы только вперёд, последняя инструкция —
+ * ACCEPT или REJECT, поэтому программа всегда завершается не больше чем
+ * за InsnCount шагов. Строки и хеши лежат в области данных за массивом
+ * инструкций: Value — смещение в ней, Length — длина.
+ */
+#define PROCMON_FILTER_VERSION     1
+#define PROCMON_FILTER_MAX_INSNS   64
+#define PROCMON_FILTER_MAX_DATA    1024
+
+/* Коды инструкций (PROCMON_FILTER_INSN.Opcode) */
+#define PROCMON_FILTER_OP_ACCEPT       0   /* Событие пропустить (конец программы) */
+#define PROCMON_FILTER_OP_REJECT       1   /* Событие отбросить (конец программы) */
+#define PROCMON_FILTER_OP_PID          2   /* ProcessId == Value */
+#define PROCMON_FILTER_OP_PPID         3   /* ParentProcessId == Value */
+#define PROCMON_FILTER_OP_CREATE       4   /* Создание процесса или его «хеш готов» (иначе — завершение) */
+#define PROCMON_FILTER_OP_NAME_PREFIX  5   /* Имя начинается с данных (без учёта регистра) */
+#define PROCMON_FILTER_OP_NAME_SUFFIX  6   /* Имя кончается данными (без учёта регистра) */
+#define PROCMON_FILTER_OP_HASH         7   /* Хеш есть и равен данным (Length — PROCMON_HASH_SIZE
+                                              для MD5 или PROCMON_SHA256_SIZE для SHA-256) */
+#define PROCMON_FILTER_OP_RATE         8   /* Через инструкцию прошло не больше Value событий
+                                              за текущую секунду (по Timestamp событий) */
+
+typedef struct _PROCMON_FILTER_INSN {
+    UCHAR  Opcode;      /* PROCMON_FILTER_OP_* */
+    UCHAR  JumpTrue;    /* Сколько инструкций пропустить, если условие выполнено */
+    UCHAR  JumpFalse;   /* Сколько инструкций пропустить, если нет */
+    UCHAR  Length;      /* Длина данных (NAME_*, HASH) */
+    ULONG  Value;       /* PID / смещение данных / предел событий в секунду */
+} PROCMON_FILTER_INSN, *PPROCMON_FILTER_INSN;
+
+typedef struct _PROCMON_FILTER_PROGRAM {
+    ULONG               Version;      /* PROCMON_FILTER_VERSION */
+    USHORT              InsnCount;    /* 1..PROCMON_FILTER_MAX_INSNS */
+    USHORT              DataLength;   /* 0..PROCMON_FILTER_MAX_DATA */
+    PROCMON_FILTER_INSN Insns[1];     /* InsnCount инструкций, за ними DataLength байт данных */
+} PROCMON_FILTER_PROGRAM, *PPROCMON_FILTER_PROGRAM;
+
+/* Полный размер программы */
+#define PROCMON_FILTER_SIZE(InsnCount, DataLength) \
+    (FIELD_OFFSET(PROCMON_FILTER_PROGRAM, Insns) + \
+     (InsnCount) * sizeof(PROCMON_FILTER_INSN) + (DataLength))
+
+/*
+ * Необязательный вход IOCTL перечислений (драйверы, устройства).
+ *
+ * Без входа (или с Cursor == 0) драйвер делает новый полный обход
+ * и отдаёт первую страницу. Если в буфер поместилось не всё, NextCursor
+ * в ответе не нулевой: повторный запрос с ним отдаёт следующую страницу
+ * того же снимка без нового обхода. Курсор непрозрачен и действует только
+ * для хэндла, который его выдал, до следующего обхода через этот хэндл.
+ *
+ * Format выбирает вид ответа:
+ *   0 — DRIVER_INFO_RESPONSE/DEVICE_INFO_RESPONSE в прежней разметке, без
+ *       NextCursor: не поместившееся просто не возвращается (ReturnedCount
+ *       меньше TotalCount). Его получают клиенты, которые входа не передают;
+ *   PROCMON_ENUM_FORMAT_PAGED — те же записи фиксированного размера, но с
+ *       заголовком, в котором есть NextCursor и счётчики кэша (..._RESPONSE_PAGED);
+ *   PROCMON_ENUM_FORMAT_V2 — DRIVER_INFO_RESPONSE_V2/DEVICE_INFO_RESPONSE_V2
+ *       с общей таблицей строк и теми же счётчиками.
+ * Вход из одного Cursor (8 байт) означает формат 0.
+ */
+typedef struct _PROCMON_ENUM_REQUEST {
+    ULONG64 Cursor;
+    ULONG   Format;     /* 0, PROCMON_ENUM_FORMAT_PAGED или PROCMON_ENUM_FORMAT_V2 */
+    ULONG   Reserved;
+} PROCMON_ENUM_REQUEST, *PPROCMON_ENUM_REQUEST;
+
+/* Форматы ответа перечислений (PROCMON_ENUM_REQUEST.Format) */
+#define PROCMON_ENUM_FORMAT_PAGED  1   /* Записи фиксированного размера и курсор */
+#define PROCMON_ENUM_FORMAT_V2     2   /* Компактные записи и таблица строк */
+
+/*
+ * Ссылка на строку в таблице строк ответа v2.
+ *
+ * Строка — это общая часть (PrefixLength байт по PrefixOffset) и следом
+ * остаток (Length байт по Offset), ANSI без завершающего '\0'. Смещения
+ * отсчитываются от начала таблицы строк (StringsOffset ответа).
+ * Одинаковые куски хранятся в таблице один раз: у путей общая часть —
+ * каталог (\SystemRoot\System32\drivers\), у Hardware ID — всё до
+ * последнего '&' или '\', имена служб совпадают целиком.
+ * Пустая строка — обе длины 0.
+ */
+typedef struct _PROCMON_STRING_REF {
+    ULONG  PrefixOffset;
+    ULONG  Offset;
+    USHORT PrefixLength;   /* 0 — общей части нет */
+    USHORT Length;
+} PROCMON_STRING_REF, *PPROCMON_STRING_REF;
+
 /*
  * Информация об одном драйвере (установленном или загруженном).
  */
@@ -76,10 +494,22 @@ typedef struct _DRIVER_INFO {
     ULONG_PTR BaseAddress;   /* Базовый адрес (для загруженных, 0 для установленных) */
     ULONG     ImageSize;     /* Размер в памяти (для загруженных) */
     ULONG     StartType;     /* Тип запуска (0-4) для установленных */
-    UCHAR     FileHash[PROCMON_HASH_SIZE];
+    UCHAR     FileHash[PROCMON_HASH_SIZE];  /* MD5 при любом Parameters\HashAlgorithm */
     BOOLEAN   HashValid;
 } DRIVER_INFO, *PDRIVER_INFO;
 
+/*
+ * Состояние кэша, из которого драйвер отдал перечисление.
+ * Нули — перечисление без кэша (каждый раз полный обход).
+ */
+typedef struct _PROCMON_CACHE_STATS {
+    ULONG64 Hits;      /* Запросов, отданных из памяти без обращения к реестру */
+    ULONG64 Misses;    /* Запросов, перед которыми кэш сверялся с реестром */
+    ULONG64 AgeMs;     /* Сколько миллисекунд назад кэш последний раз сверялся */
+    ULONG   Reread;    /* Записей, перечитанных при последней сверке */
+    ULONG   HashMs;    /* Сколько мс хешировались файлы при последней сверке (прежде Reserved) */
+} PROCMON_CACHE_STATS, *PPROCMON_CACHE_STATS;
+
 /*
  * Ответ на IOCTL_PROCMON_GET_INSTALLED_DRIVERS / IOCTL_PROCMON_GET_LOADED_DRIVERS.
  */
@@ -89,6 +519,25 @@ typedef struct _DRIVER_INFO_RESPONSE {
     DRIVER_INFO Drivers[1];
 } DRIVER_INFO_RESPONSE, *PDRIVER_INFO_RESPONSE;
 
+/* Разметка v1 не меняется: её читают клиенты, которые ничего не знают о форматах */
+C_ASSERT(FIELD_OFFSET(DRIVER_INFO_RESPONSE, TotalCount) == 0);
+C_ASSERT(FIELD_OFFSET(DRIVER_INFO_RESPONSE, ReturnedCount) == 4);
+C_ASSERT(FIELD_OFFSET(DRIVER_INFO_RESPONSE, Drivers) == 8);
+
+/*
+ * Ответ формата PROCMON_ENUM_FORMAT_PAGED: записи DRIVER_INFO, как в
+ * DRIVER_INFO_RESPONSE, плюс курсор следующей страницы и состояние кэша.
+ */
+typedef struct _DRIVER_INFO_RESPONSE_PAGED {
+    ULONG       Version;        /* PROCMON_ENUM_FORMAT_PAGED */
+    ULONG       TotalCount;
+    ULONG       ReturnedCount;
+    ULONG       Reserved;
+    ULONG64     NextCursor;     /* Курсор следующей страницы, 0 — это последняя */
+    PROCMON_CACHE_STATS Cache;  /* Кэш установленных драйверов (на момент страницы) */
+    DRIVER_INFO Drivers[1];
+} DRIVER_INFO_RESPONSE_PAGED, *PDRIVER_INFO_RESPONSE_PAGED;
+
 /*
  * Информация об одном устройстве.
  */
@@ -109,4 +558,162 @@ typedef struct _DEVICE_INFO_RESPONSE {
     DEVICE_INFO Devices[1];
 } DEVICE_INFO_RESPONSE, *PDEVICE_INFO_RESPONSE;
 
+C_ASSERT(FIELD_OFFSET(DEVICE_INFO_RESPONSE, TotalCount) == 0);
+C_ASSERT(FIELD_OFFSET(DEVICE_INFO_RESPONSE, ReturnedCount) == 4);
+C_ASSERT(FIELD_OFFSET(DEVICE_INFO_RESPONSE, Devices) == 8);
+
+typedef struct _DEVICE_INFO_RESPONSE_PAGED {
+    ULONG       Version;        /* PROCMON_ENUM_FORMAT_PAGED */
+    ULONG       TotalCount;
+    ULONG       ReturnedCount;
+    ULONG       Reserved;
+    ULONG64     NextCursor;
+    PROCMON_CACHE_STATS Cache;  /* Кэш устройств; AgeMs — с последнего полного обхода Enum */
+    DEVICE_INFO Devices[1];
+} DEVICE_INFO_RESPONSE_PAGED, *PDEVICE_INFO_RESPONSE_PAGED;
+
+/*
+ * Запись драйвера в формате v2 (64 байта): те же поля, что у DRIVER_INFO,
+ * но имя и путь — ссылки в таблицу строк.
+ */
+typedef struct _DRIVER_RECORD_V2 {
+    ULONG64            BaseAddress;
+    ULONG              ImageSize;
+    ULONG              StartType;
+    PROCMON_STRING_REF DriverName;
+    PROCMON_STRING_REF ImagePath;
+    UCHAR              FileHash[PROCMON_HASH_SIZE];
+    UCHAR              HashValid;
+    UCHAR              Reserved[7];
+} DRIVER_RECORD_V2, *PDRIVER_RECORD_V2;
+
+C_ASSERT(sizeof(DRIVER_RECORD_V2) == 64);
+
+/* Запись устройства в формате v2 (64 байта): все строки DEVICE_INFO — ссылки */
+typedef struct _DEVICE_RECORD_V2 {
+    PROCMON_STRING_REF DeviceName;
+    PROCMON_STRING_REF InstanceId;
+    PROCMON_STRING_REF HardwareId;
+    PROCMON_STRING_REF SerialNumber;
+    PROCMON_STRING_REF Service;
+    ULONG              Reserved;
+} DEVICE_RECORD_V2, *PDEVICE_RECORD_V2;
+
+C_ASSERT(sizeof(DEVICE_RECORD_V2) == 64);
+
+/*
+ * Ответ перечисления в формате v2.
+ * За массивом записей по смещению StringsOffset (от начала ответа)
+ * лежит таблица строк длиной StringsLength. Записей в странице столько,
+ * сколько поместилось вместе со строками; остальные — по NextCursor.
+ */
+typedef struct _DRIVER_INFO_RESPONSE_V2 {
+    ULONG            Version;        /* PROCMON_ENUM_FORMAT_V2 */
+    ULONG            TotalCount;
+    ULONG            ReturnedCount;
+    ULONG            Reserved;
+    ULONG            StringsOffset;  /* Начало таблицы строк */
+    ULONG            StringsLength;  /* Размер таблицы строк */
+    ULONG64          NextCursor;     /* Курсор следующей страницы, 0 — это последняя */
+    PROCMON_CACHE_STATS Cache;
+    DRIVER_RECORD_V2 Drivers[1];
+} DRIVER_INFO_RESPONSE_V2, *PDRIVER_INFO_RESPONSE_V2;
+
+typedef struct _DEVICE_INFO_RESPONSE_V2 {
+    ULONG            Version;
+    ULONG            TotalCount;
+    ULONG            ReturnedCount;
+    ULONG            Reserved;
+    ULONG            StringsOffset;
+    ULONG            StringsLength;
+    ULONG64          NextCursor;
+    PROCMON_CACHE_STATS Cache;
+    DEVICE_RECORD_V2 Devices[1];
+} DEVICE_INFO_RESPONSE_V2, *PDEVICE_INFO_RESPONSE_V2;
+
+/* Версия PROCMON_STATS */
+#define PROCMON_STATS_VERSION      2
+
+/*
+ * Счётчики IOCTL в PROCMON_STATS.Ioctl: индекс — номер функции
+ * IOCTL-кода минус 0x800 (IOCTL_PROCMON_GET_EVENTS — 0, ..._GET_STATS — 12).
+ */
+#define PROCMON_STATS_IOCTL_COUNT  16
+
+#define PROCMON_STATS_IOCTL_INDEX(Code)  ((((Code) >> 2) & 0xFFF) - 0x800)
+
+typedef struct _PROCMON_IOCTL_STATS {
+    ULONG64 Calls;      /* Вызовов */
+    ULONG64 TotalTime;  /* Суммарное время обработки (100 нс); у ожидающих —
+                           до постановки в очередь */
+} PROCMON_IOCTL_STATS, *PPROCMON_IOCTL_STATS;
+
+/*
+ * Ответ на IOCTL_PROCMON_GET_STATS. Драйвер ведёт счётчики по процессорам
+ * и складывает их при чтении, поэтому значения согласованы лишь примерно
+ * (счётчик соседнего CPU мог измениться во время сложения).
+ */
+typedef struct _PROCMON_STATS {
+    ULONG         Version;            /* PROCMON_STATS_VERSION */
+    ULONG         CpuCount;           /* Процессоров, чьи счётчики сложены */
+    LARGE_INTEGER Timestamp;          /* Время снимка (системное) */
+    ULONG64       EventsCreate;       /* Записано событий создания процесса */
+    ULONG64       EventsExit;         /* Записано событий завершения */
+    ULONG64       EventsHashReady;    /* Записано событий «хеш готов» */
+    ULONG64       EventsDropped;      /* Отброшено политикой переполнения */
+    ULONG64       EventsOverwritten;  /* Записано поверх событий, не прочитанных ни одним
+                                         IOCTL-читателем (или потеряно до записи) */
+    ULONG64       RingHighWater;      /* Наибольшее заполнение кольца, ячеек (максимум по CPU) */
+    ULONG64       HashSucceeded;      /* Файлов захешировано */
+    ULONG64       HashFailed;         /* Ошибок хеширования (файл не открылся, не прочитался) */
+    ULONG64       HashBytes;          /* Прочитано байт для хешей */
+    ULONG64       HashCacheHits;      /* Хешей, взятых из кэша по идентичности файла */
+    ULONG64       HashCacheMisses;    /* Промахов кэша (файлы без FileId кэш не ищут) */
+    ULONG64       HashCacheEvictions; /* Записей кэша, вытесненных по CLOCK */
+    ULONG         HashCacheEntries;   /* Занято записей кэша */
+    ULONG         HashCacheCapacity;  /* Предел записей (0 — кэша нет) */
+    ULONG         HashQueueDepth;     /* Файлов в очереди асинхронного хеширования */
+    ULONG         HashQueueThreads;   /* Рабочих потоков хеширования (0 — синхронный режим) */
+    ULONG64       HashQueueFull;      /* Создания без хеша из-за полной очереди */
+    ULONG         HashAlgorithm;      /* Алгоритм образов, PROCMON_HASH_* (| PROCMON_HASH_TREE) */
+    ULONG         HashImplementation; /* PROCMON_HASH_IMPL_* */
+    PROCMON_IOCTL_STATS Ioctl[PROCMON_STATS_IOCTL_COUNT];
+} PROCMON_STATS, *PPROCMON_STATS;
+
+/* Вход IOCTL_PROCMON_GET_LOADED_DRIVERS_DELTA */
+typedef struct _PROCMON_DELTA_REQUEST {
+    ULONG Generation;   /* Известное клиенту поколение, 0 — весь список */
+    ULONG Reserved;
+} PROCMON_DELTA_REQUEST, *PPROCMON_DELTA_REQUEST;
+
+/* Вид изменения в DRIVER_CHANGE */
+#define PROCMON_DRIVER_ADDED    0
+#define PROCMON_DRIVER_REMOVED  1
+
+/*
+ * Поколение клиента неизвестно драйверу (0, слишком старое или от прошлой
+ * загрузки драйвера): в ответе весь текущий набор как ADDED, и клиент
+ * заменяет свой список, а не дополняет его.
+ */
+#define PROCMON_DELTA_FLAG_FULL  0x1
+
+typedef struct _DRIVER_CHANGE {
+    ULONG       Change;     /* PROCMON_DRIVER_ADDED / PROCMON_DRIVER_REMOVED */
+    ULONG       Reserved;
+    DRIVER_INFO Driver;
+} DRIVER_CHANGE, *PDRIVER_CHANGE;
+
+/*
+ * Ответ на IOCTL_PROCMON_GET_LOADED_DRIVERS_DELTA.
+ */
+typedef struct _DRIVER_DELTA_RESPONSE {
+    ULONG         Generation;      /* Текущее поколение — вход следующего запроса */
+    ULONG         Flags;           /* PROCMON_DELTA_FLAG_* */
+    ULONG         TotalCount;      /* Загружено драйверов сейчас */
+    ULONG         ChangeCount;     /* Изменений в ответе */
+    ULONG         RequiredLength;  /* Размер полного ответа (при ERROR_MORE_DATA) */
+    ULONG         Reserved;
+    DRIVER_CHANGE Changes[1];
+} DRIVER_DELTA_RESPONSE, *PDRIVER_DELTA_RESPONSE;
+
 #endif /* PROCMON_SHARED_H */
@@ -0,0 +1,141 @@
+/*
+ * filter_bench.c — Цена FilterRun на событие.
+ *
+ * Программы от пустой (ACCEPT) до длинной цепочки сравнений гоняются по
+ * смеси событий: создания с именами и MD5, завершения. Время —
+ * наносекунд на событие, лучший из 3 прогонов.
+ *
+ * Запуск: filter_bench [событий]
+ */
+
+#include <ntddk.h>
+#include "filter.h"
+#include "filter_util.h"
+#include "km.h"
+
+#define BENCH_RECORDS  256
+#define BENCH_RUNS     3
+
+static const char *g_Names[] = {
+    "C:\\Windows\\System32\\svchost.exe",
+    "C:\\Program Files\\Build Tools\\bin\\cl.exe",
+    "C:\\Program Files\\Build Tools\\bin\\link.exe",
+    "C:\\Windows\\System32\\conhost.exe",
+    "D:\\agent\\_work\\1\\s\\out\\test_runner.exe",
+};
+
+typedef struct _BENCH_PROGRAM {
+    const char                *Name;
+    const PROCMON_FILTER_INSN *Insns;
+    ULONG                      Count;
+    const char                *Data;
+} BENCH_PROGRAM;
+
+static const PROCMON_FILTER_INSN g_Accept[] = {
+    INSN(PROCMON_FILTER_OP_ACCEPT, 0, 0, 0, 0)
+};
+
+/* Только создания */
+static const PROCMON_FILTER_INSN g_Create[] = {
+    INSN(PROCMON_FILTER_OP_CREATE, 0, 1, 0, 0),
+    INSN(PROCMON_FILTER_OP_ACCEPT, 0, 0, 0, 0),
+    INSN(PROCMON_FILTER_OP_REJECT, 0, 0, 0, 0)
+};
+
+/* Создания компилятора: префикс и суффикс имени */
+static const PROCMON_FILTER_INSN g_Name[] = {
+    INSN(PROCMON_FILTER_OP_CREATE, 0, 3, 0, 0),
+    INSN(PROCMON_FILTER_OP_NAME_PREFIX, 0, 2, 17, 0),
+    INSN(PROCMON_FILTER_OP_NAME_SUFFIX, 0, 1, 6, 17),
+    INSN(PROCMON_FILTER_OP_ACCEPT, 0, 0, 0, 0),
+    INSN(PROCMON_FILTER_OP_REJECT, 0, 0, 0, 0)
+};
+
+/* Хеш из списка плюс предел в секунду */
+static const PROCMON_FILTER_INSN g_HashRate[] = {
+    INSN(PROCMON_FILTER_OP_HASH, 1, 0, PROCMON_HASH_SIZE, 0),
+    INSN(PROCMON_FILTER_OP_HASH, 0, 2, PROCMON_HASH_SIZE, 16),
+    INSN(PROCMON_FILTER_OP_RATE, 0, 1, 0, 1000000),
+    INSN(PROCMON_FILTER_OP_ACCEPT, 0, 0, 0, 0),
+    INSN(PROCMON_FILTER_OP_REJECT, 0, 0, 0, 0)
+};
+
+/* 16 PID подряд — проверка всей цепочки почти на каждом событии */
+static PROCMON_FILTER_INSN g_PidChain[18];
+
+static const BENCH_PROGRAM g_Programs[] = {
+    { "accept",      g_Accept,   RTL_NUMBER_OF(g_Accept),   NULL },
+    { "create",      g_Create,   RTL_NUMBER_OF(g_Create),   NULL },
+    { "name",        g_Name,     RTL_NUMBER_OF(g_Name),     "c:\\program files\\cl.exe" },
+    { "hash+rate",   g_HashRate, RTL_NUMBER_OF(g_HashRate),
+      "\x11\x11\x11\x11\x11\x11\x11\x11\x11\x11\x11\x11\x11\x11\x11\x11"
+      "\x22\x22\x22\x22\x22\x22\x22\x22\x22\x22\x22\x22\x22\x22\x22\x22" },
+    { "pid x16",     g_PidChain, RTL_NUMBER_OF(g_PidChain), NULL },
+};
+
+int main(int argc, char **argv)
+{
+    ULONG          events = argc > 1 ? (ULONG)strtoul(argv[1], NULL, 10) : 20000000;
+    PROCMON_RECORD records[BENCH_RECORDS];
+    ULONG          i, p, run;
+
+    for (i = 0; i < 16; i++) {
+        g_PidChain[i] = (PROCMON_FILTER_INSN)INSN(PROCMON_FILTER_OP_PID, (UCHAR)(16 - i), 0, 0,
+                                                  90000 + i);
+    }
+    g_PidChain[16] = (PROCMON_FILTER_INSN)INSN(PROCMON_FILTER_OP_REJECT, 0, 0, 0, 0);
+    g_PidChain[17] = (PROCMON_FILTER_INSN)INSN(PROCMON_FILTER_OP_ACCEPT, 0, 0, 0, 0);
+
+    /* Две трети — создания с MD5, треть — завершения; время идёт по 10 мкс */
+    for (i = 0; i < BENCH_RECORDS; i++) {
+        if (i % 3 != 2) {
+            FilterRecord(&records[i], 1000 + i, 4,
+                         PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_HASH_VALID,
+                         (LONGLONG)i * 100, g_Names[i % RTL_NUMBER_OF(g_Names)],
+                         (UCHAR)(i % 4 == 0 ? 0x11 : 0x33));
+        } else {
+            FilterRecord(&records[i], 1000 + i, 0, 0, (LONGLONG)i * 100, NULL, 0);
+        }
+    }
+
+    for (p = 0; p < RTL_NUMBER_OF(g_Programs); p++) {
+        const BENCH_PROGRAM    *bench = &g_Programs[p];
+        ULONG                   dataLength = 0;
+        PPROCMON_FILTER_PROGRAM program;
+        PROCMON_FILTER_STATE    state;
+        SIZE_T                  size;
+        double                  best = 0;
+        ULONG                   accepted = 0;
+
+        if (bench->Data != NULL) {
+            dataLength = bench->Insns == g_HashRate ? 2 * PROCMON_HASH_SIZE
+                                                    : (ULONG)strlen(bench->Data);
+        }
+        program = FilterBuild(bench->Insns, bench->Count, bench->Data, dataLength, &size);
+        if (!FilterVerify(program, size)) {
+            fprintf(stderr, "%s: программа не прошла проверку\n", bench->Name);
+            return 1;
+        }
+
+        for (run = 0; run < BENCH_RUNS; run++) {
+            double start, elapsed;
+
+            RtlZeroMemory(&state, sizeof(state));
+            accepted = 0;
+            start = KmNow();
+            for (i = 0; i < events; i++) {
+                accepted += FilterRun(program, &state, &records[i % BENCH_RECORDS]);
+            }
+            elapsed = (KmNow() - start) * 1e9 / events;
+            if (run == 0 || elapsed < best) {
+                best = elapsed;
+            }
+        }
+
+        printf("%-10s  инструкций %2lu  %6.2f нс/событие  пропущено %5.1f%%\n",
+               bench->Name, (unsigned long)bench->Count, best, 100.0 * accepted / events);
+        free(program);
+    }
+
+    return 0;
+}
@@ -0,0 +1,403 @@
+/*
+ * filter_test.c — Проверщик и исполнение программ фильтра (common/filter.c).
+ *
+ * Проверщик: размер, версия, коды, границы переходов и данных, конец
+ * программы. Исполнение: каждое условие, «хеш готов» под фильтром PPID,
+ * записи о пропуске и окна RATE.
+ */
+
+#include <ntddk.h>
+#include "filter.h"
+#include "filter_util.h"
+#include "km.h"
+
+#define ACCEPT  INSN(PROCMON_FILTER_OP_ACCEPT, 0, 0, 0, 0)
+#define REJECT  INSN(PROCMON_FILTER_OP_REJECT, 0, 0, 0, 0)
+
+#define FILTER_RATE_WINDOW  10000000LL
+
+/* Проверить программу из инструкций и данных */
+static BOOLEAN Verify(const PROCMON_FILTER_INSN *Insns, ULONG Count, const void *Data,
+                      ULONG DataLength)
+{
+    SIZE_T                  size;
+    PPROCMON_FILTER_PROGRAM program = FilterBuild(Insns, Count, Data, DataLength, &size);
+    BOOLEAN                 result = FilterVerify(program, size);
+
+    free(program);
+    return result;
+}
+
+/* Проверщик: заголовок и размер */
+static VOID TestVerifyHeader(VOID)
+{
+    static const PROCMON_FILTER_INSN accept[] = { ACCEPT };
+    PPROCMON_FILTER_PROGRAM program;
+    SIZE_T                  size;
+
+    program = FilterBuild(accept, 1, NULL, 0, &size);
+    KM_CHECK(FilterVerify(program, size));
+
+    /* Размер должен совпадать точно */
+    KM_CHECK(!FilterVerify(program, size - 1));
+    KM_CHECK(!FilterVerify(program, size + 1));
+    KM_CHECK(!FilterVerify(program, FIELD_OFFSET(PROCMON_FILTER_PROGRAM, Insns) - 1));
+
+    program->Version = PROCMON_FILTER_VERSION + 1;
+    KM_CHECK(!FilterVerify(program, size));
+    program->Version = PROCMON_FILTER_VERSION;
+
+    /* Пустая программа */
+    program->InsnCount = 0;
+    KM_CHECK(!FilterVerify(program, PROCMON_FILTER_SIZE(0, 0)));
+    free(program);
+
+    /* Слишком длинная программа и слишком много данных */
+    {
+        PROCMON_FILTER_INSN many[PROCMON_FILTER_MAX_INSNS + 1];
+        static UCHAR        data[PROCMON_FILTER_MAX_DATA + 1];
+        ULONG               i;
+
+        for (i = 0; i < RTL_NUMBER_OF(many); i++) {
+            many[i] = (PROCMON_FILTER_INSN)ACCEPT;
+        }
+        KM_CHECK(Verify(many, PROCMON_FILTER_MAX_INSNS, NULL, 0));
+        KM_CHECK(!Verify(many, PROCMON_FILTER_MAX_INSNS + 1, NULL, 0));
+        KM_CHECK(Verify(accept, 1, data, PROCMON_FILTER_MAX_DATA));
+        KM_CHECK(!Verify(accept, 1, data, PROCMON_FILTER_MAX_DATA + 1));
+    }
+}
+
+/* Проверщик: коды, переходы, конец программы */
+static VOID TestVerifyJumps(VOID)
+{
+    /* Неизвестный код */
+    {
+        static const PROCMON_FILTER_INSN insns[] = {
+            INSN(PROCMON_FILTER_OP_RATE + 1, 0, 0, 0, 0), ACCEPT
+        };
+        KM_CHECK(!Verify(insns, 2, NULL, 0));
+    }
+
+    /* Переход ровно на последнюю инструкцию — можно, за неё — нет */
+    {
+        static const PROCMON_FILTER_INSN ok[] = {
+            INSN(PROCMON_FILTER_OP_PID, 1, 0, 0, 4), REJECT, ACCEPT
+        };
+        static const PROCMON_FILTER_INSN trueOut[] = {
+            INSN(PROCMON_FILTER_OP_PID, 2, 0, 0, 4), REJECT, ACCEPT
+        };
+        static const PROCMON_FILTER_INSN falseOut[] = {
+            INSN(PROCMON_FILTER_OP_PID, 0, 2, 0, 4), REJECT, ACCEPT
+        };
+        static const PROCMON_FILTER_INSN farOut[] = {
+            INSN(PROCMON_FILTER_OP_PID, 255, 255, 0, 4), ACCEPT
+        };
+        KM_CHECK(Verify(ok, 3, NULL, 0));
+        KM_CHECK(!Verify(trueOut, 3, NULL, 0));
+        KM_CHECK(!Verify(falseOut, 3, NULL, 0));
+        KM_CHECK(!Verify(farOut, 2, NULL, 0));
+    }
+
+    /* У концов программы поля переходов не проверяются */
+    {
+        static const PROCMON_FILTER_INSN insns[] = {
+            INSN(PROCMON_FILTER_OP_CREATE, 0, 1, 0, 0),
+            INSN(PROCMON_FILTER_OP_ACCEPT, 200, 200, 0, 0),
+            REJECT
+        };
+        KM_CHECK(Verify(insns, 3, NULL, 0));
+    }
+
+    /* Последней должна быть ACCEPT или REJECT */
+    {
+        static const PROCMON_FILTER_INSN insns[] = {
+            ACCEPT, INSN(PROCMON_FILTER_OP_CREATE, 0, 0, 0, 0)
+        };
+        static const PROCMON_FILTER_INSN single[] = {
+            INSN(PROCMON_FILTER_OP_PID, 0, 0, 0, 1)
+        };
+        KM_CHECK(!Verify(insns, 2, NULL, 0));
+        KM_CHECK(!Verify(single, 1, NULL, 0));
+    }
+}
+
+/* Проверщик: данные в пределах области данных, длина хеша, RATE */
+static VOID TestVerifyData(VOID)
+{
+    static const UCHAR data[32] = "cmd.exe";
+
+    /* Данные до самого конца области — можно */
+    {
+        static const PROCMON_FILTER_INSN insns[] = {
+            INSN(PROCMON_FILTER_OP_NAME_SUFFIX, 0, 0, 8, 24), ACCEPT
+        };
+        KM_CHECK(Verify(insns, 2, data, 32));
+    }
+
+    /* На байт за концом, начало за концом, переполнение Value + Length */
+    {
+        static const PROCMON_FILTER_INSN past[] = {
+            INSN(PROCMON_FILTER_OP_NAME_PREFIX, 0, 0, 9, 24), ACCEPT
+        };
+        static const PROCMON_FILTER_INSN start[] = {
+            INSN(PROCMON_FILTER_OP_NAME_PREFIX, 0, 0, 0, 33), ACCEPT
+        };
+        static const PROCMON_FILTER_INSN wrap[] = {
+            INSN(PROCMON_FILTER_OP_NAME_SUFFIX, 0, 0, 16, 0xFFFFFFF8u), ACCEPT
+        };
+        KM_CHECK(!Verify(past, 2, data, 32));
+        KM_CHECK(!Verify(start, 2, data, 32));
+        KM_CHECK(!Verify(wrap, 2, data, 32));
+    }
+
+    /* Хеш — 16 (MD5) или 32 (SHA-256) байта */
+    {
+        static const PROCMON_FILTER_INSN md5[] = {
+            INSN(PROCMON_FILTER_OP_HASH, 0, 0, PROCMON_HASH_SIZE, 0), ACCEPT
+        };
+        static const PROCMON_FILTER_INSN sha[] = {
+            INSN(PROCMON_FILTER_OP_HASH, 0, 0, PROCMON_SHA256_SIZE, 0), ACCEPT
+        };
+        static const PROCMON_FILTER_INSN odd[] = {
+            INSN(PROCMON_FILTER_OP_HASH, 0, 0, 20, 0), ACCEPT
+        };
+        KM_CHECK(Verify(md5, 2, data, 32));
+        KM_CHECK(Verify(sha, 2, data, 32));
+        KM_CHECK(!Verify(odd, 2, data, 32));
+    }
+
+    /* RATE с нулевым пределом не пропустит ничего — это ошибка */
+    {
+        static const PROCMON_FILTER_INSN zero[] = {
+            INSN(PROCMON_FILTER_OP_RATE, 0, 0, 0, 0), ACCEPT
+        };
+        static const PROCMON_FILTER_INSN one[] = {
+            INSN(PROCMON_FILTER_OP_RATE, 0, 0, 0, 1), ACCEPT
+        };
+        KM_CHECK(!Verify(zero, 2, NULL, 0));
+        KM_CHECK(Verify(one, 2, NULL, 0));
+    }
+}
+
+/* Прогнать запись через проверенную программу */
+static BOOLEAN Run(PPROCMON_FILTER_PROGRAM Program, PPROCMON_FILTER_STATE State,
+                   const PROCMON_RECORD *Record)
+{
+    return FilterRun(Program, State, Record);
+}
+
+/* Исполнение: условия по полям события */
+static VOID TestRunPredicates(VOID)
+{
+    static const char data[] = "c:\\windows\\" ".EXE";
+    /* PID 100, или PPID 4 и создание с именем c:\windows\*.exe */
+    static const PROCMON_FILTER_INSN insns[] = {
+        INSN(PROCMON_FILTER_OP_PID, 4, 0, 0, 100),
+        INSN(PROCMON_FILTER_OP_PPID, 0, 4, 0, 4),
+        INSN(PROCMON_FILTER_OP_CREATE, 0, 3, 0, 0),
+        INSN(PROCMON_FILTER_OP_NAME_PREFIX, 0, 2, 11, 0),
+        INSN(PROCMON_FILTER_OP_NAME_SUFFIX, 0, 1, 4, 11),
+        ACCEPT,
+        REJECT
+    };
+    PROCMON_FILTER_STATE    state;
+    PROCMON_RECORD          record;
+    PPROCMON_FILTER_PROGRAM program;
+    SIZE_T                  size;
+
+    program = FilterBuild(insns, RTL_NUMBER_OF(insns), data, sizeof(data) - 1, &size);
+    KM_CHECK(FilterVerify(program, size));
+    RtlZeroMemory(&state, sizeof(state));
+
+    FilterRecord(&record, 100, 0, 0, 1, NULL, 0);
+    KM_CHECK(Run(program, &state, &record));
+
+    /* Регистр не важен */
+    FilterRecord(&record, 7, 4, PROCMON_EVENT_FLAG_CREATE, 1, "C:\\Windows\\Notepad.exe", 0);
+    KM_CHECK(Run(program, &state, &record));
+
+    FilterRecord(&record, 7, 5, PROCMON_EVENT_FLAG_CREATE, 1, "C:\\Windows\\Notepad.exe", 0);
+    KM_CHECK(!Run(program, &state, &record));
+
+    FilterRecord(&record, 7, 4, 0, 1, "C:\\Windows\\Notepad.exe", 0);
+    KM_CHECK(!Run(program, &state, &record));
+
+    /* «Хеш готов» идёт как создание */
+    FilterRecord(&record, 7, 4, PROCMON_EVENT_FLAG_HASH_READY, 1, "C:\\Windows\\a.exe", 0);
+    KM_CHECK(Run(program, &state, &record));
+
+    FilterRecord(&record, 7, 4, PROCMON_EVENT_FLAG_CREATE, 1, "D:\\Windows\\a.exe", 0);
+    KM_CHECK(!Run(program, &state, &record));
+
+    FilterRecord(&record, 7, 4, PROCMON_EVENT_FLAG_CREATE, 1, "C:\\Windows\\a.dll", 0);
+    KM_CHECK(!Run(program, &state, &record));
+
+    /* Имя короче суффикса и префикса */
+    FilterRecord(&record, 7, 4, PROCMON_EVENT_FLAG_CREATE, 1, "exe", 0);
+    KM_CHECK(!Run(program, &state, &record));
+
+    /* Записи о пропуске проходят всегда */
+    FilterRecord(&record, 5, 0, PROCMON_EVENT_FLAG_GAP, 1, NULL, 0);
+    KM_CHECK(Run(program, &state, &record));
+
+    free(program);
+}
+
+/*
+ * Исполнение: «хеш готов» под фильтром PPID. Запись несёт PPID создания,
+ * а номер создания — в Sequence, и совпадение номера с PPID фильтра
+ * ничего не решает.
+ */
+static VOID TestRunHashReady(VOID)
+{
+    /* Только дети процесса 500 */
+    static const PROCMON_FILTER_INSN insns[] = {
+        INSN(PROCMON_FILTER_OP_PPID, 0, 1, 0, 500),
+        ACCEPT,
+        REJECT
+    };
+    PROCMON_FILTER_STATE    state;
+    PROCMON_RECORD          record;
+    PPROCMON_FILTER_PROGRAM program;
+    SIZE_T                  size;
+
+    program = FilterBuild(insns, RTL_NUMBER_OF(insns), NULL, 0, &size);
+    KM_CHECK(FilterVerify(program, size));
+    RtlZeroMemory(&state, sizeof(state));
+
+    /* Создание и его хеш проходят вместе */
+    FilterRecord(&record, 7, 500, PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_HASH_PENDING, 1,
+                 "C:\\a.exe", 0);
+    record.Header.Sequence = 42;
+    KM_CHECK(Run(program, &state, &record));
+
+    FilterRecord(&record, 7, 500, PROCMON_EVENT_FLAG_HASH_READY | PROCMON_EVENT_FLAG_HASH_VALID, 2,
+                 "C:\\a.exe", 0xAB);
+    record.Header.Sequence = 42;
+    KM_CHECK(Run(program, &state, &record));
+
+    /* Чужой процесс, чьё создание получило номер 500, — и создание, и хеш отброшены */
+    FilterRecord(&record, 8, 9, PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_HASH_PENDING, 3,
+                 "C:\\b.exe", 0);
+    record.Header.Sequence = 500;
+    KM_CHECK(!Run(program, &state, &record));
+
+    FilterRecord(&record, 8, 9, PROCMON_EVENT_FLAG_HASH_READY | PROCMON_EVENT_FLAG_HASH_VALID, 4,
+                 "C:\\b.exe", 0xCD);
+    record.Header.Sequence = 500;
+    KM_CHECK(!Run(program, &state, &record));
+
+    free(program);
+}
+
+/* Исполнение: хеш сравнивается только с хешем того же алгоритма */
+static VOID TestRunHash(VOID)
+{
+    UCHAR                   data[PROCMON_HASH_SIZE];
+    PROCMON_FILTER_INSN     insns[] = {
+        INSN(PROCMON_FILTER_OP_HASH, 0, 1, PROCMON_HASH_SIZE, 0), ACCEPT, REJECT
+    };
+    PROCMON_FILTER_STATE    state;
+    PROCMON_RECORD          record;
+    PPROCMON_FILTER_PROGRAM program;
+    SIZE_T                  size;
+
+    memset(data, 0xab, sizeof(data));
+    program = FilterBuild(insns, RTL_NUMBER_OF(insns), data, sizeof(data), &size);
+    KM_CHECK(FilterVerify(program, size));
+    RtlZeroMemory(&state, sizeof(state));
+
+    FilterRecord(&record, 1, 0, PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_HASH_VALID, 1,
+                 "a.exe", 0xab);
+    KM_CHECK(Run(program, &state, &record));
+
+    /* Без HASH_VALID хеша нет, сколько бы байт ни совпало */
+    FilterRecord(&record, 1, 0, PROCMON_EVENT_FLAG_CREATE, 1, "a.exe", 0xab);
+    KM_CHECK(!Run(program, &state, &record));
+
+    FilterRecord(&record, 1, 0, PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_HASH_VALID, 1,
+                 "a.exe", 0xac);
+    KM_CHECK(!Run(program, &state, &record));
+
+    /* SHA-256 с теми же первыми 16 байтами — другой алгоритм */
+    FilterRecord(&record, 1, 0, PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_HASH_VALID |
+                 PROCMON_EVENT_FLAG_HASH_SHA256, 1, "a.exe", 0xab);
+    KM_CHECK(!Run(program, &state, &record));
+
+    free(program);
+}
+
+/* Исполнение: окна RATE по времени событий */
+static VOID TestRunRate(VOID)
+{
+    /* Не больше 3 созданий в секунду, завершения без ограничений */
+    static const PROCMON_FILTER_INSN insns[] = {
+        INSN(PROCMON_FILTER_OP_CREATE, 0, 1, 0, 0),
+        INSN(PROCMON_FILTER_OP_RATE, 0, 1, 0, 3),
+        ACCEPT,
+        REJECT
+    };
+    PROCMON_FILTER_STATE    state;
+    PROCMON_RECORD          record;
+    PPROCMON_FILTER_PROGRAM program;
+    SIZE_T                  size;
+    LONGLONG                base = 132000000000000000LL;
+    ULONG                   i, passed;
+
+    program = FilterBuild(insns, RTL_NUMBER_OF(insns), NULL, 0, &size);
+    KM_CHECK(FilterVerify(program, size));
+    RtlZeroMemory(&state, sizeof(state));
+
+    /* Первое окно: 3 из 10, завершения проходят и предел не тратят */
+    for (i = 0, passed = 0; i < 10; i++) {
+        FilterRecord(&record, i, 0, PROCMON_EVENT_FLAG_CREATE, base + i * 1000, "a.exe", 0);
+        passed += Run(program, &state, &record);
+    }
+    KM_CHECK(passed == 3);
+    FilterRecord(&record, 50, 0, 0, base + 20000, NULL, 0);
+    KM_CHECK(Run(program, &state, &record));
+
+    /* Окно отсчитывается от первого события: за 1 тик до конца — всё ещё оно */
+    FilterRecord(&record, 11, 0, PROCMON_EVENT_FLAG_CREATE, base + FILTER_RATE_WINDOW - 1,
+                 "a.exe", 0);
+    KM_CHECK(!Run(program, &state, &record));
+
+    /* Новое окно — снова 3 */
+    for (i = 0, passed = 0; i < 5; i++) {
+        FilterRecord(&record, 20 + i, 0, PROCMON_EVENT_FLAG_CREATE,
+                     base + FILTER_RATE_WINDOW + i, "a.exe", 0);
+        passed += Run(program, &state, &record);
+    }
+    KM_CHECK(passed == 3);
+
+    /* Время назад (событие другого CPU) начинает окно заново */
+    FilterRecord(&record, 30, 0, PROCMON_EVENT_FLAG_CREATE, base + FILTER_RATE_WINDOW - 5,
+                 "a.exe", 0);
+    KM_CHECK(Run(program, &state, &record));
+
+    /* Состояние своё у каждого владельца программы */
+    {
+        PROCMON_FILTER_STATE other;
+
+        RtlZeroMemory(&other, sizeof(other));
+        FilterRecord(&record, 31, 0, PROCMON_EVENT_FLAG_CREATE, base + FILTER_RATE_WINDOW,
+                     "a.exe", 0);
+        KM_CHECK(Run(program, &other, &record));
+    }
+
+    free(program);
+}
+
+int main(void)
+{
+    TestVerifyHeader();
+    TestVerifyJumps();
+    TestVerifyData();
+    TestRunPredicates();
+    TestRunHashReady();
+    TestRunHash();
+    TestRunRate();
+
+    return KM_TEST_RESULT();
+}
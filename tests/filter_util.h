@@ -0,0 +1,56 @@
+#ifndef PROCMON_TESTS_FILTER_UTIL_H
+#define PROCMON_TESTS_FILTER_UTIL_H
+
+/*
+ * filter_util.h — Сборка программ фильтра для filter_test и filter_bench.
+ */
+
+#include <ntddk.h>
+#include "filter.h"
+
+#include <stdlib.h>
+
+#define INSN(op, jt, jf, len, value)  { (op), (jt), (jf), (len), (value) }
+
+/* Программа из массива инструкций и данных. *Size — её полный размер. */
+static inline PPROCMON_FILTER_PROGRAM FilterBuild(const PROCMON_FILTER_INSN *Insns, ULONG Count,
+                                                  const void *Data, ULONG DataLength,
+                                                  SIZE_T *Size)
+{
+    PPROCMON_FILTER_PROGRAM program;
+
+    *Size = PROCMON_FILTER_SIZE(Count, DataLength);
+    program = calloc(1, *Size + 64);
+    if (program == NULL) {
+        abort();
+    }
+
+    program->Version = PROCMON_FILTER_VERSION;
+    program->InsnCount = (USHORT)Count;
+    program->DataLength = (USHORT)DataLength;
+    memcpy(program->Insns, Insns, Count * sizeof(PROCMON_FILTER_INSN));
+    if (DataLength != 0) {
+        memcpy(&program->Insns[Count], Data, DataLength);
+    }
+    return program;
+}
+
+/* Запись события: имя (ASCII) и хеш длиной PROCMON_EVENT_HASH_SIZE(Flags) */
+static inline VOID FilterRecord(PPROCMON_RECORD Record, ULONG Pid, ULONG ParentPid, USHORT Flags,
+                                LONGLONG Time, const char *Name, UCHAR HashByte)
+{
+    memset(Record, 0, sizeof(*Record));
+    Record->Header.ProcessId = Pid;
+    Record->Header.ParentProcessId = ParentPid;
+    Record->Header.Flags = Flags;
+    Record->Header.Timestamp.QuadPart = Time;
+    Record->Header.NameOffset = PROCMON_NO_DATA;
+    Record->Header.HashOffset = PROCMON_NO_DATA;
+    if (Name != NULL) {
+        Record->Header.NameLength = (USHORT)strlen(Name);
+        memcpy(Record->ImageName, Name, Record->Header.NameLength);
+    }
+    memset(Record->FileHash, HashByte, PROCMON_EVENT_HASH_SIZE(Flags));
+}
+
+#endif /* PROCMON_TESTS_FILTER_UTIL_H */
@@ -0,0 +1,219 @@
+/*
+ * hash_io_bench.c — Отображение файла против чтения при хешировании.
+ *
+ * Три способа на одних и тех же файлах:
+ *   map    — ComputeFileHash как в драйвере: секция и отображение первых 4MB;
+ *   read   — ComputeFileHash без секций (KmSetNoSections): блоки по 256KB;
+ *   read4k — ZwReadFile по 4KB и Md5Update, как хешировал драйвер до секций.
+ * Для каждого — MB/s (лучший из 3), вызовы ядра на файл (ZwReadFile,
+ * ZwCreateSection, отображения) и малые страничные ошибки процесса на
+ * файл. Файлы только что записаны и лежат в кэше страниц, так что это
+ * цена копирования и вызовов, а не диска. Дайджесты способов сверяются.
+ *
+ * Запуск: hash_io_bench [каталог] [файлов] — по умолчанию /tmp, 16.
+ */
+
+#include <ntddk.h>
+#include "hash.h"
+#include "km.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#define BENCH_RUNS        3
+#define BENCH_MAX_FILES   64
+#define BENCH_BLOCK_4K    4096
+
+/* Размеры файлов: 4MB — весь предел хеша, 1MB и 64KB — типичные образы */
+static const ULONG g_Sizes[] = { 4 * 1024 * 1024, 1024 * 1024, 64 * 1024 };
+
+typedef struct _BENCH_FILE {
+    char           Posix[256];
+    WCHAR          Buffer[300];
+    UNICODE_STRING Path;
+    UCHAR          Digest[PROCMON_HASH_MAX_SIZE];
+} BENCH_FILE;
+
+typedef NTSTATUS (*HASH_ROUTINE)(PCUNICODE_STRING Path, UCHAR *Digest);
+
+static BENCH_FILE g_Files[BENCH_MAX_FILES];
+
+static NTSTATUS HashMap(PCUNICODE_STRING Path, UCHAR *Digest)
+{
+    return ComputeFileHash(Path, &g_HashMd5, Digest);
+}
+
+/* Прежний способ: чтение по 4KB до 4MB */
+static NTSTATUS HashRead4k(PCUNICODE_STRING Path, UCHAR *Digest)
+{
+    static UCHAR      block[BENCH_BLOCK_4K];
+    OBJECT_ATTRIBUTES objAttr;
+    IO_STATUS_BLOCK   ioStatus;
+    HANDLE            fileHandle;
+    NTSTATUS          status;
+    MD5_CTX           ctx;
+    LARGE_INTEGER     offset;
+    ULONG             total = 0;
+
+    InitializeObjectAttributes(&objAttr, (PUNICODE_STRING)Path,
+                               OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+    status = ZwCreateFile(&fileHandle, FILE_READ_DATA | SYNCHRONIZE, &objAttr, &ioStatus, NULL,
+                          FILE_ATTRIBUTE_NORMAL, FILE_SHARE_READ, FILE_OPEN,
+                          FILE_SYNCHRONOUS_IO_NONALERT | FILE_NON_DIRECTORY_FILE, NULL, 0);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    Md5Init(&ctx);
+    offset.QuadPart = 0;
+    while (total < 4 * 1024 * 1024) {
+        status = ZwReadFile(fileHandle, NULL, NULL, NULL, &ioStatus, block, sizeof(block),
+                            &offset, NULL);
+        if (status == STATUS_END_OF_FILE || (NT_SUCCESS(status) && ioStatus.Information == 0)) {
+            status = STATUS_SUCCESS;
+            break;
+        }
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+        Md5Update(&ctx, block, (ULONG)ioStatus.Information);
+        offset.QuadPart += ioStatus.Information;
+        total += (ULONG)ioStatus.Information;
+    }
+    Md5Final(&ctx, Digest);
+
+    ZwClose(fileHandle);
+    return status;
+}
+
+static long MinorFaults(void)
+{
+    struct rusage usage;
+
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt;
+}
+
+static BOOLEAN CreateFiles(const char *Dir, ULONG Count, ULONG Size)
+{
+    UCHAR *data = malloc(Size);
+    ULONG  i, j;
+
+    if (data == NULL) {
+        return FALSE;
+    }
+
+    for (i = 0; i < Count; i++) {
+        FILE *file;
+
+        for (j = 0; j < Size; j++) {
+            data[j] = (UCHAR)(j * 131 + i * 7 + (j >> 12));
+        }
+        snprintf(g_Files[i].Posix, sizeof(g_Files[i].Posix), "%s/procmon_hash_%lu_%lu.bin",
+                 Dir, (unsigned long)Size, (unsigned long)i);
+        file = fopen(g_Files[i].Posix, "wb");
+        if (file == NULL || fwrite(data, 1, Size, file) != Size) {
+            perror(g_Files[i].Posix);
+            if (file != NULL) {
+                fclose(file);
+            }
+            free(data);
+            return FALSE;
+        }
+        fclose(file);
+        KmInitPath(&g_Files[i].Path, g_Files[i].Buffer, RTL_NUMBER_OF(g_Files[i].Buffer),
+                   g_Files[i].Posix);
+    }
+
+    free(data);
+    return TRUE;
+}
+
+static VOID RemoveFiles(ULONG Count)
+{
+    ULONG i;
+
+    for (i = 0; i < Count; i++) {
+        unlink(g_Files[i].Posix);
+    }
+}
+
+/* Прогон способа по всем файлам. FALSE — ошибка или дайджест не совпал с первым способом. */
+static BOOLEAN Measure(const char *Name, HASH_ROUTINE Hash, BOOLEAN Reference,
+                       ULONG Count, ULONG Size)
+{
+    UCHAR  digest[PROCMON_HASH_MAX_SIZE];
+    double best = 0;
+    long   faults = 0;
+    ULONG  run, i;
+
+    for (run = 0; run < BENCH_RUNS; run++) {
+        double start, elapsed;
+        long   faultsStart;
+
+        KmResetCounters();
+        faultsStart = MinorFaults();
+        start = KmNow();
+        for (i = 0; i < Count; i++) {
+            RtlZeroMemory(digest, sizeof(digest));
+            if (!NT_SUCCESS(Hash(&g_Files[i].Path, digest))) {
+                fprintf(stderr, "%s: %s не хешируется\n", Name, g_Files[i].Posix);
+                return FALSE;
+            }
+            if (Reference) {
+                RtlCopyMemory(g_Files[i].Digest, digest, sizeof(digest));
+            } else if (memcmp(g_Files[i].Digest, digest, g_HashMd5.DigestSize) != 0) {
+                fprintf(stderr, "%s: дайджест %s не совпал\n", Name, g_Files[i].Posix);
+                return FALSE;
+            }
+        }
+        elapsed = KmNow() - start;
+        if (run == 0 || elapsed < best) {
+            best = elapsed;
+            faults = MinorFaults() - faultsStart;
+        }
+    }
+
+    printf("  %-7s %8.1f MB/s   ZwReadFile %5.1f  секций %3.1f  отображений %3.1f  "
+           "страничных ошибок %6.1f на файл\n",
+           Name, (double)Size * Count / best / (1024 * 1024),
+           (double)g_KmCounters.Reads / Count, (double)g_KmCounters.Sections / Count,
+           (double)g_KmCounters.Maps / Count, (double)faults / Count);
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    ULONG       count = argc > 2 ? (ULONG)strtoul(argv[2], NULL, 10) : 16;
+    BOOLEAN     ok = TRUE;
+    ULONG       s;
+
+    if (count == 0 || count > BENCH_MAX_FILES) {
+        count = 16;
+    }
+
+    for (s = 0; s < RTL_NUMBER_OF(g_Sizes) && ok; s++) {
+        ULONG size = g_Sizes[s];
+
+        if (!CreateFiles(dir, count, size)) {
+            return 1;
+        }
+
+        printf("%lu файлов по %lu KB:\n", (unsigned long)count, (unsigned long)size / 1024);
+
+        KmSetNoSections(FALSE);
+        ok = Measure("map", HashMap, TRUE, count, size);
+
+        KmSetNoSections(TRUE);
+        ok = ok && Measure("read", HashMap, FALSE, count, size);
+        KmSetNoSections(FALSE);
+
+        ok = ok && Measure("read4k", HashRead4k, FALSE, count, size);
+
+        RemoveFiles(count);
+    }
+
+    return ok ? 0 : 1;
+}
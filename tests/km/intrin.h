@@ -0,0 +1,19 @@
+#ifndef PROCMON_TESTS_KM_INTRIN_H
+#define PROCMON_TESTS_KM_INTRIN_H
+
+/*
+ * intrin.h — Подмена intrin.h MSVC: SIMD-интринсики GCC и __cpuid.
+ *
+ * __cpuid/__cpuidex идут через km.c: тест может скрыть от драйвера SHA
+ * и AVX2 (KmHideCpuFeatures) и проверить запасные реализации на том же
+ * процессоре.
+ */
+
+#include <immintrin.h>
+
+void KmCpuid(int Regs[4], int Leaf, int SubLeaf);
+
+#define __cpuid(r, l)       KmCpuid((r), (l), 0)
+#define __cpuidex(r, l, s)  KmCpuid((r), (l), (s))
+
+#endif /* PROCMON_TESTS_KM_INTRIN_H */
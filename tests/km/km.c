@@ -0,0 +1,1143 @@
+/*
+ * km.c — Подмена функций ядра для тестов: pthreads, mmap, open/pread.
+ *
+ * Объекты ядра (файлы, секции, потоки, именованные события) — KM_OBJECT
+ * со счётчиком ссылок; HANDLE — указатель на него. Первое поле —
+ * событие: завершение потока и ожидание по хэндлу идут через него.
+ *
+ * Все объекты ожидания разделяют одну пару mutex/cond: подмена для
+ * тестов, а не для скорости ожиданий. Горячий путь колец ожиданий не
+ * делает — там только атомарные операции из ntddk.h.
+ */
+
+#define _GNU_SOURCE
+#include <ntddk.h>
+#include <ntifs.h>
+#include "km.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#define STATUS_SECTION_TOO_BIG  ((NTSTATUS)0xC0000040L)
+
+/* Типы объектов ожидания (KM_DISPATCHER_HEADER.Type) */
+#define KM_WAIT_NOTIFICATION   0
+#define KM_WAIT_SYNCHRONIZATION 1
+#define KM_WAIT_SEMAPHORE      2
+#define KM_WAIT_MUTEX          3
+
+/* Типы объектов с хэндлами */
+typedef enum _KM_OBJECT_KIND {
+    KmObjectEvent,
+    KmObjectFile,
+    KmObjectSection,
+    KmObjectThread
+} KM_OBJECT_KIND;
+
+typedef struct _KM_OBJECT {
+    KEVENT          Event;       /* Должно быть первым: ожидание по объекту */
+    KM_OBJECT_KIND  Kind;
+    volatile LONG   References;
+    int             Fd;          /* Файл или секция (memfd для анонимной) */
+    BOOLEAN         Writable;    /* Анонимная секция: виды на запись */
+    ULONG64         Length;      /* Секция: размер */
+    PKSTART_ROUTINE StartRoutine;
+    PVOID           StartContext;
+} KM_OBJECT, *PKM_OBJECT;
+
+/* Вид секции: адрес и длина для munmap */
+typedef struct _KM_VIEW {
+    struct _KM_VIEW *Next;
+    PVOID            Base;
+    SIZE_T           Size;
+} KM_VIEW;
+
+struct _KM_OBJECT_TYPE {
+    KM_OBJECT_KIND Kind;
+};
+
+static struct _KM_OBJECT_TYPE g_KmThreadType = { KmObjectThread };
+static struct _KM_OBJECT_TYPE g_KmEventType = { KmObjectEvent };
+static struct _KM_OBJECT_TYPE g_KmFileType = { KmObjectFile };
+static POBJECT_TYPE g_KmThreadTypePtr = &g_KmThreadType;
+static POBJECT_TYPE g_KmEventTypePtr = &g_KmEventType;
+static POBJECT_TYPE g_KmFileTypePtr = &g_KmFileType;
+
+POBJECT_TYPE *PsThreadType = &g_KmThreadTypePtr;
+POBJECT_TYPE *ExEventObjectType = &g_KmEventTypePtr;
+POBJECT_TYPE *IoFileObjectType = &g_KmFileTypePtr;
+
+KM_COUNTERS g_KmCounters;
+LONG        g_KmFailures;
+
+static pthread_mutex_t  g_KmWaitLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   g_KmWaitCond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t  g_KmViewLock = PTHREAD_MUTEX_INITIALIZER;
+static KM_VIEW         *g_KmViews;
+static ULONG            g_KmProcessorCount = 1;
+static __thread ULONG   t_KmProcessor;
+static __thread PKM_OBJECT t_KmThread;
+static BOOLEAN          g_KmNoSections;
+static ULONG            g_KmHiddenCpu;
+
+/* --- Управление из тестов --- */
+
+VOID KmSetProcessorCount(ULONG Count)
+{
+    g_KmProcessorCount = Count ? Count : 1;
+}
+
+VOID KmSetCurrentProcessor(ULONG Number)
+{
+    t_KmProcessor = Number;
+}
+
+VOID KmSetNoSections(BOOLEAN NoSections)
+{
+    g_KmNoSections = NoSections;
+}
+
+VOID KmHideCpuFeatures(ULONG Mask)
+{
+    g_KmHiddenCpu = Mask;
+}
+
+VOID KmResetCounters(VOID)
+{
+    memset(&g_KmCounters, 0, sizeof(g_KmCounters));
+}
+
+VOID KmInitPath(PUNICODE_STRING Path, PWCHAR Buffer, ULONG Capacity, PCSTR PosixPath)
+{
+    static const char prefix[] = "\\??\\";
+    ULONG length = 0;
+    PCSTR p;
+
+    for (p = prefix; *p != '\0' && length + 1 < Capacity; p++) {
+        Buffer[length++] = (WCHAR)*p;
+    }
+    for (p = PosixPath; *p != '\0' && length + 1 < Capacity; p++) {
+        Buffer[length++] = (WCHAR)(UCHAR)*p;
+    }
+    Buffer[length] = 0;
+
+    Path->Buffer = Buffer;
+    Path->Length = (USHORT)(length * sizeof(WCHAR));
+    Path->MaximumLength = (USHORT)(Capacity * sizeof(WCHAR));
+}
+
+/* --- Процессор --- */
+
+void KmCpuid(int Regs[4], int Leaf, int SubLeaf)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int a = 0, b = 0, c = 0, d = 0;
+
+    __cpuid_count((unsigned int)Leaf, (unsigned int)SubLeaf, a, b, c, d);
+    if (Leaf == 7 && SubLeaf == 0) {
+        if (g_KmHiddenCpu & KM_CPU_AVX2) {
+            b &= ~(1u << 5);
+        }
+        if (g_KmHiddenCpu & KM_CPU_SHA) {
+            b &= ~(1u << 29);
+        }
+    }
+    Regs[0] = (int)a;
+    Regs[1] = (int)b;
+    Regs[2] = (int)c;
+    Regs[3] = (int)d;
+#else
+    UNREFERENCED_PARAMETER(Leaf);
+    UNREFERENCED_PARAMETER(SubLeaf);
+    Regs[0] = Regs[1] = Regs[2] = Regs[3] = 0;
+#endif
+}
+
+NTSTATUS KeSaveExtendedProcessorState(ULONG64 Mask, PXSTATE_SAVE XStateSave)
+{
+    UNREFERENCED_PARAMETER(Mask);
+    UNREFERENCED_PARAMETER(XStateSave);
+    return STATUS_SUCCESS;
+}
+
+VOID KeRestoreExtendedProcessorState(PXSTATE_SAVE XStateSave)
+{
+    UNREFERENCED_PARAMETER(XStateSave);
+}
+
+ULONG64 RtlGetEnabledExtendedFeatures(ULONG64 FeatureMask)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    /* __builtin_cpu_supports учитывает OSXSAVE и XCR0 */
+    if (__builtin_cpu_supports("avx")) {
+        return FeatureMask & XSTATE_MASK_AVX;
+    }
+#endif
+    UNREFERENCED_PARAMETER(FeatureMask);
+    return 0;
+}
+
+KIRQL KeGetCurrentIrql(VOID)
+{
+    return PASSIVE_LEVEL;
+}
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber)
+{
+    if (ProcNumber != NULL) {
+        ProcNumber->Group = 0;
+        ProcNumber->Number = (UCHAR)t_KmProcessor;
+        ProcNumber->Reserved = 0;
+    }
+    return t_KmProcessor;
+}
+
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber)
+{
+    UNREFERENCED_PARAMETER(GroupNumber);
+    return g_KmProcessorCount;
+}
+
+ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber)
+{
+    UNREFERENCED_PARAMETER(GroupNumber);
+    return g_KmProcessorCount;
+}
+
+/* --- Время: системное — с 1601 года, прерываний — монотонное, 100 нс --- */
+
+VOID KeQuerySystemTime(PLARGE_INTEGER CurrentTime)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    CurrentTime->QuadPart = (LONGLONG)ts.tv_sec * 10000000 + ts.tv_nsec / 100 +
+                            116444736000000000LL;
+}
+
+VOID KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime)
+{
+    KeQuerySystemTime(CurrentTime);
+}
+
+ULONG64 KeQueryInterruptTime(VOID)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ULONG64)ts.tv_sec * 10000000 + (ULONG64)ts.tv_nsec / 100;
+}
+
+/* --- Пул --- */
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag)
+{
+    PVOID p = NULL;
+
+    UNREFERENCED_PARAMETER(PoolType);
+    UNREFERENCED_PARAMETER(Tag);
+
+    if (posix_memalign(&p, 64, NumberOfBytes ? NumberOfBytes : 1) != 0) {
+        return NULL;
+    }
+    return p;
+}
+
+PVOID ExAllocatePool2(ULONG64 Flags, SIZE_T NumberOfBytes, ULONG Tag)
+{
+    PVOID p = ExAllocatePoolWithTag(NonPagedPoolNx, NumberOfBytes, Tag);
+
+    UNREFERENCED_PARAMETER(Flags);
+    if (p != NULL) {
+        memset(p, 0, NumberOfBytes);
+    }
+    return p;
+}
+
+VOID ExFreePoolWithTag(PVOID P, ULONG Tag)
+{
+    UNREFERENCED_PARAMETER(Tag);
+    free(P);
+}
+
+ULONG DbgPrint(PCSTR Format, ...)
+{
+    va_list args;
+
+    if (getenv("PROCMON_KM_VERBOSE") == NULL) {
+        return 0;
+    }
+
+    va_start(args, Format);
+    vfprintf(stderr, Format, args);
+    va_end(args);
+    return 0;
+}
+
+VOID RtlInitUnicodeString(PUNICODE_STRING Destination, PCWSTR Source)
+{
+    USHORT length = 0;
+
+    if (Source != NULL) {
+        while (Source[length] != 0) {
+            length++;
+        }
+    }
+    Destination->Buffer = (PWCH)Source;
+    Destination->Length = (USHORT)(length * sizeof(WCHAR));
+    Destination->MaximumLength = (USHORT)(Destination->Length + (Source ? sizeof(WCHAR) : 0));
+}
+
+/* --- Объекты ожидания --- */
+
+static VOID KmInitHeader(KM_DISPATCHER_HEADER *Header, LONG Type, LONG State, LONG Limit)
+{
+    Header->Type = Type;
+    Header->SignalState = State;
+    Header->Limit = Limit;
+}
+
+static VOID KmSignal(KM_DISPATCHER_HEADER *Header, LONG State)
+{
+    pthread_mutex_lock(&g_KmWaitLock);
+    Header->SignalState = State;
+    pthread_cond_broadcast(&g_KmWaitCond);
+    pthread_mutex_unlock(&g_KmWaitLock);
+}
+
+/* Под g_KmWaitLock: объект свободен — занять его (сбросить, уменьшить) */
+static BOOLEAN KmTrySatisfy(KM_DISPATCHER_HEADER *Header)
+{
+    if (Header->SignalState <= 0) {
+        return FALSE;
+    }
+
+    switch (Header->Type) {
+    case KM_WAIT_SYNCHRONIZATION:
+    case KM_WAIT_MUTEX:
+        Header->SignalState = 0;
+        break;
+    case KM_WAIT_SEMAPHORE:
+        Header->SignalState--;
+        break;
+    default:
+        break;
+    }
+    return TRUE;
+}
+
+VOID KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State)
+{
+    KmInitHeader(&Event->Header,
+                 Type == SynchronizationEvent ? KM_WAIT_SYNCHRONIZATION : KM_WAIT_NOTIFICATION,
+                 State ? 1 : 0, 1);
+}
+
+LONG KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait)
+{
+    LONG previous = Event->Header.SignalState;
+
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+    KmSignal(&Event->Header, 1);
+    return previous;
+}
+
+VOID KeClearEvent(PRKEVENT Event)
+{
+    pthread_mutex_lock(&g_KmWaitLock);
+    Event->Header.SignalState = 0;
+    pthread_mutex_unlock(&g_KmWaitLock);
+}
+
+LONG KeReadStateEvent(PRKEVENT Event)
+{
+    return ReadAcquire(&Event->Header.SignalState);
+}
+
+VOID KeInitializeSemaphore(PRKSEMAPHORE Semaphore, LONG Count, LONG Limit)
+{
+    KmInitHeader(&Semaphore->Header, KM_WAIT_SEMAPHORE, Count, Limit);
+}
+
+LONG KeReleaseSemaphore(PRKSEMAPHORE Semaphore, KPRIORITY Increment, LONG Adjustment,
+                        BOOLEAN Wait)
+{
+    LONG previous;
+
+    UNREFERENCED_PARAMETER(Increment);
+    UNREFERENCED_PARAMETER(Wait);
+
+    pthread_mutex_lock(&g_KmWaitLock);
+    previous = Semaphore->Header.SignalState;
+    Semaphore->Header.SignalState = min(previous + Adjustment, Semaphore->Header.Limit);
+    pthread_cond_broadcast(&g_KmWaitCond);
+    pthread_mutex_unlock(&g_KmWaitLock);
+    return previous;
+}
+
+VOID KeInitializeMutex(PRKMUTEX Mutex, ULONG Level)
+{
+    UNREFERENCED_PARAMETER(Level);
+    KmInitHeader(&Mutex->Header, KM_WAIT_MUTEX, 1, 1);
+}
+
+LONG KeReleaseMutex(PRKMUTEX Mutex, BOOLEAN Wait)
+{
+    UNREFERENCED_PARAMETER(Wait);
+    KmSignal(&Mutex->Header, 1);
+    return 0;
+}
+
+NTSTATUS KeWaitForMultipleObjects(ULONG Count, PVOID Object[], WAIT_TYPE WaitType,
+                                  KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode,
+                                  BOOLEAN Alertable, PLARGE_INTEGER Timeout,
+                                  PKWAIT_BLOCK WaitBlockArray)
+{
+    struct timespec deadline;
+    NTSTATUS        status = STATUS_TIMEOUT;
+    ULONG           i;
+
+    UNREFERENCED_PARAMETER(WaitType);  /* Только WaitAny */
+    UNREFERENCED_PARAMETER(WaitReason);
+    UNREFERENCED_PARAMETER(WaitMode);
+    UNREFERENCED_PARAMETER(Alertable);
+    UNREFERENCED_PARAMETER(WaitBlockArray);
+
+    if (Timeout != NULL) {
+        /* Отрицательный — относительный; абсолютные подмена считает от «сейчас» */
+        LONGLONG interval = Timeout->QuadPart < 0 ? -Timeout->QuadPart : Timeout->QuadPart;
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)(interval / 10000000);
+        deadline.tv_nsec += (long)(interval % 10000000) * 100;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&g_KmWaitLock);
+    for (;;) {
+        for (i = 0; i < Count; i++) {
+            if (KmTrySatisfy((KM_DISPATCHER_HEADER *)Object[i])) {
+                status = STATUS_WAIT_0 + (NTSTATUS)i;
+                goto done;
+            }
+        }
+
+        if (Timeout == NULL) {
+            pthread_cond_wait(&g_KmWaitCond, &g_KmWaitLock);
+        } else if (pthread_cond_timedwait(&g_KmWaitCond, &g_KmWaitLock, &deadline) == ETIMEDOUT) {
+            status = STATUS_TIMEOUT;
+            break;
+        }
+    }
+done:
+    pthread_mutex_unlock(&g_KmWaitLock);
+    return status;
+}
+
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode,
+                               BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+{
+    return KeWaitForMultipleObjects(1, &Object, WaitAny, WaitReason, WaitMode, Alertable,
+                                    Timeout, NULL);
+}
+
+/* --- Блокировки: ожидание с уступкой процессора --- */
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock)
+{
+    *SpinLock = 0;
+}
+
+VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql)
+{
+    while (__atomic_exchange_n(SpinLock, 1, __ATOMIC_ACQUIRE) != 0) {
+        YieldProcessor();
+    }
+    *OldIrql = PASSIVE_LEVEL;
+}
+
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql)
+{
+    UNREFERENCED_PARAMETER(NewIrql);
+    __atomic_store_n(SpinLock, 0, __ATOMIC_RELEASE);
+}
+
+VOID ExInitializeFastMutex(PFAST_MUTEX FastMutex)
+{
+    FastMutex->Locked = 0;
+}
+
+VOID ExAcquireFastMutex(PFAST_MUTEX FastMutex)
+{
+    while (InterlockedExchange(&FastMutex->Locked, 1) != 0) {
+        YieldProcessor();
+    }
+}
+
+VOID ExReleaseFastMutex(PFAST_MUTEX FastMutex)
+{
+    WriteRelease(&FastMutex->Locked, 0);
+}
+
+/* Бит 0 — занят исключительно, остальное — число разделяющих по 2 */
+VOID ExInitializePushLock(PEX_PUSH_LOCK PushLock)
+{
+    *PushLock = 0;
+}
+
+VOID ExAcquirePushLockShared(PEX_PUSH_LOCK PushLock)
+{
+    for (;;) {
+        ULONG_PTR value = ReadAcquire(PushLock);
+
+        if ((value & 1) == 0 &&
+            __atomic_compare_exchange_n(PushLock, &value, value + 2, FALSE,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        YieldProcessor();
+    }
+}
+
+VOID ExReleasePushLockShared(PEX_PUSH_LOCK PushLock)
+{
+    __atomic_sub_fetch(PushLock, 2, __ATOMIC_RELEASE);
+}
+
+VOID ExAcquirePushLockExclusive(PEX_PUSH_LOCK PushLock)
+{
+    for (;;) {
+        ULONG_PTR value = 0;
+
+        if (__atomic_compare_exchange_n(PushLock, &value, 1, FALSE,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return;
+        }
+        YieldProcessor();
+    }
+}
+
+VOID ExReleasePushLockExclusive(PEX_PUSH_LOCK PushLock)
+{
+    __atomic_store_n(PushLock, 0, __ATOMIC_RELEASE);
+}
+
+VOID KeEnterCriticalRegion(VOID)
+{
+}
+
+VOID KeLeaveCriticalRegion(VOID)
+{
+}
+
+/* Бит 0 — идёт rundown, остальное — ссылки по 2 */
+struct _EX_RUNDOWN_REF_CACHE_AWARE {
+    volatile LONG64 Count;
+};
+
+PEX_RUNDOWN_REF_CACHE_AWARE ExAllocateCacheAwareRundownProtection(POOL_TYPE PoolType, ULONG Tag)
+{
+    PEX_RUNDOWN_REF_CACHE_AWARE ref = ExAllocatePoolWithTag(PoolType, sizeof(*ref), Tag);
+
+    if (ref != NULL) {
+        ref->Count = 0;
+    }
+    return ref;
+}
+
+VOID ExFreeCacheAwareRundownProtection(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+    free(RunRefCacheAware);
+}
+
+BOOLEAN ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+    for (;;) {
+        LONG64 value = ReadAcquire64(&RunRefCacheAware->Count);
+
+        if (value & 1) {
+            return FALSE;
+        }
+        if (InterlockedCompareExchange64(&RunRefCacheAware->Count, value + 2, value) == value) {
+            return TRUE;
+        }
+    }
+}
+
+VOID ExReleaseRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+    InterlockedAdd64(&RunRefCacheAware->Count, -2);
+}
+
+VOID ExWaitForRundownProtectionReleaseCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+    __atomic_fetch_or(&RunRefCacheAware->Count, 1, __ATOMIC_SEQ_CST);
+    while (ReadAcquire64(&RunRefCacheAware->Count) != 1) {
+        YieldProcessor();
+    }
+}
+
+VOID ExReInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware)
+{
+    WriteRelease64(&RunRefCacheAware->Count, 0);
+}
+
+/* --- Объекты с хэндлами --- */
+
+static PKM_OBJECT KmObjectCreate(KM_OBJECT_KIND Kind)
+{
+    PKM_OBJECT object = calloc(1, sizeof(KM_OBJECT));
+
+    if (object == NULL) {
+        return NULL;
+    }
+    KeInitializeEvent(&object->Event, NotificationEvent, FALSE);
+    object->Kind = Kind;
+    object->References = 1;
+    object->Fd = -1;
+    return object;
+}
+
+VOID ObReferenceObject(PVOID Object)
+{
+    InterlockedIncrement(&((PKM_OBJECT)Object)->References);
+}
+
+VOID ObDereferenceObject(PVOID Object)
+{
+    PKM_OBJECT object = (PKM_OBJECT)Object;
+
+    if (InterlockedDecrement(&object->References) != 0) {
+        return;
+    }
+    if (object->Fd >= 0) {
+        close(object->Fd);
+    }
+    free(object);
+}
+
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK DesiredAccess,
+                                   POBJECT_TYPE ObjectType, KPROCESSOR_MODE AccessMode,
+                                   PVOID *Object, PVOID HandleInformation)
+{
+    PKM_OBJECT object = (PKM_OBJECT)Handle;
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(HandleInformation);
+
+    if (object == NULL) {
+        return STATUS_INVALID_HANDLE;
+    }
+    /* FILE_OBJECT подмена не изображает: кэшу дерева нечего узнать о томе */
+    if (object->Kind == KmObjectFile ||
+        (ObjectType != NULL && ObjectType->Kind != object->Kind)) {
+        return STATUS_OBJECT_TYPE_MISMATCH;
+    }
+
+    ObReferenceObject(object);
+    *Object = object;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwClose(HANDLE Handle)
+{
+    if (Handle == NULL) {
+        return STATUS_INVALID_HANDLE;
+    }
+    ObDereferenceObject(Handle);
+    return STATUS_SUCCESS;
+}
+
+PKEVENT IoCreateSynchronizationEvent(PUNICODE_STRING EventName, PHANDLE EventHandle)
+{
+    PKM_OBJECT object = KmObjectCreate(KmObjectEvent);
+
+    UNREFERENCED_PARAMETER(EventName);
+    if (object == NULL) {
+        return NULL;
+    }
+    /* Как в ядре: событие создаётся свободным */
+    KeInitializeEvent(&object->Event, SynchronizationEvent, TRUE);
+    *EventHandle = object;
+    return &object->Event;
+}
+
+PEPROCESS PsGetCurrentProcess(VOID)
+{
+    static int process;
+
+    return (PEPROCESS)&process;
+}
+
+/* --- Потоки --- */
+
+static __attribute__((noreturn)) VOID KmThreadExit(VOID)
+{
+    PKM_OBJECT thread = t_KmThread;
+
+    KmSignal(&thread->Event.Header, 1);
+    ObDereferenceObject(thread);
+    pthread_exit(NULL);
+}
+
+static void *KmThreadStart(void *Argument)
+{
+    PKM_OBJECT thread = (PKM_OBJECT)Argument;
+
+    t_KmThread = thread;
+    thread->StartRoutine(thread->StartContext);
+    KmThreadExit();
+}
+
+NTSTATUS PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess,
+                              POBJECT_ATTRIBUTES ObjectAttributes, HANDLE ProcessHandle,
+                              PVOID ClientId, PKSTART_ROUTINE StartRoutine,
+                              PVOID StartContext)
+{
+    PKM_OBJECT thread = KmObjectCreate(KmObjectThread);
+    pthread_t  id;
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(ObjectAttributes);
+    UNREFERENCED_PARAMETER(ProcessHandle);
+    UNREFERENCED_PARAMETER(ClientId);
+
+    if (thread == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    thread->StartRoutine = StartRoutine;
+    thread->StartContext = StartContext;
+    thread->References = 2;  /* Хэндл и сам поток до выхода */
+
+    if (pthread_create(&id, NULL, KmThreadStart, thread) != 0) {
+        free(thread);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    pthread_detach(id);
+
+    *ThreadHandle = thread;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS PsTerminateSystemThread(NTSTATUS ExitStatus)
+{
+    UNREFERENCED_PARAMETER(ExitStatus);
+    KmThreadExit();
+}
+
+NTSTATUS ZwWaitForSingleObject(HANDLE Handle, BOOLEAN Alertable, PLARGE_INTEGER Timeout)
+{
+    return KeWaitForSingleObject(&((PKM_OBJECT)Handle)->Event, Executive, KernelMode,
+                                 Alertable, Timeout);
+}
+
+/* --- Файлы --- */
+
+NTSTATUS ZwCreateFile(PHANDLE FileHandle, ACCESS_MASK DesiredAccess,
+                      POBJECT_ATTRIBUTES ObjectAttributes, PIO_STATUS_BLOCK IoStatusBlock,
+                      PLARGE_INTEGER AllocationSize, ULONG FileAttributes, ULONG ShareAccess,
+                      ULONG CreateDisposition, ULONG CreateOptions, PVOID EaBuffer,
+                      ULONG EaLength)
+{
+    PCUNICODE_STRING name = ObjectAttributes->ObjectName;
+    PKM_OBJECT       object;
+    char             path[4096];
+    ULONG            count = name->Length / sizeof(WCHAR);
+    ULONG            start = 0;
+    ULONG            i;
+    int              fd;
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(AllocationSize);
+    UNREFERENCED_PARAMETER(FileAttributes);
+    UNREFERENCED_PARAMETER(ShareAccess);
+    UNREFERENCED_PARAMETER(CreateDisposition);
+    UNREFERENCED_PARAMETER(CreateOptions);
+    UNREFERENCED_PARAMETER(EaBuffer);
+    UNREFERENCED_PARAMETER(EaLength);
+
+    InterlockedIncrement64(&g_KmCounters.Opens);
+
+    if (count >= 4 && name->Buffer[0] == '\\' && name->Buffer[1] == '?' &&
+        name->Buffer[2] == '?' && name->Buffer[3] == '\\') {
+        start = 4;
+    }
+    if (count - start >= sizeof(path)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    for (i = start; i < count; i++) {
+        /* Тестовые пути — ASCII */
+        path[i - start] = (char)name->Buffer[i];
+    }
+    path[count - start] = '\0';
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        IoStatusBlock->Status = STATUS_OBJECT_NAME_NOT_FOUND;
+        return STATUS_OBJECT_NAME_NOT_FOUND;
+    }
+
+    object = KmObjectCreate(KmObjectFile);
+    if (object == NULL) {
+        close(fd);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    object->Fd = fd;
+
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    IoStatusBlock->Information = 0;
+    *FileHandle = object;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwReadFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine,
+                    PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer,
+                    ULONG Length, PLARGE_INTEGER ByteOffset, PULONG Key)
+{
+    PKM_OBJECT object = (PKM_OBJECT)FileHandle;
+    ssize_t    done;
+
+    UNREFERENCED_PARAMETER(Event);
+    UNREFERENCED_PARAMETER(ApcRoutine);
+    UNREFERENCED_PARAMETER(ApcContext);
+    UNREFERENCED_PARAMETER(Key);
+
+    InterlockedIncrement64(&g_KmCounters.Reads);
+
+    done = ByteOffset != NULL ? pread(object->Fd, Buffer, Length, (off_t)ByteOffset->QuadPart)
+                              : read(object->Fd, Buffer, Length);
+    if (done < 0) {
+        IoStatusBlock->Status = STATUS_UNSUCCESSFUL;
+        return STATUS_UNSUCCESSFUL;
+    }
+    if (done == 0 && Length != 0) {
+        IoStatusBlock->Status = STATUS_END_OF_FILE;
+        IoStatusBlock->Information = 0;
+        return STATUS_END_OF_FILE;
+    }
+
+    InterlockedAdd64(&g_KmCounters.ReadBytes, done);
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    IoStatusBlock->Information = (ULONG_PTR)done;
+    return STATUS_SUCCESS;
+}
+
+static LONGLONG KmFileTime(const struct timespec *Time)
+{
+    return (LONGLONG)Time->tv_sec * 10000000 + Time->tv_nsec / 100 + 116444736000000000LL;
+}
+
+NTSTATUS ZwQueryInformationFile(HANDLE FileHandle, PIO_STATUS_BLOCK IoStatusBlock,
+                                PVOID FileInformation, ULONG Length,
+                                FILE_INFORMATION_CLASS FileInformationClass)
+{
+    PKM_OBJECT  object = (PKM_OBJECT)FileHandle;
+    struct stat st;
+
+    if (fstat(object->Fd, &st) != 0) {
+        return STATUS_UNSUCCESSFUL;
+    }
+
+    switch (FileInformationClass) {
+    case FileStandardInformation: {
+        PFILE_STANDARD_INFORMATION info = FileInformation;
+
+        if (Length < sizeof(*info)) {
+            return STATUS_INFO_LENGTH_MISMATCH;
+        }
+        memset(info, 0, sizeof(*info));
+        info->AllocationSize.QuadPart = (LONGLONG)st.st_blocks * 512;
+        info->EndOfFile.QuadPart = st.st_size;
+        info->NumberOfLinks = (ULONG)st.st_nlink;
+        info->Directory = S_ISDIR(st.st_mode) ? TRUE : FALSE;
+        IoStatusBlock->Information = sizeof(*info);
+        break;
+    }
+    case FileNetworkOpenInformation: {
+        PFILE_NETWORK_OPEN_INFORMATION info = FileInformation;
+
+        if (Length < sizeof(*info)) {
+            return STATUS_INFO_LENGTH_MISMATCH;
+        }
+        memset(info, 0, sizeof(*info));
+        info->CreationTime.QuadPart = KmFileTime(&st.st_ctim);
+        info->LastAccessTime.QuadPart = KmFileTime(&st.st_atim);
+        info->LastWriteTime.QuadPart = KmFileTime(&st.st_mtim);
+        info->ChangeTime.QuadPart = KmFileTime(&st.st_ctim);
+        info->AllocationSize.QuadPart = (LONGLONG)st.st_blocks * 512;
+        info->EndOfFile.QuadPart = st.st_size;
+        info->FileAttributes = FILE_ATTRIBUTE_NORMAL;
+        IoStatusBlock->Information = sizeof(*info);
+        break;
+    }
+    default:
+        /* FileIdInformation — как у ФС без идентификаторов: кэши не включаются */
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    IoStatusBlock->Status = STATUS_SUCCESS;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS ZwFsControlFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine,
+                         PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, ULONG FsControlCode,
+                         PVOID InputBuffer, ULONG InputBufferLength, PVOID OutputBuffer,
+                         ULONG OutputBufferLength)
+{
+    UNREFERENCED_PARAMETER(FileHandle);
+    UNREFERENCED_PARAMETER(Event);
+    UNREFERENCED_PARAMETER(ApcRoutine);
+    UNREFERENCED_PARAMETER(ApcContext);
+    UNREFERENCED_PARAMETER(IoStatusBlock);
+    UNREFERENCED_PARAMETER(FsControlCode);
+    UNREFERENCED_PARAMETER(InputBuffer);
+    UNREFERENCED_PARAMETER(InputBufferLength);
+    UNREFERENCED_PARAMETER(OutputBuffer);
+    UNREFERENCED_PARAMETER(OutputBufferLength);
+    return STATUS_NOT_SUPPORTED;
+}
+
+NTSTATUS ObQueryNameString(PVOID Object, POBJECT_NAME_INFORMATION ObjectNameInfo,
+                           ULONG Length, PULONG ReturnLength)
+{
+    UNREFERENCED_PARAMETER(Object);
+    UNREFERENCED_PARAMETER(ObjectNameInfo);
+    UNREFERENCED_PARAMETER(Length);
+    UNREFERENCED_PARAMETER(ReturnLength);
+    return STATUS_NOT_SUPPORTED;
+}
+
+/* --- Секции --- */
+
+NTSTATUS ZwCreateSection(PHANDLE SectionHandle, ACCESS_MASK DesiredAccess,
+                         POBJECT_ATTRIBUTES ObjectAttributes, PLARGE_INTEGER MaximumSize,
+                         ULONG SectionPageProtection, ULONG AllocationAttributes,
+                         HANDLE FileHandle)
+{
+    PKM_OBJECT object;
+    ULONG64    length = MaximumSize != NULL ? (ULONG64)MaximumSize->QuadPart : 0;
+    int        fd;
+
+    UNREFERENCED_PARAMETER(DesiredAccess);
+    UNREFERENCED_PARAMETER(ObjectAttributes);
+    UNREFERENCED_PARAMETER(AllocationAttributes);
+
+    if (FileHandle != NULL) {
+        struct stat st;
+
+        InterlockedIncrement64(&g_KmCounters.Sections);
+        if (g_KmNoSections) {
+            return STATUS_NOT_SUPPORTED;
+        }
+        if (fstat(((PKM_OBJECT)FileHandle)->Fd, &st) != 0) {
+            return STATUS_UNSUCCESSFUL;
+        }
+        /* Секция только для чтения не может быть больше файла */
+        if (length == 0) {
+            length = (ULONG64)st.st_size;
+        } else if (length > (ULONG64)st.st_size) {
+            return STATUS_SECTION_TOO_BIG;
+        }
+        fd = dup(((PKM_OBJECT)FileHandle)->Fd);
+    } else {
+        fd = memfd_create("procmon-km", MFD_CLOEXEC);
+        if (fd >= 0 && ftruncate(fd, (off_t)length) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd < 0) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    object = KmObjectCreate(KmObjectSection);
+    if (object == NULL) {
+        close(fd);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    object->Fd = fd;
+    object->Length = length;
+    object->Writable = FileHandle == NULL && SectionPageProtection == PAGE_READWRITE;
+
+    *SectionHandle = object;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS KmMapSection(PKM_OBJECT Section, BOOLEAN Writable, ULONG64 Offset, PVOID *Base,
+                             PSIZE_T Size)
+{
+    SIZE_T   size;
+    KM_VIEW *view;
+    PVOID    base;
+    LONG64   largest;
+
+    /* Смещение — на границе гранулярности отображений, как в Windows */
+    if (Offset >= Section->Length || (Offset & 0xFFFF) != 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    size = (*Size != 0 && *Size < Section->Length - Offset) ? *Size : (SIZE_T)(Section->Length - Offset);
+
+    InterlockedIncrement64(&g_KmCounters.Maps);
+    do {
+        largest = g_KmCounters.MapBytesMax;
+    } while ((LONG64)size > largest &&
+             InterlockedCompareExchange64(&g_KmCounters.MapBytesMax, (LONG64)size, largest) != largest);
+
+    view = malloc(sizeof(KM_VIEW));
+    if (view == NULL) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    base = mmap(NULL, size, PROT_READ | (Writable ? PROT_WRITE : 0), MAP_SHARED, Section->Fd,
+                (off_t)Offset);
+    if (base == MAP_FAILED) {
+        free(view);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    view->Base = base;
+    view->Size = size;
+    pthread_mutex_lock(&g_KmViewLock);
+    view->Next = g_KmViews;
+    g_KmViews = view;
+    pthread_mutex_unlock(&g_KmViewLock);
+
+    *Base = base;
+    *Size = size;
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS KmUnmapSection(PVOID Base)
+{
+    KM_VIEW **link;
+    KM_VIEW  *view = NULL;
+
+    pthread_mutex_lock(&g_KmViewLock);
+    for (link = &g_KmViews; *link != NULL; link = &(*link)->Next) {
+        if ((*link)->Base == Base) {
+            view = *link;
+            *link = view->Next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_KmViewLock);
+
+    if (view == NULL) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    munmap(view->Base, view->Size);
+    free(view);
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS MmMapViewInSystemSpace(PVOID Section, PVOID *MappedBase, PSIZE_T ViewSize)
+{
+    PKM_OBJECT section = (PKM_OBJECT)Section;
+
+    return KmMapSection(section, section->Writable, 0, MappedBase, ViewSize);
+}
+
+NTSTATUS MmMapViewInSystemSpaceEx(PVOID Section, PVOID *MappedBase, PSIZE_T ViewSize,
+                                  PLARGE_INTEGER SectionOffset, ULONG_PTR Flags)
+{
+    PKM_OBJECT section = (PKM_OBJECT)Section;
+
+    UNREFERENCED_PARAMETER(Flags);
+    return KmMapSection(section, section->Writable,
+                        SectionOffset != NULL ? (ULONG64)SectionOffset->QuadPart : 0,
+                        MappedBase, ViewSize);
+}
+
+NTSTATUS MmUnmapViewInSystemSpace(PVOID MappedBase)
+{
+    return KmUnmapSection(MappedBase);
+}
+
+PVOID MmGetSystemRoutineAddress(PUNICODE_STRING SystemRoutineName)
+{
+    static const char name[] = "MmMapViewInSystemSpaceEx";
+    ULONG i;
+
+    if (SystemRoutineName->Length != (sizeof(name) - 1) * sizeof(WCHAR)) {
+        return NULL;
+    }
+    for (i = 0; i < sizeof(name) - 1; i++) {
+        if (SystemRoutineName->Buffer[i] != (WCHAR)name[i]) {
+            return NULL;
+        }
+    }
+    return (PVOID)MmMapViewInSystemSpaceEx;
+}
+
+NTSTATUS ZwMapViewOfSection(HANDLE SectionHandle, HANDLE ProcessHandle, PVOID *BaseAddress,
+                            ULONG_PTR ZeroBits, SIZE_T CommitSize,
+                            PLARGE_INTEGER SectionOffset, PSIZE_T ViewSize,
+                            SECTION_INHERIT InheritDisposition, ULONG AllocationType,
+                            ULONG Win32Protect)
+{
+    UNREFERENCED_PARAMETER(ProcessHandle);
+    UNREFERENCED_PARAMETER(ZeroBits);
+    UNREFERENCED_PARAMETER(CommitSize);
+    UNREFERENCED_PARAMETER(InheritDisposition);
+    UNREFERENCED_PARAMETER(AllocationType);
+    UNREFERENCED_PARAMETER(Win32Protect);
+
+    return KmMapSection((PKM_OBJECT)SectionHandle, FALSE,
+                        SectionOffset != NULL ? (ULONG64)SectionOffset->QuadPart : 0,
+                        BaseAddress, ViewSize);
+}
+
+NTSTATUS ZwUnmapViewOfSection(HANDLE ProcessHandle, PVOID BaseAddress)
+{
+    UNREFERENCED_PARAMETER(ProcessHandle);
+    return KmUnmapSection(BaseAddress);
+}
+
+/* --- MDL: страницы процесса и так не уходят, закреплять нечего --- */
+
+PMDL IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer,
+                   BOOLEAN ChargeQuota, PIRP Irp)
+{
+    PMDL mdl = calloc(1, sizeof(MDL));
+
+    UNREFERENCED_PARAMETER(SecondaryBuffer);
+    UNREFERENCED_PARAMETER(ChargeQuota);
+    UNREFERENCED_PARAMETER(Irp);
+
+    if (mdl != NULL) {
+        mdl->StartVa = VirtualAddress;
+        mdl->ByteCount = Length;
+    }
+    return mdl;
+}
+
+VOID IoFreeMdl(PMDL Mdl)
+{
+    free(Mdl);
+}
+
+VOID MmProbeAndLockPages(PMDL Mdl, KPROCESSOR_MODE AccessMode, LOCK_OPERATION Operation)
+{
+    UNREFERENCED_PARAMETER(Mdl);
+    UNREFERENCED_PARAMETER(AccessMode);
+    UNREFERENCED_PARAMETER(Operation);
+}
+
+VOID MmUnlockPages(PMDL Mdl)
+{
+    UNREFERENCED_PARAMETER(Mdl);
+}
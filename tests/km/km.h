@@ -0,0 +1,73 @@
+#ifndef PROCMON_TESTS_KM_H
+#define PROCMON_TESTS_KM_H
+
+/*
+ * km.h — Управление подменой ядра из тестов и замеров.
+ *
+ * Подмена (km.c) исполняет код драйвера в обычном процессе: «процессор»
+ * потока задаёт сам тест (KmSetCurrentProcessor), и несколько потоков
+ * pthreads пишут в разные или одно кольцо независимо от того, сколько
+ * ядер у машины. Счётчики вызовов показывают, сколько открытий, чтений
+ * и отображений сделал код драйвера.
+ */
+
+#include <ntddk.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Возможности процессора, которые можно скрыть от драйвера */
+#define KM_CPU_AVX2  0x00000001
+#define KM_CPU_SHA   0x00000002
+
+/* Вызовы, которые подмена считает */
+typedef struct _KM_COUNTERS {
+    volatile LONG64 Opens;      /* ZwCreateFile */
+    volatile LONG64 Reads;      /* ZwReadFile */
+    volatile LONG64 ReadBytes;  /* Прочитано ZwReadFile */
+    volatile LONG64 Sections;   /* ZwCreateSection для файлов */
+    volatile LONG64 Maps;       /* MmMapViewInSystemSpace(Ex) / ZwMapViewOfSection */
+    volatile LONG64 MapBytesMax;  /* Самый большой вид */
+} KM_COUNTERS, *PKM_COUNTERS;
+
+extern KM_COUNTERS g_KmCounters;
+
+/* Процессоров в системе (KeQuery*ProcessorCountEx), по умолчанию 1 */
+VOID KmSetProcessorCount(ULONG Count);
+
+/* Номер процессора текущего потока (KeGetCurrentProcessorNumberEx) */
+VOID KmSetCurrentProcessor(ULONG Number);
+
+/* TRUE — ZwCreateSection для файлов отказывает, хеш идёт через ZwReadFile */
+VOID KmSetNoSections(BOOLEAN NoSections);
+
+/* Скрыть от __cpuid возможности KM_CPU_* */
+VOID KmHideCpuFeatures(ULONG Mask);
+
+VOID KmResetCounters(VOID);
+
+/* Путь POSIX в UNICODE_STRING вида \??\path (Buffer — Capacity символов) */
+VOID KmInitPath(PUNICODE_STRING Path, PWCHAR Buffer, ULONG Capacity, PCSTR PosixPath);
+
+/* Монотонное время в секундах — для замеров */
+static inline double KmNow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/* Проверка в тестах: печатает место и считает ошибку, тест продолжается */
+extern LONG g_KmFailures;
+
+#define KM_CHECK(cond) do {                                                   \
+    if (!(cond)) {                                                            \
+        fprintf(stderr, "%s:%d: проверка не прошла: %s\n",                    \
+                __FILE__, __LINE__, #cond);                                   \
+        g_KmFailures++;                                                       \
+    }                                                                         \
+} while (0)
+
+#define KM_TEST_RESULT()  (g_KmFailures == 0 ? 0 : 1)
+
+#endif /* PROCMON_TESTS_KM_H */
@@ -0,0 +1,727 @@
+#ifndef PROCMON_TESTS_KM_NTDDK_H
+#define PROCMON_TESTS_KM_NTDDK_H
+
+/*
+ * ntddk.h — Подмена заголовка WDK для сборки кода драйвера под Linux.
+ *
+ * Только то, чем пользуются исходники, которые собирают тесты
+ * (common/, буферы, хеширование, счётчики). Типы повторяют размеры
+ * Windows x64 (LONG — 32 бита, WCHAR — 16 бит: собирать с -fshort-wchar).
+ * Реализация функций ядра — в km.c поверх pthreads и POSIX: потоки,
+ * события, секции (mmap), файлы (open/pread). Управление подменой из
+ * тестов (число процессоров, счётчики вызовов) — в km.h.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+
+/* --- SAL --- */
+#define _In_
+#define _In_opt_
+#define _In_z_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+#define _In_reads_(x)
+#define _In_reads_opt_(x)
+#define _In_reads_bytes_(x)
+#define _Out_writes_(x)
+#define _Out_writes_opt_(x)
+#define _Out_writes_bytes_(x)
+#define _Out_writes_bytes_opt_(x)
+#define _Inout_updates_(x)
+#define _Outptr_result_maybenull_
+#define _Dispatch_type_(x)
+#define _IRQL_requires_max_(x)
+#define _IRQL_requires_(x)
+#define _IRQL_raises_(x)
+#define _Function_class_(x)
+#define _Use_decl_annotations_
+#define _When_(a, b)
+#define _Requires_lock_held_(x)
+#define _Acquires_lock_(x)
+#define _Releases_lock_(x)
+#define _Success_(x)
+#define _Must_inspect_result_
+
+/* --- Базовые типы (как в Windows x64) --- */
+typedef void            VOID, *PVOID;
+typedef char            CHAR, *PCHAR, CCHAR, *PSTR;
+typedef const char     *PCSTR, *PCSZ;
+typedef unsigned char   UCHAR, *PUCHAR, BYTE, *PBYTE, BOOLEAN, *PBOOLEAN;
+typedef short           SHORT;
+typedef unsigned short  USHORT, *PUSHORT, WORD;
+typedef int             INT, BOOL;
+typedef unsigned int    UINT;
+typedef int32_t         LONG, *PLONG;
+typedef uint32_t        ULONG, *PULONG, DWORD, *PDWORD;
+typedef int64_t         LONG64, *PLONG64, LONGLONG;
+typedef uint64_t        ULONG64, *PULONG64, ULONGLONG, DWORD64;
+typedef uintptr_t       ULONG_PTR, *PULONG_PTR, SIZE_T, *PSIZE_T, UINT_PTR;
+typedef intptr_t        LONG_PTR;
+typedef uint16_t        WCHAR, *PWCHAR, *PWCH, *PWSTR;
+typedef const uint16_t *PCWSTR, *PCWCH;
+typedef void           *HANDLE, **PHANDLE;
+typedef LONG            NTSTATUS, *PNTSTATUS;
+typedef ULONG           ACCESS_MASK;
+typedef LONG            KPRIORITY;
+
+typedef union _LARGE_INTEGER {
+    struct { ULONG LowPart; LONG HighPart; };
+    LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef union _ULARGE_INTEGER {
+    struct { ULONG LowPart; ULONG HighPart; };
+    ULONGLONG QuadPart;
+} ULARGE_INTEGER;
+
+typedef struct _GUID {
+    ULONG  Data1;
+    USHORT Data2, Data3;
+    UCHAR  Data4[8];
+} GUID, *LPGUID;
+typedef const GUID *LPCGUID;
+
+#define TRUE   1
+#define FALSE  0
+#define CONST  const
+#ifndef NULL
+#define NULL   ((void *)0)
+#endif
+
+#define FORCEINLINE      static inline
+#define __inline         inline
+#define __forceinline    inline
+#define NTAPI
+#define NTSYSAPI
+
+#define MAXUSHORT   0xffffu
+#define MAXLONG     0x7fffffff
+#define MAXULONG    0xffffffffu
+#define MAXLONG64   ((LONG64)0x7fffffffffffffffll)
+#define MAXULONG64  ((ULONG64)~0ull)
+
+#define UNREFERENCED_PARAMETER(x)  (void)(x)
+#define DECLSPEC_ALIGN(x)          __attribute__((aligned(x)))
+#define DECLSPEC_CACHEALIGN        DECLSPEC_ALIGN(SYSTEM_CACHE_ALIGNMENT_SIZE)
+#define SYSTEM_CACHE_ALIGNMENT_SIZE 64
+#define C_ASSERT(e)                _Static_assert(e, #e)
+#define FIELD_OFFSET(t, f)         ((LONG)offsetof(t, f))
+#define RTL_SIZEOF_THROUGH_FIELD(t, f) (FIELD_OFFSET(t, f) + sizeof(((t *)0)->f))
+#define RTL_NUMBER_OF(a)           (sizeof(a) / sizeof((a)[0]))
+#define ARRAYSIZE(a)               RTL_NUMBER_OF(a)
+#define CONTAINING_RECORD(address, type, field) \
+    ((type *)((PCHAR)(address) - offsetof(type, field)))
+#ifndef max
+#define max(a, b)  (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef min
+#define min(a, b)  (((a) < (b)) ? (a) : (b))
+#endif
+#define PAGE_SIZE  0x1000
+#define ROUND_TO_PAGES(s)  (((ULONG_PTR)(s) + PAGE_SIZE - 1) & ~(ULONG_PTR)(PAGE_SIZE - 1))
+
+/* SEH нет: блок __except никогда не исполняется */
+#define __try                      if (1)
+#define __except(x)                else if (0)
+#define EXCEPTION_EXECUTE_HANDLER  1
+#define GetExceptionCode()         ((NTSTATUS)0)
+
+/* --- NTSTATUS --- */
+#define NT_SUCCESS(s)  (((NTSTATUS)(s)) >= 0)
+
+#define STATUS_SUCCESS                 ((NTSTATUS)0x00000000L)
+#define STATUS_WAIT_0                  ((NTSTATUS)0x00000000L)
+#define STATUS_WAIT_1                  ((NTSTATUS)0x00000001L)
+#define STATUS_TIMEOUT                 ((NTSTATUS)0x00000102L)
+#define STATUS_PENDING                 ((NTSTATUS)0x00000103L)
+#define STATUS_NOTIFY_ENUM_DIR         ((NTSTATUS)0x0000010CL)
+#define STATUS_DATATYPE_MISALIGNMENT   ((NTSTATUS)0x80000002L)
+#define STATUS_BUFFER_OVERFLOW         ((NTSTATUS)0x80000005L)
+#define STATUS_DEVICE_BUSY             ((NTSTATUS)0x80000011L)
+#define STATUS_NO_MORE_ENTRIES         ((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL            ((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED         ((NTSTATUS)0xC0000002L)
+#define STATUS_INFO_LENGTH_MISMATCH    ((NTSTATUS)0xC0000004L)
+#define STATUS_INVALID_HANDLE          ((NTSTATUS)0xC0000008L)
+#define STATUS_INVALID_PARAMETER       ((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST  ((NTSTATUS)0xC0000010L)
+#define STATUS_END_OF_FILE             ((NTSTATUS)0xC0000011L)
+#define STATUS_ACCESS_DENIED           ((NTSTATUS)0xC0000022L)
+#define STATUS_BUFFER_TOO_SMALL        ((NTSTATUS)0xC0000023L)
+#define STATUS_OBJECT_TYPE_MISMATCH    ((NTSTATUS)0xC0000024L)
+#define STATUS_OBJECT_NAME_NOT_FOUND   ((NTSTATUS)0xC0000034L)
+#define STATUS_DATA_ERROR              ((NTSTATUS)0xC000003EL)
+#define STATUS_DELETE_PENDING          ((NTSTATUS)0xC0000056L)
+#define STATUS_REVISION_MISMATCH       ((NTSTATUS)0xC0000059L)
+#define STATUS_INTEGER_OVERFLOW        ((NTSTATUS)0xC0000095L)
+#define STATUS_INSUFFICIENT_RESOURCES  ((NTSTATUS)0xC000009AL)
+#define STATUS_DEVICE_NOT_READY        ((NTSTATUS)0xC00000A3L)
+#define STATUS_NOT_SUPPORTED           ((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_USER_BUFFER     ((NTSTATUS)0xC00000E8L)
+#define STATUS_CANCELLED               ((NTSTATUS)0xC0000120L)
+#define STATUS_INVALID_DEVICE_STATE    ((NTSTATUS)0xC0000184L)
+#define STATUS_INVALID_BUFFER_SIZE     ((NTSTATUS)0xC0000206L)
+#define STATUS_NOT_FOUND               ((NTSTATUS)0xC0000225L)
+#define STATUS_NO_MATCH                ((NTSTATUS)0xC0000272L)
+#define STATUS_ALREADY_REGISTERED      ((NTSTATUS)0xC0000718L)
+#define STATUS_FILE_TOO_LARGE          ((NTSTATUS)0xC0000904L)
+
+/* --- Строки и списки --- */
+typedef struct _UNICODE_STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PWCH   Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+typedef struct _STRING {
+    USHORT Length;
+    USHORT MaximumLength;
+    PCHAR  Buffer;
+} STRING, *PSTRING, ANSI_STRING, *PANSI_STRING;
+typedef const ANSI_STRING *PCANSI_STRING;
+
+typedef struct _LIST_ENTRY {
+    struct _LIST_ENTRY *Flink;
+    struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+typedef struct _SINGLE_LIST_ENTRY {
+    struct _SINGLE_LIST_ENTRY *Next;
+} SINGLE_LIST_ENTRY, *PSINGLE_LIST_ENTRY;
+
+FORCEINLINE VOID InitializeListHead(PLIST_ENTRY Head)
+{
+    Head->Flink = Head->Blink = Head;
+}
+
+FORCEINLINE BOOLEAN IsListEmpty(const LIST_ENTRY *Head)
+{
+    return Head->Flink == Head;
+}
+
+FORCEINLINE BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+    PLIST_ENTRY flink = Entry->Flink;
+    PLIST_ENTRY blink = Entry->Blink;
+
+    blink->Flink = flink;
+    flink->Blink = blink;
+    return flink == blink;
+}
+
+FORCEINLINE PLIST_ENTRY RemoveHeadList(PLIST_ENTRY Head)
+{
+    PLIST_ENTRY entry = Head->Flink;
+
+    RemoveEntryList(entry);
+    return entry;
+}
+
+FORCEINLINE VOID InsertTailList(PLIST_ENTRY Head, PLIST_ENTRY Entry)
+{
+    Entry->Flink = Head;
+    Entry->Blink = Head->Blink;
+    Head->Blink->Flink = Entry;
+    Head->Blink = Entry;
+}
+
+FORCEINLINE VOID InsertHeadList(PLIST_ENTRY Head, PLIST_ENTRY Entry)
+{
+    Entry->Flink = Head->Flink;
+    Entry->Blink = Head;
+    Head->Flink->Blink = Entry;
+    Head->Flink = Entry;
+}
+
+#define RtlZeroMemory(d, l)        memset((d), 0, (l))
+#define RtlSecureZeroMemory(d, l)  memset((d), 0, (l))
+#define RtlFillMemory(d, l, f)     memset((d), (f), (l))
+#define RtlCopyMemory(d, s, l)     memcpy((d), (s), (l))
+#define RtlMoveMemory(d, s, l)     memmove((d), (s), (l))
+#define RtlEqualMemory(a, b, l)    (memcmp((a), (b), (l)) == 0)
+
+VOID RtlInitUnicodeString(PUNICODE_STRING Destination, PCWSTR Source);
+VOID RtlInitAnsiString(PANSI_STRING Destination, PCSZ Source);
+
+ULONG DbgPrint(PCSTR Format, ...);
+
+/* --- Атомарные операции и барьеры --- */
+#define MemoryBarrier()    __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define KeMemoryBarrier()  MemoryBarrier()
+
+/* Ожидающий писатель может ждать вытесненного: на одном ядре без уступки он не дождётся */
+#define YieldProcessor()   sched_yield()
+
+#define ReadNoFence(p)        __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ReadNoFence64(p)      __atomic_load_n((p), __ATOMIC_RELAXED)
+#define ReadAcquire(p)        __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ReadAcquire64(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define WriteNoFence(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define WriteNoFence64(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#define WriteRelease(p, v)    __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define WriteRelease64(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+FORCEINLINE LONG InterlockedIncrement(volatile LONG *p)
+{
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedDecrement(volatile LONG *p)
+{
+    return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedExchange(volatile LONG *p, LONG v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedExchangeAdd(volatile LONG *p, LONG v)
+{
+    return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedCompareExchange(volatile LONG *p, LONG exchange, LONG comparand)
+{
+    __atomic_compare_exchange_n(p, &comparand, exchange, FALSE,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+FORCEINLINE LONG InterlockedOr(volatile LONG *p, LONG v)
+{
+    return __atomic_fetch_or(p, v, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedAnd(volatile LONG *p, LONG v)
+{
+    return __atomic_fetch_and(p, v, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64 InterlockedIncrement64(volatile LONG64 *p)
+{
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64 InterlockedDecrement64(volatile LONG64 *p)
+{
+    return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64 InterlockedExchange64(volatile LONG64 *p, LONG64 v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64 InterlockedExchangeAdd64(volatile LONG64 *p, LONG64 v)
+{
+    return __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64 InterlockedAdd64(volatile LONG64 *p, LONG64 v)
+{
+    return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64 InterlockedCompareExchange64(volatile LONG64 *p, LONG64 exchange,
+                                                LONG64 comparand)
+{
+    __atomic_compare_exchange_n(p, &comparand, exchange, FALSE,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+FORCEINLINE PVOID InterlockedExchangePointer(PVOID volatile *p, PVOID v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE PVOID InterlockedCompareExchangePointer(PVOID volatile *p, PVOID exchange,
+                                                    PVOID comparand)
+{
+    __atomic_compare_exchange_n(p, &comparand, exchange, FALSE,
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return comparand;
+}
+
+/* --- Пул --- */
+typedef enum _POOL_TYPE {
+    NonPagedPool = 0,
+    PagedPool = 1,
+    NonPagedPoolNx = 512
+} POOL_TYPE;
+
+#define POOL_FLAG_NON_PAGED  0x0000000000000040ULL
+#define POOL_FLAG_PAGED      0x0000000000000100ULL
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE PoolType, SIZE_T NumberOfBytes, ULONG Tag);
+PVOID ExAllocatePool2(ULONG64 Flags, SIZE_T NumberOfBytes, ULONG Tag);
+VOID  ExFreePoolWithTag(PVOID P, ULONG Tag);
+
+/* --- IRQL, процессоры, время --- */
+typedef UCHAR KIRQL, *PKIRQL;
+typedef CCHAR KPROCESSOR_MODE;
+
+#define KernelMode      0
+#define UserMode        1
+#define PASSIVE_LEVEL   0
+#define APC_LEVEL       1
+#define DISPATCH_LEVEL  2
+
+typedef struct _PROCESSOR_NUMBER {
+    USHORT Group;
+    UCHAR  Number;
+    UCHAR  Reserved;
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+#define ALL_PROCESSOR_GROUPS  0xffff
+
+KIRQL KeGetCurrentIrql(VOID);
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+ULONG KeQueryActiveProcessorCountEx(USHORT GroupNumber);
+ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber);
+
+VOID          KeQuerySystemTime(PLARGE_INTEGER CurrentTime);
+VOID          KeQuerySystemTimePrecise(PLARGE_INTEGER CurrentTime);
+ULONG64       KeQueryInterruptTime(VOID);
+ULONG64       KeQueryInterruptTimePrecise(PULONG64 QpcTimeStamp);
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+
+/* --- Синхронизация --- */
+
+/*
+ * Общий заголовок объектов ожидания: KeWaitForSingleObject различает
+ * их по Type. Все ожидания идут через одну пару mutex/cond в km.c.
+ */
+typedef struct _KM_DISPATCHER_HEADER {
+    LONG          Type;
+    volatile LONG SignalState;
+    LONG          Limit;
+} KM_DISPATCHER_HEADER;
+
+typedef struct _KEVENT     { KM_DISPATCHER_HEADER Header; } KEVENT, *PKEVENT, *PRKEVENT;
+typedef struct _KSEMAPHORE { KM_DISPATCHER_HEADER Header; } KSEMAPHORE, *PKSEMAPHORE, *PRKSEMAPHORE;
+typedef struct _KMUTEX     { KM_DISPATCHER_HEADER Header; } KMUTEX, *PKMUTEX, *PRKMUTEX;
+
+typedef enum _EVENT_TYPE {
+    NotificationEvent,
+    SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum _KWAIT_REASON {
+    Executive
+} KWAIT_REASON;
+
+typedef enum _WAIT_TYPE {
+    WaitAll,
+    WaitAny
+} WAIT_TYPE;
+
+typedef struct _KWAIT_BLOCK { int Unused; } KWAIT_BLOCK, *PKWAIT_BLOCK;
+
+#define IO_NO_INCREMENT  0
+
+VOID     KeInitializeEvent(PRKEVENT Event, EVENT_TYPE Type, BOOLEAN State);
+LONG     KeSetEvent(PRKEVENT Event, KPRIORITY Increment, BOOLEAN Wait);
+VOID     KeClearEvent(PRKEVENT Event);
+LONG     KeReadStateEvent(PRKEVENT Event);
+VOID     KeInitializeSemaphore(PRKSEMAPHORE Semaphore, LONG Count, LONG Limit);
+LONG     KeReleaseSemaphore(PRKSEMAPHORE Semaphore, KPRIORITY Increment, LONG Adjustment,
+                            BOOLEAN Wait);
+VOID     KeInitializeMutex(PRKMUTEX Mutex, ULONG Level);
+LONG     KeReleaseMutex(PRKMUTEX Mutex, BOOLEAN Wait);
+NTSTATUS KeWaitForSingleObject(PVOID Object, KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode,
+                               BOOLEAN Alertable, PLARGE_INTEGER Timeout);
+NTSTATUS KeWaitForMultipleObjects(ULONG Count, PVOID Object[], WAIT_TYPE WaitType,
+                                  KWAIT_REASON WaitReason, KPROCESSOR_MODE WaitMode,
+                                  BOOLEAN Alertable, PLARGE_INTEGER Timeout,
+                                  PKWAIT_BLOCK WaitBlockArray);
+
+typedef ULONG_PTR KSPIN_LOCK, *PKSPIN_LOCK;
+
+VOID KeInitializeSpinLock(PKSPIN_LOCK SpinLock);
+VOID KeAcquireSpinLock(PKSPIN_LOCK SpinLock, PKIRQL OldIrql);
+VOID KeReleaseSpinLock(PKSPIN_LOCK SpinLock, KIRQL NewIrql);
+
+typedef struct _FAST_MUTEX {
+    volatile LONG Locked;
+} FAST_MUTEX, *PFAST_MUTEX;
+
+VOID ExInitializeFastMutex(PFAST_MUTEX FastMutex);
+VOID ExAcquireFastMutex(PFAST_MUTEX FastMutex);
+VOID ExReleaseFastMutex(PFAST_MUTEX FastMutex);
+
+typedef ULONG_PTR EX_PUSH_LOCK, *PEX_PUSH_LOCK;
+
+VOID ExInitializePushLock(PEX_PUSH_LOCK PushLock);
+VOID ExAcquirePushLockShared(PEX_PUSH_LOCK PushLock);
+VOID ExReleasePushLockShared(PEX_PUSH_LOCK PushLock);
+VOID ExAcquirePushLockExclusive(PEX_PUSH_LOCK PushLock);
+VOID ExReleasePushLockExclusive(PEX_PUSH_LOCK PushLock);
+
+VOID KeEnterCriticalRegion(VOID);
+VOID KeLeaveCriticalRegion(VOID);
+
+typedef struct _EX_RUNDOWN_REF_CACHE_AWARE *PEX_RUNDOWN_REF_CACHE_AWARE;
+
+PEX_RUNDOWN_REF_CACHE_AWARE ExAllocateCacheAwareRundownProtection(POOL_TYPE PoolType, ULONG Tag);
+VOID    ExFreeCacheAwareRundownProtection(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+BOOLEAN ExAcquireRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+VOID    ExReleaseRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+VOID    ExWaitForRundownProtectionReleaseCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+VOID    ExReInitializeRundownProtectionCacheAware(PEX_RUNDOWN_REF_CACHE_AWARE RunRefCacheAware);
+
+/* --- Объекты и потоки --- */
+typedef struct _KM_OBJECT_TYPE *POBJECT_TYPE;
+
+extern POBJECT_TYPE *PsThreadType;
+extern POBJECT_TYPE *ExEventObjectType;
+extern POBJECT_TYPE *IoFileObjectType;
+
+typedef struct _OBJECT_ATTRIBUTES {
+    ULONG           Length;
+    HANDLE          RootDirectory;
+    PUNICODE_STRING ObjectName;
+    ULONG           Attributes;
+    PVOID           SecurityDescriptor;
+    PVOID           SecurityQualityOfService;
+} OBJECT_ATTRIBUTES, *POBJECT_ATTRIBUTES;
+
+#define InitializeObjectAttributes(p, n, a, r, s) do { \
+    (p)->Length = sizeof(OBJECT_ATTRIBUTES);          \
+    (p)->RootDirectory = (r);                         \
+    (p)->Attributes = (a);                            \
+    (p)->ObjectName = (n);                            \
+    (p)->SecurityDescriptor = (s);                    \
+    (p)->SecurityQualityOfService = NULL;             \
+} while (0)
+
+#define OBJ_CASE_INSENSITIVE  0x00000040L
+#define OBJ_OPENIF            0x00000080L
+#define OBJ_KERNEL_HANDLE     0x00000200L
+
+#define SYNCHRONIZE           0x00100000L
+#define GENERIC_READ          0x80000000L
+#define EVENT_ALL_ACCESS      0x001F0003L
+#define THREAD_ALL_ACCESS     0x001FFFFFL
+
+NTSTATUS ObReferenceObjectByHandle(HANDLE Handle, ACCESS_MASK DesiredAccess,
+                                   POBJECT_TYPE ObjectType, KPROCESSOR_MODE AccessMode,
+                                   PVOID *Object, PVOID HandleInformation);
+VOID     ObReferenceObject(PVOID Object);
+VOID     ObDereferenceObject(PVOID Object);
+NTSTATUS ZwClose(HANDLE Handle);
+
+typedef struct _ETHREAD  *PETHREAD, *PKTHREAD;
+typedef struct _EPROCESS *PEPROCESS;
+
+typedef VOID KSTART_ROUTINE(PVOID StartContext);
+typedef KSTART_ROUTINE *PKSTART_ROUTINE;
+
+NTSTATUS  PsCreateSystemThread(PHANDLE ThreadHandle, ULONG DesiredAccess,
+                               POBJECT_ATTRIBUTES ObjectAttributes, HANDLE ProcessHandle,
+                               PVOID ClientId, PKSTART_ROUTINE StartRoutine,
+                               PVOID StartContext);
+NTSTATUS  PsTerminateSystemThread(NTSTATUS ExitStatus);
+NTSTATUS  ZwWaitForSingleObject(HANDLE Handle, BOOLEAN Alertable, PLARGE_INTEGER Timeout);
+PKTHREAD  KeGetCurrentThread(VOID);
+KPRIORITY KeSetPriorityThread(PKTHREAD Thread, KPRIORITY Priority);
+PEPROCESS PsGetCurrentProcess(VOID);
+
+#define LOW_REALTIME_PRIORITY  16
+
+/* --- Ввод-вывод --- */
+typedef struct _DEVICE_OBJECT *PDEVICE_OBJECT;
+typedef struct _DRIVER_OBJECT *PDRIVER_OBJECT;
+
+typedef struct _IO_STATUS_BLOCK {
+    union {
+        NTSTATUS Status;
+        PVOID    Pointer;
+    };
+    ULONG_PTR Information;
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+typedef VOID (*PIO_APC_ROUTINE)(PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, ULONG Reserved);
+
+typedef struct _MDL {
+    struct _MDL *Next;
+    PVOID        StartVa;
+    ULONG        ByteCount;
+} MDL, *PMDL;
+
+typedef struct _IRP {
+    PMDL MdlAddress;
+    union {
+        PVOID SystemBuffer;
+    } AssociatedIrp;
+    IO_STATUS_BLOCK IoStatus;
+    KPROCESSOR_MODE RequestorMode;
+    struct {
+        struct {
+            LIST_ENTRY ListEntry;
+            PVOID      DriverContext[4];
+        } Overlay;
+    } Tail;
+} IRP, *PIRP;
+
+typedef struct _FILE_OBJECT {
+    PDEVICE_OBJECT DeviceObject;
+    PVOID          FsContext;
+    PVOID          FsContext2;
+} FILE_OBJECT, *PFILE_OBJECT;
+
+typedef struct _PS_CREATE_NOTIFY_INFO *PPS_CREATE_NOTIFY_INFO;
+
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath);
+typedef VOID     DRIVER_UNLOAD(PDRIVER_OBJECT DriverObject);
+typedef NTSTATUS DRIVER_DISPATCH(PDEVICE_OBJECT DeviceObject, PIRP Irp);
+
+/* Cancel-safe очередь: только типы — pending.h входит в driver.h */
+typedef struct _IO_CSQ IO_CSQ, *PIO_CSQ;
+typedef struct _IO_CSQ_IRP_CONTEXT { int Unused; } IO_CSQ_IRP_CONTEXT, *PIO_CSQ_IRP_CONTEXT;
+typedef VOID IO_CSQ_INSERT_IRP(PIO_CSQ Csq, PIRP Irp);
+typedef VOID IO_CSQ_REMOVE_IRP(PIO_CSQ Csq, PIRP Irp);
+typedef PIRP IO_CSQ_PEEK_NEXT_IRP(PIO_CSQ Csq, PIRP Irp, PVOID PeekContext);
+typedef VOID IO_CSQ_ACQUIRE_LOCK(PIO_CSQ Csq, PKIRQL Irql);
+typedef VOID IO_CSQ_RELEASE_LOCK(PIO_CSQ Csq, KIRQL Irql);
+typedef VOID IO_CSQ_COMPLETE_CANCELED_IRP(PIO_CSQ Csq, PIRP Irp);
+struct _IO_CSQ {
+    ULONG Type;
+    PVOID Routines[6];
+};
+
+#define CTL_CODE(t, f, m, a)  (((t) << 16) | ((a) << 14) | ((f) << 2) | (m))
+#define FILE_DEVICE_UNKNOWN   0x00000022
+#define METHOD_BUFFERED       0
+#define METHOD_IN_DIRECT      1
+#define METHOD_OUT_DIRECT     2
+#define METHOD_NEITHER        3
+#define FILE_ANY_ACCESS       0
+#define FILE_READ_ACCESS      1
+#define FILE_WRITE_ACCESS     2
+
+typedef enum _LOCK_OPERATION {
+    IoReadAccess,
+    IoWriteAccess,
+    IoModifyAccess
+} LOCK_OPERATION;
+
+PMDL    IoAllocateMdl(PVOID VirtualAddress, ULONG Length, BOOLEAN SecondaryBuffer,
+                      BOOLEAN ChargeQuota, PIRP Irp);
+VOID    IoFreeMdl(PMDL Mdl);
+VOID    MmProbeAndLockPages(PMDL Mdl, KPROCESSOR_MODE AccessMode, LOCK_OPERATION Operation);
+VOID    MmUnlockPages(PMDL Mdl);
+PKEVENT IoCreateSynchronizationEvent(PUNICODE_STRING EventName, PHANDLE EventHandle);
+PKEVENT IoCreateNotificationEvent(PUNICODE_STRING EventName, PHANDLE EventHandle);
+
+/* Файлы: путь — обычный путь POSIX, префикс \??\ отбрасывается */
+#define FILE_READ_DATA               0x0001
+#define FILE_READ_ATTRIBUTES         0x0080
+#define FILE_ATTRIBUTE_NORMAL        0x00000080
+#define FILE_SHARE_READ              0x00000001
+#define FILE_SHARE_WRITE             0x00000002
+#define FILE_SHARE_DELETE            0x00000004
+#define FILE_OPEN                    0x00000001
+#define FILE_SEQUENTIAL_ONLY         0x00000004
+#define FILE_SYNCHRONOUS_IO_NONALERT 0x00000020
+#define FILE_NON_DIRECTORY_FILE      0x00000040
+
+typedef enum _FILE_INFORMATION_CLASS {
+    FileStandardInformation = 5,
+    FileNetworkOpenInformation = 34,
+    FileIdInformation = 59
+} FILE_INFORMATION_CLASS;
+
+typedef struct _FILE_STANDARD_INFORMATION {
+    LARGE_INTEGER AllocationSize;
+    LARGE_INTEGER EndOfFile;
+    ULONG         NumberOfLinks;
+    BOOLEAN       DeletePending;
+    BOOLEAN       Directory;
+} FILE_STANDARD_INFORMATION, *PFILE_STANDARD_INFORMATION;
+
+typedef struct _FILE_NETWORK_OPEN_INFORMATION {
+    LARGE_INTEGER CreationTime;
+    LARGE_INTEGER LastAccessTime;
+    LARGE_INTEGER LastWriteTime;
+    LARGE_INTEGER ChangeTime;
+    LARGE_INTEGER AllocationSize;
+    LARGE_INTEGER EndOfFile;
+    ULONG         FileAttributes;
+} FILE_NETWORK_OPEN_INFORMATION, *PFILE_NETWORK_OPEN_INFORMATION;
+
+typedef struct _FILE_ID_128 {
+    UCHAR Identifier[16];
+} FILE_ID_128, *PFILE_ID_128;
+
+typedef struct _FILE_ID_INFORMATION {
+    ULONGLONG   VolumeSerialNumber;
+    FILE_ID_128 FileId;
+} FILE_ID_INFORMATION, *PFILE_ID_INFORMATION;
+
+NTSTATUS ZwCreateFile(PHANDLE FileHandle, ACCESS_MASK DesiredAccess,
+                      POBJECT_ATTRIBUTES ObjectAttributes, PIO_STATUS_BLOCK IoStatusBlock,
+                      PLARGE_INTEGER AllocationSize, ULONG FileAttributes, ULONG ShareAccess,
+                      ULONG CreateDisposition, ULONG CreateOptions, PVOID EaBuffer,
+                      ULONG EaLength);
+NTSTATUS ZwReadFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine,
+                    PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, PVOID Buffer,
+                    ULONG Length, PLARGE_INTEGER ByteOffset, PULONG Key);
+NTSTATUS ZwQueryInformationFile(HANDLE FileHandle, PIO_STATUS_BLOCK IoStatusBlock,
+                                PVOID FileInformation, ULONG Length,
+                                FILE_INFORMATION_CLASS FileInformationClass);
+
+/* Секции: без файла — анонимная память, с файлом — mmap файла */
+#define SECTION_QUERY       0x0001
+#define SECTION_MAP_WRITE   0x0002
+#define SECTION_MAP_READ    0x0004
+#define SECTION_ALL_ACCESS  0x000F001F
+#define PAGE_READONLY       0x02
+#define PAGE_READWRITE      0x04
+#define SEC_COMMIT          0x08000000
+
+typedef enum _SECTION_INHERIT {
+    ViewShare = 1,
+    ViewUnmap = 2
+} SECTION_INHERIT;
+
+#define ZwCurrentProcess()  ((HANDLE)(LONG_PTR)-1)
+
+NTSTATUS ZwCreateSection(PHANDLE SectionHandle, ACCESS_MASK DesiredAccess,
+                         POBJECT_ATTRIBUTES ObjectAttributes, PLARGE_INTEGER MaximumSize,
+                         ULONG SectionPageProtection, ULONG AllocationAttributes,
+                         HANDLE FileHandle);
+NTSTATUS ZwMapViewOfSection(HANDLE SectionHandle, HANDLE ProcessHandle, PVOID *BaseAddress,
+                            ULONG_PTR ZeroBits, SIZE_T CommitSize,
+                            PLARGE_INTEGER SectionOffset, PSIZE_T ViewSize,
+                            SECTION_INHERIT InheritDisposition, ULONG AllocationType,
+                            ULONG Win32Protect);
+NTSTATUS ZwUnmapViewOfSection(HANDLE ProcessHandle, PVOID BaseAddress);
+NTSTATUS MmMapViewInSystemSpace(PVOID Section, PVOID *MappedBase, PSIZE_T ViewSize);
+NTSTATUS MmUnmapViewInSystemSpace(PVOID MappedBase);
+
+#define MM_SYSTEM_VIEW_EXCEPTIONS_FOR_INPAGE_ERRORS  0x1
+
+NTSTATUS MmMapViewInSystemSpaceEx(PVOID Section, PVOID *MappedBase, PSIZE_T ViewSize,
+                                  PLARGE_INTEGER SectionOffset, ULONG_PTR Flags);
+
+/* Находит только то, что драйвер ищет при загрузке (MmMapViewInSystemSpaceEx) */
+PVOID MmGetSystemRoutineAddress(PUNICODE_STRING SystemRoutineName);
+
+/* --- Расширенное состояние процессора --- */
+typedef struct _XSTATE_SAVE { ULONG64 Reserved[8]; } XSTATE_SAVE, *PXSTATE_SAVE;
+
+#define XSTATE_MASK_AVX  (1ULL << 2)
+
+NTSTATUS KeSaveExtendedProcessorState(ULONG64 Mask, PXSTATE_SAVE XStateSave);
+VOID     KeRestoreExtendedProcessorState(PXSTATE_SAVE XStateSave);
+ULONG64  RtlGetEnabledExtendedFeatures(ULONG64 FeatureMask);
+
+#endif /* PROCMON_TESTS_KM_NTDDK_H */
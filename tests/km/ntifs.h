@@ -0,0 +1,111 @@
+#ifndef PROCMON_TESTS_KM_NTIFS_H
+#define PROCMON_TESTS_KM_NTIFS_H
+
+/*
+ * ntifs.h — Подмена: журнал изменений тома и имена объектов.
+ *
+ * Журнала в подмене нет (ZwFsControlFile — STATUS_NOT_SUPPORTED), так
+ * что кэш дайджестов кусков ведёт себя как на томе FAT.
+ */
+
+#include <ntddk.h>
+
+typedef LONGLONG USN;
+
+#define FSCTL_QUERY_USN_JOURNAL   0x000900f4
+#define FSCTL_READ_USN_JOURNAL    0x000900bb
+#define FSCTL_READ_FILE_USN_DATA  0x000900eb
+
+#define USN_REASON_DATA_OVERWRITE      0x00000001
+#define USN_REASON_DATA_EXTEND         0x00000002
+#define USN_REASON_DATA_TRUNCATION     0x00000004
+#define USN_REASON_EA_CHANGE           0x00000400
+#define USN_REASON_SECURITY_CHANGE     0x00000800
+#define USN_REASON_RENAME_OLD_NAME     0x00001000
+#define USN_REASON_RENAME_NEW_NAME     0x00002000
+#define USN_REASON_INDEXABLE_CHANGE    0x00004000
+#define USN_REASON_BASIC_INFO_CHANGE   0x00008000
+#define USN_REASON_HARD_LINK_CHANGE    0x00010000
+#define USN_REASON_OBJECT_ID_CHANGE    0x00080000
+#define USN_REASON_CLOSE               0x80000000
+
+#define STATUS_JOURNAL_ENTRY_DELETED   ((NTSTATUS)0xC00002CFL)
+
+typedef struct _USN_JOURNAL_DATA_V0 {
+    ULONGLONG UsnJournalID;
+    USN       FirstUsn;
+    USN       NextUsn;
+    USN       LowestValidUsn;
+    USN       MaxUsn;
+    ULONGLONG MaximumSize;
+    ULONGLONG AllocationDelta;
+} USN_JOURNAL_DATA_V0;
+
+typedef struct _READ_USN_JOURNAL_DATA_V1 {
+    USN       StartUsn;
+    ULONG     ReasonMask;
+    ULONG     ReturnOnlyOnClose;
+    ULONGLONG Timeout;
+    ULONGLONG BytesToWaitFor;
+    ULONGLONG UsnJournalID;
+    USHORT    MinMajorVersion;
+    USHORT    MaxMajorVersion;
+} READ_USN_JOURNAL_DATA_V1;
+
+typedef struct _READ_FILE_USN_DATA {
+    USHORT MinMajorVersion;
+    USHORT MaxMajorVersion;
+} READ_FILE_USN_DATA;
+
+typedef struct _USN_RECORD_COMMON_HEADER {
+    ULONG  RecordLength;
+    USHORT MajorVersion;
+    USHORT MinorVersion;
+} USN_RECORD_COMMON_HEADER, *PUSN_RECORD_COMMON_HEADER;
+
+typedef struct _USN_RECORD_V2 {
+    ULONG         RecordLength;
+    USHORT        MajorVersion;
+    USHORT        MinorVersion;
+    ULONGLONG     FileReferenceNumber;
+    ULONGLONG     ParentFileReferenceNumber;
+    USN           Usn;
+    LARGE_INTEGER TimeStamp;
+    ULONG         Reason;
+    ULONG         SourceInfo;
+    ULONG         SecurityId;
+    ULONG         FileAttributes;
+    USHORT        FileNameLength;
+    USHORT        FileNameOffset;
+    WCHAR         FileName[1];
+} USN_RECORD_V2, *PUSN_RECORD_V2;
+
+typedef struct _USN_RECORD_V3 {
+    ULONG         RecordLength;
+    USHORT        MajorVersion;
+    USHORT        MinorVersion;
+    FILE_ID_128   FileReferenceNumber;
+    FILE_ID_128   ParentFileReferenceNumber;
+    USN           Usn;
+    LARGE_INTEGER TimeStamp;
+    ULONG         Reason;
+    ULONG         SourceInfo;
+    ULONG         SecurityId;
+    ULONG         FileAttributes;
+    USHORT        FileNameLength;
+    USHORT        FileNameOffset;
+    WCHAR         FileName[1];
+} USN_RECORD_V3, *PUSN_RECORD_V3;
+
+typedef struct _OBJECT_NAME_INFORMATION {
+    UNICODE_STRING Name;
+} OBJECT_NAME_INFORMATION, *POBJECT_NAME_INFORMATION;
+
+NTSTATUS ZwFsControlFile(HANDLE FileHandle, HANDLE Event, PIO_APC_ROUTINE ApcRoutine,
+                         PVOID ApcContext, PIO_STATUS_BLOCK IoStatusBlock, ULONG FsControlCode,
+                         PVOID InputBuffer, ULONG InputBufferLength, PVOID OutputBuffer,
+                         ULONG OutputBufferLength);
+NTSTATUS ObQueryNameString(PVOID Object, POBJECT_NAME_INFORMATION ObjectNameInfo,
+                           ULONG Length, PULONG ReturnLength);
+
+#endif /* PROCMON_TESTS_KM_NTIFS_H */
@@ -0,0 +1,211 @@
+/*
+ * md5_mb_bench.c — MD5 по одному потоку против многоканального.
+ *
+ * В памяти: 8 независимых потоков данных хешируются
+ *   1 канал  — по очереди Md5Update, как скалярный запасной канал;
+ *   4 канала — Md5MbTransform на SSE2 (AVX2 скрыт от CPUID), две группы;
+ *   8 каналов — Md5MbTransform на AVX2, если он есть.
+ * На файлах: ComputeFileHash по одному против ComputeFileHashBatch при 4
+ * и 8 каналах, один поток (HashBatchConfigure(1)), файлы в кэше страниц.
+ * MB/s суммарно по всем потокам, лучший из 3 прогонов.
+ *
+ * Запуск: md5_mb_bench [KB на поток] [каталог] — по умолчанию 1024, /tmp.
+ */
+
+#include <ntddk.h>
+#include "hash.h"
+#include "km.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#define BENCH_RUNS     3
+#define BENCH_STREAMS  8
+#define BENCH_FILES    32
+#define BENCH_ROUNDS   16   /* Повторов хеширования в памяти на прогон */
+
+static UCHAR *g_Streams[BENCH_STREAMS];
+
+typedef struct _BENCH_FILE {
+    char           Posix[256];
+    WCHAR          Buffer[300];
+    UNICODE_STRING Path;
+    UCHAR          Hash[PROCMON_HASH_SIZE];
+} BENCH_FILE;
+
+static BENCH_FILE g_Files[BENCH_FILES];
+
+/* Все потоки по Md5MbLaneCount() за раз; Lanes == 1 — Md5Update по очереди */
+static VOID HashStreams(ULONG Lanes, ULONG Size)
+{
+    MD5_MB_STATE state;
+    MD5_CTX      ctx;
+    UCHAR        digest[16];
+    ULONG        group, i;
+
+    if (Lanes == 1) {
+        for (i = 0; i < BENCH_STREAMS; i++) {
+            Md5Init(&ctx);
+            Md5Update(&ctx, g_Streams[i], Size);
+            Md5Final(&ctx, digest);
+        }
+        return;
+    }
+
+    for (group = 0; group < BENCH_STREAMS; group += Lanes) {
+        for (i = 0; i < MD5_MB_MAX_LANES; i++) {
+            Md5MbInitLane(&state, i);
+        }
+        Md5MbTransform(&state, (const UCHAR * const *)&g_Streams[group], Size / 64);
+    }
+}
+
+static double MeasureMemory(ULONG Lanes, ULONG Size)
+{
+    double best = 0;
+    ULONG  run, i;
+
+    for (run = 0; run < BENCH_RUNS; run++) {
+        double start, elapsed;
+
+        start = KmNow();
+        for (i = 0; i < BENCH_ROUNDS; i++) {
+            HashStreams(Lanes, Size);
+        }
+        elapsed = KmNow() - start;
+        if (run == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return (double)Size * BENCH_STREAMS * BENCH_ROUNDS / best / (1024 * 1024);
+}
+
+static double MeasureFiles(BOOLEAN Batch, ULONG Size)
+{
+    HASH_BATCH_ITEM items[BENCH_FILES];
+    double          best = 0;
+    ULONG           run, i;
+
+    for (run = 0; run < BENCH_RUNS; run++) {
+        double start, elapsed;
+
+        RtlZeroMemory(items, sizeof(items));
+        for (i = 0; i < BENCH_FILES; i++) {
+            items[i].Path = g_Files[i].Path;
+            items[i].Hash = g_Files[i].Hash;
+        }
+
+        start = KmNow();
+        if (Batch) {
+            ComputeFileHashBatch(items, BENCH_FILES);
+        } else {
+            for (i = 0; i < BENCH_FILES; i++) {
+                items[i].Status = ComputeFileHash(&items[i].Path, &g_HashMd5, items[i].Hash);
+            }
+        }
+        elapsed = KmNow() - start;
+
+        for (i = 0; i < BENCH_FILES; i++) {
+            if (!NT_SUCCESS(items[i].Status)) {
+                fprintf(stderr, "%s не хешируется: 0x%08X\n", g_Files[i].Posix, items[i].Status);
+                return 0;
+            }
+        }
+        if (run == 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return (double)Size * BENCH_FILES / best / (1024 * 1024);
+}
+
+static BOOLEAN CreateFiles(const char *Dir, ULONG Size)
+{
+    ULONG i;
+
+    for (i = 0; i < BENCH_FILES; i++) {
+        FILE *file;
+
+        snprintf(g_Files[i].Posix, sizeof(g_Files[i].Posix), "%s/procmon_md5_mb_bench_%lu.bin",
+                 Dir, (unsigned long)i);
+        file = fopen(g_Files[i].Posix, "wb");
+        if (file == NULL || fwrite(g_Streams[i % BENCH_STREAMS], 1, Size, file) != Size) {
+            perror(g_Files[i].Posix);
+            if (file != NULL) {
+                fclose(file);
+            }
+            return FALSE;
+        }
+        fclose(file);
+        KmInitPath(&g_Files[i].Path, g_Files[i].Buffer, RTL_NUMBER_OF(g_Files[i].Buffer),
+                   g_Files[i].Posix);
+    }
+    return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+    ULONG       kb = argc > 1 ? (ULONG)strtoul(argv[1], NULL, 10) : 1024;
+    const char *dir = argc > 2 ? argv[2] : "/tmp";
+    ULONG       size, i, j;
+    double      scalar, sse2, avx2 = 0, single, batch4, batch8 = 0;
+    BOOLEAN     wide;
+    BOOLEAN     ok;
+
+    if (kb == 0 || kb > 4096) {
+        kb = 1024;
+    }
+    size = kb * 1024;
+
+    for (i = 0; i < BENCH_STREAMS; i++) {
+        g_Streams[i] = malloc(size);
+        if (g_Streams[i] == NULL) {
+            return 1;
+        }
+        for (j = 0; j < size; j++) {
+            g_Streams[i][j] = (UCHAR)(j * 131 + i * 7 + (j >> 10));
+        }
+    }
+
+    ok = CreateFiles(dir, size);
+    HashBatchConfigure(1);
+
+    KmHideCpuFeatures(KM_CPU_AVX2);
+    Md5MbSelectImplementation();
+    scalar = MeasureMemory(1, size);
+    sse2 = MeasureMemory(Md5MbLaneCount(), size);
+    single = ok ? MeasureFiles(FALSE, size) : 0;
+    batch4 = ok ? MeasureFiles(TRUE, size) : 0;
+
+    KmHideCpuFeatures(0);
+    wide = Md5MbSelectImplementation() == 8;
+    if (wide) {
+        avx2 = MeasureMemory(8, size);
+        batch8 = ok ? MeasureFiles(TRUE, size) : 0;
+    }
+
+    printf("память, %d потоков по %lu KB:\n", BENCH_STREAMS, (unsigned long)kb);
+    printf("  1 канал   %7.1f MB/s\n", scalar);
+    printf("  4 канала  %7.1f MB/s (x%.1f)\n", sse2, sse2 / scalar);
+    if (wide) {
+        printf("  8 каналов %7.1f MB/s (x%.1f)\n", avx2, avx2 / scalar);
+    } else {
+        printf("  8 каналов — AVX2 недоступен\n");
+    }
+
+    if (ok) {
+        printf("файлы, %d по %lu KB:\n", BENCH_FILES, (unsigned long)kb);
+        printf("  ComputeFileHash        %7.1f MB/s\n", single);
+        printf("  пакет, 4 канала        %7.1f MB/s (x%.1f)\n", batch4, batch4 / single);
+        if (wide) {
+            printf("  пакет, 8 каналов       %7.1f MB/s (x%.1f)\n", batch8, batch8 / single);
+        }
+        for (i = 0; i < BENCH_FILES; i++) {
+            unlink(g_Files[i].Posix);
+        }
+    }
+
+    HashBatchShutdown();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,178 @@
+/*
+ * md5_mb_test.c — Многоканальный MD5 (md5_mb.c) и пакетное хеширование.
+ *
+ * Для каждой ширины, которую умеет процессор (8 каналов AVX2, 4 SSE2 —
+ * AVX2 скрыт от CPUID), каждый канал Md5MbTransform ведёт свои данные,
+ * хвост дохешируется Md5Update/Md5Final, и дайджест сверяется с
+ * Md5Final по всему сообщению. Затем ComputeFileHashBatch на файлах
+ * разной длины, включая пустой и больше 4MB, сверяется с ComputeFileHash.
+ */
+
+#include <ntddk.h>
+#include "hash.h"
+#include "km.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#define TEST_MAX_BLOCKS  40
+
+/* Длины файлов пакета: пустой, внутри блока, на границах, больше 4MB */
+static const ULONG g_FileSizes[] = {
+    0, 1, 55, 63, 64, 65, 4096 + 17, 256 * 1024, 1024 * 1024 + 5, 5 * 1024 * 1024, 3, 100000
+};
+
+static VOID FillData(UCHAR *Data, ULONG Length, ULONG Seed)
+{
+    ULONG i;
+
+    for (i = 0; i < Length; i++) {
+        Data[i] = (UCHAR)(i * 131 + Seed * 29 + (i >> 9));
+    }
+}
+
+static VOID Md5Digest(const UCHAR *Data, ULONG Length, UCHAR Digest[16])
+{
+    MD5_CTX ctx;
+
+    Md5Init(&ctx);
+    Md5Update(&ctx, Data, Length);
+    Md5Final(&ctx, Digest);
+}
+
+/* Все каналы Blocks блоками, хвост Tail байт (у канала i — Tail + i, по модулю 64) */
+static VOID TestLanes(ULONG Lanes, ULONG Blocks, ULONG Tail)
+{
+    static UCHAR data[MD5_MB_MAX_LANES][TEST_MAX_BLOCKS * 64 + 64];
+    const UCHAR *lanes[MD5_MB_MAX_LANES];
+    MD5_MB_STATE state;
+    ULONG        i, j;
+
+    for (i = 0; i < MD5_MB_MAX_LANES; i++) {
+        FillData(data[i], sizeof(data[i]), i + Blocks);
+        lanes[i] = data[i];
+        Md5MbInitLane(&state, i);
+    }
+
+    /* Несколькими вызовами, как HashBatchRun по мере освобождения каналов */
+    for (j = 0; j < Blocks; j += 7) {
+        ULONG step = Blocks - j < 7 ? Blocks - j : 7;
+
+        KM_CHECK(NT_SUCCESS(Md5MbTransform(&state, lanes, step)));
+        for (i = 0; i < MD5_MB_MAX_LANES; i++) {
+            lanes[i] += step * 64;
+        }
+    }
+
+    for (i = 0; i < Lanes; i++) {
+        ULONG   tail = (Tail + i) % 64;
+        ULONG   length = Blocks * 64 + tail;
+        UCHAR   expected[16], digest[16];
+        MD5_CTX ctx;
+
+        ctx.State[0] = state.State[0][i];
+        ctx.State[1] = state.State[1][i];
+        ctx.State[2] = state.State[2][i];
+        ctx.State[3] = state.State[3][i];
+        ctx.Count = (ULONG64)Blocks * 64;
+        Md5Update(&ctx, lanes[i], tail);
+        Md5Final(&ctx, digest);
+
+        Md5Digest(data[i], length, expected);
+        if (memcmp(digest, expected, sizeof(digest)) != 0) {
+            fprintf(stderr, "каналов %lu: канал %lu, блоков %lu, хвост %lu\n",
+                    (unsigned long)Lanes, (unsigned long)i, (unsigned long)Blocks,
+                    (unsigned long)tail);
+            g_KmFailures++;
+        }
+    }
+}
+
+static VOID TestWidth(ULONG Lanes)
+{
+    ULONG blocks, tail;
+
+    KM_CHECK(Md5MbLaneCount() == Lanes);
+
+    for (blocks = 0; blocks <= TEST_MAX_BLOCKS; blocks += (blocks < 4 ? 1 : 9)) {
+        for (tail = 0; tail < 64; tail += 13) {
+            TestLanes(Lanes, blocks, tail);
+        }
+    }
+}
+
+static VOID TestBatch(const char *Dir)
+{
+    ULONG           count = RTL_NUMBER_OF(g_FileSizes);
+    char            posix[RTL_NUMBER_OF(g_FileSizes)][256];
+    WCHAR           buffers[RTL_NUMBER_OF(g_FileSizes)][300];
+    HASH_BATCH_ITEM items[RTL_NUMBER_OF(g_FileSizes)];
+    UCHAR           hashes[RTL_NUMBER_OF(g_FileSizes)][PROCMON_HASH_SIZE];
+    UCHAR          *data = malloc(5 * 1024 * 1024);
+    ULONG           i;
+
+    if (data == NULL) {
+        g_KmFailures++;
+        return;
+    }
+
+    RtlZeroMemory(items, sizeof(items));
+    for (i = 0; i < count; i++) {
+        FILE *file;
+
+        FillData(data, g_FileSizes[i], i);
+        snprintf(posix[i], sizeof(posix[i]), "%s/procmon_md5_mb_%lu.bin", Dir, (unsigned long)i);
+        file = fopen(posix[i], "wb");
+        KM_CHECK(file != NULL);
+        if (file != NULL) {
+            KM_CHECK(fwrite(data, 1, g_FileSizes[i], file) == g_FileSizes[i]);
+            fclose(file);
+        }
+        KmInitPath(&items[i].Path, buffers[i], RTL_NUMBER_OF(buffers[i]), posix[i]);
+        items[i].Hash = hashes[i];
+    }
+    /* Последний — несуществующий файл */
+    unlink(posix[count - 1]);
+
+    ComputeFileHashBatch(items, count);
+
+    for (i = 0; i < count; i++) {
+        UCHAR    expected[PROCMON_HASH_SIZE];
+        NTSTATUS status = ComputeFileHash(&items[i].Path, &g_HashMd5, expected);
+
+        KM_CHECK(NT_SUCCESS(status) == NT_SUCCESS(items[i].Status));
+        if (NT_SUCCESS(status) && memcmp(hashes[i], expected, sizeof(expected)) != 0) {
+            fprintf(stderr, "пакет: файл %lu байт\n", (unsigned long)g_FileSizes[i]);
+            g_KmFailures++;
+        }
+        unlink(posix[i]);
+    }
+    KM_CHECK(!NT_SUCCESS(items[count - 1].Status));
+
+    free(data);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    ULONG       lanes;
+
+    KmHideCpuFeatures(KM_CPU_AVX2);
+    lanes = Md5MbSelectImplementation();
+    KM_CHECK(lanes == 4);
+    TestWidth(4);
+    HashBatchConfigure(1);
+    TestBatch(dir);
+
+    KmHideCpuFeatures(0);
+    lanes = Md5MbSelectImplementation();
+    if (lanes == 8) {
+        TestWidth(8);
+        TestBatch(dir);
+    } else {
+        printf("AVX2 недоступен, проверено 4 канала\n");
+    }
+    HashBatchShutdown();
+
+    return KM_TEST_RESULT();
+}
@@ -0,0 +1,253 @@
+/*
+ * ring_bench.c — Замер записи в кольца при соперничестве писателей.
+ *
+ * Писатели — потоки pthreads с BufferPush из buffer.c драйвера (события
+ * создания: MD5 и имя в 32 байта). Режимы:
+ *   percpu   — каждый поток на своём «процессоре», то есть в своём кольце;
+ *   shared   — все потоки на процессоре 0: одно кольцо, соперничество
+ *              за Head и арену (вытесненный писатель в ядре даёт то же);
+ *   spinlock — прежняя схема для сравнения: одно кольцо PROCMON_EVENT
+ *              под KSPIN_LOCK, копирование события целиком.
+ * Параллельно читатель непрерывно забирает события (BufferRead или
+ * копирование под той же блокировкой, как прежний BufferRead).
+ *
+ * Запуск: ring_bench [событий на поток] [потоков через запятую]
+ * Вывод — миллионов событий в секунду на все потоки. На машине с одним
+ * ядром потоки идут по очереди, и замер показывает только цену самой
+ * записи; соперничество видно на машине с несколькими ядрами.
+ */
+
+#include <ntddk.h>
+#include "buffer.h"
+#include "km.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define BENCH_RING_SIZE   4096
+#define BENCH_ARENA_SIZE  (256 * 1024)
+#define BENCH_MAX_THREADS 64
+#define BENCH_NAME        "C:\\Windows\\System32\\cmd.exe\\..."
+#define BENCH_READ_BATCH  64
+
+typedef enum _BENCH_MODE {
+    BenchPerCpu,
+    BenchShared,
+    BenchSpinLock
+} BENCH_MODE;
+
+/* Прежний буфер: один массив событий под спинлоком */
+typedef struct _LOCKED_RING {
+    KSPIN_LOCK    Lock;
+    ULONG         Head;
+    ULONG         Tail;
+    ULONG         Count;
+    PROCMON_EVENT Entries[BENCH_RING_SIZE];
+} LOCKED_RING;
+
+typedef struct _BENCH {
+    BENCH_MODE    Mode;
+    ULONG         EventsPerThread;
+    EVENT_BUFFER  Buffer;
+    LOCKED_RING  *Locked;
+    volatile LONG Running;    /* Писателей, ещё не закончивших */
+    volatile LONG Start;      /* Старт для всех потоков сразу */
+    ULONG64       ReadCount;  /* Прочитано читателем */
+} BENCH;
+
+typedef struct _WRITER {
+    BENCH    *Bench;
+    ULONG     Index;
+    pthread_t Thread;
+} WRITER;
+
+static VOID LockedPush(LOCKED_RING *Ring, const PROCMON_EVENT *Event)
+{
+    KIRQL irql;
+
+    KeAcquireSpinLock(&Ring->Lock, &irql);
+    RtlCopyMemory(&Ring->Entries[Ring->Head], Event, sizeof(PROCMON_EVENT));
+    Ring->Head = (Ring->Head + 1) % BENCH_RING_SIZE;
+    if (Ring->Count < BENCH_RING_SIZE) {
+        Ring->Count++;
+    } else {
+        Ring->Tail = (Ring->Tail + 1) % BENCH_RING_SIZE;
+    }
+    KeReleaseSpinLock(&Ring->Lock, irql);
+}
+
+static ULONG LockedRead(LOCKED_RING *Ring, PROCMON_EVENT *Out, ULONG Max)
+{
+    KIRQL irql;
+    ULONG i;
+
+    KeAcquireSpinLock(&Ring->Lock, &irql);
+    for (i = 0; i < Max && Ring->Count > 0; i++) {
+        RtlCopyMemory(&Out[i], &Ring->Entries[Ring->Tail], sizeof(PROCMON_EVENT));
+        Ring->Tail = (Ring->Tail + 1) % BENCH_RING_SIZE;
+        Ring->Count--;
+    }
+    KeReleaseSpinLock(&Ring->Lock, irql);
+    return i;
+}
+
+static void *WriterThread(void *Argument)
+{
+    WRITER              *writer = Argument;
+    BENCH               *bench = writer->Bench;
+    PROCMON_EVENT_HEADER header;
+    PROCMON_EVENT        event;
+    UCHAR                hash[PROCMON_HASH_SIZE];
+    ULONG                i;
+
+    KmSetCurrentProcessor(bench->Mode == BenchPerCpu ? writer->Index : 0);
+
+    RtlZeroMemory(&header, sizeof(header));
+    header.Flags = PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_HASH_VALID;
+    RtlFillMemory(hash, sizeof(hash), 0x5a);
+
+    RtlZeroMemory(&event, sizeof(event));
+    event.IsCreate = TRUE;
+    event.HashValid = TRUE;
+    RtlCopyMemory(event.ImageName, BENCH_NAME, sizeof(BENCH_NAME) - 1);
+    RtlCopyMemory(event.FileHash, hash, sizeof(hash));
+
+    while (ReadAcquire(&bench->Start) == 0) {
+        YieldProcessor();
+    }
+
+    for (i = 0; i < bench->EventsPerThread; i++) {
+        if (bench->Mode == BenchSpinLock) {
+            event.ProcessId = i;
+            KeQuerySystemTime(&event.Timestamp);
+            LockedPush(bench->Locked, &event);
+        } else {
+            header.ProcessId = i;
+            KeQuerySystemTime(&header.Timestamp);
+            BufferPush(&bench->Buffer, &header, hash, BENCH_NAME, sizeof(BENCH_NAME) - 1);
+        }
+    }
+
+    InterlockedDecrement(&bench->Running);
+    return NULL;
+}
+
+static BOOLEAN CountSink(PVOID Context, const PROCMON_RECORD *Record)
+{
+    UNREFERENCED_PARAMETER(Record);
+    (*(ULONG64 *)Context)++;
+    return TRUE;
+}
+
+/* Читатель: забирает события, пока пишут писатели */
+static VOID ReadWhileRunning(BENCH *Bench)
+{
+    static PROCMON_EVENT out[BENCH_READ_BATCH];
+    BUFFER_READER        reader;
+    ULONG64              count = 0;
+
+    if (Bench->Mode == BenchSpinLock) {
+        while (ReadAcquire(&Bench->Running) != 0) {
+            count += LockedRead(Bench->Locked, out, BENCH_READ_BATCH);
+            YieldProcessor();
+        }
+        Bench->ReadCount = count;
+        return;
+    }
+
+    RtlZeroMemory(&reader, sizeof(reader));
+    BufferReaderOpen(&Bench->Buffer, &reader);
+    while (ReadAcquire(&Bench->Running) != 0) {
+        BufferRead(&Bench->Buffer, &reader, CountSink, &count);
+        YieldProcessor();
+    }
+    BufferReaderClose(&Bench->Buffer, &reader);
+    Bench->ReadCount = count;
+}
+
+static int RunBench(BENCH_MODE Mode, ULONG Threads, ULONG EventsPerThread)
+{
+    static const char *names[] = { "percpu", "shared", "spinlock" };
+    PROCMON_BUFFER_CONFIG config = { BENCH_RING_SIZE, BENCH_ARENA_SIZE,
+                                     PROCMON_OVERFLOW_OVERWRITE };
+    WRITER  writers[BENCH_MAX_THREADS];
+    BENCH  *bench;
+    double  start, elapsed;
+    ULONG   i;
+
+    bench = calloc(1, sizeof(BENCH));
+    if (bench == NULL) {
+        return 1;
+    }
+    bench->Mode = Mode;
+    bench->EventsPerThread = EventsPerThread;
+    bench->Running = (LONG)Threads;
+
+    if (Mode == BenchSpinLock) {
+        bench->Locked = calloc(1, sizeof(LOCKED_RING));
+        if (bench->Locked == NULL) {
+            free(bench);
+            return 1;
+        }
+        KeInitializeSpinLock(&bench->Locked->Lock);
+    } else {
+        KmSetProcessorCount(Threads);
+        BufferNormalizeConfig(&config, NULL);
+        if (!NT_SUCCESS(BufferInit(&bench->Buffer, &config))) {
+            fprintf(stderr, "BufferInit не удался\n");
+            free(bench);
+            return 1;
+        }
+    }
+
+    for (i = 0; i < Threads; i++) {
+        writers[i].Bench = bench;
+        writers[i].Index = i;
+        pthread_create(&writers[i].Thread, NULL, WriterThread, &writers[i]);
+    }
+
+    start = KmNow();
+    WriteRelease(&bench->Start, 1);
+    ReadWhileRunning(bench);
+    for (i = 0; i < Threads; i++) {
+        pthread_join(writers[i].Thread, NULL);
+    }
+    elapsed = KmNow() - start;
+
+    printf("%-8s  потоков %2lu  %8.2f Mops/s  (прочитано %llu из %llu)\n",
+           names[Mode], (unsigned long)Threads,
+           (double)Threads * EventsPerThread / elapsed / 1e6,
+           (unsigned long long)bench->ReadCount,
+           (unsigned long long)Threads * EventsPerThread);
+
+    if (Mode == BenchSpinLock) {
+        free(bench->Locked);
+    } else {
+        BufferFree(&bench->Buffer);
+    }
+    free(bench);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    ULONG events = argc > 1 ? (ULONG)strtoul(argv[1], NULL, 10) : 1000000;
+    char  defaultThreads[] = "1,2,4,8";
+    char *list = argc > 2 ? argv[2] : defaultThreads;
+    char *token;
+    char *save = NULL;
+    int   result = 0;
+
+    for (token = strtok_r(list, ",", &save); token != NULL; token = strtok_r(NULL, ",", &save)) {
+        ULONG threads = (ULONG)strtoul(token, NULL, 10);
+
+        if (threads == 0 || threads > BENCH_MAX_THREADS) {
+            continue;
+        }
+        result |= RunBench(BenchPerCpu, threads, events);
+        result |= RunBench(BenchShared, threads, events);
+        result |= RunBench(BenchSpinLock, threads, events);
+    }
+
+    return result;
+}
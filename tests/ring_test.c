@@ -0,0 +1,480 @@
+/*
+ * ring_test.c — Слияние per-CPU колец при чтении (buffer.c + common/ring.c).
+ *
+ * Проверяется, что BufferRead отдаёт события всех колец одним потоком
+ * по времени, сообщает потери записями о пропуске, останавливается на
+ * неопубликованной голове и не теряет событий при параллельной записи.
+ */
+
+#include <ntddk.h>
+#include "buffer.h"
+#include "km.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define TEST_NAME  "C:\\Windows\\System32\\notepad.exe"
+
+/* Приёмник: складывает записи в массив */
+typedef struct _COLLECTOR {
+    PROCMON_RECORD *Records;
+    ULONG           Count;
+    ULONG           Capacity;
+    ULONG64         Events;   /* Записей-событий */
+    ULONG64         Lost;     /* Сумма потерь из записей о пропуске */
+} COLLECTOR;
+
+static BOOLEAN CollectSink(PVOID Context, const PROCMON_RECORD *Record)
+{
+    COLLECTOR *collector = Context;
+
+    if (Record->Header.Flags & PROCMON_EVENT_FLAG_GAP) {
+        collector->Lost += Record->Header.ProcessId;
+    } else {
+        collector->Events++;
+    }
+
+    if (collector->Records != NULL) {
+        if (collector->Count == collector->Capacity) {
+            return FALSE;
+        }
+        collector->Records[collector->Count] = *Record;
+    }
+    collector->Count++;
+    return TRUE;
+}
+
+static VOID CollectorInit(COLLECTOR *Collector, ULONG Capacity)
+{
+    RtlZeroMemory(Collector, sizeof(COLLECTOR));
+    Collector->Capacity = Capacity;
+    Collector->Records = Capacity ? calloc(Capacity, sizeof(PROCMON_RECORD)) : NULL;
+}
+
+static BOOLEAN OpenBuffer(PEVENT_BUFFER Buffer, ULONG Processors, ULONG RingSize, ULONG Policy)
+{
+    PROCMON_BUFFER_CONFIG config = { RingSize, 64 * 1024, Policy };
+
+    KmSetProcessorCount(Processors);
+    KmSetCurrentProcessor(0);
+    BufferNormalizeConfig(&config, NULL);
+    RtlZeroMemory(Buffer, sizeof(EVENT_BUFFER));
+    return NT_SUCCESS(BufferInit(Buffer, &config));
+}
+
+static VOID PushAt(PEVENT_BUFFER Buffer, ULONG Processor, LONGLONG Time, ULONG Pid,
+                   BOOLEAN WithName)
+{
+    PROCMON_EVENT_HEADER header;
+    UCHAR                hash[PROCMON_HASH_SIZE];
+
+    RtlZeroMemory(&header, sizeof(header));
+    RtlFillMemory(hash, sizeof(hash), (UCHAR)Pid);
+    header.ProcessId = Pid;
+    header.ParentProcessId = Processor;
+    header.Timestamp.QuadPart = Time;
+
+    KmSetCurrentProcessor(Processor);
+    if (WithName) {
+        header.Flags = PROCMON_EVENT_FLAG_CREATE | PROCMON_EVENT_FLAG_HASH_VALID;
+        BufferPush(Buffer, &header, hash, TEST_NAME, sizeof(TEST_NAME) - 1);
+    } else {
+        BufferPush(Buffer, &header, NULL, NULL, 0);
+    }
+    KmSetCurrentProcessor(0);
+}
+
+/* Кольца, заполненные вперемешку, читаются одним потоком по времени */
+static VOID TestMergeOrder(VOID)
+{
+    EVENT_BUFFER  buffer;
+    BUFFER_READER reader;
+    COLLECTOR     out;
+    ULONG         ring, k, i;
+    ULONG         seed = 12345;
+
+    KM_CHECK(OpenBuffer(&buffer, 4, 64, PROCMON_OVERFLOW_OVERWRITE));
+
+    /* В каждом кольце время растёт, между кольцами — перемешано */
+    for (k = 0; k < 50; k++) {
+        for (ring = 0; ring < 4; ring++) {
+            seed = seed * 1103515245 + 12345;
+            PushAt(&buffer, ring, (LONGLONG)k * 10 + (seed >> 16) % 10, ring * 1000 + k, ring & 1);
+        }
+    }
+
+    RtlZeroMemory(&reader, sizeof(reader));
+    KM_CHECK(NT_SUCCESS(BufferReaderOpen(&buffer, &reader)));
+    CollectorInit(&out, 1000);
+    KM_CHECK(BufferRead(&buffer, &reader, CollectSink, &out) == 200);
+    KM_CHECK(out.Count == 200 && out.Lost == 0);
+
+    for (i = 1; i < out.Count; i++) {
+        KM_CHECK(out.Records[i - 1].Header.Timestamp.QuadPart <=
+                 out.Records[i].Header.Timestamp.QuadPart);
+    }
+
+    /* Имя и хеш приходят с событием; у событий без данных их нет */
+    for (i = 0; i < out.Count; i++) {
+        const PROCMON_RECORD *record = &out.Records[i];
+
+        if (record->Header.ParentProcessId & 1) {
+            KM_CHECK(strcmp(record->ImageName, TEST_NAME) == 0);
+            KM_CHECK(record->Header.Flags & PROCMON_EVENT_FLAG_HASH_VALID);
+            KM_CHECK(record->FileHash[0] == (UCHAR)record->Header.ProcessId);
+        } else {
+            KM_CHECK(record->Header.NameLength == 0 && record->ImageName[0] == '\0');
+        }
+    }
+
+    /* Всё прочитано — повторное чтение пусто */
+    out.Count = 0;
+    KM_CHECK(BufferRead(&buffer, &reader, CollectSink, &out) == 0);
+
+    free(out.Records);
+    BufferReaderClose(&buffer, &reader);
+    BufferFree(&buffer);
+}
+
+/* Перезаписанные до чтения события приходят одной записью о пропуске */
+static VOID TestOverwriteGap(VOID)
+{
+    EVENT_BUFFER  buffer;
+    BUFFER_READER reader;
+    COLLECTOR     out;
+    ULONG         i;
+
+    KM_CHECK(OpenBuffer(&buffer, 1, 64, PROCMON_OVERFLOW_OVERWRITE));
+
+    RtlZeroMemory(&reader, sizeof(reader));
+    KM_CHECK(NT_SUCCESS(BufferReaderOpen(&buffer, &reader)));
+
+    for (i = 0; i < 100; i++) {
+        PushAt(&buffer, 0, 1000 + i, i, FALSE);
+    }
+
+    CollectorInit(&out, 1000);
+    BufferRead(&buffer, &reader, CollectSink, &out);
+    KM_CHECK(out.Count == 65);
+    KM_CHECK(out.Records[0].Header.Flags & PROCMON_EVENT_FLAG_GAP);
+    KM_CHECK(out.Records[0].Header.ProcessId == 36);
+    for (i = 1; i < out.Count; i++) {
+        KM_CHECK(out.Records[i].Header.ProcessId == 36 + i - 1);
+    }
+
+    free(out.Records);
+    BufferReaderClose(&buffer, &reader);
+    BufferFree(&buffer);
+}
+
+/* Политика «отбрасывать новые»: кольцо держит старые, потери — пропуском */
+static VOID TestDropNewest(VOID)
+{
+    EVENT_BUFFER  buffer;
+    BUFFER_READER reader;
+    COLLECTOR     out;
+    ULONG         i;
+
+    KM_CHECK(OpenBuffer(&buffer, 1, 64, PROCMON_OVERFLOW_DROP_NEWEST));
+
+    RtlZeroMemory(&reader, sizeof(reader));
+    KM_CHECK(NT_SUCCESS(BufferReaderOpen(&buffer, &reader)));
+
+    /* Политика отбрасывания действует с первого IOCTL-чтения */
+    CollectorInit(&out, 1000);
+    KM_CHECK(BufferRead(&buffer, &reader, CollectSink, &out) == 0);
+
+    for (i = 0; i < 100; i++) {
+        PushAt(&buffer, 0, 1000 + i, i, FALSE);
+    }
+
+    BufferRead(&buffer, &reader, CollectSink, &out);
+    KM_CHECK(out.Events == 64 && out.Lost == 36);
+
+    /* Сохранились первые 64 события */
+    for (i = 0; i < out.Count; i++) {
+        if ((out.Records[i].Header.Flags & PROCMON_EVENT_FLAG_GAP) == 0) {
+            KM_CHECK(out.Records[i].Header.ProcessId < 64);
+        }
+    }
+
+    free(out.Records);
+    BufferReaderClose(&buffer, &reader);
+    BufferFree(&buffer);
+}
+
+/*
+ * Только клиент отображения: хэндл открыт, но через IOCTL не читает, и
+ * ReadTail не движется. Отбрасывающие политики тогда работают как
+ * перезапись — иначе кольцо, заполнившись раз, отбрасывало бы всё.
+ */
+static VOID TestMappedOnlyReader(ULONG Policy)
+{
+    EVENT_BUFFER      buffer;
+    BUFFER_READER     reader;
+    PROCMON_RING_VIEW view;
+    PROCMON_RECORD    record;
+    COLLECTOR         out;
+    ULONG64           dropped, overwritten, pending;
+    ULONG             events = 0, lost = 0, last = 0;
+    LONG              best;
+    ULONG             i;
+
+    KM_CHECK(OpenBuffer(&buffer, 1, 64, Policy));
+
+    RtlZeroMemory(&reader, sizeof(reader));
+    KM_CHECK(NT_SUCCESS(BufferReaderOpen(&buffer, &reader)));
+    RingViewInit(&view, buffer.Active->Header, 0);
+
+    /* Втрое больше кольца: создания с именем, как у PRIORITY отбрасываемые первыми */
+    for (i = 0; i < 3 * 64; i++) {
+        PushAt(&buffer, 0, 1000 + i, i, TRUE);
+    }
+
+    BufferQueryLoss(&buffer, &reader, &dropped, &overwritten, &pending);
+    KM_CHECK(dropped == 0);
+
+    /* Клиент отображения видит последние 64 события и пропуск перед ними */
+    while ((best = RingMergeSelect(&view, 1)) >= 0) {
+        if (RingViewTake(&view, &record)) {
+            if (record.Header.Flags & PROCMON_EVENT_FLAG_GAP) {
+                lost += record.Header.ProcessId;
+            } else {
+                events++;
+                last = record.Header.ProcessId;
+            }
+            RingViewNext(&view, &record);
+        } else {
+            RingViewSkip(&view);
+        }
+    }
+    KM_CHECK(events == 64 && lost == 2 * 64 && last == 3 * 64 - 1);
+
+    /* Первое IOCTL-чтение включает политику: дальше — отбрасывание по ReadTail */
+    CollectorInit(&out, 0);
+    BufferRead(&buffer, &reader, CollectSink, &out);
+    for (i = 0; i < 100; i++) {
+        PushAt(&buffer, 0, 2000 + i, 1000 + i, TRUE);
+    }
+    BufferQueryLoss(&buffer, &reader, &dropped, &overwritten, &pending);
+    KM_CHECK(dropped != 0);
+
+    BufferReaderClose(&buffer, &reader);
+    BufferFree(&buffer);
+}
+
+/* Неопубликованная голова останавливает слияние: она может быть раньше всех */
+static VOID TestPendingHead(VOID)
+{
+    EVENT_BUFFER       buffer;
+    BUFFER_READER      reader;
+    BUFFER_RESERVATION reservation;
+    COLLECTOR          out;
+
+    KM_CHECK(OpenBuffer(&buffer, 2, 64, PROCMON_OVERFLOW_OVERWRITE));
+
+    RtlZeroMemory(&reader, sizeof(reader));
+    KM_CHECK(NT_SUCCESS(BufferReaderOpen(&buffer, &reader)));
+
+    KmSetCurrentProcessor(1);
+    KM_CHECK(BufferReserve(&buffer, 0, 0, &reservation));
+    KmSetCurrentProcessor(0);
+    reservation.Header->ProcessId = 1;
+    reservation.Header->Timestamp.QuadPart = 5;
+
+    PushAt(&buffer, 0, 10, 2, FALSE);
+    PushAt(&buffer, 0, 20, 3, FALSE);
+
+    CollectorInit(&out, 16);
+    KM_CHECK(BufferRead(&buffer, &reader, CollectSink, &out) == 0);
+    KM_CHECK(!BufferHasData(&buffer, &reader));
+
+    BufferCommit(&buffer, &reservation);
+    KM_CHECK(BufferHasData(&buffer, &reader));
+    KM_CHECK(BufferRead(&buffer, &reader, CollectSink, &out) == 3);
+    KM_CHECK(out.Records[0].Header.ProcessId == 1);
+    KM_CHECK(out.Records[1].Header.ProcessId == 2);
+    KM_CHECK(out.Records[2].Header.ProcessId == 3);
+
+    free(out.Records);
+    BufferReaderClose(&buffer, &reader);
+    BufferFree(&buffer);
+}
+
+/* Приёмник, отказавший в записи, оставляет её следующему чтению; читатели независимы */
+static VOID TestReadersAndSinkFull(VOID)
+{
+    EVENT_BUFFER  buffer;
+    BUFFER_READER first, second;
+    COLLECTOR     a, b;
+    ULONG         i;
+
+    KM_CHECK(OpenBuffer(&buffer, 2, 64, PROCMON_OVERFLOW_OVERWRITE));
+
+    for (i = 0; i < 10; i++) {
+        PushAt(&buffer, i & 1, 100 + i, i, TRUE);
+    }
+
+    RtlZeroMemory(&first, sizeof(first));
+    RtlZeroMemory(&second, sizeof(second));
+    KM_CHECK(NT_SUCCESS(BufferReaderOpen(&buffer, &first)));
+    KM_CHECK(NT_SUCCESS(BufferReaderOpen(&buffer, &second)));
+
+    CollectorInit(&a, 4);
+    KM_CHECK(BufferRead(&buffer, &first, CollectSink, &a) == 4);
+    a.Count = 0;
+    KM_CHECK(BufferRead(&buffer, &first, CollectSink, &a) == 4);
+    KM_CHECK(a.Records[0].Header.ProcessId == 4);
+
+    CollectorInit(&b, 64);
+    KM_CHECK(BufferRead(&buffer, &second, CollectSink, &b) == 10);
+    for (i = 0; i < b.Count; i++) {
+        KM_CHECK(b.Records[i].Header.ProcessId == i);
+    }
+
+    free(a.Records);
+    free(b.Records);
+    BufferReaderClose(&buffer, &first);
+    BufferReaderClose(&buffer, &second);
+    BufferFree(&buffer);
+}
+
+/* --- Параллельная запись --- */
+
+#define STRESS_WRITERS  4
+#define STRESS_EVENTS   20000
+
+typedef struct _STRESS {
+    EVENT_BUFFER  Buffer;
+    volatile LONG Running;
+} STRESS;
+
+typedef struct _STRESS_WRITER {
+    STRESS   *Stress;
+    ULONG     Index;
+    pthread_t Thread;
+} STRESS_WRITER;
+
+static void *StressWriter(void *Argument)
+{
+    STRESS_WRITER       *writer = Argument;
+    PROCMON_EVENT_HEADER header;
+    ULONG                i;
+
+    KmSetCurrentProcessor(writer->Index);
+    RtlZeroMemory(&header, sizeof(header));
+    header.ParentProcessId = writer->Index;
+
+    for (i = 0; i < STRESS_EVENTS; i++) {
+        header.ProcessId = i;
+        KeQuerySystemTime(&header.Timestamp);
+        if (i % 3 == 0) {
+            header.Flags = PROCMON_EVENT_FLAG_CREATE;
+            BufferPush(&writer->Stress->Buffer, &header, NULL, TEST_NAME, sizeof(TEST_NAME) - 1);
+        } else {
+            header.Flags = 0;
+            BufferPush(&writer->Stress->Buffer, &header, NULL, NULL, 0);
+        }
+        if ((i & 4095) == 0) {
+            YieldProcessor();
+        }
+    }
+
+    InterlockedDecrement(&writer->Stress->Running);
+    return NULL;
+}
+
+/* Проверка по ходу чтения: события каждого писателя идут по порядку */
+typedef struct _STRESS_CHECK {
+    COLLECTOR Totals;
+    LONG64    Last[STRESS_WRITERS];
+    ULONG     Disorder;
+    ULONG     BadNames;
+} STRESS_CHECK;
+
+static BOOLEAN StressSink(PVOID Context, const PROCMON_RECORD *Record)
+{
+    STRESS_CHECK *check = Context;
+    ULONG         writer = Record->Header.ParentProcessId;
+
+    CollectSink(&check->Totals, Record);
+    if (Record->Header.Flags & PROCMON_EVENT_FLAG_GAP) {
+        return TRUE;
+    }
+
+    if (writer >= STRESS_WRITERS || (LONG64)Record->Header.ProcessId <= check->Last[writer]) {
+        check->Disorder++;
+    } else {
+        check->Last[writer] = Record->Header.ProcessId;
+    }
+
+    if ((Record->Header.Flags & PROCMON_EVENT_FLAG_CREATE) &&
+        (Record->Header.Flags & PROCMON_EVENT_FLAG_NAME_LOST) == 0 &&
+        strcmp(Record->ImageName, TEST_NAME) != 0) {
+        check->BadNames++;
+    }
+    return TRUE;
+}
+
+static VOID TestConcurrentWriters(VOID)
+{
+    STRESS        *stress = calloc(1, sizeof(STRESS));
+    STRESS_WRITER  writers[STRESS_WRITERS];
+    BUFFER_READER  reader;
+    STRESS_CHECK   check;
+    ULONG          i;
+
+    KM_CHECK(OpenBuffer(&stress->Buffer, STRESS_WRITERS, 1024, PROCMON_OVERFLOW_OVERWRITE));
+
+    RtlZeroMemory(&reader, sizeof(reader));
+    KM_CHECK(NT_SUCCESS(BufferReaderOpen(&stress->Buffer, &reader)));
+
+    RtlZeroMemory(&check, sizeof(check));
+    for (i = 0; i < STRESS_WRITERS; i++) {
+        check.Last[i] = -1;
+    }
+
+    stress->Running = STRESS_WRITERS;
+    for (i = 0; i < STRESS_WRITERS; i++) {
+        writers[i].Stress = stress;
+        writers[i].Index = i;
+        pthread_create(&writers[i].Thread, NULL, StressWriter, &writers[i]);
+    }
+
+    while (ReadAcquire(&stress->Running) != 0) {
+        BufferRead(&stress->Buffer, &reader, StressSink, &check);
+        YieldProcessor();
+    }
+    for (i = 0; i < STRESS_WRITERS; i++) {
+        pthread_join(writers[i].Thread, NULL);
+    }
+    BufferRead(&stress->Buffer, &reader, StressSink, &check);
+
+    /* Каждое событие либо прочитано, либо сосчитано в пропуске */
+    KM_CHECK(check.Totals.Events + check.Totals.Lost ==
+             (ULONG64)STRESS_WRITERS * STRESS_EVENTS);
+    KM_CHECK(check.Disorder == 0);
+    KM_CHECK(check.BadNames == 0);
+    KM_CHECK(!BufferHasData(&stress->Buffer, &reader));
+
+    printf("параллельно: прочитано %llu, потеряно %llu\n",
+           (unsigned long long)check.Totals.Events, (unsigned long long)check.Totals.Lost);
+
+    BufferReaderClose(&stress->Buffer, &reader);
+    BufferFree(&stress->Buffer);
+    free(stress);
+}
+
+int main(void)
+{
+    TestMergeOrder();
+    TestOverwriteGap();
+    TestDropNewest();
+    TestMappedOnlyReader(PROCMON_OVERFLOW_DROP_NEWEST);
+    TestMappedOnlyReader(PROCMON_OVERFLOW_PRIORITY);
+    TestPendingHead();
+    TestReadersAndSinkFull();
+    TestConcurrentWriters();
+
+    return KM_TEST_RESULT();
+}
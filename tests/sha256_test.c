@@ -0,0 +1,134 @@
+/*
+ * sha256_test.c — SHA-256 (sha256.c) на известных ответах FIPS 180-4.
+ *
+ * Каждая реализация блочной функции — переносимая (SHA скрыт от CPUID)
+ * и SHA-NI, если процессор его умеет, — проверяется на векторах NIST,
+ * на тех же сообщениях, поданных кусками разной длины, и сверяется с
+ * переносимой на сообщениях всех длин до 300 байт.
+ */
+
+#include <ntddk.h>
+#include "hash.h"
+#include "km.h"
+
+#include <stdlib.h>
+
+#define TEST_MAX_LENGTH  300
+
+typedef struct _SHA256_KAT {
+    const char *Name;
+    const char *Message;
+    ULONG       Repeat;      /* Сообщение — Message столько раз подряд */
+    UCHAR       Digest[32];
+} SHA256_KAT;
+
+static const SHA256_KAT g_Kats[] = {
+    { "пустое", "", 1,
+      { 0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14, 0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+        0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c, 0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55 } },
+    { "abc", "abc", 1,
+      { 0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad } },
+    { "448 бит", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+      { 0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+        0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1 } },
+    { "896 бит", "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmno"
+                 "ijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+      { 0xcf, 0x5b, 0x16, 0xa7, 0x78, 0xaf, 0x83, 0x80, 0x03, 0x6c, 0xe5, 0x9e, 0x7b, 0x04, 0x92, 0x37,
+        0x0b, 0x24, 0x9b, 0x11, 0xe8, 0xf0, 0x7a, 0x51, 0xaf, 0xac, 0x45, 0x03, 0x7a, 0xfe, 0xe9, 0xd1 } },
+    { "миллион a", "a", 1000000,
+      { 0xcd, 0xc7, 0x6e, 0x5c, 0x99, 0x14, 0xfb, 0x92, 0x81, 0xa1, 0xc7, 0xe2, 0x84, 0xd7, 0x3e, 0x67,
+        0xf1, 0x80, 0x9a, 0x48, 0xa4, 0x97, 0x20, 0x0e, 0x04, 0x6d, 0x39, 0xcc, 0xc7, 0x11, 0x2c, 0xd0 } },
+};
+
+/* Длины кусков: внутри блока, ровно блок, через границу блока */
+static const ULONG g_Pieces[] = { 1, 3, 55, 63, 64, 65, 127, 4096 };
+
+static UCHAR *KatMessage(const SHA256_KAT *Kat, ULONG *Length)
+{
+    ULONG  part = (ULONG)strlen(Kat->Message);
+    UCHAR *message = malloc(part * Kat->Repeat + 1);
+    ULONG  i;
+
+    for (i = 0; i < Kat->Repeat; i++) {
+        memcpy(message + i * part, Kat->Message, part);
+    }
+    *Length = part * Kat->Repeat;
+    return message;
+}
+
+static VOID Digest(const UCHAR *Message, ULONG Length, ULONG Piece, UCHAR Hash[32])
+{
+    SHA256_CTX ctx;
+    ULONG      offset, step;
+
+    Sha256Init(&ctx);
+    for (offset = 0; offset < Length; offset += step) {
+        step = Length - offset < Piece ? Length - offset : Piece;
+        Sha256Update(&ctx, Message + offset, step);
+    }
+    Sha256Final(&ctx, Hash);
+}
+
+static VOID TestKnownAnswers(const char *Implementation)
+{
+    UCHAR hash[32];
+    ULONG k, p;
+
+    for (k = 0; k < RTL_NUMBER_OF(g_Kats); k++) {
+        ULONG  length;
+        UCHAR *message = KatMessage(&g_Kats[k], &length);
+
+        /* Одним куском, затем кусками g_Pieces */
+        for (p = 0; p <= RTL_NUMBER_OF(g_Pieces); p++) {
+            ULONG piece = p == 0 ? (length ? length : 1) : g_Pieces[p - 1];
+
+            Digest(message, length, piece, hash);
+            if (memcmp(hash, g_Kats[k].Digest, sizeof(hash)) != 0) {
+                fprintf(stderr, "%s: «%s» кусками по %lu\n", Implementation, g_Kats[k].Name,
+                        (unsigned long)piece);
+                g_KmFailures++;
+            }
+        }
+        free(message);
+    }
+}
+
+/* Дайджесты всех длин 0..TEST_MAX_LENGTH текущей реализацией */
+static VOID DigestAllLengths(UCHAR Hashes[TEST_MAX_LENGTH + 1][32])
+{
+    UCHAR message[TEST_MAX_LENGTH];
+    ULONG i;
+
+    for (i = 0; i < TEST_MAX_LENGTH; i++) {
+        message[i] = (UCHAR)(i * 37 + 11);
+    }
+    for (i = 0; i <= TEST_MAX_LENGTH; i++) {
+        Digest(message, i, 64, Hashes[i]);
+    }
+}
+
+int main(void)
+{
+    static UCHAR scalar[TEST_MAX_LENGTH + 1][32];
+    static UCHAR shaNi[TEST_MAX_LENGTH + 1][32];
+    ULONG        implementation;
+
+    KmHideCpuFeatures(KM_CPU_SHA);
+    implementation = Sha256SelectImplementation();
+    KM_CHECK(implementation == PROCMON_HASH_IMPL_SCALAR);
+    TestKnownAnswers("переносимая");
+    DigestAllLengths(scalar);
+
+    KmHideCpuFeatures(0);
+    implementation = Sha256SelectImplementation();
+    if (implementation == PROCMON_HASH_IMPL_SHA_NI) {
+        TestKnownAnswers("SHA-NI");
+        DigestAllLengths(shaNi);
+        KM_CHECK(memcmp(scalar, shaNi, sizeof(scalar)) == 0);
+    } else {
+        printf("SHA-NI недоступен, проверена только переносимая реализация\n");
+    }
+
+    return KM_TEST_RESULT();
+}
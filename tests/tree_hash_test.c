@@ -0,0 +1,137 @@
+/*
+ * tree_hash_test.c — Хеш-дерево файла целиком (Parameters\TreeHash).
+ *
+ * Для MD5 (8 и 4 канала) и SHA-256 корень ComputeFileHash сверяется с
+ * деревом, посчитанным здесь же по определению, на файлах вокруг границ
+ * кусков: из отображения (вид на кусок — не больше куска за раз) и
+ * чтением ZwReadFile, когда секции недоступны (KmSetNoSections).
+ */
+
+#include <ntddk.h>
+#include "hash.h"
+#include "km.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#define CHUNK  PROCMON_HASH_TREE_CHUNK
+
+/* Длины файлов: меньше куска, на границах, неполный последний, больше 8 кусков */
+static const ULONG g_FileSizes[] = {
+    1, 4096, CHUNK - 1, CHUNK, CHUNK + 1, 3 * CHUNK + 100, 8 * CHUNK, 9 * CHUNK + 7
+};
+
+static UCHAR *g_Data;
+
+/* Дерево по определению: лист — H(0x00 || кусок), корень — H(0x01 || листья) */
+static VOID TreeDigest(PCHASH_ALGORITHM Algorithm, const UCHAR *Data, ULONG Length, UCHAR *Root)
+{
+    const UCHAR  leaf = PROCMON_HASH_TREE_LEAF;
+    const UCHAR  node = PROCMON_HASH_TREE_NODE;
+    UCHAR        leaves[16 * PROCMON_HASH_MAX_SIZE];
+    HASH_CONTEXT ctx;
+    ULONG        count = (Length + CHUNK - 1) / CHUNK;
+    ULONG        i;
+
+    for (i = 0; i < count; i++) {
+        ULONG part = Length - i * CHUNK < CHUNK ? Length - i * CHUNK : CHUNK;
+
+        Algorithm->Init(&ctx);
+        Algorithm->Update(&ctx, &leaf, 1);
+        Algorithm->Update(&ctx, Data + (SIZE_T)i * CHUNK, part);
+        Algorithm->Final(&ctx, leaves + i * Algorithm->DigestSize);
+    }
+
+    Algorithm->Init(&ctx);
+    Algorithm->Update(&ctx, &node, 1);
+    Algorithm->Update(&ctx, leaves, count * Algorithm->DigestSize);
+    Algorithm->Final(&ctx, Root);
+}
+
+static VOID TestFile(PCHASH_ALGORITHM Algorithm, const char *Name, const char *Dir, ULONG Size)
+{
+    char           posix[256];
+    WCHAR          buffer[300];
+    UNICODE_STRING path;
+    UCHAR          expected[PROCMON_HASH_MAX_SIZE];
+    UCHAR          hash[PROCMON_HASH_MAX_SIZE];
+    FILE          *file;
+
+    snprintf(posix, sizeof(posix), "%s/procmon_tree_%lu.bin", Dir, (unsigned long)Size);
+    file = fopen(posix, "wb");
+    KM_CHECK(file != NULL);
+    if (file == NULL) {
+        return;
+    }
+    KM_CHECK(fwrite(g_Data, 1, Size, file) == Size);
+    fclose(file);
+    KmInitPath(&path, buffer, RTL_NUMBER_OF(buffer), posix);
+
+    TreeDigest(Algorithm, g_Data, Size, expected);
+
+    /* Из отображения: по виду на кусок */
+    KmResetCounters();
+    RtlZeroMemory(hash, sizeof(hash));
+    KM_CHECK(NT_SUCCESS(ComputeFileHash(&path, Algorithm, hash)));
+    if (memcmp(hash, expected, Algorithm->DigestSize) != 0) {
+        fprintf(stderr, "%s: отображение, файл %lu байт\n", Name, (unsigned long)Size);
+        g_KmFailures++;
+    }
+    KM_CHECK(g_KmCounters.Maps == (Size + CHUNK - 1) / CHUNK);
+    KM_CHECK(g_KmCounters.MapBytesMax <= CHUNK);
+    KM_CHECK(g_KmCounters.Reads == 0);
+
+    /* Чтением */
+    KmSetNoSections(TRUE);
+    RtlZeroMemory(hash, sizeof(hash));
+    KM_CHECK(NT_SUCCESS(ComputeFileHash(&path, Algorithm, hash)));
+    if (memcmp(hash, expected, Algorithm->DigestSize) != 0) {
+        fprintf(stderr, "%s: чтение, файл %lu байт\n", Name, (unsigned long)Size);
+        g_KmFailures++;
+    }
+    KmSetNoSections(FALSE);
+
+    unlink(posix);
+}
+
+static VOID TestAlgorithm(ULONG AlgorithmId, const char *Name, const char *Dir)
+{
+    ULONG i;
+
+    HashSelectAlgorithm(AlgorithmId, TRUE);
+    KM_CHECK(g_HashAlgorithm->ChunkSize == CHUNK);
+
+    for (i = 0; i < RTL_NUMBER_OF(g_FileSizes); i++) {
+        TestFile(g_HashAlgorithm, Name, Dir, g_FileSizes[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = argc > 1 ? argv[1] : "/tmp";
+    ULONG       maxSize = g_FileSizes[RTL_NUMBER_OF(g_FileSizes) - 1];
+    ULONG       i;
+
+    g_Data = malloc(maxSize);
+    if (g_Data == NULL) {
+        return 1;
+    }
+    for (i = 0; i < maxSize; i++) {
+        g_Data[i] = (UCHAR)(i * 131 + (i >> 11) * 7);
+    }
+
+    HashBatchConfigure(1);
+
+    TestAlgorithm(PROCMON_HASH_MD5, "MD5", dir);
+
+    KmHideCpuFeatures(KM_CPU_AVX2);
+    TestAlgorithm(PROCMON_HASH_MD5, "MD5, 4 канала", dir);
+    KmHideCpuFeatures(0);
+
+    TestAlgorithm(PROCMON_HASH_SHA256, "SHA-256", dir);
+
+    HashBatchShutdown();
+    free(g_Data);
+
+    return KM_TEST_RESULT();
+}